@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks VMOptions.allocator. A loop makes strings, small objects and
+   objects too big for a size class from a native, and calls a user function
+   with two arguments (so every call saves registers in a frame). The hook
+   counts the blocks and bytes it hands out: it must have been used while the
+   VM ran, and after vm_destroy every block must be back, with the size it
+   was allocated with. Runs without and with a nursery. Then a native fills
+   the nursery with live strings and turns the hook off, so the minor
+   collection that follows cannot copy them out: vm_run must report
+   VM_MEM_LIMIT_ERROR with the strings intact, and once the hook works again
+   vm_gc must promote them. */
+
+#define ITERS 20000
+#define BIG_FIELDS 64
+#define FILL_STRINGS 2000
+
+typedef struct
+{
+    long blocks;
+    long long bytes;
+    long calls;
+    int fail; /* non-zero: hand out nothing */
+} Counts;
+
+static Counts g_fill_counts;
+static int g_fill_holder = -1;
+
+static void *count_alloc(void *ctx, size_t size)
+{
+    Counts *c = (Counts *)ctx;
+    if (c->fail)
+        return NULL;
+    c->blocks++;
+    c->bytes += (long long)size;
+    c->calls++;
+    return malloc(size);
+}
+
+static void count_free(void *ctx, void *p, size_t size)
+{
+    Counts *c = (Counts *)ctx;
+    c->blocks--;
+    c->bytes -= (long long)size;
+    free(p);
+}
+
+/* native 0: make(i): {i, "item-i", big object}, and some garbage */
+static Value make(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "item-%lld", (long long)value_as_int(args[0]));
+    int big = vm_alloc_object(vm, BIG_FIELDS);
+    vm_set_object_field(vm, big, BIG_FIELDS - 1, args[0]);
+    int obj = vm_alloc_object(vm, 3);
+    vm_set_object_field(vm, obj, 0, args[0]);
+    vm_set_object_field(vm, obj, 1, value_str(vm_alloc_string(vm, buf)));
+    vm_set_object_field(vm, obj, 2, value_obj(big));
+    vm_alloc_object(vm, 2);
+    return value_obj(obj);
+}
+
+/* string i of fill(): "fill-<i>-" padded with one letter to size - 1 */
+static void fill_string(char *buf, size_t size, int i)
+{
+    int n = snprintf(buf, size, "fill-%d-", i);
+    memset(buf + n, 'a' + i % 26, size - 1 - (size_t)n);
+    buf[size - 1] = '\0';
+}
+
+/* native 1: fill(): an object holding FILL_STRINGS strings, more than the
+   nursery takes; the hook fails from then on */
+static Value fill(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    int holder = vm_alloc_object(vm, FILL_STRINGS);
+    for (int i = 0; i < FILL_STRINGS; ++i)
+    {
+        char buf[200];
+        fill_string(buf, sizeof(buf), i);
+        vm_set_object_field(vm, holder, i, value_str(vm_alloc_string(vm, buf)));
+    }
+    g_fill_counts.fail = 1;
+    g_fill_holder = holder;
+    return value_obj(holder);
+}
+
+/* the strings fill() made, read back through its holder */
+static int fill_intact(VM *vm, int holder)
+{
+    for (int i = 0; i < FILL_STRINGS; ++i)
+    {
+        char buf[200];
+        fill_string(buf, sizeof(buf), i);
+        const char *s = vm_string_chars(vm, vm_get_object_field(vm, holder, i));
+        if (!s || strcmp(s, buf) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int run_fill(void)
+{
+    Bytecode bc;
+    bc_init(&bc);
+    /* the holder goes to r1: the thrown error lands in r0 */
+    bc_emit(&bc, OP_CALL);
+    bc_emit_operand(&bc, OPND_NATIVE, 1);
+    bc_emit_count(&bc, 0);
+    bc_emit_reg(&bc, 1);
+    bc_emit(&bc, OP_HALT);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 2;
+    opts.allocator.alloc = count_alloc;
+    opts.allocator.free = count_free;
+    opts.allocator.ctx = &g_fill_counts;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 1, fill);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    int holder = g_fill_holder;
+    VMGCStats st;
+    vm_gc_stats(vm, &st);
+    int kept = holder >= 0 && fill_intact(vm, holder);
+    g_fill_counts.fail = 0;
+    vm_gc(vm);
+    int promoted = holder >= 0 && fill_intact(vm, holder);
+    vm_destroy(vm);
+    bc_free(&bc);
+    int failed = err == NULL || strcmp(err, VM_MEM_LIMIT_ERROR) != 0 || st.minor_collections == 0 || !kept ||
+                 !promoted || g_fill_counts.blocks != 0 || g_fill_counts.bytes != 0;
+    printf("failing hook in a minor collection: %s, %llu minor collections, strings %s, then %s: %s\n",
+           err ? err : "no error", (unsigned long long)st.minor_collections, kept ? "kept" : "lost",
+           promoted ? "promoted" : "lost", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+static void emit_const(Bytecode *bc, int reg, int ci)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, reg);
+    bc_emit_const_idx(bc, ci);
+}
+
+static void emit_rrr(Bytecode *bc, u8 op, int a, int b, int c)
+{
+    bc_emit(bc, op);
+    bc_emit_reg(bc, a);
+    bc_emit_reg(bc, b);
+    bc_emit_reg(bc, c);
+}
+
+static int run(const Bytecode *bc, size_t nursery_size)
+{
+    Counts counts = {0, 0, 0, 0};
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    opts.nursery_size = nursery_size ? nursery_size : VM_NURSERY_OFF;
+    opts.allocator.alloc = count_alloc;
+    opts.allocator.free = count_free;
+    opts.allocator.ctx = &counts;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make);
+    vm_load(vm, bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+    long calls = counts.calls;
+    vm_destroy(vm);
+    int failed = err != NULL || calls == 0 || counts.blocks != 0 || counts.bytes != 0;
+    printf("\nnursery %zu KiB: %ld hook allocations, %ld blocks and %lld bytes left after vm_destroy: %s\n",
+           nursery_size / 1024, calls, counts.blocks, counts.bytes, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+
+    /* r4 = ITERS; r5 = 1; r6 = 0
+       loop: r0 = make(r4); r1 = r4; r7 = add2(r0, r1); r6 += r7;
+             r4 -= r5; jz r4 done; jmp loop
+       done: print r6; halt
+       add2: r2 = r1 + r1; ret r2 */
+    emit_const(&bc, 4, bc_add_const_int(&bc, ITERS));
+    emit_const(&bc, 5, bc_add_const_int(&bc, 1));
+    emit_const(&bc, 6, bc_add_const_int(&bc, 0));
+    int loop = (int)bc.code_size;
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 0);
+    bc_emit_reg(&bc, 4);
+    bc_emit(&bc, OP_CALL);
+    bc_emit_operand(&bc, OPND_NATIVE, 0);
+    bc_emit_count(&bc, 1);
+    bc_emit_reg(&bc, 0);
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 4);
+    bc_emit(&bc, OP_CALL_USER);
+    long user_pos = bc_emit_const_idx(&bc, 0);
+    bc_emit_count(&bc, 2);
+    bc_emit_reg(&bc, 7);
+    emit_rrr(&bc, OP_ADD, 6, 6, 7);
+    emit_rrr(&bc, OP_SUB, 4, 4, 5);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 4);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    bc_emit(&bc, OP_PRINT);
+    bc_emit_reg(&bc, 6);
+    bc_emit(&bc, OP_HALT);
+
+    int fn_add2 = (int)bc.code_size;
+    emit_rrr(&bc, OP_ADD, 2, 1, 1);
+    bc_emit(&bc, OP_RET);
+    bc_emit_reg(&bc, 2);
+    bc_patch_operand(&bc, (size_t)user_pos, OPND_CONST, bc_add_const_function(&bc, fn_add2, 2));
+
+    int failed = run(&bc, 0) | run(&bc, VM_NURSERY_DEFAULT_SIZE) | run_fill();
+    bc_free(&bc);
+    return failed;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks the per-call-site inline caches: a loop with a monomorphic closure
+   call, a CALL_USER call and a closure call whose target alternates between
+   two functions. The first two sites should miss once and then always hit,
+   the alternating one should miss every time. */
+
+#define ITERS 10
+
+static void emit_const(Bytecode *bc, int reg, int ci)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, reg);
+    bc_emit_const_idx(bc, ci);
+}
+
+static void emit_rrr(Bytecode *bc, u8 op, int a, int b, int c)
+{
+    bc_emit(bc, op);
+    bc_emit_reg(bc, a);
+    bc_emit_reg(bc, b);
+    bc_emit_reg(bc, c);
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+
+    emit_const(&bc, 2, bc_add_const_int(&bc, ITERS)); /* r2 = loop counter */
+    emit_const(&bc, 1, bc_add_const_int(&bc, 1));
+    emit_const(&bc, 3, bc_add_const_int(&bc, 0)); /* r3 = sum */
+
+    /* r10 = closure(three); r4 = closure(three); r5 = closure(five) */
+    long mk_pos[3];
+    int mk_dst[3] = {10, 4, 5};
+    for (int i = 0; i < 3; ++i)
+    {
+        bc_emit(&bc, OP_MK_CLOSURE);
+        bc_emit_reg(&bc, mk_dst[i]);
+        mk_pos[i] = bc_emit_const_idx(&bc, 0);
+        bc_emit_count(&bc, 0);
+    }
+
+    int loop = (int)bc.code_size;
+    /* site A: always the same closure */
+    bc_emit(&bc, OP_CALL_CLOSURE);
+    bc_emit_reg(&bc, 10);
+    bc_emit_count(&bc, 0);
+    bc_emit_reg(&bc, 6);
+    emit_rrr(&bc, OP_ADD, 3, 3, 6);
+    /* site B: direct call */
+    bc_emit(&bc, OP_CALL_USER);
+    long user_pos = bc_emit_const_idx(&bc, 0);
+    bc_emit_count(&bc, 0);
+    bc_emit_reg(&bc, 6);
+    emit_rrr(&bc, OP_ADD, 3, 3, 6);
+    /* site C: swap r4/r5 first, so the target alternates */
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 9);
+    bc_emit_reg(&bc, 4);
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 4);
+    bc_emit_reg(&bc, 5);
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 5);
+    bc_emit_reg(&bc, 9);
+    bc_emit(&bc, OP_CALL_CLOSURE);
+    bc_emit_reg(&bc, 4);
+    bc_emit_count(&bc, 0);
+    bc_emit_reg(&bc, 6);
+    emit_rrr(&bc, OP_ADD, 3, 3, 6);
+
+    emit_rrr(&bc, OP_SUB, 2, 2, 1);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 2);
+    long end_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)end_pos, OPND_JUMP, (int32_t)bc.code_size);
+    bc_emit(&bc, OP_PRINT);
+    bc_emit_reg(&bc, 3);
+    bc_emit(&bc, OP_HALT);
+
+    /* three: r8 = 3; ret r8.  five: r8 = 5; ret r8 */
+    int fn_three = (int)bc.code_size;
+    emit_const(&bc, 8, bc_add_const_int(&bc, 3));
+    bc_emit(&bc, OP_RET);
+    bc_emit_reg(&bc, 8);
+    int fn_five = (int)bc.code_size;
+    emit_const(&bc, 8, bc_add_const_int(&bc, 5));
+    bc_emit(&bc, OP_RET);
+    bc_emit_reg(&bc, 8);
+    int ci_three = bc_add_const_function(&bc, fn_three, 0);
+    int ci_five = bc_add_const_function(&bc, fn_five, 0);
+    bc_patch_operand(&bc, (size_t)mk_pos[0], OPND_CONST, ci_three);
+    bc_patch_operand(&bc, (size_t)mk_pos[1], OPND_CONST, ci_three);
+    bc_patch_operand(&bc, (size_t)mk_pos[2], OPND_CONST, ci_five);
+    bc_patch_operand(&bc, (size_t)user_pos, OPND_CONST, ci_five);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 16;
+    VM *vm = vm_create(&opts);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    printf("\n");
+    if (err)
+        printf("VM error: %s\n", err);
+
+    VMCallSiteStats stats[4];
+    size_t n = vm_call_site_stats(vm, stats, 4);
+    for (size_t i = 0; i < n && i < 4; ++i)
+        printf("call site @%zu: f%d hits=%llu misses=%llu\n", stats[i].offset, stats[i].func_index,
+               (unsigned long long)stats[i].hits, (unsigned long long)stats[i].misses);
+
+    int failed = err != NULL || n != 3;
+    if (!failed)
+    {
+        failed |= stats[0].hits != ITERS - 1 || stats[0].misses != 1;
+        failed |= stats[1].hits != ITERS - 1 || stats[1].misses != 1;
+        failed |= stats[2].hits != 0 || stats[2].misses != ITERS;
+    }
+    vm_destroy(vm);
+    bc_free(&bc);
+    return failed;
+}
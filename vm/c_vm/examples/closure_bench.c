@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Closure benchmark: a loop that makes a closure and calls it, the way our
+   generated code uses them. Each closure captures 1 to MAX_CAPTURES
+   registers and its function adds up the first two captures. Closures with
+   up to three captures keep their fields inline in the object table (see
+   OBJ_INLINE_FIELDS in vm.c), bigger ones in an array of their own, so the
+   per-iteration times show what the inline storage saves. The garbage is
+   left to the default collector settings, whose pause time is printed too.
+   Each case runs REPEATS times and the fastest run counts. */
+
+#define LOOP_ITERS 2000000
+#define REPEATS 3
+#define MAX_CAPTURES 6
+/* registers: the captures land in 0.. of the callee, so the loop keeps
+   its state above them */
+#define R_RESULT 8
+#define R_COUNT 9
+#define R_ONE 10
+#define R_CLOSURE 11
+#define R_CAPTURE 12
+
+static void emit_load(Bytecode *bc, int reg, int ci)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_i32(bc, reg);
+    bc_emit_i32(bc, ci);
+}
+
+/* seconds for one run, or a negative value on a VM error */
+static double run(int captures, VMGCStats *stats)
+{
+    Bytecode bc;
+    bc_init(&bc);
+    emit_load(&bc, R_COUNT, bc_add_const_int(&bc, LOOP_ITERS));
+    emit_load(&bc, R_ONE, bc_add_const_int(&bc, 1));
+    for (int i = 0; i < captures; ++i)
+        emit_load(&bc, R_CAPTURE + i, bc_add_const_int(&bc, i + 1));
+
+    /* loop: closure = mk_closure(f, captures...); result = closure()
+       count -= 1; jz count end; jmp loop */
+    int loop = (int)bc.code_size;
+    bc_emit(&bc, OP_MK_CLOSURE);
+    bc_emit_i32(&bc, R_CLOSURE);
+    size_t ci_pos = bc.code_size;
+    bc_emit_i32(&bc, 0); /* patched with f */
+    bc_emit_i32(&bc, captures);
+    for (int i = 0; i < captures; ++i)
+        bc_emit_i32(&bc, R_CAPTURE + i);
+    bc_emit(&bc, OP_CALL_CLOSURE);
+    bc_emit_i32(&bc, R_CLOSURE);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, R_RESULT);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_i32(&bc, R_COUNT);
+    bc_emit_i32(&bc, R_COUNT);
+    bc_emit_i32(&bc, R_ONE);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_i32(&bc, R_COUNT);
+    size_t end_pos = bc.code_size;
+    bc_emit_i32(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_i32(&bc, loop);
+    int end = (int)bc.code_size;
+    memcpy(&bc.code[end_pos], &end, 4);
+    bc_emit(&bc, OP_HALT);
+
+    /* f: r0 += r1 (r0 alone with one capture); ret r0 */
+    int f = bc_add_const_function(&bc, (int)bc.code_size, 0);
+    memcpy(&bc.code[ci_pos], &f, 4);
+    bc_emit(&bc, OP_ADD);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, captures > 1 ? 1 : 0);
+    bc_emit(&bc, OP_RET);
+    bc_emit_i32(&bc, 0);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = R_CAPTURE + MAX_CAPTURES;
+    VM *vm = vm_create(&opts);
+    vm_load(vm, &bc);
+    clock_t t0 = clock();
+    const char *err = vm_run(vm);
+    clock_t t1 = clock();
+    if (err)
+        printf("VM error: %s\n", err);
+    vm_gc_stats(vm, stats);
+    vm_destroy(vm);
+    bc_free(&bc);
+    return err ? -1.0 : (double)(t1 - t0) / CLOCKS_PER_SEC;
+}
+
+int main(void)
+{
+    for (int captures = 1; captures <= MAX_CAPTURES; ++captures)
+    {
+        double best = 0;
+        VMGCStats stats;
+        for (int r = 0; r < REPEATS; ++r)
+        {
+            double secs = run(captures, &stats);
+            if (secs < 0)
+                return 1;
+            if (r == 0 || secs < best)
+                best = secs;
+        }
+        printf("%d capture%s (%d fields): %.1f ns per closure made and called, %llu collections, "
+               "%.1f ms paused\n",
+               captures, captures == 1 ? " " : "s", captures + 1, best * 1e9 / LOOP_ITERS,
+               (unsigned long long)(stats.minor_collections + stats.major_collections),
+               (double)stats.pause_ns_total / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/disassembler.h"
+#include "../include/vm.h"
+
+/* Emits the same program in encoding v1 and v2 using the version-aware
+   bc_emit_* helpers, checks the compact form is much smaller, and runs both.
+   The program sums 1..10 in a loop, then calls a closure that prints a
+   captured label and the sum. */
+static void emit_program(Bytecode *bc)
+{
+    int ci_ten = bc_add_const_int(bc, 10);
+    int ci_one = bc_add_const_int(bc, 1);
+    int ci_zero = bc_add_const_int(bc, 0);
+    int ci_label = bc_add_const_string(bc, "sum of 1..10:");
+
+    /* r0 = 10; r1 = 1; r2 = 0 */
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 0);
+    bc_emit_const_idx(bc, ci_ten);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 1);
+    bc_emit_const_idx(bc, ci_one);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 2);
+    bc_emit_const_idx(bc, ci_zero);
+
+    /* loop: r2 += r0; r0 -= r1; jz r0 -> done; jmp loop */
+    int loop = (int)bc->code_size;
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 0);
+    bc_emit(bc, OP_SUB);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 0);
+    long done_pos = bc_emit_jump(bc, 0); /* patched below */
+    bc_emit(bc, OP_JMP);
+    bc_emit_jump(bc, loop);
+
+    /* done: r3 = label; r4 = closure(func, r3, r2); call r4 */
+    bc_patch_operand(bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 3);
+    bc_emit_const_idx(bc, ci_label);
+    bc_emit(bc, OP_MK_CLOSURE);
+    bc_emit_reg(bc, 4);
+    long func_ci_pos = bc_emit_const_idx(bc, 0); /* patched below */
+    bc_emit_count(bc, 2);
+    bc_emit_reg(bc, 3);
+    bc_emit_reg(bc, 2);
+    bc_emit(bc, OP_CALL_CLOSURE);
+    bc_emit_reg(bc, 4);
+    bc_emit_count(bc, 0);
+    bc_emit_reg(bc, 5);
+    bc_emit(bc, OP_HALT);
+
+    /* function: print r0 (label); print r1 (sum); ret r1 */
+    int func_start = (int)bc->code_size;
+    bc_emit(bc, OP_PRINT);
+    bc_emit_reg(bc, 0);
+    bc_emit(bc, OP_PRINT);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 1);
+    int ci_func = bc_add_const_function(bc, func_start, 0);
+    bc_patch_operand(bc, (size_t)func_ci_pos, OPND_CONST, ci_func);
+}
+
+static int run(const Bytecode *bc)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    VM *vm = vm_create(&opts);
+    vm_load(vm, bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s (at byte %u)\n", err, (unsigned)vm_error_offset(vm));
+    vm_destroy(vm);
+    return err ? 1 : 0;
+}
+
+int main(void)
+{
+    Bytecode v1, v2;
+    bc_init_version(&v1, BC_VERSION_1);
+    bc_init_version(&v2, BC_VERSION_2);
+    emit_program(&v1);
+    emit_program(&v2);
+
+    printf("v1: %zu bytes, v2: %zu bytes\n", v1.code_size, v2.code_size);
+    disassemble_bytecode(&v2, stdout);
+
+    int failed = run(&v1) | run(&v2);
+    if (v2.code_size * 2 > v1.code_size)
+    {
+        printf("compact encoding is not under half the size of v1\n");
+        failed = 1;
+    }
+    bc_free(&v1);
+    bc_free(&v2);
+    return failed;
+}
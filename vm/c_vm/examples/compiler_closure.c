@@ -62,7 +62,7 @@ int main(void)
     vm_load(vm, &bc);
     const char *err = vm_run(vm);
     if (err)
-        fprintf(stderr, "VM error: %s\n", err);
+        fprintf(stderr, "VM error: %s (at byte %u)\n", err, (unsigned)vm_error_offset(vm));
 
     bc_free(&bc);
     vm_destroy(vm);
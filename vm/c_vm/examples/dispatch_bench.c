@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Interpreter dispatch benchmark: a tight counted loop of int arithmetic and
+   branches, the shape that dominates our generated code. Prints the time per
+   executed instruction so dispatch strategies can be compared directly.
+   Pass -O to run the peephole pass first; the per-instruction time is still
+   reported against the unfused instruction count. */
+
+#define LOOP_ITERS 20000000
+
+int main(int argc, char **argv)
+{
+    Bytecode bc;
+    bc_init(&bc);
+
+    int ci_n = bc_add_const_int(&bc, LOOP_ITERS);
+    int ci_one = bc_add_const_int(&bc, 1);
+    int ci_zero = bc_add_const_int(&bc, 0);
+
+    /* r0 = n; r1 = 1; r2 = 0 */
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, ci_n);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 1);
+    bc_emit_i32(&bc, ci_one);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 2);
+    bc_emit_i32(&bc, ci_zero);
+
+    /* loop: r2 += r0; r0 -= r1; jz r0 -> end; jmp loop */
+    int loop = (int)bc.code_size;
+    bc_emit(&bc, OP_ADD);
+    bc_emit_i32(&bc, 2);
+    bc_emit_i32(&bc, 2);
+    bc_emit_i32(&bc, 0);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 1);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_i32(&bc, 0);
+    size_t end_pos = bc.code_size;
+    bc_emit_i32(&bc, 0); /* placeholder for end */
+    bc_emit(&bc, OP_JMP);
+    bc_emit_i32(&bc, loop);
+
+    /* end: print r2; halt */
+    int end = (int)bc.code_size;
+    bc_emit(&bc, OP_PRINT);
+    bc_emit_i32(&bc, 2);
+    bc_emit(&bc, OP_HALT);
+    memcpy(&bc.code[end_pos], &end, 4);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    VM *vm = vm_create(&opts);
+    vm_load(vm, &bc);
+    const char *err = NULL;
+    if (argc > 1 && strcmp(argv[1], "-O") == 0)
+        err = vm_optimize(vm);
+
+    clock_t t0 = clock();
+    if (!err)
+        err = vm_run(vm);
+    clock_t t1 = clock();
+    if (err)
+        printf("VM error: %s\n", err);
+
+    double secs = (double)(t1 - t0) / CLOCKS_PER_SEC;
+    double instrs = 4.0 * LOOP_ITERS;
+    printf("dispatch bench: %.0f instructions in %.3f s (%.2f ns/instr)\n",
+           instrs, secs, secs * 1e9 / instrs);
+
+    vm_destroy(vm);
+    bc_free(&bc);
+    return err ? 1 : 0;
+}
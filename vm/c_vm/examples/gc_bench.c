@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <time.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* GC stress benchmark: LIVE_STRINGS strings stay reachable from registers
+   and OLD_STRINGS more from the fields of one object while a loop allocates
+   short-lived strings, so the collector runs over and over with a large live
+   heap. Runs with the default nursery, without one (every collection a full
+   one) sweeping in the pause and lazily, and with incremental major
+   collections, and prints the time per allocation, the longest gap between
+   two allocations (the worst GC pause) and what vm_gc_stats counted for
+   each; string allocation,
+   marking and sweeping should all be independent of where a string sits in
+   the heap. String constants are interned at load and never allocate, so
+   the strings come from a native that numbers them: "str-1", "str-2", ...
+   A last run numbers them "1", "2", ... (modulo a million) instead, short
+   enough to be stored inline (vm_string_value), to show what that saves. */
+
+#define LIVE_STRINGS 512
+#define OLD_STRINGS 100000
+#define ALLOCS 1000000
+#define FIRST_LIVE 8
+
+static int g_next;
+static int g_short;
+static clock_t g_last;
+static clock_t g_max_gap;
+
+static Value make_string(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    /* clock() is too slow to read on every call; a pause still shows up in
+       the gap between two reads */
+    if (g_next % 256 == 0)
+    {
+        clock_t now = clock();
+        if (g_last && now - g_last > g_max_gap)
+            g_max_gap = now - g_last;
+        g_last = now;
+    }
+    char buf[32];
+    if (g_short)
+    {
+        snprintf(buf, sizeof(buf), "%d", ++g_next % 1000000);
+        return vm_string_value(vm, buf);
+    }
+    snprintf(buf, sizeof(buf), "str-%d", ++g_next);
+    return value_str(vm_alloc_string(vm, buf));
+}
+
+/* native 1: an object holding OLD_STRINGS new strings */
+static Value make_holder(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    int obj = vm_alloc_object(vm, OLD_STRINGS);
+    for (int i = 0; i < OLD_STRINGS; ++i)
+        vm_set_object_field(vm, obj, i, make_string(vm, 0, NULL));
+    return value_obj(obj);
+}
+
+static void emit_call_native(Bytecode *bc, int native, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_i32(bc, native);
+    bc_emit_i32(bc, 0); /* nargs */
+    bc_emit_i32(bc, dst);
+}
+
+/* slice_us != 0 makes major collections incremental; otherwise lazy_sweep
+   0 sets VMOptions.gc_eager_sweep */
+static int run(const Bytecode *bc, size_t nursery_size, int lazy_sweep, unsigned slice_us)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = FIRST_LIVE + LIVE_STRINGS;
+    opts.nursery_size = nursery_size ? nursery_size : VM_NURSERY_OFF;
+    opts.gc_incremental = slice_us != 0;
+    opts.gc_slice_us = slice_us;
+    opts.gc_eager_sweep = !lazy_sweep;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make_string);
+    vm_register_native(vm, 1, make_holder);
+    vm_load(vm, bc);
+    g_next = 0;
+    g_last = 0;
+    g_max_gap = 0;
+
+    clock_t t0 = clock();
+    const char *err = vm_run(vm);
+    clock_t t1 = clock();
+    if (err)
+        printf("VM error: %s\n", err);
+
+    double secs = (double)(t1 - t0) / CLOCKS_PER_SEC;
+    const char *mode = g_short      ? "short inline strings"
+                       : slice_us   ? "incremental"
+                       : lazy_sweep ? "stop-the-world, lazy sweep"
+                                    : "stop-the-world";
+    printf("gc bench (nursery %zu KiB, %s): %d allocations with %d live strings in %.3f s (%.1f ns/alloc), "
+           "max pause %.0f us\n",
+           nursery_size / 1024, mode,
+           ALLOCS, LIVE_STRINGS + OLD_STRINGS,
+           secs, secs * 1e9 / ALLOCS, (double)g_max_gap * 1e6 / CLOCKS_PER_SEC);
+    VMGCStats stats;
+    vm_gc_stats(vm, &stats);
+    printf("  %llu minor and %llu major collections, %llu pauses: %.1f ms in total, longest %.0f us; "
+           "%.1f MiB allocated, %.1f MiB live at the end\n",
+           (unsigned long long)stats.minor_collections, (unsigned long long)stats.major_collections,
+           (unsigned long long)stats.pauses, (double)stats.pause_ns_total / 1e6, (double)stats.pause_ns_max / 1e3,
+           (double)stats.bytes_allocated / (1024 * 1024), (double)stats.live_bytes / (1024 * 1024));
+    vm_destroy(vm);
+    return err ? 1 : 0;
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init(&bc);
+
+    int ci_n = bc_add_const_int(&bc, ALLOCS);
+    int ci_one = bc_add_const_int(&bc, 1);
+
+    /* r0 = n; r2 = 1; r3 = the holder of OLD_STRINGS strings; r8.. = the
+       next odd strings, each after an even one that the first collection
+       frees, so the end prints "str-100001" and "str-101023" unless the
+       collector moved them */
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, ci_n);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 2);
+    bc_emit_i32(&bc, ci_one);
+    emit_call_native(&bc, 1, 3);
+    for (int i = 0; i < LIVE_STRINGS; ++i)
+    {
+        emit_call_native(&bc, 0, FIRST_LIVE + i);
+        emit_call_native(&bc, 0, 1);
+    }
+
+    /* loop: r1 = new string; r0 -= r2; jz r0 -> end; jmp loop */
+    int loop = (int)bc.code_size;
+    emit_call_native(&bc, 0, 1);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 2);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_i32(&bc, 0);
+    size_t end_pos = bc.code_size;
+    bc_emit_i32(&bc, 0); /* placeholder for end */
+    bc_emit(&bc, OP_JMP);
+    bc_emit_i32(&bc, loop);
+
+    /* end: print the first and last live string; halt */
+    int end = (int)bc.code_size;
+    bc_emit(&bc, OP_PRINT);
+    bc_emit_i32(&bc, FIRST_LIVE);
+    bc_emit(&bc, OP_PRINT);
+    bc_emit_i32(&bc, FIRST_LIVE + LIVE_STRINGS - 1);
+    bc_emit(&bc, OP_HALT);
+    bc_patch_operand(&bc, end_pos, OPND_JUMP, end);
+
+    int failed = run(&bc, VM_NURSERY_DEFAULT_SIZE, 1, 0) | run(&bc, 0, 0, 0) | run(&bc, 0, 1, 0) | run(&bc, 0, 1, 100);
+    g_short = 1;
+    failed |= run(&bc, VM_NURSERY_DEFAULT_SIZE, 1, 0);
+    bc_free(&bc);
+    return failed;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks the byte-based major collection trigger and vm_gc_stats. r0 holds
+   an object of HOLD_FIELDS fields while a loop allocates ITERS garbage
+   objects of GARBAGE_FIELDS fields. That is only a few hundred objects, but
+   many times the live size in bytes, so major collections must run and keep
+   the heap within the growth factor of the live data. A larger
+   gc_heap_growth_percent must collect less often. Runs without a nursery. */
+
+#define HOLD_FIELDS (64 * 1024)
+#define GARBAGE_FIELDS 4096
+#define ITERS 400
+
+static int g_failed;
+
+/* native 0: hold(): the live object */
+static Value hold(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    return value_obj(vm_alloc_object(vm, HOLD_FIELDS));
+}
+
+/* native 1: garbage() */
+static Value garbage(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    vm_alloc_object(vm, GARBAGE_FIELDS);
+    return value_none();
+}
+
+static void emit_call_native(Bytecode *bc, int native, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, native);
+    bc_emit_count(bc, 0);
+    bc_emit_reg(bc, dst);
+}
+
+/* returns the number of major collections */
+static uint64_t run(const Bytecode *bc, unsigned growth_percent)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 4;
+    opts.nursery_size = VM_NURSERY_OFF;
+    opts.gc_heap_growth_percent = growth_percent;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, hold);
+    vm_register_native(vm, 1, garbage);
+    vm_load(vm, bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+
+    VMGCStats run_stats, stats;
+    vm_gc_stats(vm, &run_stats);
+    vm_gc(vm);
+    vm_gc_stats(vm, &stats);
+    size_t live = HOLD_FIELDS * sizeof(Value);
+    size_t garbage_size = GARBAGE_FIELDS * sizeof(Value);
+    /* the heap may grow by growth_percent past the live data before a
+       collection starts, and by a few more garbage objects until its lazy
+       sweep is done */
+    size_t bound = live + live / 100 * growth_percent + 8 * garbage_size;
+    int failed = err != NULL || run_stats.major_collections == 0 || run_stats.pauses < run_stats.major_collections ||
+                 run_stats.pause_ns_max > run_stats.pause_ns_total ||
+                 run_stats.bytes_allocated < live + (uint64_t)ITERS * garbage_size ||
+                 run_stats.live_bytes > bound || stats.major_collections != run_stats.major_collections + 1 ||
+                 stats.live_bytes != stats.bytes_allocated - stats.bytes_freed || stats.old_bytes < live ||
+                 stats.old_bytes > live + 1024 || stats.objects != 1;
+    printf("growth %u%%: %llu major collections, %llu pauses (max %.0f us), %llu bytes allocated, "
+           "%zu live after the loop, %zu after vm_gc: %s\n",
+           growth_percent, (unsigned long long)run_stats.major_collections, (unsigned long long)run_stats.pauses,
+           (double)run_stats.pause_ns_max / 1e3, (unsigned long long)run_stats.bytes_allocated,
+           run_stats.live_bytes, stats.live_bytes, failed ? "FAILED" : "ok");
+    g_failed |= failed;
+    vm_destroy(vm);
+    return run_stats.major_collections;
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+
+    /* r0 = hold(); r1 = ITERS; r2 = 1
+       loop: r3 = garbage(); r1 -= r2; jz r1 done; jmp loop
+       done: halt */
+    emit_call_native(&bc, 0, 0);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 1);
+    bc_emit_const_idx(&bc, bc_add_const_int(&bc, ITERS));
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 2);
+    bc_emit_const_idx(&bc, bc_add_const_int(&bc, 1));
+    int loop = (int)bc.code_size;
+    emit_call_native(&bc, 1, 3);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 2);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 1);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    bc_emit(&bc, OP_HALT);
+
+    uint64_t often = run(&bc, 100);
+    uint64_t rarely = run(&bc, 400);
+    if (rarely >= often)
+    {
+        printf("growth 400%% collected as often as 100%%: FAILED\n");
+        g_failed = 1;
+    }
+    bc_free(&bc);
+    return g_failed;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+#include "../include/gctrace.h"
+
+/* Checks the collector trace (VMOptions.gc_trace_events). A loop grows a
+   list in r0 by one node and GARBAGE dead objects per call, with a unique
+   string in each node, and starts a new list every RESTART calls. Major
+   collections are incremental and the nursery is small, so there are minor
+   collections, mark and sweep slices; vm_compact_heap adds a compaction at
+   the end. With a ring big enough for every pause, the events must be in
+   order and account for every string and object freed, and the longest
+   must match vm_gc_stats. A ring of RING events must hold the same last
+   RING pauses, and a VM without tracing none. The trace is exported as
+   JSON, and the pause histogram printed. */
+
+#define CALLS 20000
+#define GARBAGE 4
+#define RESTART 500
+#define ALL_EVENTS 4096
+#define RING 16
+
+static int g_calls;
+
+/* native 0: step(list): a new node {list, "node-n"} in front of list */
+static Value step(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "node-%d", g_calls);
+    int node = vm_alloc_object(vm, 2);
+    if (g_calls++ % RESTART != 0)
+        vm_set_object_field(vm, node, 0, args[0]);
+    vm_set_object_field(vm, node, 1, value_str(vm_alloc_string(vm, buf)));
+    for (int i = 0; i < GARBAGE; ++i)
+        vm_alloc_object(vm, 3);
+    return value_obj(node);
+}
+
+static VM *run(const Bytecode *bc, size_t trace_events)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 4;
+    opts.nursery_size = 16 * 1024;
+    opts.gc_incremental = 1;
+    opts.gc_slice_work = 200;
+    opts.gc_trace_events = trace_events;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, step);
+    vm_load(vm, bc);
+    g_calls = 0;
+    const char *err = vm_run(vm);
+    if (err)
+    {
+        printf("VM error: %s\n", err);
+        vm_destroy(vm);
+        return NULL;
+    }
+    vm_compact_heap(vm);
+    return vm;
+}
+
+static int same_pause(const VMGCEvent *a, const VMGCEvent *b)
+{
+    return a->cycle == b->cycle && a->phases == b->phases && a->roots == b->roots &&
+           a->strings_marked == b->strings_marked && a->objects_marked == b->objects_marked &&
+           a->strings_freed == b->strings_freed && a->objects_freed == b->objects_freed &&
+           a->string_free_list == b->string_free_list && a->object_free_list == b->object_free_list;
+}
+
+static VMGCEvent g_all[ALL_EVENTS];
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+
+    /* r1 = CALLS; r2 = 1
+       loop: r0 = step(r0); r1 -= r2; jz r1 done; jmp loop
+       done: halt */
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 1);
+    bc_emit_const_idx(&bc, bc_add_const_int(&bc, CALLS));
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 2);
+    bc_emit_const_idx(&bc, bc_add_const_int(&bc, 1));
+    int loop = (int)bc.code_size;
+    bc_emit(&bc, OP_CALL);
+    bc_emit_operand(&bc, OPND_NATIVE, 0);
+    bc_emit_count(&bc, 1);
+    bc_emit_reg(&bc, 0);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 2);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 1);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    bc_emit(&bc, OP_HALT);
+
+    int failed = 0;
+
+    /* every pause */
+    VM *vm = run(&bc, ALL_EVENTS);
+    if (!vm)
+        return 1;
+    VMGCStats stats;
+    vm_gc_stats(vm, &stats);
+    size_t n = vm_gc_events(vm, g_all, ALL_EVENTS);
+    size_t strings_freed = 0, objects_freed = 0, out_of_order = 0;
+    unsigned phases = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const VMGCEvent *e = &g_all[i];
+        if (e->end_ns < e->start_ns || (i > 0 && e->start_ns < g_all[i - 1].end_ns) || !e->phases)
+            ++out_of_order;
+        strings_freed += e->strings_freed;
+        objects_freed += e->objects_freed;
+        phases |= e->phases;
+    }
+    GCPauseSummary summary;
+    gc_pause_summary(g_all, n, &summary);
+    size_t objects = (size_t)CALLS * (1 + GARBAGE);
+    int bad = n != stats.pauses || out_of_order || strings_freed != CALLS - stats.strings ||
+              objects_freed != objects - stats.objects || phases != 15 || summary.max_ns != stats.pause_ns_max ||
+              summary.p50_ns > summary.p99_ns || summary.p99_ns > summary.max_ns;
+    printf("%zu events, %zu out of order, %zu strings and %zu objects freed, phases %u: %s\n", n, out_of_order,
+           strings_freed, objects_freed, phases, bad ? "FAILED" : "ok");
+    failed |= bad;
+    gc_pause_histogram(g_all, n, stdout);
+
+    FILE *json = tmpfile();
+    gc_trace_write_json(g_all, n, json);
+    rewind(json);
+    char line[512];
+    size_t complete = 0;
+    int header = fgets(line, sizeof(line), json) && strncmp(line, "{\"displayTimeUnit\"", 18) == 0;
+    while (fgets(line, sizeof(line), json))
+        complete += strstr(line, "\"ph\":\"X\"") != NULL;
+    fclose(json);
+    bad = !header || complete != n;
+    printf("trace JSON: %zu complete events: %s\n", complete, bad ? "FAILED" : "ok");
+    failed |= bad;
+    vm_destroy(vm);
+
+    /* the ring keeps the last RING */
+    vm = run(&bc, RING);
+    if (!vm)
+        return 1;
+    VMGCEvent ring[RING];
+    size_t held = vm_gc_events(vm, ring, RING);
+    size_t differ = 0;
+    for (size_t i = 0; i < held && n >= RING; ++i)
+        differ += !same_pause(&ring[i], &g_all[n - RING + i]);
+    bad = held != RING || differ;
+    printf("ring of %d: %zu events, %zu differ from the last ones: %s\n", RING, held, differ, bad ? "FAILED" : "ok");
+    failed |= bad;
+    vm_destroy(vm);
+
+    /* off */
+    vm = run(&bc, 0);
+    if (!vm)
+        return 1;
+    held = vm_gc_events(vm, ring, RING);
+    printf("tracing off: %zu events: %s\n", held, held ? "FAILED" : "ok");
+    failed |= held != 0;
+    vm_destroy(vm);
+
+    bc_free(&bc);
+    return failed;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks the generational collector with a tiny nursery, so minor
+   collections run every few dozen allocations: an object that has been
+   promoted to the old generation is then given a young string and a young
+   object (holding another young string) through vm_set_object_field. Only
+   the write barrier keeps those alive across the following minor
+   collections, and a final major collection must keep them too. */
+
+#define GARBAGE_LOOPS 2000
+
+static int g_next;
+static int g_failed;
+
+/* native 0: a new, unique string */
+static Value make_string(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "garbage-%d", ++g_next);
+    return value_str(vm_alloc_string(vm, buf));
+}
+
+/* native 1: a new object with two empty fields */
+static Value make_object(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    return value_obj(vm_alloc_object(vm, 2));
+}
+
+/* native 2: old.f0 = "young"; old.f1 = {"inner", none} */
+static Value store_young(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    int obj = value_as_obj(args[0]);
+    int inner = vm_alloc_object(vm, 2);
+    vm_set_object_field(vm, inner, 0, value_str(vm_alloc_string(vm, "inner")));
+    vm_set_object_field(vm, obj, 0, value_str(vm_alloc_string(vm, "young")));
+    vm_set_object_field(vm, obj, 1, value_obj(inner));
+    return value_none();
+}
+
+static int check_fields(VM *vm, int obj, const char *when)
+{
+    const char *young = vm_string_chars(vm, vm_get_object_field(vm, obj, 0));
+    Value inner = vm_get_object_field(vm, obj, 1);
+    const char *in = value_type(inner) == V_OBJECT
+                         ? vm_string_chars(vm, vm_get_object_field(vm, value_as_obj(inner), 0))
+                         : NULL;
+    int ok = young && strcmp(young, "young") == 0 && in && strcmp(in, "inner") == 0;
+    printf("%s: %s / %s: %s\n", when, young ? young : "(lost)", in ? in : "(lost)", ok ? "ok" : "FAILED");
+    return !ok;
+}
+
+/* native 3: the values stored by native 2 are still there */
+static Value check(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    g_failed |= check_fields(vm, value_as_obj(args[0]), "after minor collections");
+    return value_none();
+}
+
+static void emit_call_native(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, native);
+    bc_emit_count(bc, nargs);
+    bc_emit_reg(bc, dst);
+}
+
+/* r2 = n; loop: r3 = new string; r2 -= r4; jz r2 done; jmp loop; done: */
+static void emit_garbage_loop(Bytecode *bc, int ci_n)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 2);
+    bc_emit_const_idx(bc, ci_n);
+    int loop = (int)bc->code_size;
+    emit_call_native(bc, 0, 0, 3);
+    bc_emit(bc, OP_SUB);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 4);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 2);
+    long done_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_JMP);
+    bc_emit_jump(bc, loop);
+    bc_patch_operand(bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc->code_size);
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_n = bc_add_const_int(&bc, GARBAGE_LOOPS);
+    int ci_one = bc_add_const_int(&bc, 1);
+
+    /* r4 = 1; r0 = new object; garbage (promotes r0); store_young(r0);
+       garbage; check(r0); halt */
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 4);
+    bc_emit_const_idx(&bc, ci_one);
+    emit_call_native(&bc, 1, 0, 0);
+    emit_garbage_loop(&bc, ci_n);
+    emit_call_native(&bc, 2, 1, 1);
+    emit_garbage_loop(&bc, ci_n);
+    emit_call_native(&bc, 3, 1, 1);
+    bc_emit(&bc, OP_HALT);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 5;
+    opts.nursery_size = 1024;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make_string);
+    vm_register_native(vm, 1, make_object);
+    vm_register_native(vm, 2, store_young);
+    vm_register_native(vm, 3, check);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+
+    /* r0 still holds the object after the run */
+    vm_gc(vm);
+    int failed = g_failed | (err != NULL);
+    failed |= check_fields(vm, 0, "after a major collection");
+
+    vm_destroy(vm);
+    bc_free(&bc);
+    return failed;
+}
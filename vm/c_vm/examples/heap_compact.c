@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks heap compaction. A list of LIST objects is built with GARBAGE dead
+   objects allocated after each node, so the live nodes end up spread over
+   the object table. r0 holds the head and r1 the middle node. A loop of
+   small allocations then lets the major collection this starts sweep, and
+   with VMOptions.gc_compact_percent the live objects are slid together.
+   The check afterwards walks the list and expects r1 to still be the
+   middle node and nearly every node at the index next to the one before it
+   (churn objects allocated during the sweep are still alive, and some sit
+   in between). After vm_compact_heap, called from a native, that must hold
+   for every node. Runs without and with a nursery. */
+
+#define LIST 10000
+#define GARBAGE 3
+#define CHURN_CALLS 500
+#define CHURN_ALLOCS 64
+
+static int g_failed;
+
+/* native 0: make(): the list, node i = {i, next, "node-i"} */
+static Value make(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    Value head = value_none();
+    int prev = -1;
+    for (int i = 0; i < LIST; ++i)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "node-%d", i);
+        int node = vm_alloc_object(vm, 3);
+        vm_set_object_field(vm, node, 0, value_int(i));
+        vm_set_object_field(vm, node, 2, value_str(vm_alloc_string(vm, buf)));
+        if (prev < 0)
+            head = value_obj(node);
+        else
+            vm_set_object_field(vm, prev, 1, value_obj(node));
+        prev = node;
+        for (int g = 0; g < GARBAGE; ++g)
+            vm_alloc_object(vm, 2);
+    }
+    return head;
+}
+
+/* native 1: middle(list): node LIST / 2 */
+static Value middle(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    Value v = args[0];
+    for (int i = 0; i < LIST / 2; ++i)
+        v = vm_get_object_field(vm, value_as_obj(v), 1);
+    return v;
+}
+
+/* native 2: churn(): CHURN_ALLOCS garbage objects, so the sweep advances */
+static Value churn(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    for (int i = 0; i < CHURN_ALLOCS; ++i)
+        vm_alloc_object(vm, 1);
+    return value_none();
+}
+
+/* walks args[0] and compares node LIST / 2 with args[1]; fails if more than
+   max_scattered nodes are not next to their predecessor */
+static void check_list(VM *vm, const Value *args, int max_scattered)
+{
+    int bad = 0, scattered = 0;
+    Value v = args[0];
+    for (int i = 0; i < LIST; ++i)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "node-%d", i);
+        int node = value_as_obj(v);
+        Value id = vm_get_object_field(vm, node, 0);
+        const char *s = vm_string_chars(vm, vm_get_object_field(vm, node, 2));
+        if (value_type(v) != V_OBJECT || !value_is_int(id) || value_as_int(id) != i || !s || strcmp(s, buf) != 0)
+        {
+            ++bad;
+            break;
+        }
+        if (i == LIST / 2 && (value_type(args[1]) != V_OBJECT || value_as_obj(args[1]) != node))
+            ++bad;
+        v = vm_get_object_field(vm, node, 1);
+        if (i + 1 < LIST && value_as_obj(v) != node + 1)
+            ++scattered;
+    }
+    int failed = bad || scattered > max_scattered;
+    printf("%d broken, %d of %d nodes not next to their predecessor: %s\n", bad, scattered, LIST,
+           failed ? "FAILED" : "ok");
+    g_failed |= failed;
+}
+
+/* native 3: check_auto(list, middle) */
+static Value check_auto(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    check_list(vm, args, LIST / 10);
+    return value_none();
+}
+
+/* native 5: check_exact(list, middle) */
+static Value check_exact(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    check_list(vm, args, 0);
+    return value_none();
+}
+
+/* native 4: compact() */
+static Value compact(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    vm_compact_heap(vm);
+    return value_none();
+}
+
+static void emit_call_native(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, native);
+    bc_emit_count(bc, nargs);
+    bc_emit_reg(bc, dst);
+}
+
+static int run(const Bytecode *bc, size_t nursery_size)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 5;
+    opts.nursery_size = nursery_size ? nursery_size : VM_NURSERY_OFF;
+    opts.gc_compact_percent = 50;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make);
+    vm_register_native(vm, 1, middle);
+    vm_register_native(vm, 2, churn);
+    vm_register_native(vm, 3, check_auto);
+    vm_register_native(vm, 4, compact);
+    vm_register_native(vm, 5, check_exact);
+    vm_load(vm, bc);
+    printf("nursery %zu KiB: ", nursery_size / 1024);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+    vm_destroy(vm);
+    return err != NULL;
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_one = bc_add_const_int(&bc, 1);
+    int ci_calls = bc_add_const_int(&bc, CHURN_CALLS);
+
+    /* r0 = make(); r1 = middle(r0); r2 = CHURN_CALLS; r3 = 1
+       loop: r4 = churn(); r2 -= r3; jz r2 done; jmp loop
+       done: r4 = check_auto(r0, r1); r4 = compact(); r4 = check_exact(r0, r1);
+       halt */
+    emit_call_native(&bc, 0, 0, 0);
+    emit_call_native(&bc, 1, 1, 1);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 2);
+    bc_emit_const_idx(&bc, ci_calls);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 3);
+    bc_emit_const_idx(&bc, ci_one);
+    int loop = (int)bc.code_size;
+    emit_call_native(&bc, 2, 0, 4);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_reg(&bc, 2);
+    bc_emit_reg(&bc, 2);
+    bc_emit_reg(&bc, 3);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 2);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    emit_call_native(&bc, 3, 2, 4);
+    emit_call_native(&bc, 4, 0, 4);
+    emit_call_native(&bc, 5, 2, 4);
+    bc_emit(&bc, OP_HALT);
+
+    int failed = run(&bc, 0) | run(&bc, VM_NURSERY_DEFAULT_SIZE);
+    bc_free(&bc);
+    return failed | g_failed;
+}
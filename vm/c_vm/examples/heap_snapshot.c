@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+#include "../include/heapsnap.h"
+
+/* Checks vm_heap_snapshot and the analysis in heapsnap.h. A list of LIST
+   nodes {next, "item-n"} is captured by a closure of f1, and a shared
+   object by that closure and one of f2; then the registers holding the
+   list and the object are cleared and GARBAGE unreachable objects are
+   made. The snapshot, taken from a native, must read back and show: f1's
+   closure retaining itself and the whole list, f2's only itself, the
+   shared object dominated by the root alone, and the garbage unreachable.
+   Nothing is collected in between (the nursery is big enough). Corrupt
+   files, whose counts claim far more than they hold, must be refused. */
+
+#define LIST 50
+#define GARBAGE 7
+
+static int g_list_objects[LIST];
+static int g_list_strings[LIST];
+static int g_shared;
+static int g_failed;
+
+/* native 0: the list */
+static Value make_list(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    Value next = value_int(0);
+    for (int i = 0; i < LIST; ++i)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "item-%d", i);
+        int node = vm_alloc_object(vm, 2);
+        int s = vm_alloc_string(vm, buf);
+        vm_set_object_field(vm, node, 0, next);
+        vm_set_object_field(vm, node, 1, value_str(s));
+        g_list_objects[i] = node;
+        g_list_strings[i] = s;
+        next = value_obj(node);
+    }
+    return next;
+}
+
+/* native 1: the shared object */
+static Value make_shared(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    g_shared = vm_alloc_object(vm, 1);
+    return value_obj(g_shared);
+}
+
+/* native 2: a chain of unreachable objects */
+static Value make_garbage(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    Value next = value_int(0);
+    for (int i = 0; i < GARBAGE; ++i)
+    {
+        int o = vm_alloc_object(vm, 1);
+        vm_set_object_field(vm, o, 0, next);
+        next = value_obj(o);
+    }
+    return value_int(0);
+}
+
+static const HeapNode *find(const HeapSnapshot *hs, int is_object, int index)
+{
+    for (size_t i = 1; i < hs->node_count; ++i)
+    {
+        if (hs->nodes[i].is_object == is_object && hs->nodes[i].index == index)
+            return &hs->nodes[i];
+    }
+    return NULL;
+}
+
+static void check(int bad, const char *what)
+{
+    printf("%s: %s\n", what, bad ? "FAILED" : "ok");
+    g_failed |= bad;
+}
+
+/* native 3: snapshot and analyze; args are the two closures */
+static Value analyze(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    FILE *f = tmpfile();
+    const char *err = vm_heap_snapshot(vm, f);
+    rewind(f);
+    HeapSnapshot hs;
+    if (!err)
+        err = heap_snapshot_read(&hs, f);
+    fclose(f);
+    if (err)
+    {
+        printf("snapshot: %s\n", err);
+        g_failed = 1;
+        return value_int(0);
+    }
+    err = heap_snapshot_analyze(&hs);
+    if (!err)
+        err = heap_snapshot_report(&hs, stdout, 5);
+    if (err)
+    {
+        printf("analyze: %s\n", err);
+        g_failed = 1;
+        heap_snapshot_free(&hs);
+        return value_int(0);
+    }
+    printf("\n");
+
+    const HeapNode *f1 = find(&hs, 1, value_as_obj(args[0]));
+    const HeapNode *f2 = find(&hs, 1, value_as_obj(args[1]));
+    const HeapNode *shared = find(&hs, 1, g_shared);
+    if (!f1 || !f2 || !shared)
+    {
+        check(1, "closures and shared object in the snapshot");
+        heap_snapshot_free(&hs);
+        return value_int(0);
+    }
+    size_t list_bytes = 0;
+    int missing = 0, first_ok = 0;
+    for (int i = 0; i < LIST; ++i)
+    {
+        const HeapNode *o = find(&hs, 1, g_list_objects[i]);
+        const HeapNode *s = find(&hs, 0, g_list_strings[i]);
+        if (!o || !s)
+        {
+            ++missing;
+            continue;
+        }
+        list_bytes += o->size + s->size;
+        if (i == 0)
+            first_ok = strcmp(s->chars, "item-0") == 0 && o->edge_count == 1;
+    }
+    check(missing || !first_ok, "list read back");
+    check(f1->closure < 0 || f2->closure < 0 || f1->closure == f2->closure, "closure functions");
+    check(f1->retained != f1->size + list_bytes, "f1 retains its closure and the list");
+    check(f2->retained != f2->size, "f2 retains its closure only");
+    check(shared->idom != HEAP_NODE_ROOT || shared->retained != shared->size, "shared object dominated by the root");
+    check(hs.unreachable_count != GARBAGE, "garbage unreachable");
+
+    HeapClosureGroup groups[4];
+    size_t ngroups = heap_snapshot_closure_groups(&hs, groups, 4);
+    int bad = ngroups != 2 || groups[0].const_index != f1->closure || groups[0].retained != f1->retained ||
+              groups[1].const_index != f2->closure || groups[1].retained != f2->retained ||
+              groups[0].closures != 1 || groups[1].closures != 1;
+    check(bad, "closure groups");
+    heap_snapshot_free(&hs);
+    return value_int(0);
+}
+
+/* a file must be refused, not read past or sized from its own counts */
+static void check_corrupt(const char *what, const unsigned char *bytes, size_t size)
+{
+    FILE *f = tmpfile();
+    fwrite(bytes, 1, size, f);
+    rewind(f);
+    HeapSnapshot hs;
+    const char *err = heap_snapshot_read(&hs, f);
+    fclose(f);
+    if (err)
+        printf("%s: %s\n", what, err);
+    else
+        heap_snapshot_free(&hs);
+    check(!err, what);
+}
+
+static void emit_call(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_i32(bc, native);
+    bc_emit_i32(bc, nargs);
+    bc_emit_i32(bc, dst);
+}
+
+static size_t emit_closure(Bytecode *bc, int dst, int ncaptures, const int *captures)
+{
+    bc_emit(bc, OP_MK_CLOSURE);
+    bc_emit_i32(bc, dst);
+    size_t ci_pos = bc->code_size;
+    bc_emit_i32(bc, 0); /* patched with the function constant */
+    bc_emit_i32(bc, ncaptures);
+    for (int i = 0; i < ncaptures; ++i)
+        bc_emit_i32(bc, captures[i]);
+    return ci_pos;
+}
+
+int main(void)
+{
+    /* 2^31 string slots and strings, and none there */
+    static const unsigned char many_strings[] = {'V', 'M', 'H', 'S', 0x02, 0x10, 0x10, 0x04, 0x10, 0x80, 0x80,
+                                                 0x80, 0x80, 0x08, 0x00, 0x00, 0x00, 0x80, 0x80, 0x80, 0x80, 0x08};
+    /* 2^31 functions, and none there */
+    static const unsigned char many_functions[] = {'V', 'M', 'H', 'S', 0x02, 0x10, 0x10, 0x04,
+                                                   0x10, 0x01, 0x01, 0x80, 0x80, 0x80, 0x80, 0x08};
+    /* one string of 2^31 bytes, and three there */
+    static const unsigned char long_string[] = {'V', 'M', 'H', 'S', 0x02, 0x10, 0x10, 0x04, 0x10, 0x01, 0x00, 0x00,
+                                                0x00, 0x01, 0x00, 0x00, 0x80, 0x80, 0x80, 0x80, 0x08, 'a', 'b', 'c'};
+    check_corrupt("corrupt string count refused", many_strings, sizeof(many_strings));
+    check_corrupt("corrupt function count refused", many_functions, sizeof(many_functions));
+    check_corrupt("corrupt string length refused", long_string, sizeof(long_string));
+
+    Bytecode bc;
+    bc_init(&bc);
+    int ci_zero = bc_add_const_int(&bc, 0);
+
+    /* r2 = make_list(); r3 = make_shared()
+       r4 = closure f1 [r2, r3]; r5 = closure f2 [r3]
+       r2 = 0; r3 = 0; make_garbage()
+       r0 = r4; r1 = r5; analyze(r0, r1); halt */
+    emit_call(&bc, 0, 0, 2);
+    emit_call(&bc, 1, 0, 3);
+    int f1_captures[] = {2, 3}, f2_captures[] = {3};
+    size_t f1_pos = emit_closure(&bc, 4, 2, f1_captures);
+    size_t f2_pos = emit_closure(&bc, 5, 1, f2_captures);
+    for (int r = 2; r <= 3; ++r)
+    {
+        bc_emit(&bc, OP_LOAD_CONST);
+        bc_emit_i32(&bc, r);
+        bc_emit_i32(&bc, ci_zero);
+    }
+    emit_call(&bc, 2, 0, 6);
+    for (int r = 0; r <= 1; ++r)
+    {
+        bc_emit(&bc, OP_MOV);
+        bc_emit_i32(&bc, r);
+        bc_emit_i32(&bc, r + 4);
+    }
+    emit_call(&bc, 3, 2, 6);
+    bc_emit(&bc, OP_HALT);
+
+    /* f1 and f2: ret r0 (never called) */
+    int ci_f1 = bc_add_const_function(&bc, (int)bc.code_size, 0);
+    bc_emit(&bc, OP_RET);
+    bc_emit_i32(&bc, 0);
+    int ci_f2 = bc_add_const_function(&bc, (int)bc.code_size, 0);
+    bc_emit(&bc, OP_RET);
+    bc_emit_i32(&bc, 0);
+    memcpy(&bc.code[f1_pos], &ci_f1, 4);
+    memcpy(&bc.code[f2_pos], &ci_f2, 4);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    opts.nursery_size = 1024 * 1024;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make_list);
+    vm_register_native(vm, 1, make_shared);
+    vm_register_native(vm, 2, make_garbage);
+    vm_register_native(vm, 3, analyze);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    if (err)
+    {
+        printf("VM error: %s\n", err);
+        g_failed = 1;
+    }
+    vm_destroy(vm);
+    bc_free(&bc);
+    return g_failed;
+}
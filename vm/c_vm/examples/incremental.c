@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks incremental major collections with a small slice budget, so one
+   collection spans hundreds of native calls. Each call moves the last object
+   of a long list into the next field of a holder object and cuts it off the
+   list. The holder sits in a register and is scanned early, while the list
+   is traced from its head, so the moved object is usually not marked yet:
+   only the barrier in vm_set_object_field keeps it alive. Runs without and
+   with a nursery and checks every moved object at the end. */
+
+#define LIST_LENGTH 3000
+#define MOVES 1500
+#define GARBAGE_PER_MOVE 16
+
+static int g_failed;
+
+/* native 0: a list of LIST_LENGTH objects, field 0 = id, field 1 = next */
+static Value make_list(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    Value next = value_none();
+    for (int i = LIST_LENGTH - 1; i >= 0; --i)
+    {
+        int obj = vm_alloc_object(vm, 2);
+        vm_set_object_field(vm, obj, 0, value_int(i));
+        vm_set_object_field(vm, obj, 1, next);
+        next = value_obj(obj);
+    }
+    return next;
+}
+
+/* native 1: a holder with MOVES empty fields */
+static Value make_holder(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    return value_obj(vm_alloc_object(vm, MOVES));
+}
+
+/* native 2: move(list, holder, i): holder[i] = last object of list, which
+   is cut off; then some garbage, so collection slices keep running */
+static Value move(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    int prev = value_as_obj(args[0]);
+    int last = value_as_obj(vm_get_object_field(vm, prev, 1));
+    for (;;)
+    {
+        Value next = vm_get_object_field(vm, last, 1);
+        if (value_type(next) != V_OBJECT)
+            break;
+        prev = last;
+        last = value_as_obj(next);
+    }
+    vm_set_object_field(vm, value_as_obj(args[1]), (int)value_as_int(args[2]), value_obj(last));
+    vm_set_object_field(vm, prev, 1, value_none());
+    for (int i = 0; i < GARBAGE_PER_MOVE; ++i)
+        vm_alloc_object(vm, 2);
+    return value_none();
+}
+
+/* native 3: check(holder): field i holds object LIST_LENGTH - 1 - i */
+static Value check(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    int lost = 0;
+    for (int i = 0; i < MOVES; ++i)
+    {
+        Value obj = vm_get_object_field(vm, value_as_obj(args[0]), i);
+        Value id = value_type(obj) == V_OBJECT ? vm_get_object_field(vm, value_as_obj(obj), 0) : value_none();
+        if (!value_is_int(id) || value_as_int(id) != LIST_LENGTH - 1 - i)
+            ++lost;
+    }
+    printf("%d of %d moved objects lost: %s\n", lost, MOVES, lost ? "FAILED" : "ok");
+    g_failed |= lost != 0;
+    return value_none();
+}
+
+static void emit_call_native(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, native);
+    bc_emit_count(bc, nargs);
+    bc_emit_reg(bc, dst);
+}
+
+static int run(const Bytecode *bc, size_t nursery_size)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 6;
+    opts.nursery_size = nursery_size ? nursery_size : VM_NURSERY_OFF;
+    opts.gc_incremental = 1;
+    opts.gc_slice_work = 50;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make_list);
+    vm_register_native(vm, 1, make_holder);
+    vm_register_native(vm, 2, move);
+    vm_register_native(vm, 3, check);
+    vm_load(vm, bc);
+    printf("nursery %zu KiB: ", nursery_size / 1024);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+    vm_destroy(vm);
+    return err != NULL;
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_zero = bc_add_const_int(&bc, 0);
+    int ci_one = bc_add_const_int(&bc, 1);
+    int ci_moves = bc_add_const_int(&bc, MOVES);
+
+    /* r0 = list; r1 = holder; r2 = 0; r3 = MOVES; r4 = 1
+       loop: r5 = move(r0, r1, r2); r2 += r4; r3 -= r4; jz r3 done; jmp loop
+       done: r0 = r1; r5 = check(r0); halt */
+    emit_call_native(&bc, 0, 0, 0);
+    emit_call_native(&bc, 1, 0, 1);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 2);
+    bc_emit_const_idx(&bc, ci_zero);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 3);
+    bc_emit_const_idx(&bc, ci_moves);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 4);
+    bc_emit_const_idx(&bc, ci_one);
+    int loop = (int)bc.code_size;
+    emit_call_native(&bc, 2, 3, 5);
+    bc_emit(&bc, OP_ADD);
+    bc_emit_reg(&bc, 2);
+    bc_emit_reg(&bc, 2);
+    bc_emit_reg(&bc, 4);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_reg(&bc, 3);
+    bc_emit_reg(&bc, 3);
+    bc_emit_reg(&bc, 4);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 3);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 0);
+    bc_emit_reg(&bc, 1);
+    emit_call_native(&bc, 3, 1, 5);
+    bc_emit(&bc, OP_HALT);
+
+    int failed = run(&bc, 0) | run(&bc, VM_NURSERY_DEFAULT_SIZE);
+    bc_free(&bc);
+    return failed | g_failed;
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks string interning: every LOAD_CONST and ALLOC_STR of a string
+   constant yields the one string vm_load interned, runtime strings with equal
+   contents share an index, constants survive collections that free
+   unreferenced runtime strings, and a loop loading a string constant
+   thousands of times leaves the heap as small as it found it. Then
+   RELOADS programs, each with a constant of its own, are loaded into one
+   VM in turn: the constants of a replaced program must be collected once
+   nothing refers to them, but not while a register still does. */
+
+#define LOOP_ITERS 5000
+#define RELOADS 200
+
+static int g_seen = -1;
+static int g_mismatches;
+
+/* native 0: every string it is passed must be the same heap string */
+static Value expect_same(VM *vm, int nargs, const Value *args)
+{
+    (void)vm;
+    if (nargs < 1 || value_type(args[0]) != V_STRING)
+        g_mismatches++;
+    else if (g_seen < 0)
+        g_seen = value_as_str(args[0]);
+    else if (value_as_str(args[0]) != g_seen)
+        g_mismatches++;
+    return value_none();
+}
+
+static int check(const char *what, int ok)
+{
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    return !ok;
+}
+
+static int g_reload;
+
+/* native 1: prev(s): s is the previous program's constant, or none at first */
+static Value expect_prev(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    char want[64];
+    snprintf(want, sizeof(want), "constant of script %d", g_reload - 1);
+    const char *got = vm_string_chars(vm, args[0]);
+    if (g_reload > 0 && (!got || strcmp(got, want) != 0))
+        g_mismatches++;
+    return value_none();
+}
+
+/* script k: r1 = "constant of script k"; prev(r0); r0 = r1; halt. r0 still
+   holds the previous script's constant when the next one is loaded. */
+static void build_script(Bytecode *bc, int k)
+{
+    char s[64];
+    snprintf(s, sizeof(s), "constant of script %d", k);
+    bc_init_version(bc, BC_VERSION_2);
+    int ci = bc_add_const_string(bc, s);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 1);
+    bc_emit_const_idx(bc, ci);
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, 1);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 3);
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_HALT);
+}
+
+static int check_reload(void)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 4;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 1, expect_prev);
+    g_mismatches = 0;
+    size_t first = 0;
+    VMGCStats stats;
+    int failed = 0;
+    for (g_reload = 0; g_reload < RELOADS && !failed; ++g_reload)
+    {
+        Bytecode bc;
+        build_script(&bc, g_reload);
+        vm_load(vm, &bc);
+        /* the previous constant is only in r0 now */
+        vm_gc(vm);
+        const char *err = vm_run(vm);
+        if (err)
+        {
+            printf("VM error: %s\n", err);
+            failed = 1;
+        }
+        vm_gc(vm);
+        vm_gc_stats(vm, &stats);
+        if (g_reload == 0)
+            first = stats.strings;
+        bc_free(&bc);
+    }
+    failed |= check("a replaced program's constant kept while a register holds it", g_mismatches == 0);
+    printf("%zu strings after the first load, %zu after %d\n", first, stats.strings, RELOADS);
+    failed |= check("replaced programs' constants collected", stats.strings == first);
+    vm_destroy(vm);
+    return failed;
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_label = bc_add_const_string(&bc, "label");
+    bc_add_const_string(&bc, "never-loaded");
+    int ci_n = bc_add_const_int(&bc, LOOP_ITERS);
+    int ci_one = bc_add_const_int(&bc, 1);
+
+    /* r1 = n; r2 = 1
+       loop: r0 = "label"; native0(r0); r0 = alloc "label"; native0(r0);
+             r1 -= r2; jz r1 done; jmp loop
+       done: halt */
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 1);
+    bc_emit_const_idx(&bc, ci_n);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 2);
+    bc_emit_const_idx(&bc, ci_one);
+    int loop = (int)bc.code_size;
+    for (int i = 0; i < 2; ++i)
+    {
+        bc_emit(&bc, i == 0 ? OP_LOAD_CONST : OP_ALLOC_STR);
+        bc_emit_reg(&bc, 0);
+        bc_emit_const_idx(&bc, ci_label);
+        bc_emit(&bc, OP_CALL);
+        bc_emit_operand(&bc, OPND_NATIVE, 0);
+        bc_emit_count(&bc, 1);
+        bc_emit_reg(&bc, 3);
+    }
+    bc_emit(&bc, OP_SUB);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 2);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 1);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    bc_emit(&bc, OP_HALT);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 4;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, expect_same);
+    vm_load(vm, &bc);
+    int label = vm_alloc_string(vm, "label");
+    int never = vm_alloc_string(vm, "never-loaded");
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+
+    int failed = err != NULL;
+    failed |= check("constant loads share the interned string", g_mismatches == 0 && g_seen == label);
+    failed |= check("interned contents", strcmp(vm_string_chars(vm, value_str(label)), "label") == 0);
+
+    int a = vm_alloc_string(vm, "runtime");
+    int b = vm_alloc_string(vm, "runtime");
+    failed |= check("equal runtime strings share an index", a == b && a != label);
+
+    vm_gc(vm);
+    failed |= check("unreferenced runtime string collected", vm_string_chars(vm, value_str(a)) == NULL);
+    const char *s = vm_string_chars(vm, value_str(never));
+    failed |= check("unreferenced constant kept", s && strcmp(s, "never-loaded") == 0);
+    /* the collected slot is the only free one; nothing else was ever allocated */
+    failed |= check("no copies made by the loop", vm_alloc_string(vm, "fresh") == a);
+
+    vm_destroy(vm);
+    bc_free(&bc);
+    failed |= check_reload();
+    return failed;
+}
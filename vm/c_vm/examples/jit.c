@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../include/bytecode.h"
+#include "../include/jit.h"
+#include "../include/vm.h"
+
+/* Runs the same programs with the JIT off and with a low threshold and checks
+   the results match: a hot loop function, a function that throws from
+   jitted code into a handler in the caller, and a type guard failing after
+   compilation. Results are collected through native 0. */
+
+static int64_t g_sum;
+static int g_records;
+
+static Value record(VM *vm, int nargs, const Value *args)
+{
+    (void)vm;
+    if (nargs > 0 && value_is_int(args[0]))
+        g_sum += value_as_int(args[0]);
+    g_records++;
+    return value_none();
+}
+
+static void emit_load(Bytecode *bc, int reg, int ci)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, reg);
+    bc_emit_const_idx(bc, ci);
+}
+
+static void emit_rrr(Bytecode *bc, u8 op, int a, int b, int c)
+{
+    bc_emit(bc, op);
+    bc_emit_reg(bc, a);
+    bc_emit_reg(bc, b);
+    bc_emit_reg(bc, c);
+}
+
+/* record(r) through native 0 */
+static void emit_record(Bytecode *bc, int r)
+{
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, r);
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 4);
+}
+
+/* main: for r7 = calls..1: r0 = arg; r5 = f(r0); record(r5). Returns the
+   position of f's constant operand. */
+static long emit_main_loop(Bytecode *bc, int calls, int ci_arg)
+{
+    emit_load(bc, 7, bc_add_const_int(bc, calls));
+    emit_load(bc, 6, bc_add_const_int(bc, 1));
+    int loop = (int)bc->code_size;
+    emit_load(bc, 0, ci_arg);
+    bc_emit(bc, OP_CALL_USER);
+    long func_pos = bc_emit_const_idx(bc, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 5);
+    emit_record(bc, 5);
+    emit_rrr(bc, OP_SUB, 7, 7, 6);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 7);
+    long end_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_JMP);
+    bc_emit_jump(bc, loop);
+    bc_patch_operand(bc, (size_t)end_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_HALT);
+    return func_pos;
+}
+
+/* sum_to(r0): r1 = r0 + (r0 - 1) + ... + 1, counting down in r0 */
+static void emit_sum_to(Bytecode *bc, long func_pos)
+{
+    int ci_zero = bc_add_const_int(bc, 0);
+    int ci_one = bc_add_const_int(bc, 1);
+    int start = (int)bc->code_size;
+    emit_load(bc, 1, ci_zero);
+    emit_load(bc, 2, ci_one);
+    int loop = (int)bc->code_size;
+    emit_rrr(bc, OP_ADD, 1, 1, 0);
+    emit_rrr(bc, OP_SUB, 0, 0, 2);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 0);
+    long done_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_JMP);
+    bc_emit_jump(bc, loop);
+    bc_patch_operand(bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 1);
+    bc_patch_operand(bc, (size_t)func_pos, OPND_CONST, bc_add_const_function(bc, start, 1));
+}
+
+static const char *run(const Bytecode *bc, int threshold, int *compiled, double *secs)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    opts.jit_threshold = threshold ? threshold : VM_JIT_OFF;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, record);
+    vm_load(vm, bc);
+    g_sum = 0;
+    g_records = 0;
+    clock_t t0 = clock();
+    const char *err = vm_run(vm);
+    if (secs)
+        *secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+    *compiled = vm_jit_compiled(vm);
+    vm_destroy(vm);
+    return err;
+}
+
+/* runs bc interpreted and jitted; both must agree and the JIT must compile */
+static int compare(const char *name, const Bytecode *bc, const char *want_err)
+{
+    int compiled_off, compiled_on;
+    double t_off, t_on;
+    const char *err_off = run(bc, 0, &compiled_off, &t_off);
+    int64_t sum_off = g_sum;
+    int records_off = g_records;
+    const char *err_on = run(bc, 10, &compiled_on, &t_on);
+    int ok = err_off == err_on && sum_off == g_sum && records_off == g_records &&
+             (want_err ? err_on && strcmp(err_on, want_err) == 0 : !err_on);
+    if (VM_JIT_AVAILABLE)
+        ok &= compiled_on == 1;
+    printf("%-8s %s: sum %lld over %d records, %s; compiled %d; %.3f s -> %.3f s\n", name,
+           ok ? "ok" : "FAILED", (long long)g_sum, g_records, err_on ? err_on : "no error", compiled_on,
+           t_off, t_on);
+    return ok ? 0 : 1;
+}
+
+int main(void)
+{
+    int failed = 0;
+    Bytecode bc;
+
+    /* hot loop: 2000 calls of sum_to(5000) */
+    bc_init_version(&bc, BC_VERSION_2);
+    long pos = emit_main_loop(&bc, 2000, bc_add_const_int(&bc, 5000));
+    emit_sum_to(&bc, pos);
+    failed |= compare("loop", &bc, NULL);
+    bc_free(&bc);
+
+    /* throw: f(r0) = r0 * 2 until the counter reaches 0, then f throws 99
+       out of jitted code to the handler in main, which records it */
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_99 = bc_add_const_int(&bc, 99);
+    bc_emit(&bc, OP_PUSH_HANDLER);
+    long handler_pos = bc_emit_jump(&bc, 0);
+    emit_load(&bc, 7, bc_add_const_int(&bc, 50));
+    emit_load(&bc, 6, bc_add_const_int(&bc, 1));
+    int loop = (int)bc.code_size;
+    emit_rrr(&bc, OP_SUB, 7, 7, 6);
+    bc_emit(&bc, OP_MOV);
+    bc_emit_reg(&bc, 0);
+    bc_emit_reg(&bc, 7);
+    bc_emit(&bc, OP_CALL_USER);
+    long f_pos = bc_emit_const_idx(&bc, 0);
+    bc_emit_count(&bc, 1);
+    bc_emit_reg(&bc, 5);
+    emit_record(&bc, 5);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)handler_pos, OPND_JUMP, (int32_t)bc.code_size);
+    emit_record(&bc, 0); /* r0 holds the exception */
+    bc_emit(&bc, OP_HALT);
+    int f_start = (int)bc.code_size;
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 0);
+    long throw_pos = bc_emit_jump(&bc, 0);
+    emit_rrr(&bc, OP_ADD, 1, 0, 0);
+    bc_emit(&bc, OP_RET);
+    bc_emit_reg(&bc, 1);
+    bc_patch_operand(&bc, (size_t)throw_pos, OPND_JUMP, (int32_t)bc.code_size);
+    emit_load(&bc, 1, ci_99);
+    bc_emit(&bc, OP_THROW);
+    bc_emit_reg(&bc, 1);
+    bc_patch_operand(&bc, (size_t)f_pos, OPND_CONST, bc_add_const_function(&bc, f_start, 1));
+    failed |= compare("throw", &bc, NULL);
+    bc_free(&bc);
+
+    /* guard: sum_to compiled on ints, then called with a double */
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_two = bc_add_const_int(&bc, 2);
+    int ci_half = bc_add_const_double(&bc, 0.5);
+    int ci_ten = bc_add_const_int(&bc, 10);
+    emit_load(&bc, 7, ci_ten);
+    emit_load(&bc, 6, bc_add_const_int(&bc, 1));
+    loop = (int)bc.code_size;
+    emit_load(&bc, 0, ci_two);
+    emit_rrr(&bc, OP_SUB, 7, 7, 6);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 7);
+    long last_pos = bc_emit_jump(&bc, 0);
+    long call_pos[2];
+    bc_emit(&bc, OP_CALL_USER);
+    call_pos[0] = bc_emit_const_idx(&bc, 0);
+    bc_emit_count(&bc, 1);
+    bc_emit_reg(&bc, 5);
+    emit_record(&bc, 5);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)last_pos, OPND_JUMP, (int32_t)bc.code_size);
+    emit_load(&bc, 0, ci_half);
+    bc_emit(&bc, OP_CALL_USER);
+    call_pos[1] = bc_emit_const_idx(&bc, 0);
+    bc_emit_count(&bc, 1);
+    bc_emit_reg(&bc, 5);
+    bc_emit(&bc, OP_HALT);
+    emit_sum_to(&bc, call_pos[0]);
+    int32_t ci_f;
+    size_t p = (size_t)call_pos[0];
+    ci_f = bc_read_operand(&bc, &p, OPND_CONST);
+    bc_patch_operand(&bc, (size_t)call_pos[1], OPND_CONST, ci_f);
+    failed |= compare("guard", &bc, "type error: expected int");
+    bc_free(&bc);
+
+    return failed;
+}
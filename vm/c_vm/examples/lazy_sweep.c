@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks allocation during a lazy sweep (the default; see
+   VMOptions.gc_eager_sweep). Without a nursery, DEAD strings are made
+   reachable from r0 and survive a vm_gc, which also sets the next major
+   collection to start once the old generation has doubled. They are dropped, and enough garbage then starts
+   that collection, which marks nothing of them and leaves them all to the
+   sweep. Right after that pause a native interns the same strings again
+   into a new holder object. Interning hands back the dead, not yet swept
+   strings and the holder is allocated old, so the sweep must spare both. A
+   loop of small allocations then drives the sweep to its end and every
+   string is checked. */
+
+#define DEAD 20000
+#define FILL 40000
+#define CHURN_CALLS 2000
+#define CHURN_ALLOCS 64
+
+static int g_failed;
+
+static void name(char *buf, size_t size, int i)
+{
+    snprintf(buf, size, "dead-%d", i);
+}
+
+/* native 0: make(): an object with DEAD fields, field i = "dead-i" */
+static Value make(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    int holder = vm_alloc_object(vm, DEAD);
+    for (int i = 0; i < DEAD; ++i)
+    {
+        char buf[32];
+        name(buf, sizeof(buf), i);
+        vm_set_object_field(vm, holder, i, value_str(vm_alloc_string(vm, buf)));
+    }
+    return value_obj(holder);
+}
+
+/* native 1: settle(): a complete collection, ending any sweep under way */
+static Value settle(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    vm_gc(vm);
+    return value_none();
+}
+
+/* native 2: fill(): FILL garbage objects, enough to start a major collection */
+static Value fill(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    for (int i = 0; i < FILL; ++i)
+        vm_alloc_object(vm, 1);
+    return value_none();
+}
+
+/* native 3: churn(): CHURN_ALLOCS garbage objects, so the sweep advances */
+static Value churn(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    for (int i = 0; i < CHURN_ALLOCS; ++i)
+        vm_alloc_object(vm, 1);
+    return value_none();
+}
+
+/* native 4: check(holder): field i still reads "dead-i" */
+static Value check(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    int lost = 0;
+    for (int i = 0; i < DEAD; ++i)
+    {
+        char buf[32];
+        name(buf, sizeof(buf), i);
+        const char *s = vm_string_chars(vm, vm_get_object_field(vm, value_as_obj(args[0]), i));
+        if (!s || strcmp(s, buf) != 0)
+            ++lost;
+    }
+    printf("%d of %d revived strings lost: %s\n", lost, DEAD, lost ? "FAILED" : "ok");
+    g_failed |= lost != 0;
+    return value_none();
+}
+
+static void emit_call_native(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, native);
+    bc_emit_count(bc, nargs);
+    bc_emit_reg(bc, dst);
+}
+
+int main(void)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_one = bc_add_const_int(&bc, 1);
+    int ci_calls = bc_add_const_int(&bc, CHURN_CALLS);
+
+    /* r0 = make(); r3 = settle(); r0 = fill(); r0 = make(); r1 = CHURN_CALLS;
+       r2 = 1
+       loop: r3 = churn(); r1 -= r2; jz r1 done; jmp loop
+       done: r3 = check(r0); halt */
+    emit_call_native(&bc, 0, 0, 0);
+    emit_call_native(&bc, 1, 0, 3);
+    emit_call_native(&bc, 2, 0, 0);
+    emit_call_native(&bc, 0, 0, 0);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 1);
+    bc_emit_const_idx(&bc, ci_calls);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 2);
+    bc_emit_const_idx(&bc, ci_one);
+    int loop = (int)bc.code_size;
+    emit_call_native(&bc, 3, 0, 3);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 1);
+    bc_emit_reg(&bc, 2);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_reg(&bc, 1);
+    long done_pos = bc_emit_jump(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, loop);
+    bc_patch_operand(&bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc.code_size);
+    emit_call_native(&bc, 4, 1, 3);
+    bc_emit(&bc, OP_HALT);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 4;
+    opts.nursery_size = VM_NURSERY_OFF;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make);
+    vm_register_native(vm, 1, settle);
+    vm_register_native(vm, 2, fill);
+    vm_register_native(vm, 3, churn);
+    vm_register_native(vm, 4, check);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+    vm_destroy(vm);
+    bc_free(&bc);
+    return (err != NULL) | g_failed;
+}
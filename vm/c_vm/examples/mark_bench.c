@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Marking benchmark: times major collections (vm_gc) of two object graphs
+   that stress the mark stack in opposite ways, each held in a register:
+   - a linked list of CHAIN_LENGTH objects, built the way a program conses a
+     list, so every object points at one allocated before it;
+   - one object with FAN_OUT fields, each pointing at a small object holding
+     a string, so all of them are pushed on the mark stack at once and it
+     overflows.
+   Each graph is collected with 1, 2, 4 and 8 marking threads
+   (VMOptions.gc_mark_threads). Prints the time per collection for each run
+   and checks that the graph is still intact afterwards. The chain can only be
+   traced one object after another, so it shows the overhead of the worker
+   pool; the fan-out is where extra threads pay off, given the cores (the VM
+   starts at most one marking thread per processor). */
+
+#define CHAIN_LENGTH 1000000
+#define FAN_OUT 1000000
+#define COLLECTIONS 10
+#define MAX_THREADS 8
+
+/* native 0: a list of CHAIN_LENGTH objects, field 0 = value, field 1 = next */
+static Value make_chain(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    Value next = value_none();
+    for (int i = 0; i < CHAIN_LENGTH; ++i)
+    {
+        int obj = vm_alloc_object(vm, 2);
+        vm_set_object_field(vm, obj, 0, value_int(i));
+        vm_set_object_field(vm, obj, 1, next);
+        next = value_obj(obj);
+    }
+    return next;
+}
+
+/* native 1: an object with FAN_OUT fields, each an object holding a string */
+static Value make_fan(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    int root = vm_alloc_object(vm, FAN_OUT);
+    int s = vm_alloc_string(vm, "leaf");
+    for (int i = 0; i < FAN_OUT; ++i)
+    {
+        int leaf = vm_alloc_object(vm, 1);
+        vm_set_object_field(vm, leaf, 0, value_str(s));
+        vm_set_object_field(vm, root, i, value_obj(leaf));
+    }
+    return value_obj(root);
+}
+
+static int chain_length(VM *vm, Value v)
+{
+    int n = 0;
+    for (; value_type(v) == V_OBJECT; v = vm_get_object_field(vm, value_as_obj(v), 1))
+        ++n;
+    return n;
+}
+
+static int fan_leaves(VM *vm, Value v)
+{
+    int n = 0;
+    for (int i = 0; i < FAN_OUT; ++i)
+    {
+        Value leaf = vm_get_object_field(vm, value_as_obj(v), i);
+        if (value_type(leaf) == V_OBJECT && vm_string_chars(vm, vm_get_object_field(vm, value_as_obj(leaf), 0)))
+            ++n;
+    }
+    return n;
+}
+
+static int g_failed;
+static int g_threads;
+
+/* wall-clock seconds: clock() would add up the CPU time of all threads */
+static double now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* native 2: times COLLECTIONS major collections, then checks that the graph
+   in args[0] (still in r0, so reachable) is intact */
+static Value measure(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    double t0 = now();
+    for (int i = 0; i < COLLECTIONS; ++i)
+        vm_gc(vm);
+    double secs = (now() - t0) / COLLECTIONS;
+
+    int is_chain = value_is_int(vm_get_object_field(vm, value_as_obj(args[0]), 0));
+    int expected = is_chain ? CHAIN_LENGTH : FAN_OUT;
+    int found = is_chain ? chain_length(vm, args[0]) : fan_leaves(vm, args[0]);
+    printf("mark bench (%s, %d thread%s): %d objects, %.2f ms per collection, %d reachable afterwards%s\n",
+           is_chain ? "deep chain" : "wide fan-out", g_threads, g_threads == 1 ? "" : "s", expected, secs * 1e3,
+           found, found == expected ? "" : " (FAILED)");
+    g_failed |= found != expected;
+    return value_none();
+}
+
+static void emit_call_native(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_i32(bc, native);
+    bc_emit_i32(bc, nargs);
+    bc_emit_i32(bc, dst);
+}
+
+/* r0 = the graph built by native `build`; measure(r0); halt */
+static int run(int build, int threads)
+{
+    Bytecode bc;
+    bc_init(&bc);
+    emit_call_native(&bc, build, 0, 0);
+    emit_call_native(&bc, 2, 1, 1);
+    bc_emit(&bc, OP_HALT);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 2;
+    opts.gc_mark_threads = threads;
+    g_threads = threads;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make_chain);
+    vm_register_native(vm, 1, make_fan);
+    vm_register_native(vm, 2, measure);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s\n", err);
+    vm_destroy(vm);
+    bc_free(&bc);
+    return err != NULL;
+}
+
+int main(void)
+{
+    int failed = 0;
+#ifdef _SC_NPROCESSORS_ONLN
+    printf("%ld processor(s) online\n", sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+    for (int build = 0; build < 2; ++build)
+    {
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 2)
+            failed |= run(build, threads);
+    }
+    return failed | g_failed;
+}
@@ -0,0 +1,437 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/jit.h"
+#include "../include/vm.h"
+
+/* Checks memory accounting and limits (vm_memory_stats, mem_soft_limit,
+   mem_hard_limit). The kinds must add up to the total, frames must be given
+   back when calls return, a soft limit must collect a program that only
+   makes garbage, and a program that keeps a chain of closures alive must be
+   stopped by a hard limit: with a handler the handler gets
+   VM_MEM_LIMIT_ERROR in r0 and the program carries on, without one vm_run
+   returns it. A native that allocates past the limit gets -1 from
+   vm_alloc_object, and the program then throws. When memory cannot be had
+   at all, vm_create returns NULL and vm_load leaves vm_run to return
+   VM_MEM_LIMIT_ERROR. */
+
+#define GARBAGE_ITERS 20000
+#define RECOVER_ITERS 50000
+#define HARD_LIMIT_SLACK (512 * 1024)
+
+static int g_failed;
+static int g_caught;
+static size_t g_frames_in_call;
+
+static void check(int bad, const char *what)
+{
+    printf("%s: %s\n", what, bad ? "FAILED" : "ok");
+    g_failed |= bad;
+}
+
+static size_t sum_kinds(const VMMemoryStats *st)
+{
+    size_t sum = 0;
+    for (int k = 0; k < VM_MEM_KINDS; ++k)
+        sum += st->by_kind[k];
+    return sum;
+}
+
+/* native 0: probe(): what the frames use inside a call */
+static Value probe(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    VMMemoryStats st;
+    vm_memory_stats(vm, &st);
+    g_frames_in_call = st.by_kind[VM_MEM_FRAMES];
+    return value_none();
+}
+
+/* native 1: garbage(): an object of 64 fields, dropped at once */
+static Value garbage(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    vm_alloc_object(vm, 64);
+    return value_none();
+}
+
+/* native 2: caught(exc) */
+static Value caught(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    const char *s = vm_string_chars(vm, args[0]);
+    g_caught = s && strcmp(s, VM_MEM_LIMIT_ERROR) == 0;
+    return value_none();
+}
+
+/* native 3: fill(): objects until one is refused; returns how many */
+static Value fill(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    int64_t n = 0;
+    while (n < 1000000 && vm_alloc_object(vm, 64) >= 0)
+        ++n;
+    /* a string bigger than the refused object cannot fit either */
+    char s[1024];
+    memset(s, 'x', sizeof(s) - 1);
+    s[sizeof(s) - 1] = '\0';
+    check(n == 1000000 || vm_alloc_string(vm, s) != -1, "vm_alloc_object and vm_alloc_string refused in a native");
+    return value_int(n);
+}
+
+/* native 4: collect(): the program has dropped what it held */
+static Value collect(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    vm_gc(vm);
+    return value_none();
+}
+
+static void emit_call(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_i32(bc, native);
+    bc_emit_i32(bc, nargs);
+    bc_emit_i32(bc, dst);
+}
+
+static void emit_load_int(Bytecode *bc, int reg, int64_t v)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_i32(bc, reg);
+    bc_emit_i32(bc, bc_add_const_int(bc, v));
+}
+
+/* r<counter> -= r<one>; jz r<counter> (patched later); returns the jz target position */
+static size_t emit_count_down(Bytecode *bc, int counter, int one)
+{
+    bc_emit(bc, OP_SUB);
+    bc_emit_i32(bc, counter);
+    bc_emit_i32(bc, counter);
+    bc_emit_i32(bc, one);
+    bc_emit(bc, OP_JZ);
+    bc_emit_i32(bc, counter);
+    size_t pos = bc->code_size;
+    bc_emit_i32(bc, 0);
+    return pos;
+}
+
+static void patch(Bytecode *bc, size_t pos, int value)
+{
+    memcpy(&bc->code[pos], &value, 4);
+}
+
+static VM *create_with(const VMOptions *opts)
+{
+    VM *vm = vm_create(opts);
+    vm_register_native(vm, 0, probe);
+    vm_register_native(vm, 1, garbage);
+    vm_register_native(vm, 2, caught);
+    vm_register_native(vm, 3, fill);
+    vm_register_native(vm, 4, collect);
+    return vm;
+}
+
+static void init_options(VMOptions *opts, size_t nursery, size_t soft, size_t hard, int jit)
+{
+    vm_options_init(opts);
+    opts->num_registers = 8;
+    opts->nursery_size = nursery ? nursery : VM_NURSERY_OFF;
+    opts->jit_threshold = jit ? jit : VM_JIT_OFF;
+    opts->mem_soft_limit = soft;
+    opts->mem_hard_limit = hard;
+}
+
+static VM *create(size_t nursery, size_t soft, size_t hard, int jit)
+{
+    VMOptions opts;
+    init_options(&opts, nursery, soft, hard, jit);
+    return create_with(&opts);
+}
+
+/* the kinds add up, and a call's frame is given back when it returns */
+static void check_stats(void)
+{
+    /* call f; halt   f: probe(); ret r0 */
+    Bytecode bc;
+    bc_init(&bc);
+    bc_emit(&bc, OP_CALL_USER);
+    size_t f_pos = bc.code_size;
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 2);
+    bc_emit_i32(&bc, 1);
+    bc_emit(&bc, OP_HALT);
+    int f = bc_add_const_function(&bc, (int)bc.code_size, 2);
+    patch(&bc, f_pos, f);
+    emit_call(&bc, 0, 0, 3);
+    bc_emit(&bc, OP_RET);
+    bc_emit_i32(&bc, 0);
+
+    VM *vm = create(64 * 1024, 0, 0, 0);
+    VMMemoryStats st;
+    vm_memory_stats(vm, &st);
+    check(st.used != sum_kinds(&st) || st.peak < st.used, "used is the sum of the kinds");
+    check(st.by_kind[VM_MEM_REGISTERS] != 8 * sizeof(Value) || st.by_kind[VM_MEM_NURSERY] != 64 * 1024 ||
+              st.by_kind[VM_MEM_VM] == 0,
+          "registers, nursery and the VM counted");
+    vm_load(vm, &bc);
+    vm_memory_stats(vm, &st);
+    check(st.by_kind[VM_MEM_PROGRAM] == 0, "program counted");
+    const char *err = vm_run(vm);
+    vm_memory_stats(vm, &st);
+    check(err != NULL || g_frames_in_call == 0 || st.by_kind[VM_MEM_FRAMES] != 0, "frames given back");
+    check(st.used != sum_kinds(&st) || st.refused != 0, "nothing refused without limits");
+    vm_destroy(vm);
+    bc_free(&bc);
+}
+
+/* GARBAGE_ITERS calls of garbage(), with the byte trigger set out of reach:
+   only the soft limit collects */
+static void check_soft_limit(void)
+{
+    Bytecode bc;
+    bc_init(&bc);
+    emit_load_int(&bc, 6, GARBAGE_ITERS);
+    emit_load_int(&bc, 7, 1);
+    int loop = (int)bc.code_size;
+    emit_call(&bc, 1, 0, 0);
+    size_t end_pos = emit_count_down(&bc, 6, 7);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_i32(&bc, loop);
+    patch(&bc, end_pos, (int)bc.code_size);
+    bc_emit(&bc, OP_HALT);
+
+    VM *probe_vm = create(0, 0, 0, 0);
+    VMMemoryStats st;
+    vm_load(probe_vm, &bc);
+    vm_memory_stats(probe_vm, &st);
+    size_t soft = st.used + 256 * 1024;
+    vm_destroy(probe_vm);
+
+    VMOptions opts;
+    init_options(&opts, 0, soft, 0, 0);
+    opts.gc_min_heap = (size_t)1 << 40;
+    VM *vm = create_with(&opts);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    vm_memory_stats(vm, &st);
+    VMGCStats gc;
+    vm_gc_stats(vm, &gc);
+    printf("soft limit %zu: peak %zu, %llu soft collections\n", soft, st.peak,
+           (unsigned long long)st.soft_collections);
+    check(err != NULL || st.soft_collections == 0 || gc.major_collections < st.soft_collections,
+          "soft limit collects");
+    check(st.peak > soft * 2, "soft limit keeps usage near it");
+    vm_destroy(vm);
+    bc_free(&bc);
+}
+
+/* [push_handler H]; call g; halt
+   g: loop: r2 = closure f [r2]; jmp loop
+   H: r2 = 0; caught(r0); collect(); RECOVER_ITERS closures of garbage; halt */
+static void build_chain(Bytecode *bc, int handled)
+{
+    bc_init(bc);
+    size_t h_pos = 0;
+    if (handled)
+    {
+        bc_emit(bc, OP_PUSH_HANDLER);
+        h_pos = bc->code_size;
+        bc_emit_i32(bc, 0);
+    }
+    bc_emit(bc, OP_CALL_USER);
+    size_t g_pos = bc->code_size;
+    bc_emit_i32(bc, 0);
+    bc_emit_i32(bc, 0);
+    bc_emit_i32(bc, 1);
+    bc_emit(bc, OP_HALT);
+
+    int g = bc_add_const_function(bc, (int)bc->code_size, 0);
+    patch(bc, g_pos, g);
+    int loop = (int)bc->code_size;
+    bc_emit(bc, OP_MK_CLOSURE);
+    bc_emit_i32(bc, 2);
+    size_t f_pos = bc->code_size;
+    bc_emit_i32(bc, 0);
+    bc_emit_i32(bc, 1);
+    bc_emit_i32(bc, 2);
+    bc_emit(bc, OP_JMP);
+    bc_emit_i32(bc, loop);
+
+    if (handled)
+    {
+        patch(bc, h_pos, (int)bc->code_size);
+        emit_load_int(bc, 2, 0);
+        emit_call(bc, 2, 1, 3);
+        emit_call(bc, 4, 0, 3);
+        emit_load_int(bc, 6, RECOVER_ITERS);
+        emit_load_int(bc, 7, 1);
+        int again = (int)bc->code_size;
+        bc_emit(bc, OP_MK_CLOSURE);
+        bc_emit_i32(bc, 3);
+        size_t f2_pos = bc->code_size;
+        bc_emit_i32(bc, 0);
+        bc_emit_i32(bc, 1);
+        bc_emit_i32(bc, 7);
+        size_t end_pos = emit_count_down(bc, 6, 7);
+        bc_emit(bc, OP_JMP);
+        bc_emit_i32(bc, again);
+        patch(bc, end_pos, (int)bc->code_size);
+        bc_emit(bc, OP_HALT);
+        int f = bc_add_const_function(bc, (int)bc->code_size, 0);
+        patch(bc, f2_pos, f);
+        patch(bc, f_pos, f);
+    }
+    else
+    {
+        int f = bc_add_const_function(bc, (int)bc->code_size, 0);
+        patch(bc, f_pos, f);
+    }
+    bc_emit(bc, OP_RET);
+    bc_emit_i32(bc, 0);
+}
+
+static void check_hard_limit(int jit)
+{
+    char what[96];
+    for (int handled = 1; handled >= 0; --handled)
+    {
+        Bytecode bc;
+        build_chain(&bc, handled);
+        VM *probe_vm = create(64 * 1024, 0, 0, jit);
+        VMMemoryStats st;
+        vm_load(probe_vm, &bc);
+        vm_memory_stats(probe_vm, &st);
+        size_t hard = st.used + HARD_LIMIT_SLACK;
+        vm_destroy(probe_vm);
+
+        VM *vm = create(64 * 1024, 0, hard, jit);
+        vm_load(vm, &bc);
+        g_caught = 0;
+        const char *err = vm_run(vm);
+        vm_memory_stats(vm, &st);
+        printf("hard limit %zu (jit %d, handled %d): peak %zu, %llu refused, %s\n", hard, jit, handled, st.peak,
+               (unsigned long long)st.refused, err ? err : "no error");
+        snprintf(what, sizeof(what), "hard limit%s%s", handled ? " caught" : " unhandled", jit ? " (jit)" : "");
+        if (handled)
+            check(err != NULL || !g_caught || st.refused == 0, what);
+        else
+            check(err == NULL || strcmp(err, VM_MEM_LIMIT_ERROR) != 0, what);
+        check(st.peak > hard || st.used != sum_kinds(&st), "usage stays within the hard limit");
+        if (jit)
+            check(VM_JIT_AVAILABLE && vm_jit_compiled(vm) == 0, "the chain ran compiled");
+        if (handled)
+        {
+            /* the chain is garbage now */
+            size_t before = st.used;
+            vm_gc(vm);
+            vm_compact_heap(vm);
+            vm_memory_stats(vm, &st);
+            check(st.used >= before, "memory comes back after the limit");
+        }
+        vm_destroy(vm);
+        bc_free(&bc);
+    }
+}
+
+/* push_handler H; fill(); halt   H: caught(r0); halt */
+static void check_native(void)
+{
+    Bytecode bc;
+    bc_init(&bc);
+    bc_emit(&bc, OP_PUSH_HANDLER);
+    size_t h_pos = bc.code_size;
+    bc_emit_i32(&bc, 0);
+    emit_call(&bc, 3, 0, 1);
+    bc_emit(&bc, OP_HALT);
+    patch(&bc, h_pos, (int)bc.code_size);
+    emit_call(&bc, 2, 1, 3);
+    bc_emit(&bc, OP_HALT);
+
+    VM *probe_vm = create(0, 0, 0, 0);
+    VMMemoryStats st;
+    vm_load(probe_vm, &bc);
+    vm_memory_stats(probe_vm, &st);
+    size_t hard = st.used + HARD_LIMIT_SLACK;
+    vm_destroy(probe_vm);
+
+    VM *vm = create(0, 0, hard, 0);
+    vm_load(vm, &bc);
+    g_caught = 0;
+    const char *err = vm_run(vm);
+    check(err != NULL || !g_caught, "refusal in a native throws after it returns");
+    vm_destroy(vm);
+    bc_free(&bc);
+}
+
+/* the oversized program below must make malloc return NULL under
+   AddressSanitizer too, rather than stop the test */
+const char *__asan_default_options(void) { return "allocator_may_return_null=1"; }
+
+static void *fail_alloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    return NULL;
+}
+
+static void fail_free(void *ctx, void *p, size_t size)
+{
+    (void)ctx;
+    (void)p;
+    (void)size;
+}
+
+/* an allocator with no memory, and a program too big to copy */
+static void check_system_failure(void)
+{
+    VMOptions opts;
+    init_options(&opts, 64 * 1024, 0, 0, 0);
+    opts.allocator.alloc = fail_alloc;
+    opts.allocator.free = fail_free;
+    VM *vm = vm_create(&opts);
+    check(vm != NULL, "vm_create without room for the nursery");
+    vm_destroy(vm);
+
+    Bytecode bc;
+    bc_init(&bc);
+    bc_add_const_string(&bc, "constant");
+    bc_emit(&bc, OP_HALT);
+    Bytecode too_big = bc;
+    too_big.code_size = (size_t)PTRDIFF_MAX + 1; /* malloc cannot give this; never read */
+    vm = create(0, 0, 0, 0);
+    vm_load(vm, &bc);
+    VMGCStats before, after;
+    vm_gc_stats(vm, &before);
+    vm_load(vm, &too_big);
+    const char *err = vm_run(vm);
+    VMMemoryStats st;
+    vm_memory_stats(vm, &st);
+    vm_gc(vm);
+    vm_gc_stats(vm, &after);
+    /* the first program's constant is no longer pinned */
+    check(err == NULL || strcmp(err, VM_MEM_LIMIT_ERROR) != 0 || st.by_kind[VM_MEM_PROGRAM] != 0 ||
+              after.strings >= before.strings,
+          "vm_load without room for the program");
+    vm_load(vm, &bc);
+    check(vm_run(vm) != NULL, "vm_load after a failed one");
+    vm_destroy(vm);
+    bc_free(&bc);
+}
+
+int main(void)
+{
+    check_stats();
+    check_soft_limit();
+    check_hard_limit(0);
+    check_hard_limit(1);
+    check_native();
+    check_system_failure();
+    return g_failed;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/disassembler.h"
+#include "../include/ssa.h"
+#include "../include/verifier.h"
+
+/* Offline optimizer: vm_opt [-d] in.vmbc [out.vmbc]
+   Runs the SSA optimizer on a bytecode file (see bc_write), prints the
+   instruction counts before and after, and writes the result if an output
+   file is given. -d disassembles the optimized code. */
+
+int main(int argc, char **argv)
+{
+    int disasm = argc > 1 && strcmp(argv[1], "-d") == 0;
+    if (argc - disasm < 2 || argc - disasm > 3)
+    {
+        fprintf(stderr, "usage: %s [-d] in.vmbc [out.vmbc]\n", argv[0]);
+        return 2;
+    }
+    const char *in_path = argv[1 + disasm];
+    const char *out_path = argc - disasm == 3 ? argv[2 + disasm] : NULL;
+
+    FILE *f = fopen(in_path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "%s: cannot open\n", in_path);
+        return 1;
+    }
+    Bytecode bc;
+    const char *err = bc_read(&bc, f);
+    fclose(f);
+    if (!err)
+        err = verify_bytecode(&bc);
+    SsaStats st;
+    if (!err && ssa_optimize(&bc, &st) < 0)
+        err = "optimizer could not analyse the bytecode";
+    if (err)
+    {
+        fprintf(stderr, "%s: %s\n", in_path, err);
+        bc_free(&bc);
+        return 1;
+    }
+
+    printf("%s: %zu -> %zu instructions\n", in_path, st.instrs_before, st.instrs_after);
+    printf("  folded %d, copies propagated %d, removed %d, hoisted %d (%d rounds)\n", st.folded,
+           st.copies, st.removed, st.hoisted, st.rounds);
+    if (disasm)
+        disassemble_bytecode(&bc, stdout);
+
+    if (out_path)
+    {
+        f = fopen(out_path, "wb");
+        err = f ? bc_write(&bc, f) : "cannot open";
+        if (f && fclose(f) != 0 && !err)
+            err = "write failed";
+        if (err)
+        {
+            fprintf(stderr, "%s: %s\n", out_path, err);
+            bc_free(&bc);
+            return 1;
+        }
+    }
+    bc_free(&bc);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/disassembler.h"
+#include "../include/peephole.h"
+#include "../include/vm.h"
+
+/* Checks the peephole pass: a program containing every fusable sequence must
+   produce the same result before and after vm_optimize, in both encodings. */
+
+static int64_t g_result;
+
+static Value record_result(VM *vm, int nargs, const Value *args)
+{
+    (void)vm;
+    if (nargs > 0 && value_is_int(args[0]))
+        g_result = value_as_int(args[0]);
+    return value_none();
+}
+
+static void emit_program(Bytecode *bc)
+{
+    int ci_five = bc_add_const_int(bc, 5);
+    int ci_one = bc_add_const_int(bc, 1);
+    int ci_zero = bc_add_const_int(bc, 0);
+    int ci_ten = bc_add_const_int(bc, 10);
+
+    bc_emit(bc, OP_LOAD_CONST); /* r0 = 5 (counter) */
+    bc_emit_reg(bc, 0);
+    bc_emit_const_idx(bc, ci_five);
+    bc_emit(bc, OP_LOAD_CONST); /* r1 = 1 */
+    bc_emit_reg(bc, 1);
+    bc_emit_const_idx(bc, ci_one);
+    bc_emit(bc, OP_LOAD_CONST); /* r2 = 0 (acc) */
+    bc_emit_reg(bc, 2);
+    bc_emit_const_idx(bc, ci_zero);
+
+    /* loop: r3 = 10; r2 = r2 + r3 (-> ADD_IMM) */
+    int loop = (int)bc->code_size;
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 3);
+    bc_emit_const_idx(bc, ci_ten);
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 3);
+    /* r0 = r0 - r1; jz r0 done; jmp loop (-> SUB_JNZ) */
+    bc_emit(bc, OP_SUB);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 0);
+    long done_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_JMP);
+    bc_emit_jump(bc, loop);
+
+    /* done: r0 = r2; r5 = double(r0) (-> MOV_CALL_USER) */
+    bc_patch_operand(bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 2);
+    bc_emit(bc, OP_CALL_USER);
+    long func_pos = bc_emit_const_idx(bc, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 5);
+    /* record r5 through native 0 */
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 5);
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 6);
+    bc_emit(bc, OP_HALT);
+
+    /* double: r0 = r0 + r0; ret r0 */
+    int func_start = (int)bc->code_size;
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 0);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 0);
+    int ci_func = bc_add_const_function(bc, func_start, 1);
+    bc_patch_operand(bc, (size_t)func_pos, OPND_CONST, ci_func);
+}
+
+static int run(const Bytecode *bc, int optimize, int64_t *result)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, record_result);
+    vm_load(vm, bc);
+    const char *err = optimize ? vm_optimize(vm) : NULL;
+    if (!err)
+        err = vm_run(vm);
+    if (err)
+        printf("VM error: %s (at byte %u)\n", err, (unsigned)vm_error_offset(vm));
+    vm_destroy(vm);
+    *result = g_result;
+    g_result = 0;
+    return err ? 1 : 0;
+}
+
+static int check_version(int version)
+{
+    Bytecode bc;
+    bc_init_version(&bc, version);
+    emit_program(&bc);
+
+    int64_t plain = 0, fused_result = 0;
+    int failed = run(&bc, 0, &plain) | run(&bc, 1, &fused_result);
+
+    size_t before = bc.code_size;
+    int fused = peephole_optimize(&bc);
+    printf("v%d: fused %d sequences, %zu -> %zu bytes, result %lld / %lld\n", version, fused,
+           before, bc.code_size, (long long)plain, (long long)fused_result);
+    disassemble_bytecode(&bc, stdout);
+    if (fused != 3 || plain != 100 || fused_result != plain)
+        failed = 1;
+    bc_free(&bc);
+    return failed;
+}
+
+int main(void)
+{
+    return check_version(BC_VERSION_1) | check_version(BC_VERSION_2);
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks quickening: instructions specialise themselves after seeing ints, and
+   a specialised instruction that later sees other types must behave exactly
+   like the generic one. Each case calls one function several times with
+   different arguments; the results are collected through native 0. */
+
+static int64_t g_sum;
+
+static Value record(VM *vm, int nargs, const Value *args)
+{
+    (void)vm;
+    if (nargs > 0 && value_is_int(args[0]))
+        g_sum = g_sum * 10 + value_as_int(args[0]);
+    return value_none();
+}
+
+/* r0 = a; r1 = b; r2 = f(r0, r1); record(r2) */
+static void emit_call(Bytecode *bc, int ci_a, int ci_b, long *func_pos)
+{
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 0);
+    bc_emit_const_idx(bc, ci_a);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 1);
+    bc_emit_const_idx(bc, ci_b);
+    bc_emit(bc, OP_CALL_USER);
+    *func_pos = bc_emit_const_idx(bc, 0);
+    bc_emit_count(bc, 2);
+    bc_emit_reg(bc, 2);
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 2);
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 3);
+}
+
+/* calls f(args[i][0], args[i][1]) for every pair, f being emitted by body */
+static int run_case(const char *name, const int args[][2], int ncalls, void (*body)(Bytecode *),
+                    const char *want_err, int64_t want_sum)
+{
+    Bytecode bc;
+    bc_init_version(&bc, BC_VERSION_2);
+    int ci_double = bc_add_const_double(&bc, 0.0);
+    long pos[8];
+    for (int i = 0; i < ncalls; ++i)
+    {
+        /* -1 stands for the double constant 0.0 */
+        int a = args[i][0] < 0 ? ci_double : bc_add_const_int(&bc, args[i][0]);
+        int b = args[i][1] < 0 ? ci_double : bc_add_const_int(&bc, args[i][1]);
+        emit_call(&bc, a, b, &pos[i]);
+    }
+    bc_emit(&bc, OP_HALT);
+    int start = (int)bc.code_size;
+    body(&bc);
+    int ci_f = bc_add_const_function(&bc, start, 2);
+    for (int i = 0; i < ncalls; ++i)
+        bc_patch_operand(&bc, (size_t)pos[i], OPND_CONST, ci_f);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, record);
+    vm_load(vm, &bc);
+    g_sum = 0;
+    const char *err = vm_run(vm);
+    int ok = (want_err ? err && strcmp(err, want_err) == 0 : !err) && g_sum == want_sum;
+    printf("%-10s %s: recorded %lld, %s\n", name, ok ? "ok" : "FAILED", (long long)g_sum,
+           err ? err : "no error");
+    vm_destroy(vm);
+    bc_free(&bc);
+    return ok ? 0 : 1;
+}
+
+/* r4 = r0 + r1; ret r4 */
+static void add_body(Bytecode *bc)
+{
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 4);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 4);
+}
+
+/* r4 = r0 / r1; ret r4 */
+static void div_body(Bytecode *bc)
+{
+    bc_emit(bc, OP_DIV);
+    bc_emit_reg(bc, 4);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 4);
+}
+
+/* jz r0 -> one; r4 = 2; ret r4; one: r4 = 1; ret r4 (uses r1 as 1 + 1) */
+static void jz_body(Bytecode *bc)
+{
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 0);
+    long one_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 4);
+    bc_emit_reg(bc, 1);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 4);
+    bc_patch_operand(bc, (size_t)one_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 1);
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    /* ints quicken the ADD, the double must then fail the guard */
+    const int add_args[][2] = {{1, 2}, {3, 4}, {2, -1}};
+    failed |= run_case("add", add_args, 3, add_body, "type error: expected int", 37);
+
+    /* division by zero after quickening is still reported */
+    const int div_args[][2] = {{6, 3}, {8, 2}, {1, 0}};
+    failed |= run_case("div", div_args, 3, div_body, "division by zero", 24);
+
+    /* JZ on a double never jumps, before or after quickening */
+    const int jz_args[][2] = {{0, 1}, {5, 1}, {-1, 1}, {0, 1}};
+    failed |= run_case("jz", jz_args, 4, jz_body, NULL, 1221);
+
+    return failed;
+}
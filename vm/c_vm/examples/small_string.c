@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks inline small strings (vm_string_value). First the API: strings of
+   up to VALUE_SMALL_STR_MAX characters stay in the Value, longer ones go to
+   the heap, and vm_string_chars reads both. Then a loop of CALLS iterations
+   gets a short string from a native, captures it in a closure, calls the
+   closure for it back and stores it in a field of an old object, with a
+   small nursery so that the closures are collected over and over. At the
+   end the fields and the last string must read back, with not one string
+   ever allocated on the heap; the last one is printed with OP_PRINT. */
+
+#define CALLS 50000
+#define FIELDS 64
+
+static int g_failed;
+
+static void check(int bad, const char *what)
+{
+    printf("%s: %s\n", what, bad ? "FAILED" : "ok");
+    g_failed |= bad;
+}
+
+/* native 0: make(n): the decimal digits of n */
+static Value make(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", (long long)value_as_int(args[0]));
+    return vm_string_value(vm, buf);
+}
+
+/* native 1: the holder of FIELDS strings */
+static Value make_holder(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    (void)args;
+    return value_obj(vm_alloc_object(vm, FIELDS));
+}
+
+/* native 2: store(holder, s, n): field n % FIELDS of holder = s */
+static Value store(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    vm_set_object_field(vm, value_as_obj(args[0]), (int)(value_as_int(args[2]) % FIELDS), args[1]);
+    return value_int(0);
+}
+
+/* native 3: verify(holder, last) */
+static Value verify(VM *vm, int nargs, const Value *args)
+{
+    (void)nargs;
+    /* counting down, the last store to field k came from the smallest n */
+    int wrong = 0;
+    for (int k = 0; k < FIELDS; ++k)
+    {
+        char want[32];
+        snprintf(want, sizeof(want), "%d", k == 0 ? FIELDS : k);
+        Value v = vm_get_object_field(vm, value_as_obj(args[0]), k);
+        const char *got = vm_string_chars(vm, v);
+        wrong += !value_is_small_str(v) || !got || strcmp(got, want) != 0;
+    }
+    check(wrong != 0, "object fields read back");
+    const char *last = vm_string_chars(vm, args[1]);
+    check(!last || strcmp(last, "1") != 0, "closure returned its capture");
+    return value_int(0);
+}
+
+static void check_api(void)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    VM *vm = vm_create(&opts);
+    char s[VALUE_SMALL_STR_MAX + 2];
+    int bad = 0;
+    for (int n = 0; n <= VALUE_SMALL_STR_MAX + 1; ++n)
+    {
+        memset(s, 'a' + n, (size_t)n);
+        s[n] = '\0';
+        Value v = vm_string_value(vm, s);
+        const char *chars = vm_string_chars(vm, v);
+        bad |= value_type(v) != V_STRING || value_is_small_str(v) != (n <= VALUE_SMALL_STR_MAX);
+        bad |= !chars || strcmp(chars, s) != 0;
+        bad |= value_is_small_str(v) ? value_as_str(v) != -1 : value_as_str(v) < 0;
+    }
+    check(bad, "inline up to VALUE_SMALL_STR_MAX characters, heap beyond");
+
+    /* each of the last VM_STRING_SCRATCH results is still intact */
+    const char *held[VM_STRING_SCRATCH];
+    for (int i = 0; i < VM_STRING_SCRATCH; ++i)
+    {
+        snprintf(s, sizeof(s), "%d", i);
+        held[i] = vm_string_chars(vm, vm_string_value(vm, s));
+    }
+    bad = 0;
+    for (int i = 0; i < VM_STRING_SCRATCH; ++i)
+    {
+        snprintf(s, sizeof(s), "%d", i);
+        bad |= strcmp(held[i], s) != 0;
+    }
+    check(bad, "vm_string_chars scratch buffers");
+    vm_destroy(vm);
+}
+
+static void emit_mov(Bytecode *bc, int dst, int src)
+{
+    bc_emit(bc, OP_MOV);
+    bc_emit_i32(bc, dst);
+    bc_emit_i32(bc, src);
+}
+
+static void emit_call(Bytecode *bc, int native, int nargs, int dst)
+{
+    bc_emit(bc, OP_CALL);
+    bc_emit_i32(bc, native);
+    bc_emit_i32(bc, nargs);
+    bc_emit_i32(bc, dst);
+}
+
+int main(void)
+{
+    check_api();
+
+    Bytecode bc;
+    bc_init(&bc);
+
+    /* r8 = CALLS; r9 = 1; r6 = make_holder()
+       loop: r0 = r8; r3 = make(r0); r5 = closure f [r3]; r4 = r5()
+             r0 = r6; r1 = r4; r2 = r8; store(r0, r1, r2)
+             r8 -= r9; jz r8 end; jmp loop
+       end:  print r4; r0 = r6; r1 = r4; verify(r0, r1); halt */
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 8);
+    bc_emit_i32(&bc, bc_add_const_int(&bc, CALLS));
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_i32(&bc, 9);
+    bc_emit_i32(&bc, bc_add_const_int(&bc, 1));
+    emit_call(&bc, 1, 0, 6);
+    int loop = (int)bc.code_size;
+    emit_mov(&bc, 0, 8);
+    emit_call(&bc, 0, 1, 3);
+    bc_emit(&bc, OP_MK_CLOSURE);
+    bc_emit_i32(&bc, 5);
+    size_t f_pos = bc.code_size;
+    bc_emit_i32(&bc, 0); /* patched with f */
+    bc_emit_i32(&bc, 1);
+    bc_emit_i32(&bc, 3);
+    bc_emit(&bc, OP_CALL_CLOSURE);
+    bc_emit_i32(&bc, 5);
+    bc_emit_i32(&bc, 0);
+    bc_emit_i32(&bc, 4);
+    emit_mov(&bc, 0, 6);
+    emit_mov(&bc, 1, 4);
+    emit_mov(&bc, 2, 8);
+    emit_call(&bc, 2, 3, 7);
+    bc_emit(&bc, OP_SUB);
+    bc_emit_i32(&bc, 8);
+    bc_emit_i32(&bc, 8);
+    bc_emit_i32(&bc, 9);
+    bc_emit(&bc, OP_JZ);
+    bc_emit_i32(&bc, 8);
+    size_t end_pos = bc.code_size;
+    bc_emit_i32(&bc, 0);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_i32(&bc, loop);
+    int end = (int)bc.code_size;
+    memcpy(&bc.code[end_pos], &end, 4);
+    bc_emit(&bc, OP_PRINT);
+    bc_emit_i32(&bc, 4);
+    emit_mov(&bc, 0, 6);
+    emit_mov(&bc, 1, 4);
+    emit_call(&bc, 3, 2, 7);
+    bc_emit(&bc, OP_HALT);
+
+    /* f: ret r0 (the capture) */
+    int f = bc_add_const_function(&bc, (int)bc.code_size, 0);
+    memcpy(&bc.code[f_pos], &f, 4);
+    bc_emit(&bc, OP_RET);
+    bc_emit_i32(&bc, 0);
+
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 10;
+    opts.nursery_size = 16 * 1024;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, make);
+    vm_register_native(vm, 1, make_holder);
+    vm_register_native(vm, 2, store);
+    vm_register_native(vm, 3, verify);
+    vm_load(vm, &bc);
+    const char *err = vm_run(vm);
+    if (err)
+    {
+        printf("VM error: %s\n", err);
+        g_failed = 1;
+    }
+    VMGCStats stats;
+    vm_gc_stats(vm, &stats);
+    printf("%llu minor and %llu major collections, %zu strings on the heap\n",
+           (unsigned long long)stats.minor_collections, (unsigned long long)stats.major_collections, stats.strings);
+    check(stats.minor_collections == 0 || stats.strings != 0, "collected without heap strings");
+    vm_destroy(vm);
+    bc_free(&bc);
+    return g_failed;
+}
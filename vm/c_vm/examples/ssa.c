@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/disassembler.h"
+#include "../include/ssa.h"
+#include "../include/verifier.h"
+#include "../include/vm.h"
+
+/* Checks the SSA optimizer on a program with the redundancy generated code
+   tends to have: constants reloaded and recomputed inside a loop, a MOV chain,
+   a branch on a constant guarding dead code, and a dead store. The result
+   must not change, the loop body must shrink from 9 instructions to 4, and
+   the optimized program must survive a bc_write/bc_read round trip. */
+
+static int64_t g_result;
+
+static Value record_result(VM *vm, int nargs, const Value *args)
+{
+    (void)vm;
+    if (nargs > 0 && value_is_int(args[0]))
+        g_result = value_as_int(args[0]);
+    return value_none();
+}
+
+static void emit_program(Bytecode *bc)
+{
+    int ci_ten = bc_add_const_int(bc, 10);
+    int ci_zero = bc_add_const_int(bc, 0);
+    int ci_one = bc_add_const_int(bc, 1);
+    int ci_three = bc_add_const_int(bc, 3);
+    int ci_four = bc_add_const_int(bc, 4);
+
+    bc_emit(bc, OP_LOAD_CONST); /* r0 = 10 (counter) */
+    bc_emit_reg(bc, 0);
+    bc_emit_const_idx(bc, ci_ten);
+    bc_emit(bc, OP_LOAD_CONST); /* r1 = 0 (acc) */
+    bc_emit_reg(bc, 1);
+    bc_emit_const_idx(bc, ci_zero);
+
+    /* loop: r2 = 3; r3 = 4 (dead once the MUL folds); r4 = r2 * r3 (folded
+       and hoisted); r5 = r4; r1 += r5 (reads r4, the MOV dies); r5 = 1
+       (hoisted once the MOV is gone); r0 -= r5; jz r0 done; jmp loop */
+    int loop = (int)bc->code_size;
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 2);
+    bc_emit_const_idx(bc, ci_three);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 3);
+    bc_emit_const_idx(bc, ci_four);
+    bc_emit(bc, OP_MUL);
+    bc_emit_reg(bc, 4);
+    bc_emit_reg(bc, 2);
+    bc_emit_reg(bc, 3);
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 5);
+    bc_emit_reg(bc, 4);
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 1);
+    bc_emit_reg(bc, 1);
+    bc_emit_reg(bc, 5);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 5);
+    bc_emit_const_idx(bc, ci_one);
+    bc_emit(bc, OP_SUB);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 5);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 0);
+    long done_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_JMP);
+    bc_emit_jump(bc, loop);
+
+    /* done: r2 = 0; jz r2 skip (always taken); print r1 (never runs) */
+    bc_patch_operand(bc, (size_t)done_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 2);
+    bc_emit_const_idx(bc, ci_zero);
+    bc_emit(bc, OP_JZ);
+    bc_emit_reg(bc, 2);
+    long skip_pos = bc_emit_jump(bc, 0);
+    bc_emit(bc, OP_PRINT);
+    bc_emit_reg(bc, 1);
+
+    /* skip: r3 = r1 + r1 (dead store); r3 = 0 */
+    bc_patch_operand(bc, (size_t)skip_pos, OPND_JUMP, (int32_t)bc->code_size);
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 3);
+    bc_emit_reg(bc, 1);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_LOAD_CONST);
+    bc_emit_reg(bc, 3);
+    bc_emit_const_idx(bc, ci_zero);
+
+    /* r6 = double(r1); record r6 through native 0 */
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 1);
+    bc_emit(bc, OP_CALL_USER);
+    long func_pos = bc_emit_const_idx(bc, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 6);
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 6);
+    bc_emit(bc, OP_CALL);
+    bc_emit_operand(bc, OPND_NATIVE, 0);
+    bc_emit_count(bc, 1);
+    bc_emit_reg(bc, 7);
+    bc_emit(bc, OP_HALT);
+
+    /* double: r3 = r0; r0 = r3 + r3 (reads r0 directly); ret r0. The MOV
+       stays: the caller can see r3. */
+    int func_start = (int)bc->code_size;
+    bc_emit(bc, OP_MOV);
+    bc_emit_reg(bc, 3);
+    bc_emit_reg(bc, 0);
+    bc_emit(bc, OP_ADD);
+    bc_emit_reg(bc, 0);
+    bc_emit_reg(bc, 3);
+    bc_emit_reg(bc, 3);
+    bc_emit(bc, OP_RET);
+    bc_emit_reg(bc, 0);
+    int ci_func = bc_add_const_function(bc, func_start, 1);
+    bc_patch_operand(bc, (size_t)func_pos, OPND_CONST, ci_func);
+}
+
+static int run(const Bytecode *bc, int64_t *result)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = 8;
+    VM *vm = vm_create(&opts);
+    vm_register_native(vm, 0, record_result);
+    vm_load(vm, bc);
+    const char *err = vm_run(vm);
+    if (err)
+        printf("VM error: %s (at byte %u)\n", err, (unsigned)vm_error_offset(vm));
+    vm_destroy(vm);
+    *result = g_result;
+    g_result = 0;
+    return err ? 1 : 0;
+}
+
+/* the optimized program written out and read back must be the same program */
+static int round_trip(const Bytecode *bc)
+{
+    FILE *f = tmpfile();
+    if (!f)
+        return 1;
+    Bytecode back;
+    const char *err = bc_write(bc, f);
+    rewind(f);
+    const char *rerr = bc_read(&back, f);
+    fclose(f);
+    int same = !err && !rerr && back.version == bc->version && back.code_size == bc->code_size &&
+               memcmp(back.code, bc->code, bc->code_size) == 0 &&
+               back.consts_count == bc->consts_count;
+    for (size_t i = 0; same && i < bc->consts_count; ++i)
+    {
+        const Constant *a = &bc->consts[i], *b = &back.consts[i];
+        same = a->type == b->type &&
+               (a->type == CONST_STRING ? strcmp(a->value.s, b->value.s) == 0
+                : a->type == CONST_FUNCTION
+                    ? a->value.func.start == b->value.func.start && a->value.func.nargs == b->value.func.nargs
+                    : a->value.i == b->value.i);
+    }
+    bc_free(&back);
+    if (!same)
+        printf("round trip failed: %s\n", err ? err : rerr ? rerr : "program differs");
+    return !same;
+}
+
+static int check_version(int version)
+{
+    Bytecode bc;
+    bc_init_version(&bc, version);
+    emit_program(&bc);
+
+    int64_t plain = 0, optimized = 0;
+    int failed = run(&bc, &plain);
+
+    SsaStats st;
+    if (ssa_optimize(&bc, &st) < 0)
+    {
+        printf("v%d: optimizer failed\n", version);
+        bc_free(&bc);
+        return 1;
+    }
+    const char *err = verify_program(&bc, 8);
+    failed |= err != NULL || run(&bc, &optimized) || round_trip(&bc);
+    printf("v%d: %zu -> %zu instructions (folded %d, copies %d, removed %d, hoisted %d, %d rounds), "
+           "result %lld / %lld\n",
+           version, st.instrs_before, st.instrs_after, st.folded, st.copies, st.removed, st.hoisted,
+           st.rounds, (long long)plain, (long long)optimized);
+    disassemble_bytecode(&bc, stdout);
+    if (err)
+        printf("optimized program does not verify: %s\n", err);
+    if (plain != 240 || optimized != plain || st.instrs_before != 24 || st.instrs_after != 18 ||
+        st.hoisted != 2)
+        failed = 1;
+    bc_free(&bc);
+    return failed;
+}
+
+int main(void)
+{
+    return check_version(BC_VERSION_1) | check_version(BC_VERSION_2);
+}
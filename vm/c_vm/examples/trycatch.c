@@ -43,8 +43,8 @@ int main(void)
     memcpy(&bc.code[call_ci_pos], &ci_func, 4);
     memcpy(&bc.code[handler_pos], &handler_start, 4);
 
-    VMOptions opts;
-    opts.num_registers = 8;
+    /* the fields not named are 0, which is their default */
+    VMOptions opts = {.num_registers = 8};
     VM *vm = vm_create(&opts);
     vm_load(vm, &bc);
     const char *err = vm_run(vm);
@@ -0,0 +1,43 @@
+#include <math.h>
+#include <stdio.h>
+#include "../include/vm.h"
+
+/* Round-trips every kind of Value through the value_* helpers. Build with
+   -DVM_NAN_BOXING=ON to check the 8-byte representation. */
+
+static int check(const char *what, int ok)
+{
+    if (!ok)
+        printf("FAILED: %s\n", what);
+    return ok ? 0 : 1;
+}
+
+int main(void)
+{
+    int failed = 0;
+    static const int64_t ints[] = {0, 1, -1, 123456789, -987654321, 140737488355327LL, -140737488355328LL};
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); ++i)
+    {
+        Value v = value_int(ints[i]);
+        failed |= check("int type", value_type(v) == V_INT && value_is_int(v));
+        failed |= check("int value", value_as_int(v) == ints[i]);
+    }
+
+    static const double doubles[] = {0.0, -0.0, 1.5, -2.25, 1e300, -1e-300, INFINITY, -INFINITY};
+    for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); ++i)
+    {
+        Value v = value_double(doubles[i]);
+        failed |= check("double type", value_type(v) == V_DOUBLE && !value_is_int(v));
+        failed |= check("double value", value_as_double(v) == doubles[i] &&
+                                             signbit(value_as_double(v)) == signbit(doubles[i]));
+    }
+    Value nan = value_double(-NAN);
+    failed |= check("nan stays a double", value_type(nan) == V_DOUBLE && isnan(value_as_double(nan)));
+
+    failed |= check("none", value_type(value_none()) == V_NONE);
+    failed |= check("string", value_type(value_str(42)) == V_STRING && value_as_str(value_str(42)) == 42);
+    failed |= check("object", value_type(value_obj(7)) == V_OBJECT && value_as_obj(value_obj(7)) == 7);
+
+    printf("Value is %zu bytes, %s\n", sizeof(Value), failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/bytecode.h"
+#include "../include/vm.h"
+
+/* Checks that the static verifier rejects programs the interpreter no longer
+   guards against at run time, and that vm_run refuses them. */
+
+#define NUM_REGS 4
+
+static int expect(const char *name, const Bytecode *bc, const char *want)
+{
+    VMOptions opts;
+    vm_options_init(&opts);
+    opts.num_registers = NUM_REGS;
+    VM *vm = vm_create(&opts);
+    vm_load(vm, bc);
+    const char *err = vm_run(vm);
+    int ok = want ? (err && strcmp(err, want) == 0) : err == NULL;
+    printf("%-22s %s (%s)\n", name, ok ? "ok" : "FAILED", err ? err : "no error");
+    vm_destroy(vm);
+    return ok ? 0 : 1;
+}
+
+int main(void)
+{
+    int failed = 0;
+    Bytecode bc;
+
+    bc_init(&bc);
+    int ci = bc_add_const_int(&bc, 7);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, NUM_REGS); /* one past the register file */
+    bc_emit_const_idx(&bc, ci);
+    bc_emit(&bc, OP_HALT);
+    failed |= expect("register out of range", &bc, "register out of range");
+    bc_free(&bc);
+
+    bc_init(&bc);
+    bc_emit(&bc, OP_LOAD_CONST);
+    bc_emit_reg(&bc, 0);
+    bc_emit_const_idx(&bc, 3); /* no constants at all */
+    bc_emit(&bc, OP_HALT);
+    failed |= expect("constant out of range", &bc, "constant index out of range");
+    bc_free(&bc);
+
+    bc_init(&bc);
+    ci = bc_add_const_int(&bc, 7);
+    bc_emit(&bc, OP_ALLOC_STR);
+    bc_emit_reg(&bc, 0);
+    bc_emit_const_idx(&bc, ci);
+    bc_emit(&bc, OP_HALT);
+    failed |= expect("alloc_str of an int", &bc, "constant is not a string");
+    bc_free(&bc);
+
+    bc_init(&bc);
+    ci = bc_add_const_int(&bc, 7);
+    bc_emit(&bc, OP_CALL_USER);
+    bc_emit_const_idx(&bc, ci);
+    bc_emit_count(&bc, 0);
+    bc_emit_reg(&bc, 0);
+    bc_emit(&bc, OP_HALT);
+    failed |= expect("call of an int", &bc, "constant is not a function");
+    bc_free(&bc);
+
+    bc_init(&bc);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, 2); /* inside the JMP's own operand */
+    bc_emit(&bc, OP_HALT);
+    failed |= expect("misaligned jump", &bc, "jump target is not an instruction boundary");
+    bc_free(&bc);
+
+    bc_init(&bc);
+    bc_emit(&bc, OP_HALT);
+    bc_emit(&bc, OP_RET);
+    bc_emit_reg(&bc, 0);
+    bc_add_const_function(&bc, 3, 0); /* inside the RET */
+    failed |= expect("misaligned function", &bc, "function start is not an instruction boundary");
+    bc_free(&bc);
+
+    bc_init(&bc);
+    bc_emit(&bc, OP_CALL);
+    bc_emit_operand(&bc, OPND_NATIVE, 0);
+    bc_emit_count(&bc, NUM_REGS + 1);
+    bc_emit_reg(&bc, 0);
+    bc_emit(&bc, OP_HALT);
+    failed |= expect("too many arguments", &bc, "argument count out of range");
+    bc_free(&bc);
+
+    /* a jump to the very end of the code is a valid way to halt */
+    bc_init(&bc);
+    bc_emit(&bc, OP_JMP);
+    bc_emit_jump(&bc, 5);
+    failed |= expect("jump to end", &bc, NULL);
+    bc_free(&bc);
+
+    return failed;
+}
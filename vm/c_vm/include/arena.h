@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "vm.h"
+
+/* Per-VM size-class allocator for the heap data of strings, objects and
+   frames. Blocks of up to ARENA_MAX_BLOCK bytes are rounded up to one of
+   ARENA_CLASSES sizes and carved from ARENA_CHUNK_SIZE chunks; a freed block
+   goes onto its class's free-list and is reused by the next allocation of
+   that class, so neither costs a call into the system allocator. Chunks are
+   only returned by arena_destroy, all at once. Bigger blocks, and the chunks
+   themselves, come from the VMAllocator the arena was set up with.
+
+   Callers pass the size of a block back to arena_free, as with the
+   VMAllocator hook. */
+#define ARENA_CLASSES 8
+#define ARENA_MAX_BLOCK 256
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct Arena
+{
+    VMAllocator hook;
+    void *free_blocks[ARENA_CLASSES];
+    char *bump; /* unused tail of the newest chunk */
+    char *bump_end;
+    ArenaChunk *chunks;
+} Arena;
+
+/* hook->alloc NULL means malloc and free */
+void arena_init(Arena *a, const VMAllocator *hook);
+/* releases every chunk; blocks bigger than ARENA_MAX_BLOCK must have been
+   freed already */
+void arena_destroy(Arena *a);
+void *arena_alloc(Arena *a, size_t size);
+void arena_free(Arena *a, void *p, size_t size);
+/* bytes a block of size bytes really takes: its size class, or size itself
+   above ARENA_MAX_BLOCK */
+size_t arena_block_size(size_t size);
+/* allocates and frees through the hook directly, for big buffers */
+void *arena_alloc_raw(Arena *a, size_t size);
+void arena_free_raw(Arena *a, void *p, size_t size);
+
+#endif
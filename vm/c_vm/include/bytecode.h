@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
 
 typedef uint8_t u8;
 
@@ -30,6 +31,13 @@ typedef struct
     } value;
 } Constant;
 
+/* encoding versions. Version 1 writes every operand as a little-endian int32 and
+   jumps as absolute byte offsets. Version 2 is compact: u8 registers and counts,
+   u16 constant and native indices, and int32 jumps relative to the end of the
+   jumping instruction. Opcode numbers and operand order are the same in both. */
+#define BC_VERSION_1 1
+#define BC_VERSION_2 2
+
 typedef struct
 {
     u8 *code;
@@ -37,10 +45,22 @@ typedef struct
     Constant *consts;
     size_t consts_count;
     size_t consts_cap;
+    int version; /* BC_VERSION_1 or BC_VERSION_2 */
 } Bytecode;
 
+/* kinds of instruction operands; their encoded size depends on the version */
+typedef enum
+{
+    OPND_REG,    /* register index */
+    OPND_CONST,  /* constant pool index */
+    OPND_COUNT,  /* small count: nargs, ncaptures */
+    OPND_NATIVE, /* native function index */
+    OPND_JUMP    /* jump target (read back as an absolute byte offset) */
+} OperandKind;
+
 /* helpers to init/free */
-void bc_init(Bytecode *bc);
+void bc_init(Bytecode *bc); /* version 1 */
+void bc_init_version(Bytecode *bc, int version);
 void bc_free(Bytecode *bc);
 void bc_emit(Bytecode *bc, u8 b);
 void bc_emit_i32(Bytecode *bc, int32_t v);
@@ -49,6 +69,32 @@ int bc_add_const_double(Bytecode *bc, double v);
 int bc_add_const_string(Bytecode *bc, const char *s);
 int bc_add_const_function(Bytecode *bc, int start, int nargs);
 
+/* version-aware operand emitters. Each returns the byte position of the operand
+   (for later patching), or -1 if the value does not fit the bc's encoding. */
+long bc_emit_operand(Bytecode *bc, OperandKind kind, int32_t v);
+long bc_emit_reg(Bytecode *bc, int32_t r);
+long bc_emit_const_idx(Bytecode *bc, int32_t ci);
+long bc_emit_count(Bytecode *bc, int32_t n);
+/* target is an absolute byte offset; version 2 stores it relative */
+long bc_emit_jump(Bytecode *bc, int32_t target);
+/* rewrite an operand emitted earlier at pos; returns 0, or -1 if v does not fit */
+int bc_patch_operand(Bytecode *bc, size_t pos, OperandKind kind, int32_t v);
+
+/* binary file form: "VMBC", the version byte, the code and then the constant
+   pool, all little-endian. Both return NULL on success or a static error
+   string; bc_read initialises bc (which the caller frees either way). */
+const char *bc_write(const Bytecode *bc, FILE *f);
+const char *bc_read(Bytecode *bc, FILE *f);
+
+/* operand layout queries shared by the verifier, disassembler and decoder */
+#define BC_MAX_OPERANDS 5
+size_t bc_operand_size(const Bytecode *bc, OperandKind kind);
+/* fixed operand kinds of op (OP_MK_CLOSURE is followed by ncaptures more
+   OPND_REG operands); returns the count, or -1 for an unknown opcode */
+int bc_op_operands(u8 op, OperandKind kinds[BC_MAX_OPERANDS]);
+/* read the operand at *ip and advance past it; the caller checks bounds */
+int32_t bc_read_operand(const Bytecode *bc, size_t *ip, OperandKind kind);
+
 /* opcodes */
 enum OpCode
 {
@@ -70,7 +116,13 @@ enum OpCode
     OP_PUSH_HANDLER,
     OP_POP_HANDLER,
     OP_MK_CLOSURE,
-    OP_CALL_CLOSURE
+    OP_CALL_CLOSURE,
+    /* superinstructions produced by the peephole pass (peephole.h) */
+    OP_ADD_IMM,       /* dst, src, kreg, const: kreg = const; dst = src + kreg */
+    OP_SUB_JZ,        /* dst, a, b, target: dst = a - b; jump if dst == 0 */
+    OP_SUB_JNZ,       /* dst, a, b, target: dst = a - b; jump if dst != 0 */
+    OP_MOV_CALL_USER, /* mdst, msrc, const, nargs, dst: mdst = msrc; CALL_USER const, nargs, dst */
+    OP_COUNT          /* number of opcodes; not an instruction */
 };
 
 #endif
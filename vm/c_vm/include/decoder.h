@@ -0,0 +1,69 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "bytecode.h"
+
+/* loader-internal opcodes; they only ever appear in a decoded stream */
+enum DecodedOpCode
+{
+    OP_BAD_JUMP = OP_COUNT, /* control reached a byte offset that is not an instruction */
+    OP_EXT,                 /* operand slot following an instruction with more than 3 operands */
+    /* quickened forms: vm_run rewrites a generic instruction in place once it
+       has seen the operand types, and rewrites it back if a guard fails */
+    OP_ADD_II,            /* OP_ADD on two ints */
+    OP_SUB_II,
+    OP_MUL_II,
+    OP_DIV_II,
+    OP_JZ_I,              /* OP_JZ on an int */
+    OP_LOAD_CONST_INT,    /* a = dst, b/c = the value (instr_imm64); never reverts */
+    OP_LOAD_CONST_DOUBLE, /* a = dst, b/c = the bits of the value */
+    /* set by vm_load: OP_LOAD_CONST or OP_ALLOC_STR of a string constant */
+    OP_LOAD_CONST_STR     /* a = dst, b = heap index of the interned, pinned string */
+};
+
+/* one fixed-width (16 byte) decoded instruction. Operands keep their encoding
+   order (e.g. ADD: a = dst, b = lhs, c = rhs) with these exceptions:
+   - jump operands hold instruction indices;
+   - OP_MK_CLOSURE's c is the position of its [ncaptures, reg0, reg1, ...] list
+     in DecodedProgram.captures;
+   - operands 3 and 4 of the superinstructions live in a following OP_EXT slot
+     (a, b). For OP_ADD_IMM the slot holds the constant index in a and the
+     int64 immediate itself in b and c. */
+typedef struct
+{
+    u8 op;
+    int32_t a, b, c;
+} Instr;
+
+/* the 64-bit immediate stored in b (low half) and c (high half), as in an
+   OP_ADD_IMM extension slot or an OP_LOAD_CONST_INT */
+static inline int64_t instr_imm64(const Instr *in)
+{
+    return (int64_t)(((uint64_t)(uint32_t)in->c << 32) | (uint32_t)in->b);
+}
+
+static inline void instr_set_imm64(Instr *in, int64_t v)
+{
+    in->b = (int32_t)(uint32_t)(uint64_t)v;
+    in->c = (int32_t)(uint32_t)((uint64_t)v >> 32);
+}
+
+typedef struct
+{
+    /* count instruction slots followed by two sentinels: an OP_HALT at index
+       count (end of code) and an OP_BAD_JUMP at index count + 1 */
+    Instr *code;
+    uint32_t *offsets; /* per instruction (sentinels included): byte offset in Bytecode.code */
+    size_t count;
+    int32_t *captures; /* capture lists of all OP_MK_CLOSURE instructions */
+    size_t captures_count;
+    int32_t *func_pc; /* per constant: instruction index of a CONST_FUNCTION start, -1 otherwise */
+    size_t func_count;
+} DecodedProgram;
+
+/* decode bc into out; returns NULL on success or pointer to static error string.
+   out is always left in a state that decoded_free accepts. */
+const char *decode_bytecode(const Bytecode *bc, DecodedProgram *out);
+void decoded_free(DecodedProgram *dp);
+
+#endif
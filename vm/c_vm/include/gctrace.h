@@ -0,0 +1,31 @@
+#ifndef GCTRACE_H
+#define GCTRACE_H
+
+#include "vm.h"
+#include <stdio.h>
+
+/* Offline views of the collector pauses vm_gc_events returns (see
+   VMOptions.gc_trace_events). */
+
+/* pause durations, nearest-rank percentiles; an empty summary (count 0) if
+   there is no memory to sort them in */
+typedef struct
+{
+    size_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} GCPauseSummary;
+void gc_pause_summary(const VMGCEvent *events, size_t n, GCPauseSummary *out);
+
+/* the pause durations in power-of-two microsecond buckets, one line per
+   bucket from the shortest to the longest pause, then the summary */
+void gc_pause_histogram(const VMGCEvent *events, size_t n, FILE *os);
+
+/* Chrome trace-event JSON (for chrome://tracing or Perfetto): one complete
+   ("X") event per pause on a single track, named after its phases
+   ("minor", "mark", "sweep", "compact", joined by '+'), with the other
+   VMGCEvent fields as args. Timestamps are microseconds since vm_create. */
+void gc_trace_write_json(const VMGCEvent *events, size_t n, FILE *os);
+
+#endif
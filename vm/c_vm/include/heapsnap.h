@@ -0,0 +1,107 @@
+#ifndef HEAPSNAP_H
+#define HEAPSNAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Heap snapshots (vm_heap_snapshot) and their offline analysis: a
+   dominator tree over the references from the roots, the size each string
+   and object retains (what would be freed without it), and those sizes
+   summed per closure function.
+
+   Format: the magic "VMHS", then unsigned LEB128 varints:
+     version (HEAP_SNAPSHOT_VERSION)
+     bytes of a string slot and an object slot, the fields an object slot
+       holds inline, bytes of a Value
+     string slots, object slots (the table sizes, dead slots included)
+     function count; per CONST_FUNCTION constant: index, start, nargs
+     root count; per root: ref (registers, saved registers of active calls
+       and pinned strings)
+     string count; per live string: index, flags, length, characters
+     object count; per live object: index, flags, field count, closure
+       (1 + field 0 when that is an int naming a function constant, the way
+       OP_MK_CLOSURE builds them, else 0), reference count; per reference:
+       field, ref
+   where ref = 2 + 2 * index for a string and 3 + 2 * index for an object,
+   and flags are HEAP_SNAPSHOT_*. Sizes follow VMGCStats: the slot, plus
+   the characters and terminator of a string or the fields of an object too
+   big to hold them inline. */
+#define HEAP_SNAPSHOT_MAGIC "VMHS"
+#define HEAP_SNAPSHOT_VERSION 2
+#define HEAP_SNAPSHOT_PINNED 1
+#define HEAP_SNAPSHOT_YOUNG 2
+
+#define HEAP_NODE_ROOT 0              /* node 0 stands for all the roots */
+#define HEAP_NODE_UNREACHABLE ((size_t)-1) /* idom of what no root reaches */
+#define HEAP_SNAPSHOT_NO_MEMORY ((size_t)-1) /* heap_snapshot_closure_groups failed */
+
+typedef struct
+{
+    int is_object;
+    int index;          /* string or object index in the VM */
+    unsigned flags;     /* HEAP_SNAPSHOT_* */
+    int closure;        /* CONST_FUNCTION index of a closure, otherwise -1 */
+    int field_count;    /* objects */
+    char *chars;        /* strings */
+    size_t size;        /* shallow size */
+    size_t first_edge;  /* its references, as node numbers, in edges[] */
+    size_t edge_count;
+    /* set by heap_snapshot_analyze */
+    size_t idom;     /* immediate dominator, HEAP_NODE_ROOT or HEAP_NODE_UNREACHABLE */
+    size_t retained; /* its size plus that of every node it dominates */
+} HeapNode;
+
+typedef struct
+{
+    int const_index;
+    int start;
+    int nargs;
+} HeapFunction;
+
+typedef struct
+{
+    HeapNode *nodes; /* node 0 is the root, then the strings, then the objects */
+    size_t node_count;
+    size_t *edges;
+    size_t edge_count;
+    HeapFunction *functions;
+    size_t function_count;
+    size_t string_count, string_bytes;
+    size_t object_count, object_bytes;
+    /* set by heap_snapshot_analyze */
+    size_t unreachable_count, unreachable_bytes;
+} HeapSnapshot;
+
+/* returns NULL on success, otherwise a static error string; hs is then
+   empty and needs no heap_snapshot_free */
+const char *heap_snapshot_read(HeapSnapshot *hs, FILE *in);
+void heap_snapshot_free(HeapSnapshot *hs);
+
+/* computes idom and retained for every node (Cooper, Harvey and Kennedy's
+   iterative algorithm), and the unreachable totals. Returns NULL on
+   success, otherwise a static error string; hs is then not analyzed. */
+const char *heap_snapshot_analyze(HeapSnapshot *hs);
+
+/* the closures of one function after heap_snapshot_analyze. retained
+   counts what any of them keeps alive once, even where one closure of the
+   function dominates another. */
+typedef struct
+{
+    int const_index;
+    int start;
+    size_t closures;
+    size_t shallow;
+    size_t retained;
+} HeapClosureGroup;
+/* writes up to max groups, largest retained first, to out and returns the
+   number of functions that have closures on the heap, or
+   HEAP_SNAPSHOT_NO_MEMORY */
+size_t heap_snapshot_closure_groups(const HeapSnapshot *hs, HeapClosureGroup *out, size_t max);
+
+/* a text report after heap_snapshot_analyze: totals, the closure groups
+   and the top nodes by retained size. Returns NULL on success, otherwise a
+   static error string; the report then stops where it failed. */
+const char *heap_snapshot_report(const HeapSnapshot *hs, FILE *os, size_t top);
+
+#endif
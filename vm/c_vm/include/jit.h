@@ -0,0 +1,52 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "decoder.h"
+#include "vm.h"
+
+/* Baseline template JIT for x86-64 Linux. Once a CONST_FUNCTION has been
+   called jit_threshold times its body is translated into machine code, one
+   fixed template per decoded instruction, in an mmap'd buffer.
+
+   Jitted code works directly on the VM's register file and owns no state of
+   its own: int arithmetic, moves, constants and branches run natively;
+   printing, allocation and native calls go through vm_jit_exec; anything that
+   changes frames or handlers (calls, RET, THROW) and every failed type guard
+   leaves the jitted code, returning the instruction index at which the
+   interpreter continues. Frames and the handler stack are therefore always
+   the interpreter's, and OP_THROW unwinds exactly as before. The interpreter
+   re-enters jitted code at function entry, after a call returns into a
+   compiled function, and at exception handlers.
+
+   Elsewhere, and with VM_NAN_BOXING or VM_NO_JIT, VM_JIT_AVAILABLE is 0 and
+   jit_create returns NULL. */
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(VM_NAN_BOXING) && \
+    !defined(VM_NO_JIT)
+#define VM_JIT_AVAILABLE 1
+#else
+#define VM_JIT_AVAILABLE 0
+#endif
+
+typedef struct Jit Jit;
+
+/* NULL when the JIT is unavailable or threshold is 0. prog must outlive the Jit. */
+Jit *jit_create(DecodedProgram *prog, const Bytecode *bc, int threshold);
+void jit_free(Jit *jit);
+
+/* called by the interpreter whenever control transfers to instruction pc
+   through a call (is_call), a return or a throw. Counts calls, compiles hot
+   functions, and runs jitted code if pc is one of its entry points. Returns
+   the instruction index the interpreter continues at (pc itself if no
+   jitted code ran). */
+size_t jit_enter(Jit *jit, VM *vm, Value *regs, size_t pc, int is_call);
+
+/* number of functions compiled so far */
+int jit_compiled_count(const Jit *jit);
+
+/* runtime entry for jitted code (implemented in vm.c): executes the
+   PRINT, ALLOC_STR, LOAD_CONST, CALL, MK_CLOSURE or handler instruction at
+   pc. Returns 0 on success, non-zero if the interpreter must execute it
+   instead (e.g. to report an error). */
+int vm_jit_exec(VM *vm, int32_t pc);
+
+#endif
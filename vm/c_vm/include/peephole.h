@@ -0,0 +1,17 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "bytecode.h"
+
+/* Load-time peephole pass. Rewrites common instruction sequences in bc into
+   superinstructions, then remaps jump targets and CONST_FUNCTION starts:
+     LOAD_CONST k, c(int) ; ADD d, x, k        -> ADD_IMM d, x, k, c
+     SUB d, a, b ; JZ d, t ; JMP l    (t falls through past the JMP) -> SUB_JNZ d, a, b, l
+     SUB d, a, b ; JZ d, t            -> SUB_JZ d, a, b, t
+     MOV m, s ; CALL_USER f, n, d     -> MOV_CALL_USER m, s, f, n, d
+   A sequence is only fused when no jump, handler or function start lands
+   inside it. bc must already pass verify_bytecode. Returns the number of
+   sequences fused, or -1 (bc left unchanged) if the code cannot be analysed. */
+int peephole_optimize(Bytecode *bc);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef SSA_H
+#define SSA_H
+
+#include "bytecode.h"
+
+/* SSA-based bytecode optimizer. Lifts bc into a control-flow graph in SSA form
+   and repeats, until nothing changes:
+     - constant folding: int ADD/SUB/MUL/DIV of known constants become
+       LOAD_CONST, and a JZ on a known constant becomes a JMP or disappears
+     - copy propagation: reads of a MOV's destination read its source instead
+       while the source still holds the same value
+     - dead-code elimination: pure instructions whose result is overwritten
+       before anything reads it, unreachable code, and JMPs to the next
+       instruction
+     - loop-invariant code motion: an int or double LOAD_CONST that is the only
+       write to its register inside a loop moves into a new loop preheader
+   then re-emits the code with jump targets and CONST_FUNCTION starts remapped.
+
+   The register file is shared by all frames, so calls, RET, THROW and HALT
+   count as reading every register and calls as writing every register except
+   their (restored) arguments: a value is only dead if it is overwritten before
+   any of those. Register contents after a run-time error are not preserved.
+   Folded results stay within 48 bits so they mean the same with VM_NAN_BOXING.
+
+   Returns 0 and fills stats (if non-NULL), or -1 with bc unchanged if the
+   code cannot be analysed: it fails verify_bytecode, has a negative register
+   or an out-of-range constant index, or jumps into an instruction. */
+typedef struct
+{
+    size_t instrs_before;
+    size_t instrs_after;
+    int folded;  /* instructions computed or branches decided at load time */
+    int copies;  /* register reads redirected past a MOV */
+    int removed; /* dead or unreachable instructions deleted */
+    int hoisted; /* LOAD_CONSTs moved out of loops */
+    int rounds;  /* times the passes ran */
+} SsaStats;
+
+int ssa_optimize(Bytecode *bc, SsaStats *stats);
+
+#endif
@@ -3,7 +3,15 @@
 
 #include "bytecode.h"
 
-/* returns NULL on success or pointer to static error string */
+/* structural check: known opcodes and no operand runs past the end of the code.
+   returns NULL on success or pointer to static error string */
 const char *verify_bytecode(const Bytecode *bc);
 
+/* full static check for a VM with num_registers registers: the structural
+   check, plus every register operand in range, constant indices in range and
+   of the type the opcode needs, call argument counts within the register
+   file, and jump targets and CONST_FUNCTION starts on instruction boundaries.
+   Code that passes can run without the corresponding checks at run time. */
+const char *verify_program(const Bytecode *bc, int num_registers);
+
 #endif
@@ -3,6 +3,7 @@
 
 #include "bytecode.h"
 #include <stdio.h>
+#include <string.h>
 
 typedef enum
 {
@@ -13,6 +14,107 @@ typedef enum
     V_OBJECT
 } ValueType;
 
+/* A Value is read and written only through the value_* functions below, so
+   the representation can be chosen at compile time:
+   - default: a 16-byte tagged union;
+   - VM_NAN_BOXING (cmake -DVM_NAN_BOXING=ON): 8 bytes. Doubles are stored as
+     themselves (NaNs canonicalised); every other type lives in the payload of
+     a negative quiet NaN, the type in bits 48-50 and the payload in the low 48
+     bits. Ints are therefore 48-bit, wrapping like two's complement.
+   Strings of up to VALUE_SMALL_STR_MAX characters can also be stored in the
+   Value itself (value_small_str): such a Value has type V_STRING but no heap
+   string behind it, so value_as_str returns -1 for it and the collector never
+   sees it. vm_string_chars reads both kinds. */
+/* the type stored for an inline string; value_type reports V_STRING */
+#define VALUE_SMALL_STR_TYPE (V_OBJECT + 1)
+#ifdef VM_NAN_BOXING
+typedef struct
+{
+    uint64_t bits;
+} Value;
+
+#define VALUE_BOX_PREFIX 0xFFF8000000000000ull /* sign + exponent + quiet bit */
+#define VALUE_PAYLOAD_MASK 0x0000FFFFFFFFFFFFull
+#define VALUE_CANONICAL_NAN 0x7FF8000000000000ull
+/* boxed tag = type + 1, so the tag is never 0 and no boxed value is a real NaN */
+#define VALUE_BOX(type, payload) \
+    (VALUE_BOX_PREFIX | ((uint64_t)((type) + 1) << 48) | ((uint64_t)(payload) & VALUE_PAYLOAD_MASK))
+
+#define VALUE_SMALL_STR_MAX 6 /* characters in the 48-bit payload */
+
+static inline ValueType value_type(Value v)
+{
+    if ((v.bits >> 48) <= 0xFFF8)
+        return V_DOUBLE;
+    int t = (int)((v.bits >> 48) & 7) - 1;
+    return t == VALUE_SMALL_STR_TYPE ? V_STRING : (ValueType)t;
+}
+static inline int value_is_int(Value v) { return (v.bits >> 48) == (VALUE_BOX(V_INT, 0) >> 48); }
+static inline int value_is_small_str(Value v) { return (v.bits >> 48) == (VALUE_BOX(VALUE_SMALL_STR_TYPE, 0) >> 48); }
+static inline int64_t value_as_int(Value v) { return (int64_t)(v.bits << 16) >> 16; }
+static inline double value_as_double(Value v)
+{
+    double d;
+    memcpy(&d, &v.bits, sizeof(d));
+    return d;
+}
+static inline int value_as_str(Value v) { return value_is_small_str(v) ? -1 : (int)(int32_t)v.bits; }
+static inline int value_as_obj(Value v) { return (int)(int32_t)v.bits; }
+/* copies the characters of an inline string and a terminator to out
+   (VALUE_SMALL_STR_MAX + 1 bytes) and returns the length */
+static inline size_t value_small_str_chars(Value v, char *out)
+{
+    size_t n = 0;
+    for (; n < VALUE_SMALL_STR_MAX; ++n)
+    {
+        out[n] = (char)(v.bits >> (8 * n));
+        if (!out[n])
+            return n;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static inline Value value_none(void)
+{
+    Value v = {VALUE_BOX(V_NONE, 0)};
+    return v;
+}
+static inline Value value_int(int64_t i)
+{
+    Value v = {VALUE_BOX(V_INT, (uint64_t)i)};
+    return v;
+}
+static inline Value value_double(double d)
+{
+    Value v;
+    if (d != d)
+        v.bits = VALUE_CANONICAL_NAN;
+    else
+        memcpy(&v.bits, &d, sizeof(d));
+    return v;
+}
+static inline Value value_str(int idx)
+{
+    Value v = {VALUE_BOX(V_STRING, (uint32_t)idx)};
+    return v;
+}
+static inline Value value_obj(int idx)
+{
+    Value v = {VALUE_BOX(V_OBJECT, (uint32_t)idx)};
+    return v;
+}
+/* an inline string of the first n characters of s; n must be at most
+   VALUE_SMALL_STR_MAX and they must not contain a '\0' */
+static inline Value value_small_str(const char *s, size_t n)
+{
+    uint64_t payload = 0;
+    for (size_t i = 0; i < n; ++i)
+        payload |= (uint64_t)(unsigned char)s[i] << (8 * i);
+    Value v = {VALUE_BOX(VALUE_SMALL_STR_TYPE, payload)};
+    return v;
+}
+#else
 typedef struct
 {
     ValueType type;
@@ -22,36 +124,355 @@ typedef struct
         double d;
         int str_idx; /* index into heap strings */
         int obj_idx; /* index into heap objects */
+        char chars[8]; /* inline strings, '\0'-padded */
     } as;
 } Value;
 
+#define VALUE_SMALL_STR_MAX 8
+
+static inline ValueType value_type(Value v)
+{
+    return (int)v.type == VALUE_SMALL_STR_TYPE ? V_STRING : v.type;
+}
+static inline int value_is_int(Value v) { return v.type == V_INT; }
+static inline int value_is_small_str(Value v) { return (int)v.type == VALUE_SMALL_STR_TYPE; }
+static inline int64_t value_as_int(Value v) { return v.as.i; }
+static inline double value_as_double(Value v) { return v.as.d; }
+static inline int value_as_str(Value v) { return value_is_small_str(v) ? -1 : v.as.str_idx; }
+static inline int value_as_obj(Value v) { return v.as.obj_idx; }
+/* copies the characters of an inline string and a terminator to out
+   (VALUE_SMALL_STR_MAX + 1 bytes) and returns the length */
+static inline size_t value_small_str_chars(Value v, char *out)
+{
+    size_t n = 0;
+    while (n < VALUE_SMALL_STR_MAX && v.as.chars[n])
+    {
+        out[n] = v.as.chars[n];
+        ++n;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static inline Value value_none(void)
+{
+    Value v;
+    v.type = V_NONE;
+    v.as.i = 0;
+    return v;
+}
+static inline Value value_int(int64_t i)
+{
+    Value v;
+    v.type = V_INT;
+    v.as.i = i;
+    return v;
+}
+static inline Value value_double(double d)
+{
+    Value v;
+    v.type = V_DOUBLE;
+    v.as.d = d;
+    return v;
+}
+static inline Value value_str(int idx)
+{
+    Value v;
+    v.type = V_STRING;
+    v.as.i = 0;
+    v.as.str_idx = idx;
+    return v;
+}
+static inline Value value_obj(int idx)
+{
+    Value v;
+    v.type = V_OBJECT;
+    v.as.i = 0;
+    v.as.obj_idx = idx;
+    return v;
+}
+/* an inline string of the first n characters of s; n must be at most
+   VALUE_SMALL_STR_MAX and they must not contain a '\0' */
+static inline Value value_small_str(const char *s, size_t n)
+{
+    Value v;
+    v.type = (ValueType)VALUE_SMALL_STR_TYPE;
+    v.as.i = 0;
+    memcpy(v.as.chars, s, n);
+    return v;
+}
+#endif
+
+#define VM_JIT_DEFAULT_THRESHOLD 1000
+#define VM_NURSERY_DEFAULT_SIZE (256 * 1024)
+#define VM_GC_DEFAULT_SLICE_WORK 1000
+#define VM_GC_DEFAULT_MIN_HEAP (64 * 1024)
+/* VMOptions.jit_threshold and nursery_size values that turn the feature off
+   (0 means the default there, as in every other field) */
+#define VM_JIT_OFF (-1)
+#define VM_NURSERY_OFF ((size_t)-1)
+
+/* where a VM gets the memory of its heap: the nursery, and the chunks its
+   size-class allocator (arena.h) carves string characters, object fields
+   and call frames from, plus any such block too big for a size class.
+   alloc returns memory aligned as malloc's, or NULL; free gets back the size
+   that was asked for. Its own tables (string and object slots, free-lists,
+   mark bitmaps, ...) still come from malloc. */
+typedef struct
+{
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *p, size_t size);
+    void *ctx;
+} VMAllocator;
+
+/* Options for vm_create. Every field left 0 takes its default, so
+   vm_options_init, a zero-initialized struct and designated initializers
+   all work; vm_options_init also spells the defaults out. */
 typedef struct
 {
-    int num_registers;
+    int num_registers; /* default 16 */
+    /* calls after which a function is compiled to native code (x86-64
+       Linux only, see jit.h), default VM_JIT_DEFAULT_THRESHOLD; VM_JIT_OFF
+       disables the JIT */
+    int jit_threshold;
+    /* bytes of young generation: new strings and object fields are bump
+       allocated here and a minor collection promotes the survivors once it is
+       full. Default VM_NURSERY_DEFAULT_SIZE; VM_NURSERY_OFF allocates
+       everything in the old generation. */
+    size_t nursery_size;
+    /* a major collection starts when an allocation finds that the old
+       generation (in bytes, counted as in VMGCStats) has grown by
+       gc_heap_growth_percent since the last one (default 100: doubled), and
+       is at least gc_min_heap bytes (default VM_GC_DEFAULT_MIN_HEAP) */
+    unsigned gc_heap_growth_percent;
+    size_t gc_min_heap;
+    /* non-zero: major collections are incremental. Marking and sweeping are
+       split into slices, one every 64 allocations, each of which stops after
+       gc_slice_work fields, objects or swept slots (default
+       VM_GC_DEFAULT_SLICE_WORK, (size_t)-1 for no limit) or after
+       gc_slice_us microseconds of CPU time (0, the default, for no limit),
+       whichever comes first. 0 (the default) marks in a single pause. */
+    int gc_incremental;
+    size_t gc_slice_work;
+    unsigned gc_slice_us;
+    /* threads, the collecting one included, that mark during vm_gc and
+       other stop-the-world major collections (default 1), at most one per
+       processor online. They are started on first use and stay parked until
+       vm_destroy. Minor collections and
+       incremental slices always mark on the calling thread, and so does
+       everything when the library is built without thread support. */
+    int gc_mark_threads;
+    /* 0 (the default): a stop-the-world major collection started by
+       allocation pauses only to mark; the dead strings and objects are
+       then freed in slices like those of gc_incremental, between later
+       allocations (lazy sweeping). Non-zero sweeps in the pause as well.
+       vm_gc always sweeps before it returns. */
+    int gc_eager_sweep;
+    /* non-zero: once a major collection started by allocation has swept,
+       and more than this percentage of the object slots is free, the live
+       objects are slid together and the object table shrinks (see
+       vm_compact_heap). 0 (the default) never compacts on its own. */
+    unsigned gc_compact_percent;
+    /* alloc NULL (the default): malloc and free */
+    VMAllocator allocator;
+    /* non-zero: keep a VMGCEvent for each of the last gc_trace_events
+       collector pauses (see vm_gc_events). 0 (the default) records none. */
+    size_t gc_trace_events;
+    /* limits on what the VM allocates, in bytes as VMMemoryStats.used
+       counts them; 0 (the default) is no limit. Once usage passes
+       mem_soft_limit a major collection runs at the next safepoint; while
+       usage stays above it, another runs each time usage has grown by half
+       of what is left below mem_hard_limit (by a quarter without one). A
+       string, object, call frame or handler that would take usage past
+       mem_hard_limit is refused: the program gets a VM exception (see
+       vm_run) and a major collection is requested. */
+    size_t mem_soft_limit;
+    size_t mem_hard_limit;
 } VMOptions;
 
+/* fills opts with the defaults; call it before setting individual fields */
+void vm_options_init(VMOptions *opts);
+
 typedef struct VM VM;
 
-/* lifecycle */
+/* lifecycle. vm_create returns NULL if the system allocator, or
+   opts->allocator for the nursery, has no room for the VM. */
 VM *vm_create(const VMOptions *opts);
 void vm_destroy(VM *vm);
 
-/* load bytecode and run */
+/* load bytecode and run. If the copy of bc cannot be allocated, vm_run
+   returns VM_MEM_LIMIT_ERROR until a later vm_load succeeds. */
 void vm_load(VM *vm, const Bytecode *bc);
-/* returns NULL on success, otherwise pointer to static error string */
+/* optional: after vm_load, verify the program, run the SSA optimizer (see
+   ssa.h) and fuse common instruction sequences into superinstructions (see
+   peephole.h). Returns NULL on success. */
+const char *vm_optimize(VM *vm);
+/* returns NULL on success, otherwise pointer to static error string. An
+   allocation refused by VMOptions.mem_hard_limit (or by the system
+   allocator) throws the string VM_MEM_LIMIT_ERROR to the innermost handler,
+   as OP_THROW would; without a handler vm_run returns VM_MEM_LIMIT_ERROR. */
+#define VM_MEM_LIMIT_ERROR "memory limit exceeded"
 const char *vm_run(VM *vm);
+/* byte offset in the loaded bytecode of the last instruction vm_run executed;
+   after an error this is the instruction that failed */
+size_t vm_error_offset(VM *vm);
+
+/* number of functions the JIT has compiled for the loaded program */
+int vm_jit_compiled(VM *vm);
+
+/* inline cache counters of one call site (OP_CALL_USER, OP_MOV_CALL_USER or
+   OP_CALL_CLOSURE). Each site caches the last function it called; a miss
+   means the site called a different function than the time before (or was
+   called for the first time), so misses > 1 marks a polymorphic site. */
+typedef struct
+{
+    size_t offset;  /* byte offset of the call in the loaded bytecode */
+    int func_index; /* CONST_FUNCTION index currently cached, -1 if never called */
+    uint64_t hits;
+    uint64_t misses;
+} VMCallSiteStats;
+/* writes up to max call sites of the loaded program, in code order, to out and
+   returns the total number of call sites. Counters reset on vm_load/vm_optimize. */
+size_t vm_call_site_stats(VM *vm, VMCallSiteStats *out, size_t max);
 
-/* alloc string on VM heap, returns index */
+/* alloc string on VM heap, returns index. Strings are immutable and
+   interned: an equal live string is returned instead of a copy. The index
+   stays valid until the string is collected; freed indices are reused by
+   later allocations. String constants of a loaded program are interned by
+   vm_load and not collected until another program is loaded. Returns -1 if
+   the allocation is refused (see VMOptions.mem_hard_limit); in a native,
+   the call then throws once the native returns. */
 int vm_alloc_string(VM *vm, const char *s);
+/* a string Value for s: an inline one (value_small_str) when s has at most
+   VALUE_SMALL_STR_MAX characters, which allocates nothing, otherwise
+   value_str(vm_alloc_string(vm, s)) */
+Value vm_string_value(VM *vm, const char *s);
+/* contents of string value v, or NULL if v is not a live string. The
+   characters of an inline string are copied to one of VM_STRING_SCRATCH
+   buffers in the VM, reused round-robin, so that pointer stays valid for
+   the next VM_STRING_SCRATCH - 1 calls only. */
+#define VM_STRING_SCRATCH 8
+const char *vm_string_chars(VM *vm, Value v);
+
+/* collect every string and object not reachable from the registers or the
+   saved registers of active calls (a major collection). vm_run also collects
+   on its own: a minor collection of the young generation whenever the nursery
+   fills, and a major one once the old generation has grown by
+   VMOptions.gc_heap_growth_percent since the last. Objects and strings only
+   reachable from C must be stored in a register or a reachable object, and
+   their fields written with vm_set_object_field, which records old objects
+   that point at young data and, during an incremental collection, marks what
+   is stored into marked objects. vm_gc abandons an incremental collection
+   or lazy sweep under way and collects in one pause. */
+void vm_gc(VM *vm);
+/* vm_gc, then slide the live objects to the front of the object table (in
+   their allocation order) and shrink it, so the memory of dead slots goes
+   back and neighbouring objects sit together. This renumbers objects: the
+   values in registers, saved registers and object fields are updated, but
+   an object index the host keeps anywhere else goes stale, including the
+   args of a native that calls this. Automatic compaction
+   (VMOptions.gc_compact_percent) only happens between instructions, when no
+   native is running. */
+void vm_compact_heap(VM *vm);
+
+/* collector counters since vm_create. Sizes count the characters of a
+   string (with its terminator) or the fields of an object, plus its slot
+   in the string or object table. */
+typedef struct
+{
+    uint64_t minor_collections;
+    uint64_t major_collections; /* stop-the-world and incremental, vm_gc included */
+    uint64_t compactions;
+    /* collector work done between two instructions or in vm_gc /
+       vm_compact_heap: a minor or major collection, or a slice of an
+       incremental collection or lazy sweep. Wall-clock time. */
+    uint64_t pauses;
+    uint64_t pause_ns_total;
+    uint64_t pause_ns_max;
+    uint64_t bytes_allocated;
+    uint64_t bytes_freed;
+    size_t live_bytes;       /* bytes_allocated - bytes_freed: live data and garbage not yet freed */
+    size_t old_bytes;        /* the part of live_bytes in the old generation, string constants excluded */
+    size_t next_major_bytes; /* old_bytes that starts the next major collection */
+    size_t strings;          /* strings and objects on the heap */
+    size_t objects;
+} VMGCStats;
+void vm_gc_stats(VM *vm, VMGCStats *out);
+
+/* VMGCEvent.phases: what a pause did */
+#define VM_GC_PHASE_MINOR 1   /* a minor collection */
+#define VM_GC_PHASE_MARK 2    /* marking of a major collection, or a slice of it */
+#define VM_GC_PHASE_SWEEP 4   /* sweeping of a major collection, or a slice of it */
+#define VM_GC_PHASE_COMPACT 8 /* a heap compaction */
+
+/* one collector pause (as counted by VMGCStats.pauses). A stop-the-world
+   collection that sweeps in its pause is one event; an incremental one or
+   a lazy sweep spreads over several, all with the same cycle. */
+typedef struct
+{
+    uint64_t start_ns; /* since vm_create, wall-clock */
+    uint64_t end_ns;
+    uint64_t cycle;    /* the major collection under way or last started (1 = the first) */
+    unsigned phases;   /* VM_GC_PHASE_* */
+    size_t roots;      /* registers, saved registers and remembered objects scanned */
+    /* marked strings and objects: the young survivors of a minor collection,
+       and, in the pause that finishes marking a major one, all it marked */
+    size_t strings_marked;
+    size_t objects_marked;
+    size_t strings_freed;
+    size_t objects_freed;
+    size_t string_free_list; /* free-list lengths once the pause is over */
+    size_t object_free_list;
+} VMGCEvent;
+/* writes the last (at most) max recorded events, oldest first, to out and
+   returns how many the VM holds, at most VMOptions.gc_trace_events.
+   gctrace.h turns them into a trace-event file and pause percentiles. */
+size_t vm_gc_events(VM *vm, VMGCEvent *out, size_t max);
+
+/* writes a binary snapshot of the heap to os: every string and object on
+   it (reachable or not; nothing is collected first), the references
+   between them and the roots. heapsnap.h reads it and computes what each
+   object keeps alive. Returns NULL on success, otherwise a static error
+   string. */
+const char *vm_heap_snapshot(VM *vm, FILE *os);
+
+/* what a VM has allocated for itself, by kind (VMMemoryStats.by_kind).
+   Blocks of its size-class allocator count at their class size, everything
+   else at the size asked for; the nursery counts in full from vm_create.
+   The JIT's executable code and the marking threads are not counted. */
+typedef enum
+{
+    VM_MEM_VM,        /* the VM itself and its table of natives */
+    VM_MEM_PROGRAM,   /* the loaded program: bytecode, decoded form, call caches */
+    VM_MEM_REGISTERS,
+    VM_MEM_FRAMES,    /* call frames and their saved registers, native arguments */
+    VM_MEM_HANDLERS,  /* the exception handler stack */
+    VM_MEM_STRINGS,   /* string table, hash buckets, free-list, old characters */
+    VM_MEM_OBJECTS,   /* object table, free-list, old out-of-line fields */
+    VM_MEM_NURSERY,
+    VM_MEM_GC,        /* young lists, remembered set, mark stacks, trace ring */
+    VM_MEM_KINDS
+} VMMemKind;
+typedef struct
+{
+    size_t used; /* bytes allocated now: the sum of by_kind */
+    size_t peak; /* the most used has been since vm_create */
+    size_t by_kind[VM_MEM_KINDS];
+    uint64_t refused;          /* allocations refused (VMOptions.mem_hard_limit or the system) */
+    uint64_t soft_collections; /* major collections asked for by VMOptions.mem_soft_limit */
+} VMMemoryStats;
+void vm_memory_stats(VM *vm, VMMemoryStats *out);
 
-/* disassemble and verify */
+/* disassemble and verify. vm_verify runs verify_program (see verifier.h) once
+   per loaded program and caches the result; vm_run refuses unverified code. */
 void vm_disassemble(VM *vm, FILE *os);
 const char *vm_verify(VM *vm);
 
 /* debug helpers */
 void vm_print_registers(VM *vm, FILE *os);
 
-/* object allocation and access */
+/* object allocation and access. vm_alloc_object returns -1 if the
+   allocation is refused, as vm_alloc_string does. */
 int vm_alloc_object(VM *vm, int field_count);
 void vm_set_object_field(VM *vm, int obj_idx, int field, Value val);
 Value vm_get_object_field(VM *vm, int obj_idx, int field);
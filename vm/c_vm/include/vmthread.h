@@ -0,0 +1,58 @@
+#ifndef VMTHREAD_H
+#define VMTHREAD_H
+
+/* Minimal threading shim for the parallel marker (VMOptions.gc_mark_threads):
+   threads, a mutex, a condition variable and the processor count over
+   POSIX. Code using it also relies on the GCC/Clang __atomic builtins.
+
+   Elsewhere, and with VM_NO_THREADS (cmake -DVM_THREADS=OFF),
+   VM_THREADS_AVAILABLE is 0, none of this is defined and major collections
+   always mark on the calling thread. */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32) && !defined(VM_NO_THREADS)
+#define VM_THREADS_AVAILABLE 1
+#else
+#define VM_THREADS_AVAILABLE 0
+#endif
+
+#if VM_THREADS_AVAILABLE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef pthread_t VmThread;
+typedef pthread_mutex_t VmMutex;
+typedef pthread_cond_t VmCond;
+
+/* 1 on success */
+static inline int vm_thread_start(VmThread *t, void *(*fn)(void *), void *arg)
+{
+    return pthread_create(t, NULL, fn, arg) == 0;
+}
+static inline void vm_thread_join(VmThread t) { pthread_join(t, NULL); }
+static inline void vm_thread_yield(void) { sched_yield(); }
+static inline void vm_thread_sleep_us(unsigned us)
+{
+    struct timespec ts = {0, (long)us * 1000};
+    nanosleep(&ts, NULL);
+}
+
+/* processors online, at least 1 */
+static inline int vm_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 1 ? (int)n : 1;
+}
+
+static inline void vm_mutex_init(VmMutex *m) { pthread_mutex_init(m, NULL); }
+static inline void vm_mutex_destroy(VmMutex *m) { pthread_mutex_destroy(m); }
+static inline void vm_mutex_lock(VmMutex *m) { pthread_mutex_lock(m); }
+static inline void vm_mutex_unlock(VmMutex *m) { pthread_mutex_unlock(m); }
+
+static inline void vm_cond_init(VmCond *c) { pthread_cond_init(c, NULL); }
+static inline void vm_cond_destroy(VmCond *c) { pthread_cond_destroy(c); }
+static inline void vm_cond_wait(VmCond *c, VmMutex *m) { pthread_cond_wait(c, m); }
+static inline void vm_cond_broadcast(VmCond *c) { pthread_cond_broadcast(c); }
+#endif
+
+#endif
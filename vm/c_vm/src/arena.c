@@ -0,0 +1,130 @@
+#include "../include/arena.h"
+#include <stdlib.h>
+
+/* chunk header; blocks start ARENA_ALIGN bytes in */
+struct ArenaChunk
+{
+    ArenaChunk *next;
+    size_t size;
+};
+
+#define ARENA_ALIGN 16
+
+static const size_t class_size[ARENA_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256};
+
+static size_t class_of(size_t size)
+{
+    if (size <= 64)
+        return size ? (size - 1) / 16 : 0;
+    if (size <= 96)
+        return 4;
+    if (size <= 128)
+        return 5;
+    return size <= 192 ? 6 : 7;
+}
+
+static void *default_alloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void default_free(void *ctx, void *p, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    free(p);
+}
+
+void arena_init(Arena *a, const VMAllocator *hook)
+{
+    if (hook && hook->alloc)
+    {
+        a->hook = *hook;
+    }
+    else
+    {
+        a->hook.alloc = default_alloc;
+        a->hook.free = default_free;
+        a->hook.ctx = NULL;
+    }
+    for (int i = 0; i < ARENA_CLASSES; ++i)
+        a->free_blocks[i] = NULL;
+    a->bump = NULL;
+    a->bump_end = NULL;
+    a->chunks = NULL;
+}
+
+void arena_destroy(Arena *a)
+{
+    ArenaChunk *c = a->chunks;
+    while (c)
+    {
+        ArenaChunk *next = c->next;
+        a->hook.free(a->hook.ctx, c, c->size);
+        c = next;
+    }
+    a->chunks = NULL;
+    a->bump = NULL;
+    a->bump_end = NULL;
+    for (int i = 0; i < ARENA_CLASSES; ++i)
+        a->free_blocks[i] = NULL;
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+    if (size > ARENA_MAX_BLOCK)
+        return a->hook.alloc(a->hook.ctx, size);
+    size_t k = class_of(size);
+    void *p = a->free_blocks[k];
+    if (p)
+    {
+        a->free_blocks[k] = *(void **)p;
+        return p;
+    }
+    if ((size_t)(a->bump_end - a->bump) < class_size[k])
+    {
+        /* the rest of the old chunk is dropped: at most ARENA_MAX_BLOCK bytes */
+        ArenaChunk *c = (ArenaChunk *)a->hook.alloc(a->hook.ctx, ARENA_CHUNK_SIZE);
+        if (!c)
+            return NULL;
+        c->next = a->chunks;
+        c->size = ARENA_CHUNK_SIZE;
+        a->chunks = c;
+        a->bump = (char *)c + ARENA_ALIGN;
+        a->bump_end = (char *)c + ARENA_CHUNK_SIZE;
+    }
+    p = a->bump;
+    a->bump += class_size[k];
+    return p;
+}
+
+void arena_free(Arena *a, void *p, size_t size)
+{
+    if (!p)
+        return;
+    if (size > ARENA_MAX_BLOCK)
+    {
+        a->hook.free(a->hook.ctx, p, size);
+        return;
+    }
+    size_t k = class_of(size);
+    *(void **)p = a->free_blocks[k];
+    a->free_blocks[k] = p;
+}
+
+size_t arena_block_size(size_t size)
+{
+    return size > ARENA_MAX_BLOCK ? size : class_size[class_of(size)];
+}
+
+void *arena_alloc_raw(Arena *a, size_t size)
+{
+    return a->hook.alloc(a->hook.ctx, size);
+}
+
+void arena_free_raw(Arena *a, void *p, size_t size)
+{
+    if (p)
+        a->hook.free(a->hook.ctx, p, size);
+}
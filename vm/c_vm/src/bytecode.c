@@ -4,12 +4,18 @@
 #include "../include/util.h"
 
 void bc_init(Bytecode *bc)
+{
+    bc_init_version(bc, BC_VERSION_1);
+}
+
+void bc_init_version(Bytecode *bc, int version)
 {
     bc->code = NULL;
     bc->code_size = 0;
     bc->consts = NULL;
     bc->consts_count = 0;
     bc->consts_cap = 0;
+    bc->version = version;
 }
 
 void bc_free(Bytecode *bc)
@@ -22,7 +28,7 @@ void bc_free(Bytecode *bc)
             free(bc->consts[i].value.s);
     }
     free(bc->consts);
-    bc_init(bc);
+    bc_init_version(bc, bc->version);
 }
 
 static void ensure_code(Bytecode *bc, size_t extra)
@@ -92,3 +98,310 @@ int bc_add_const_function(Bytecode *bc, int start, int nargs)
     bc->consts[bc->consts_count].value.func.nargs = nargs;
     return bc->consts_count++;
 }
+
+size_t bc_operand_size(const Bytecode *bc, OperandKind kind)
+{
+    if (bc->version != BC_VERSION_2)
+        return 4;
+    switch (kind)
+    {
+    case OPND_REG:
+    case OPND_COUNT:
+        return 1;
+    case OPND_CONST:
+    case OPND_NATIVE:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+int bc_op_operands(u8 op, OperandKind kinds[BC_MAX_OPERANDS])
+{
+    switch (op)
+    {
+    case OP_HALT:
+    case OP_POP_HANDLER:
+        return 0;
+    case OP_PRINT:
+    case OP_RET:
+    case OP_THROW:
+        kinds[0] = OPND_REG;
+        return 1;
+    case OP_JMP:
+    case OP_PUSH_HANDLER:
+        kinds[0] = OPND_JUMP;
+        return 1;
+    case OP_LOAD_CONST:
+    case OP_ALLOC_STR:
+        kinds[0] = OPND_REG;
+        kinds[1] = OPND_CONST;
+        return 2;
+    case OP_MOV:
+        kinds[0] = kinds[1] = OPND_REG;
+        return 2;
+    case OP_JZ:
+        kinds[0] = OPND_REG;
+        kinds[1] = OPND_JUMP;
+        return 2;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+        kinds[0] = kinds[1] = kinds[2] = OPND_REG;
+        return 3;
+    case OP_CALL:
+        kinds[0] = OPND_NATIVE;
+        kinds[1] = OPND_COUNT;
+        kinds[2] = OPND_REG;
+        return 3;
+    case OP_CALL_USER:
+        kinds[0] = OPND_CONST;
+        kinds[1] = OPND_COUNT;
+        kinds[2] = OPND_REG;
+        return 3;
+    case OP_MK_CLOSURE:
+        kinds[0] = OPND_REG;
+        kinds[1] = OPND_CONST;
+        kinds[2] = OPND_COUNT;
+        return 3;
+    case OP_CALL_CLOSURE:
+        kinds[0] = OPND_REG;
+        kinds[1] = OPND_COUNT;
+        kinds[2] = OPND_REG;
+        return 3;
+    case OP_ADD_IMM:
+        kinds[0] = kinds[1] = kinds[2] = OPND_REG;
+        kinds[3] = OPND_CONST;
+        return 4;
+    case OP_SUB_JZ:
+    case OP_SUB_JNZ:
+        kinds[0] = kinds[1] = kinds[2] = OPND_REG;
+        kinds[3] = OPND_JUMP;
+        return 4;
+    case OP_MOV_CALL_USER:
+        kinds[0] = kinds[1] = OPND_REG;
+        kinds[2] = OPND_CONST;
+        kinds[3] = OPND_COUNT;
+        kinds[4] = OPND_REG;
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+int32_t bc_read_operand(const Bytecode *bc, size_t *ip, OperandKind kind)
+{
+    const u8 *p = &bc->code[*ip];
+    size_t n = bc_operand_size(bc, kind);
+    *ip += n;
+    if (n == 1)
+        return p[0];
+    if (n == 2)
+        return (int32_t)(p[0] | (p[1] << 8));
+    int32_t v;
+    memcpy(&v, p, 4);
+    if (bc->version == BC_VERSION_2 && kind == OPND_JUMP)
+        v += (int32_t)*ip; /* relative to the end of the operand, i.e. the instruction */
+    return v;
+}
+
+static int operand_fits(const Bytecode *bc, OperandKind kind, int32_t v)
+{
+    size_t n = bc_operand_size(bc, kind);
+    if (n == 1)
+        return v >= 0 && v <= 0xFF;
+    if (n == 2)
+        return v >= 0 && v <= 0xFFFF;
+    return 1;
+}
+
+/* store v at pos; jumps in version 2 become relative to pos + 4 */
+static void store_operand(Bytecode *bc, size_t pos, OperandKind kind, int32_t v)
+{
+    size_t n = bc_operand_size(bc, kind);
+    if (n == 1)
+        bc->code[pos] = (u8)v;
+    else if (n == 2)
+    {
+        bc->code[pos] = (u8)(v & 0xFF);
+        bc->code[pos + 1] = (u8)((v >> 8) & 0xFF);
+    }
+    else
+    {
+        if (bc->version == BC_VERSION_2 && kind == OPND_JUMP)
+            v -= (int32_t)(pos + 4);
+        memcpy(&bc->code[pos], &v, 4);
+    }
+}
+
+long bc_emit_operand(Bytecode *bc, OperandKind kind, int32_t v)
+{
+    if (!operand_fits(bc, kind, v))
+        return -1;
+    size_t n = bc_operand_size(bc, kind);
+    size_t pos = bc->code_size;
+    ensure_code(bc, n);
+    bc->code_size += n;
+    store_operand(bc, pos, kind, v);
+    return (long)pos;
+}
+
+long bc_emit_reg(Bytecode *bc, int32_t r) { return bc_emit_operand(bc, OPND_REG, r); }
+long bc_emit_const_idx(Bytecode *bc, int32_t ci) { return bc_emit_operand(bc, OPND_CONST, ci); }
+long bc_emit_count(Bytecode *bc, int32_t n) { return bc_emit_operand(bc, OPND_COUNT, n); }
+long bc_emit_jump(Bytecode *bc, int32_t target) { return bc_emit_operand(bc, OPND_JUMP, target); }
+
+int bc_patch_operand(Bytecode *bc, size_t pos, OperandKind kind, int32_t v)
+{
+    if (!operand_fits(bc, kind, v) || pos + bc_operand_size(bc, kind) > bc->code_size)
+        return -1;
+    store_operand(bc, pos, kind, v);
+    return 0;
+}
+
+static int write_u32(FILE *f, uint32_t v)
+{
+    u8 b[4] = {(u8)v, (u8)(v >> 8), (u8)(v >> 16), (u8)(v >> 24)};
+    return fwrite(b, 1, 4, f) == 4;
+}
+
+static int write_u64(FILE *f, uint64_t v)
+{
+    return write_u32(f, (uint32_t)v) && write_u32(f, (uint32_t)(v >> 32));
+}
+
+static int read_u32(FILE *f, uint32_t *v)
+{
+    u8 b[4];
+    if (fread(b, 1, 4, f) != 4)
+        return 0;
+    *v = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    return 1;
+}
+
+static int read_u64(FILE *f, uint64_t *v)
+{
+    uint32_t lo, hi;
+    if (!read_u32(f, &lo) || !read_u32(f, &hi))
+        return 0;
+    *v = (uint64_t)lo | ((uint64_t)hi << 32);
+    return 1;
+}
+
+const char *bc_write(const Bytecode *bc, FILE *f)
+{
+    u8 version = (u8)bc->version;
+    int ok = fwrite("VMBC", 1, 4, f) == 4 && fwrite(&version, 1, 1, f) == 1 &&
+             write_u32(f, (uint32_t)bc->code_size) &&
+             fwrite(bc->code, 1, bc->code_size, f) == bc->code_size &&
+             write_u32(f, (uint32_t)bc->consts_count);
+    for (size_t i = 0; i < bc->consts_count && ok; ++i)
+    {
+        const Constant *c = &bc->consts[i];
+        u8 type = (u8)c->type;
+        ok = fwrite(&type, 1, 1, f) == 1;
+        if (!ok)
+            break;
+        switch (c->type)
+        {
+        case CONST_INT:
+            ok = write_u64(f, (uint64_t)c->value.i);
+            break;
+        case CONST_DOUBLE:
+        {
+            uint64_t bits;
+            memcpy(&bits, &c->value.d, sizeof(bits));
+            ok = write_u64(f, bits);
+            break;
+        }
+        case CONST_STRING:
+        {
+            size_t len = strlen(c->value.s);
+            ok = write_u32(f, (uint32_t)len) && fwrite(c->value.s, 1, len, f) == len;
+            break;
+        }
+        case CONST_FUNCTION:
+            ok = write_u32(f, (uint32_t)c->value.func.start) &&
+                 write_u32(f, (uint32_t)c->value.func.nargs);
+            break;
+        }
+    }
+    return ok ? NULL : "write failed";
+}
+
+const char *bc_read(Bytecode *bc, FILE *f)
+{
+    char magic[4];
+    u8 version;
+    uint32_t size, count;
+    bc_init(bc);
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "VMBC", 4) != 0)
+        return "not a bytecode file";
+    if (fread(&version, 1, 1, f) != 1 || (version != BC_VERSION_1 && version != BC_VERSION_2))
+        return "unknown bytecode version";
+    bc->version = version;
+    if (!read_u32(f, &size))
+        return "truncated bytecode file";
+    if (size)
+    {
+        ensure_code(bc, size);
+        if (!bc->code)
+            return "out of memory";
+        if (fread(bc->code, 1, size, f) != size)
+            return "truncated bytecode file";
+        bc->code_size = size;
+    }
+    if (!read_u32(f, &count))
+        return "truncated bytecode file";
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        u8 type;
+        uint64_t v;
+        uint32_t a, b;
+        if (fread(&type, 1, 1, f) != 1)
+            return "truncated bytecode file";
+        switch (type)
+        {
+        case CONST_INT:
+            if (!read_u64(f, &v))
+                return "truncated bytecode file";
+            bc_add_const_int(bc, (int64_t)v);
+            break;
+        case CONST_DOUBLE:
+        {
+            double d;
+            if (!read_u64(f, &v))
+                return "truncated bytecode file";
+            memcpy(&d, &v, sizeof(d));
+            bc_add_const_double(bc, d);
+            break;
+        }
+        case CONST_STRING:
+        {
+            if (!read_u32(f, &a))
+                return "truncated bytecode file";
+            char *s = (char *)malloc((size_t)a + 1);
+            if (!s)
+                return "out of memory";
+            if (fread(s, 1, a, f) != a)
+            {
+                free(s);
+                return "truncated bytecode file";
+            }
+            s[a] = '\0';
+            bc_add_const_string(bc, s);
+            free(s);
+            break;
+        }
+        case CONST_FUNCTION:
+            if (!read_u32(f, &a) || !read_u32(f, &b))
+                return "truncated bytecode file";
+            bc_add_const_function(bc, (int)(int32_t)a, (int)(int32_t)b);
+            break;
+        default:
+            return "unknown constant type";
+        }
+    }
+    return NULL;
+}
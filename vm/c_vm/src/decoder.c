@@ -0,0 +1,162 @@
+#include "../include/decoder.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* encoded length of the instruction at ip, or 0 if it is unknown or runs past
+   the end of the code. *ncaptures receives OP_MK_CLOSURE's capture count. */
+static size_t instr_length(const Bytecode *bc, size_t ip, int32_t *ncaptures, int *noperands)
+{
+    *ncaptures = 0;
+    OperandKind kinds[BC_MAX_OPERANDS];
+    int n = bc_op_operands(bc->code[ip], kinds);
+    *noperands = n;
+    if (n < 0)
+        return 0;
+    size_t len = 1;
+    for (int i = 0; i < n; ++i)
+        len += bc_operand_size(bc, kinds[i]);
+    if (ip + len > bc->code_size)
+        return 0;
+    if (bc->code[ip] == OP_MK_CLOSURE)
+    {
+        size_t p = ip + len - bc_operand_size(bc, OPND_COUNT);
+        int32_t nc = bc_read_operand(bc, &p, OPND_COUNT);
+        if (nc < 0)
+            return 0;
+        len += (size_t)nc * bc_operand_size(bc, OPND_REG);
+        if (ip + len > bc->code_size)
+            return 0;
+        *ncaptures = nc;
+    }
+    return len;
+}
+
+/* map a byte offset used as a jump target to an instruction index. Targets at or
+   past the end (or negative) fall off the program like the raw interpreter did;
+   targets inside an instruction go to the OP_BAD_JUMP sentinel. */
+static int32_t resolve_target(const int32_t *pc_at, size_t code_size, size_t count, int32_t loc)
+{
+    if (loc < 0 || (size_t)loc >= code_size)
+        return (int32_t)count;
+    if (pc_at[loc] < 0)
+        return (int32_t)count + 1;
+    return pc_at[loc];
+}
+
+void decoded_free(DecodedProgram *dp)
+{
+    free(dp->code);
+    free(dp->offsets);
+    free(dp->captures);
+    free(dp->func_pc);
+    memset(dp, 0, sizeof(*dp));
+}
+
+const char *decode_bytecode(const Bytecode *bc, DecodedProgram *out)
+{
+    memset(out, 0, sizeof(*out));
+    const u8 *code = bc->code;
+    size_t size = bc->code_size;
+
+    /* pass 1: find instruction boundaries */
+    int32_t *pc_at = (int32_t *)malloc((size + 1) * sizeof(int32_t));
+    if (!pc_at)
+        return "out of memory decoding bytecode";
+    for (size_t i = 0; i <= size; ++i)
+        pc_at[i] = -1;
+    size_t count = 0, ncaptures = 0, ip = 0;
+    while (ip < size)
+    {
+        int32_t nc;
+        int nops;
+        size_t len = instr_length(bc, ip, &nc, &nops);
+        if (len == 0)
+        {
+            free(pc_at);
+            return "malformed instruction in decoder";
+        }
+        if (code[ip] == OP_MK_CLOSURE)
+            ncaptures += 1 + (size_t)nc;
+        pc_at[ip] = (int32_t)count;
+        count += nops > 3 ? 2 : 1; /* operands 3 and 4 go to an OP_EXT slot */
+        ip += len;
+    }
+
+    /* pass 2: unpack operands and resolve jump targets */
+    out->code = (Instr *)calloc(count + 2, sizeof(Instr));
+    out->offsets = (uint32_t *)malloc((count + 2) * sizeof(uint32_t));
+    out->captures = ncaptures ? (int32_t *)malloc(ncaptures * sizeof(int32_t)) : NULL;
+    out->func_pc = bc->consts_count ? (int32_t *)malloc(bc->consts_count * sizeof(int32_t)) : NULL;
+    if (!out->code || !out->offsets || (ncaptures && !out->captures) || (bc->consts_count && !out->func_pc))
+    {
+        free(pc_at);
+        decoded_free(out);
+        return "out of memory decoding bytecode";
+    }
+    out->count = count;
+    out->func_count = bc->consts_count;
+
+    ip = 0;
+    for (size_t pc = 0; pc < count; ++pc)
+    {
+        Instr *in = &out->code[pc];
+        in->op = code[ip];
+        out->offsets[pc] = (uint32_t)ip;
+        OperandKind kinds[BC_MAX_OPERANDS];
+        int32_t ops[BC_MAX_OPERANDS] = {0};
+        int n = bc_op_operands(in->op, kinds);
+        size_t p = ip + 1;
+        for (int i = 0; i < n; ++i)
+        {
+            ops[i] = bc_read_operand(bc, &p, kinds[i]);
+            if (kinds[i] == OPND_JUMP)
+                ops[i] = resolve_target(pc_at, size, count, ops[i]);
+        }
+        in->a = ops[0];
+        in->b = ops[1];
+        in->c = ops[2];
+        if (in->op == OP_MK_CLOSURE)
+        {
+            int32_t nc = in->c;
+            in->c = (int32_t)out->captures_count;
+            out->captures[out->captures_count++] = nc;
+            for (int32_t i = 0; i < nc; ++i)
+                out->captures[out->captures_count++] = bc_read_operand(bc, &p, OPND_REG);
+        }
+        if (n > 3)
+        {
+            Instr *ext = &out->code[++pc];
+            ext->op = OP_EXT;
+            ext->a = ops[3];
+            ext->b = ops[4];
+            out->offsets[pc] = (uint32_t)ip;
+            if (in->op == OP_ADD_IMM)
+            {
+                /* the immediate itself replaces the constant index */
+                int32_t ci = ops[3];
+                if (ci < 0 || (size_t)ci >= bc->consts_count || bc->consts[ci].type != CONST_INT)
+                {
+                    free(pc_at);
+                    decoded_free(out);
+                    return "ADD_IMM constant is not an int";
+                }
+                instr_set_imm64(ext, bc->consts[ci].value.i);
+            }
+        }
+        ip = p;
+    }
+    out->code[count].op = OP_HALT;
+    out->offsets[count] = (uint32_t)size;
+    out->code[count + 1].op = OP_BAD_JUMP;
+    out->offsets[count + 1] = (uint32_t)size;
+
+    for (size_t i = 0; i < bc->consts_count; ++i)
+    {
+        const Constant *c = &bc->consts[i];
+        out->func_pc[i] = c->type == CONST_FUNCTION
+                              ? resolve_target(pc_at, size, count, c->value.func.start)
+                              : -1;
+    }
+    free(pc_at);
+    return NULL;
+}
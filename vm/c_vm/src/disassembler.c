@@ -4,19 +4,21 @@
 #include <inttypes.h>
 #include <string.h>
 
-static int32_t read_i32(const u8 *code, size_t size, size_t *ip)
+static int32_t read_opnd(const Bytecode *bc, size_t *ip, OperandKind kind)
 {
-    if (*ip + 4 > size)
+    if (*ip + bc_operand_size(bc, kind) > bc->code_size)
+    {
+        *ip = bc->code_size;
         return 0;
-    int32_t v;
-    memcpy(&v, &code[*ip], 4);
-    *ip += 4;
-    return v;
+    }
+    return bc_read_operand(bc, ip, kind);
 }
 
 void disassemble_bytecode(const Bytecode *bc, FILE *os)
 {
     size_t ip = 0;
+    if (bc->version == BC_VERSION_2)
+        fprintf(os, "; bytecode v2 (compact), %zu bytes\n", bc->code_size);
     while (ip < bc->code_size)
     {
         u8 op = bc->code[ip++];
@@ -28,15 +30,15 @@ void disassemble_bytecode(const Bytecode *bc, FILE *os)
             break;
         case OP_LOAD_CONST:
         {
-            int32_t r = read_i32(bc->code, bc->code_size, &ip);
-            int32_t ci = read_i32(bc->code, bc->code_size, &ip);
+            int32_t r = read_opnd(bc, &ip, OPND_REG);
+            int32_t ci = read_opnd(bc, &ip, OPND_CONST);
             fprintf(os, "OP_LOAD_CONST r%d const#%d\n", r, ci);
             break;
         }
         case OP_MOV:
         {
-            int32_t d = read_i32(bc->code, bc->code_size, &ip);
-            int32_t s = read_i32(bc->code, bc->code_size, &ip);
+            int32_t d = read_opnd(bc, &ip, OPND_REG);
+            int32_t s = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_MOV r%d r%d\n", d, s);
             break;
         }
@@ -48,96 +50,125 @@ void disassemble_bytecode(const Bytecode *bc, FILE *os)
             const char *name = op == OP_ADD ? "ADD" : op == OP_SUB ? "SUB"
                                                   : op == OP_MUL   ? "MUL"
                                                                    : "DIV";
-            int32_t dst = read_i32(bc->code, bc->code_size, &ip);
-            int32_t a = read_i32(bc->code, bc->code_size, &ip);
-            int32_t b = read_i32(bc->code, bc->code_size, &ip);
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
+            int32_t a = read_opnd(bc, &ip, OPND_REG);
+            int32_t b = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_%s r%d r%d r%d\n", name, dst, a, b);
             break;
         }
         case OP_PRINT:
         {
-            int32_t r = read_i32(bc->code, bc->code_size, &ip);
+            int32_t r = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_PRINT r%d\n", r);
             break;
         }
         case OP_JMP:
         {
-            int32_t rel = read_i32(bc->code, bc->code_size, &ip);
+            int32_t rel = read_opnd(bc, &ip, OPND_JUMP);
             fprintf(os, "OP_JMP %d\n", rel);
             break;
         }
         case OP_JZ:
         {
-            int32_t r = read_i32(bc->code, bc->code_size, &ip);
-            int32_t rel = read_i32(bc->code, bc->code_size, &ip);
+            int32_t r = read_opnd(bc, &ip, OPND_REG);
+            int32_t rel = read_opnd(bc, &ip, OPND_JUMP);
             fprintf(os, "OP_JZ r%d %d\n", r, rel);
             break;
         }
         case OP_ALLOC_STR:
         {
-            int32_t dst = read_i32(bc->code, bc->code_size, &ip);
-            int32_t ci = read_i32(bc->code, bc->code_size, &ip);
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
+            int32_t ci = read_opnd(bc, &ip, OPND_CONST);
             fprintf(os, "OP_ALLOC_STR r%d const#%d\n", dst, ci);
             break;
         }
         case OP_CALL:
         {
-            int32_t fi = read_i32(bc->code, bc->code_size, &ip);
-            int32_t nargs = read_i32(bc->code, bc->code_size, &ip);
-            int32_t dst = read_i32(bc->code, bc->code_size, &ip);
+            int32_t fi = read_opnd(bc, &ip, OPND_NATIVE);
+            int32_t nargs = read_opnd(bc, &ip, OPND_COUNT);
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_CALL f%d nargs=%d dst=r%d\n", fi, nargs, dst);
             break;
         }
         case OP_CALL_USER:
         {
-            int32_t ci = read_i32(bc->code, bc->code_size, &ip);
-            int32_t nargs2 = read_i32(bc->code, bc->code_size, &ip);
-            int32_t dst2 = read_i32(bc->code, bc->code_size, &ip);
+            int32_t ci = read_opnd(bc, &ip, OPND_CONST);
+            int32_t nargs2 = read_opnd(bc, &ip, OPND_COUNT);
+            int32_t dst2 = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_CALL_USER const#%d nargs=%d dst=r%d\n", ci, nargs2, dst2);
             break;
         }
         case OP_RET:
         {
-            int32_t r = read_i32(bc->code, bc->code_size, &ip);
+            int32_t r = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_RET r%d\n", r);
             break;
         }
         case OP_THROW:
         {
-            int32_t r = read_i32(bc->code, bc->code_size, &ip);
+            int32_t r = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_THROW r%d\n", r);
             break;
         }
         case OP_MK_CLOSURE:
         {
-            int32_t dst = read_i32(bc->code, bc->code_size, &ip);
-            int32_t ci = read_i32(bc->code, bc->code_size, &ip);
-            int32_t nc = read_i32(bc->code, bc->code_size, &ip);
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
+            int32_t ci = read_opnd(bc, &ip, OPND_CONST);
+            int32_t nc = read_opnd(bc, &ip, OPND_COUNT);
             fprintf(os, "OP_MK_CLOSURE r%d const#%d ncaptures=%d\n", dst, ci, nc);
             for (int i = 0; i < nc; ++i)
             {
-                int32_t r = read_i32(bc->code, bc->code_size, &ip);
+                int32_t r = read_opnd(bc, &ip, OPND_REG);
                 fprintf(os, "    capture r%d\n", r);
             }
             break;
         }
         case OP_CALL_CLOSURE:
         {
-            int32_t robj = read_i32(bc->code, bc->code_size, &ip);
-            int32_t nargs = read_i32(bc->code, bc->code_size, &ip);
-            int32_t dst = read_i32(bc->code, bc->code_size, &ip);
+            int32_t robj = read_opnd(bc, &ip, OPND_REG);
+            int32_t nargs = read_opnd(bc, &ip, OPND_COUNT);
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
             fprintf(os, "OP_CALL_CLOSURE robj=r%d nargs=%d dst=r%d\n", robj, nargs, dst);
             break;
         }
         case OP_PUSH_HANDLER:
         {
-            int32_t rel = read_i32(bc->code, bc->code_size, &ip);
+            int32_t rel = read_opnd(bc, &ip, OPND_JUMP);
             fprintf(os, "OP_PUSH_HANDLER %d\n", rel);
             break;
         }
         case OP_POP_HANDLER:
             fprintf(os, "OP_POP_HANDLER\n");
             break;
+        case OP_ADD_IMM:
+        {
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
+            int32_t src = read_opnd(bc, &ip, OPND_REG);
+            int32_t k = read_opnd(bc, &ip, OPND_REG);
+            int32_t ci = read_opnd(bc, &ip, OPND_CONST);
+            fprintf(os, "OP_ADD_IMM r%d r%d r%d=const#%d\n", dst, src, k, ci);
+            break;
+        }
+        case OP_SUB_JZ:
+        case OP_SUB_JNZ:
+        {
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
+            int32_t a = read_opnd(bc, &ip, OPND_REG);
+            int32_t b = read_opnd(bc, &ip, OPND_REG);
+            int32_t loc = read_opnd(bc, &ip, OPND_JUMP);
+            fprintf(os, "OP_SUB_%s r%d r%d r%d %d\n", op == OP_SUB_JZ ? "JZ" : "JNZ", dst, a, b, loc);
+            break;
+        }
+        case OP_MOV_CALL_USER:
+        {
+            int32_t d = read_opnd(bc, &ip, OPND_REG);
+            int32_t s = read_opnd(bc, &ip, OPND_REG);
+            int32_t ci = read_opnd(bc, &ip, OPND_CONST);
+            int32_t nargs = read_opnd(bc, &ip, OPND_COUNT);
+            int32_t dst = read_opnd(bc, &ip, OPND_REG);
+            fprintf(os, "OP_MOV_CALL_USER r%d r%d const#%d nargs=%d dst=r%d\n", d, s, ci, nargs, dst);
+            break;
+        }
         default:
             fprintf(os, "UNKNOWN OPCODE %u\n", op);
             break;
@@ -0,0 +1,125 @@
+#include "../include/gctrace.h"
+#include <stdlib.h>
+
+#define HISTOGRAM_BUCKETS 32
+#define HISTOGRAM_WIDTH 40
+
+static uint64_t duration(const VMGCEvent *e)
+{
+    return e->end_ns > e->start_ns ? e->end_ns - e->start_ns : 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* the smallest duration that at least pct percent of the pauses do not exceed */
+static uint64_t percentile(const uint64_t *sorted, size_t n, unsigned pct)
+{
+    size_t rank = (n * pct + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+void gc_pause_summary(const VMGCEvent *events, size_t n, GCPauseSummary *out)
+{
+    out->count = n;
+    out->p50_ns = out->p99_ns = out->max_ns = 0;
+    if (n == 0)
+        return;
+    uint64_t *d = (uint64_t *)malloc(n * sizeof(uint64_t));
+    if (!d)
+    {
+        out->count = 0;
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        d[i] = duration(&events[i]);
+    qsort(d, n, sizeof(uint64_t), compare_u64);
+    out->p50_ns = percentile(d, n, 50);
+    out->p99_ns = percentile(d, n, 99);
+    out->max_ns = d[n - 1];
+    free(d);
+}
+
+/* bucket 0: under 1 us; bucket b: [2^(b-1), 2^b) us; the last one is open */
+static int bucket_of(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while (us && b < HISTOGRAM_BUCKETS - 1)
+    {
+        us >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+void gc_pause_histogram(const VMGCEvent *events, size_t n, FILE *os)
+{
+    size_t counts[HISTOGRAM_BUCKETS] = {0};
+    size_t most = 0;
+    int first = HISTOGRAM_BUCKETS, last = -1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int b = bucket_of(duration(&events[i]));
+        if (++counts[b] > most)
+            most = counts[b];
+        if (b < first)
+            first = b;
+        if (b > last)
+            last = b;
+    }
+    for (int b = first; b <= last; ++b)
+    {
+        char range[48]; /* two 20-digit numbers at most */
+        if (b == 0)
+            snprintf(range, sizeof(range), "< 1 us");
+        else
+            snprintf(range, sizeof(range), "%llu-%llu us", 1ull << (b - 1), 1ull << b);
+        int bar = (int)(counts[b] * HISTOGRAM_WIDTH / most);
+        fprintf(os, "%16s |%-*.*s| %zu\n", range, HISTOGRAM_WIDTH, bar,
+                "########################################", counts[b]);
+    }
+    GCPauseSummary s;
+    gc_pause_summary(events, n, &s);
+    fprintf(os, "%zu pauses: p50 %.1f us, p99 %.1f us, max %.1f us\n", s.count, (double)s.p50_ns / 1e3,
+            (double)s.p99_ns / 1e3, (double)s.max_ns / 1e3);
+}
+
+static void write_name(unsigned phases, FILE *os)
+{
+    static const char *const names[] = {"minor", "mark", "sweep", "compact"};
+    int any = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (phases & (1u << i))
+        {
+            fprintf(os, "%s%s", any ? "+" : "", names[i]);
+            any = 1;
+        }
+    }
+    if (!any)
+        fputs("gc", os);
+}
+
+void gc_trace_write_json(const VMGCEvent *events, size_t n, FILE *os)
+{
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", os);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const VMGCEvent *e = &events[i];
+        fputs(i ? ",\n" : "\n", os);
+        fputs("{\"name\":\"", os);
+        write_name(e->phases, os);
+        fprintf(os,
+                "\",\"cat\":\"gc\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"cycle\":%llu,\"roots\":%zu,\"strings_marked\":%zu,\"objects_marked\":%zu,"
+                "\"strings_freed\":%zu,\"objects_freed\":%zu,\"string_free_list\":%zu,\"object_free_list\":%zu}}",
+                (double)e->start_ns / 1e3, (double)duration(e) / 1e3, (unsigned long long)e->cycle, e->roots,
+                e->strings_marked, e->objects_marked, e->strings_freed, e->objects_freed, e->string_free_list,
+                e->object_free_list);
+    }
+    fputs("\n]}\n", os);
+}
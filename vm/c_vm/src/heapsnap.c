@@ -0,0 +1,557 @@
+#include "../include/heapsnap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define UNDEFINED ((size_t)-2)
+/* table sizes beyond this are taken for a corrupt file */
+#define SNAPSHOT_MAX_SLOTS ((uint64_t)1 << 31)
+
+static int read_varint(FILE *in, uint64_t *out)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = fgetc(in);
+        if (c == EOF)
+            return 0;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            *out = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* reads a varint of at most max */
+static int read_count(FILE *in, uint64_t max, size_t *out)
+{
+    uint64_t v;
+    if (!read_varint(in, &v) || v > max)
+        return 0;
+    *out = (size_t)v;
+    return 1;
+}
+
+/* grows the array *p of *cap elements of size bytes to hold at least need,
+   zeroing the new ones; 0 if there is no memory for it. Arrays grow as
+   records are read rather than to the counts a file claims, so a corrupt
+   count cannot ask for more than the file holds. */
+static int reserve(void **p, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap)
+        return 1;
+    size_t newcap = *cap ? *cap : 16;
+    while (newcap < need)
+        newcap *= 2;
+    void *grown = realloc(*p, newcap * size);
+    if (!grown)
+        return 0;
+    memset((char *)grown + *cap * size, 0, (newcap - *cap) * size);
+    *p = grown;
+    *cap = newcap;
+    return 1;
+}
+
+static int push_edge(HeapSnapshot *hs, size_t *cap, size_t ref)
+{
+    if (!reserve((void **)&hs->edges, cap, hs->edge_count + 1, sizeof(size_t)))
+        return 0;
+    hs->edges[hs->edge_count++] = ref;
+    return 1;
+}
+
+/* the node of ref (see heapsnap.h), or 0 */
+static size_t resolve_ref(size_t ref, const size_t *str_node, size_t str_cap, const size_t *obj_node,
+                          size_t obj_cap)
+{
+    if (ref < 2)
+        return 0;
+    size_t idx = (ref - 2) / 2;
+    if (ref & 1)
+        return idx < obj_cap ? obj_node[idx] : 0;
+    return idx < str_cap ? str_node[idx] : 0;
+}
+
+const char *heap_snapshot_read(HeapSnapshot *hs, FILE *in)
+{
+    memset(hs, 0, sizeof(*hs));
+    char magic[4];
+    size_t version, str_slot_size, obj_slot_size, inline_fields, value_size, str_slots, obj_slots;
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, HEAP_SNAPSHOT_MAGIC, 4) != 0)
+        return "not a heap snapshot";
+    if (!read_count(in, HEAP_SNAPSHOT_VERSION, &version) || version != HEAP_SNAPSHOT_VERSION)
+        return "unsupported heap snapshot version";
+    if (!read_count(in, 1024, &str_slot_size) || !read_count(in, 1024, &obj_slot_size) ||
+        !read_count(in, 1024, &inline_fields) || !read_count(in, 1024, &value_size) ||
+        !read_count(in, SNAPSHOT_MAX_SLOTS, &str_slots) || !read_count(in, SNAPSHOT_MAX_SLOTS, &obj_slots))
+        return "truncated heap snapshot";
+
+    const char *truncated = "truncated heap snapshot", *no_memory = "out of memory reading heap snapshot";
+    const char *err = truncated;
+    size_t edge_cap = 0, node_cap = 0, function_cap = 0;
+    /* string and object slot -> node, 0 for none */
+    size_t *str_node = NULL, *obj_node = NULL;
+    size_t str_node_cap = 0, obj_node_cap = 0;
+
+    if (!read_count(in, SNAPSHOT_MAX_SLOTS, &hs->function_count))
+        goto fail;
+    for (size_t i = 0; i < hs->function_count; ++i)
+    {
+        size_t ci, start, nargs;
+        if (!read_count(in, INT32_MAX, &ci) || !read_count(in, INT32_MAX, &start) ||
+            !read_count(in, INT32_MAX, &nargs))
+            goto fail;
+        if (!reserve((void **)&hs->functions, &function_cap, i + 1, sizeof(HeapFunction)))
+        {
+            err = no_memory;
+            goto fail;
+        }
+        hs->functions[i].const_index = (int)ci;
+        hs->functions[i].start = (int)start;
+        hs->functions[i].nargs = (int)nargs;
+    }
+
+    /* node 0: the roots. Edges hold refs until every node is known. */
+    size_t nroots;
+    if (!read_count(in, SNAPSHOT_MAX_SLOTS, &nroots))
+        goto fail;
+    if (!reserve((void **)&hs->nodes, &node_cap, 1, sizeof(HeapNode)))
+    {
+        err = no_memory;
+        goto fail;
+    }
+    hs->node_count = 1;
+    hs->nodes[0].closure = -1;
+    hs->nodes[0].index = -1;
+    for (size_t i = 0; i < nroots; ++i)
+    {
+        uint64_t ref;
+        if (!read_varint(in, &ref))
+            goto fail;
+        if (!push_edge(hs, &edge_cap, (size_t)ref))
+        {
+            err = no_memory;
+            goto fail;
+        }
+    }
+    hs->nodes[0].edge_count = nroots;
+
+    if (!read_count(in, str_slots, &hs->string_count))
+        goto fail;
+    for (size_t i = 0; i < hs->string_count; ++i)
+    {
+        size_t idx, flags, len;
+        if (!read_count(in, str_slots - 1, &idx) || !read_count(in, 255, &flags) ||
+            !read_count(in, SNAPSHOT_MAX_SLOTS, &len))
+            goto fail;
+        if (!reserve((void **)&hs->nodes, &node_cap, hs->node_count + 1, sizeof(HeapNode)) ||
+            !reserve((void **)&str_node, &str_node_cap, idx + 1, sizeof(size_t)))
+        {
+            err = no_memory;
+            goto fail;
+        }
+        HeapNode *n = &hs->nodes[hs->node_count++];
+        memset(n, 0, sizeof(*n));
+        /* read in pieces, so a corrupt length runs out of file first */
+        size_t have = 0, chars_cap = 0;
+        do
+        {
+            size_t piece = len - have < 4096 ? len - have : 4096;
+            if (!reserve((void **)&n->chars, &chars_cap, have + piece + 1, 1))
+            {
+                err = no_memory;
+                goto fail;
+            }
+            if (fread(n->chars + have, 1, piece, in) != piece)
+                goto fail;
+            have += piece;
+        } while (have < len);
+        n->chars[len] = '\0';
+        n->index = (int)idx;
+        n->flags = (unsigned)flags;
+        n->closure = -1;
+        n->size = str_slot_size + len + 1;
+        n->first_edge = hs->edge_count;
+        str_node[idx] = hs->node_count - 1;
+        hs->string_bytes += n->size;
+    }
+
+    if (!read_count(in, obj_slots, &hs->object_count))
+        goto fail;
+    for (size_t i = 0; i < hs->object_count; ++i)
+    {
+        size_t idx, flags, field_count, closure, nedges;
+        if (!read_count(in, obj_slots - 1, &idx) || !read_count(in, 255, &flags) ||
+            !read_count(in, INT32_MAX, &field_count) || !read_count(in, INT32_MAX, &closure) ||
+            !read_count(in, field_count, &nedges))
+            goto fail;
+        if (!reserve((void **)&hs->nodes, &node_cap, hs->node_count + 1, sizeof(HeapNode)) ||
+            !reserve((void **)&obj_node, &obj_node_cap, idx + 1, sizeof(size_t)))
+        {
+            err = no_memory;
+            goto fail;
+        }
+        HeapNode *n = &hs->nodes[hs->node_count];
+        memset(n, 0, sizeof(*n));
+        n->is_object = 1;
+        n->index = (int)idx;
+        n->flags = (unsigned)flags;
+        n->field_count = (int)field_count;
+        n->closure = (int)closure - 1;
+        n->size = obj_slot_size + (field_count > inline_fields ? field_count * value_size : 0);
+        n->first_edge = hs->edge_count;
+        n->edge_count = nedges;
+        hs->node_count++;
+        obj_node[idx] = hs->node_count - 1;
+        hs->object_bytes += n->size;
+        for (size_t e = 0; e < nedges; ++e)
+        {
+            uint64_t field, ref;
+            if (!read_varint(in, &field) || !read_varint(in, &ref))
+                goto fail;
+            if (!push_edge(hs, &edge_cap, (size_t)ref))
+            {
+                err = no_memory;
+                goto fail;
+            }
+        }
+    }
+
+    err = "heap snapshot refers to a missing string or object";
+    for (size_t i = 0; i < hs->edge_count; ++i)
+    {
+        size_t node = resolve_ref(hs->edges[i], str_node, str_node_cap, obj_node, obj_node_cap);
+        if (!node)
+            goto fail;
+        hs->edges[i] = node;
+    }
+    free(str_node);
+    free(obj_node);
+    return NULL;
+
+fail:
+    free(str_node);
+    free(obj_node);
+    heap_snapshot_free(hs);
+    return err;
+}
+
+void heap_snapshot_free(HeapSnapshot *hs)
+{
+    for (size_t i = 0; i < hs->node_count; ++i)
+        free(hs->nodes[i].chars);
+    free(hs->nodes);
+    free(hs->edges);
+    free(hs->functions);
+    memset(hs, 0, sizeof(*hs));
+}
+
+/* the common dominator of a and b, walking up by postorder number */
+static size_t intersect(const HeapSnapshot *hs, const size_t *post, size_t a, size_t b)
+{
+    while (a != b)
+    {
+        while (post[a] < post[b])
+            a = hs->nodes[a].idom;
+        while (post[b] < post[a])
+            b = hs->nodes[b].idom;
+    }
+    return a;
+}
+
+const char *heap_snapshot_analyze(HeapSnapshot *hs)
+{
+    size_t n = hs->node_count;
+    if (!n)
+        return NULL;
+    size_t *post = (size_t *)malloc(n * sizeof(size_t));
+    size_t *rpo = (size_t *)malloc(n * sizeof(size_t));
+    size_t *stack = (size_t *)malloc(n * sizeof(size_t));
+    size_t *next_edge = (size_t *)malloc(n * sizeof(size_t));
+    size_t *pred_start = (size_t *)calloc(n + 1, sizeof(size_t));
+    size_t *preds = NULL;
+    const char *err = "out of memory analyzing heap snapshot";
+    if (!post || !rpo || !stack || !next_edge || !pred_start)
+        goto done;
+    for (size_t i = 0; i < n; ++i)
+    {
+        post[i] = UNDEFINED;
+        next_edge[i] = 0;
+        hs->nodes[i].idom = UNDEFINED;
+        hs->nodes[i].retained = hs->nodes[i].size;
+    }
+
+    /* depth-first from the root, without recursion: the heap can hold
+       chains far deeper than the C stack */
+    size_t depth = 0, count = 0;
+    stack[depth++] = HEAP_NODE_ROOT;
+    post[HEAP_NODE_ROOT] = 0; /* visited; numbered when it is left */
+    while (depth)
+    {
+        size_t v = stack[depth - 1];
+        const HeapNode *node = &hs->nodes[v];
+        if (next_edge[v] < node->edge_count)
+        {
+            size_t w = hs->edges[node->first_edge + next_edge[v]++];
+            if (post[w] == UNDEFINED)
+            {
+                post[w] = 0;
+                stack[depth++] = w;
+            }
+            continue;
+        }
+        post[v] = count++;
+        --depth;
+    }
+    /* rpo[i]: the node numbered count - 1 - i */
+    for (size_t v = 0; v < n; ++v)
+    {
+        if (post[v] != UNDEFINED)
+            rpo[count - 1 - post[v]] = v;
+    }
+
+    /* predecessors among the reachable nodes, by destination */
+    for (size_t v = 0; v < n; ++v)
+    {
+        if (post[v] == UNDEFINED)
+            continue;
+        for (size_t e = 0; e < hs->nodes[v].edge_count; ++e)
+            pred_start[hs->edges[hs->nodes[v].first_edge + e] + 1]++;
+    }
+    for (size_t v = 0; v < n; ++v)
+        pred_start[v + 1] += pred_start[v];
+    preds = (size_t *)malloc((pred_start[n] ? pred_start[n] : 1) * sizeof(size_t));
+    if (!preds)
+        goto done;
+    for (size_t v = 0; v < n; ++v)
+        next_edge[v] = pred_start[v];
+    for (size_t v = 0; v < n; ++v)
+    {
+        if (post[v] == UNDEFINED)
+            continue;
+        for (size_t e = 0; e < hs->nodes[v].edge_count; ++e)
+        {
+            size_t w = hs->edges[hs->nodes[v].first_edge + e];
+            preds[next_edge[w]++] = v;
+        }
+    }
+
+    hs->nodes[HEAP_NODE_ROOT].idom = HEAP_NODE_ROOT;
+    for (int changed = 1; changed;)
+    {
+        changed = 0;
+        for (size_t i = 1; i < count; ++i)
+        {
+            size_t v = rpo[i], idom = UNDEFINED;
+            for (size_t p = pred_start[v]; p < pred_start[v + 1]; ++p)
+            {
+                size_t u = preds[p];
+                if (hs->nodes[u].idom == UNDEFINED)
+                    continue;
+                idom = idom == UNDEFINED ? u : intersect(hs, post, u, idom);
+            }
+            if (hs->nodes[v].idom != idom)
+            {
+                hs->nodes[v].idom = idom;
+                changed = 1;
+            }
+        }
+    }
+
+    /* a node comes after its dominator in reverse postorder */
+    for (size_t i = count; i-- > 1;)
+        hs->nodes[hs->nodes[rpo[i]].idom].retained += hs->nodes[rpo[i]].retained;
+
+    hs->unreachable_count = 0;
+    hs->unreachable_bytes = 0;
+    for (size_t v = 0; v < n; ++v)
+    {
+        if (post[v] != UNDEFINED)
+            continue;
+        hs->nodes[v].idom = HEAP_NODE_UNREACHABLE;
+        hs->unreachable_count++;
+        hs->unreachable_bytes += hs->nodes[v].size;
+    }
+    err = NULL;
+
+done:
+    free(post);
+    free(rpo);
+    free(stack);
+    free(next_edge);
+    free(pred_start);
+    free(preds);
+    return err;
+}
+
+static int is_closure(const HeapSnapshot *hs, size_t v)
+{
+    return v != HEAP_NODE_ROOT && hs->nodes[v].closure >= 0;
+}
+
+static int compare_groups(const void *a, const void *b)
+{
+    const HeapClosureGroup *x = (const HeapClosureGroup *)a, *y = (const HeapClosureGroup *)b;
+    return x->retained < y->retained ? 1 : x->retained > y->retained ? -1 : x->const_index - y->const_index;
+}
+
+size_t heap_snapshot_closure_groups(const HeapSnapshot *hs, HeapClosureGroup *out, size_t max)
+{
+    size_t n = hs->node_count;
+    HeapClosureGroup *groups = (HeapClosureGroup *)calloc(hs->function_count ? hs->function_count : 1,
+                                                          sizeof(HeapClosureGroup));
+    /* above[v]: the nearest closure strictly dominating v, or the root */
+    size_t *above = (size_t *)malloc((n ? n : 1) * sizeof(size_t));
+    size_t *path = (size_t *)malloc((n ? n : 1) * sizeof(size_t));
+    if (!groups || !above || !path)
+    {
+        free(groups);
+        free(above);
+        free(path);
+        return HEAP_SNAPSHOT_NO_MEMORY;
+    }
+    for (size_t i = 0; i < hs->function_count; ++i)
+    {
+        groups[i].const_index = hs->functions[i].const_index;
+        groups[i].start = hs->functions[i].start;
+    }
+    for (size_t v = 0; v < n; ++v)
+        above[v] = UNDEFINED;
+    above[HEAP_NODE_ROOT] = HEAP_NODE_ROOT;
+    for (size_t v = 1; v < n; ++v)
+    {
+        if (hs->nodes[v].idom == HEAP_NODE_UNREACHABLE)
+            continue;
+        size_t len = 0, u = v;
+        while (above[u] == UNDEFINED)
+        {
+            path[len++] = u;
+            u = hs->nodes[u].idom;
+        }
+        /* u is known; fill in the path from the top down */
+        while (len)
+        {
+            size_t w = path[--len];
+            size_t d = hs->nodes[w].idom;
+            above[w] = is_closure(hs, d) ? d : above[d];
+        }
+    }
+
+    for (size_t v = 1; v < n; ++v)
+    {
+        const HeapNode *node = &hs->nodes[v];
+        if (node->closure < 0 || node->idom == HEAP_NODE_UNREACHABLE)
+            continue;
+        HeapClosureGroup *g = NULL;
+        for (size_t i = 0; i < hs->function_count && !g; ++i)
+        {
+            if (groups[i].const_index == node->closure)
+                g = &groups[i];
+        }
+        if (!g)
+            continue;
+        g->closures++;
+        g->shallow += node->size;
+        size_t a = above[v];
+        while (a != HEAP_NODE_ROOT && hs->nodes[a].closure != node->closure)
+            a = above[a];
+        if (a == HEAP_NODE_ROOT)
+            g->retained += node->retained;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < hs->function_count; ++i)
+    {
+        if (groups[i].closures)
+            groups[used++] = groups[i];
+    }
+    qsort(groups, used, sizeof(HeapClosureGroup), compare_groups);
+    for (size_t i = 0; i < used && i < max; ++i)
+        out[i] = groups[i];
+    free(groups);
+    free(above);
+    free(path);
+    return used;
+}
+
+typedef struct
+{
+    size_t retained;
+    size_t node;
+} Ranked;
+
+static int compare_ranked(const void *a, const void *b)
+{
+    const Ranked *x = (const Ranked *)a, *y = (const Ranked *)b;
+    if (x->retained != y->retained)
+        return x->retained < y->retained ? 1 : -1;
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+static void describe(const HeapSnapshot *hs, size_t v, FILE *os)
+{
+    const HeapNode *node = &hs->nodes[v];
+    if (!node->is_object)
+    {
+        fprintf(os, "string %d \"%.32s%s\"", node->index, node->chars, strlen(node->chars) > 32 ? "..." : "");
+        return;
+    }
+    fprintf(os, "object %d, %d fields", node->index, node->field_count);
+    if (node->closure >= 0)
+        fprintf(os, ", closure of const %d", node->closure);
+}
+
+const char *heap_snapshot_report(const HeapSnapshot *hs, FILE *os, size_t top)
+{
+    const char *no_memory = "out of memory reporting on heap snapshot";
+    fprintf(os, "%zu strings (%zu bytes), %zu objects (%zu bytes)\n", hs->string_count, hs->string_bytes,
+            hs->object_count, hs->object_bytes);
+    fprintf(os, "reachable: %zu bytes; unreachable: %zu strings and objects, %zu bytes\n",
+            hs->node_count ? hs->nodes[HEAP_NODE_ROOT].retained : 0, hs->unreachable_count,
+            hs->unreachable_bytes);
+
+    size_t ngroups = heap_snapshot_closure_groups(hs, NULL, 0);
+    if (ngroups == HEAP_SNAPSHOT_NO_MEMORY)
+        return no_memory;
+    if (ngroups)
+    {
+        HeapClosureGroup *groups = (HeapClosureGroup *)malloc(ngroups * sizeof(HeapClosureGroup));
+        if (!groups || heap_snapshot_closure_groups(hs, groups, ngroups) == HEAP_SNAPSHOT_NO_MEMORY)
+        {
+            free(groups);
+            return no_memory;
+        }
+        fprintf(os, "\nclosures by function:\n%10s %8s %10s %12s %12s\n", "const", "start", "closures", "shallow",
+                "retained");
+        for (size_t i = 0; i < ngroups; ++i)
+            fprintf(os, "%10d %8d %10zu %12zu %12zu\n", groups[i].const_index, groups[i].start, groups[i].closures,
+                    groups[i].shallow, groups[i].retained);
+        free(groups);
+    }
+
+    size_t nranked = 0;
+    Ranked *ranked = (Ranked *)malloc((hs->node_count ? hs->node_count : 1) * sizeof(Ranked));
+    if (!ranked)
+        return no_memory;
+    for (size_t v = 1; v < hs->node_count; ++v)
+    {
+        if (hs->nodes[v].idom == HEAP_NODE_UNREACHABLE)
+            continue;
+        ranked[nranked].retained = hs->nodes[v].retained;
+        ranked[nranked].node = v;
+        ++nranked;
+    }
+    qsort(ranked, nranked, sizeof(Ranked), compare_ranked);
+    if (nranked && top)
+        fprintf(os, "\nlargest retained sizes:\n%12s %12s  %s\n", "retained", "shallow", "what");
+    for (size_t i = 0; i < nranked && i < top; ++i)
+    {
+        fprintf(os, "%12zu %12zu  ", ranked[i].retained, hs->nodes[ranked[i].node].size);
+        describe(hs, ranked[i].node, os);
+        fputc('\n', os);
+    }
+    free(ranked);
+    return NULL;
+}
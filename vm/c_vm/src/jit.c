@@ -0,0 +1,659 @@
+#include "../include/jit.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if VM_JIT_AVAILABLE
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* functions with more instructions than this stay interpreted */
+#define JIT_MAX_REGION 4096
+
+typedef int32_t (*JitFn)(VM *vm, Value *regs, int32_t entry);
+
+struct Jit
+{
+    DecodedProgram *prog;
+    const Bytecode *bc;
+    uint32_t threshold;
+    JitFn *entry;    /* per instruction: compiled code that can be entered there */
+    uint32_t *calls; /* per instruction: calls to a function starting there */
+    void **blocks;   /* mmap'd code, one block per compiled function */
+    size_t *block_sizes;
+    int nblocks;
+};
+
+/* ---- code buffer ---- */
+
+typedef struct
+{
+    u8 *p;
+    size_t n, cap;
+} CodeBuf;
+
+typedef struct
+{
+    size_t at;  /* position of a rel32 */
+    int32_t pc; /* target instruction, or -1 for the epilogue */
+    int exit;   /* 1: always leave to the interpreter at pc */
+} Fixup;
+
+typedef struct
+{
+    CodeBuf code;
+    Fixup *fix;
+    size_t nfix, capfix;
+    long *label; /* per instruction: code offset, -1 if not compiled */
+    long *stub;  /* per instruction: offset of the stub returning it, -1 if none */
+    int oom;
+} Asm;
+
+static void put(Asm *as, const void *src, size_t n)
+{
+    CodeBuf *b = &as->code;
+    if (b->n + n > b->cap)
+    {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->n + n)
+            cap *= 2;
+        u8 *p = (u8 *)realloc(b->p, cap);
+        if (!p)
+        {
+            as->oom = 1;
+            return;
+        }
+        b->p = p;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->n, src, n);
+    b->n += n;
+}
+
+static void put8(Asm *as, u8 v) { put(as, &v, 1); }
+static void put32(Asm *as, int32_t v) { put(as, &v, 4); } /* x86 is little-endian */
+static void put64(Asm *as, uint64_t v) { put(as, &v, 8); }
+
+/* ---- x86-64 templates. rbx = register file, r12 = VM, rax/rcx scratch ---- */
+
+enum
+{
+    RAX = 0,
+    RCX = 1
+};
+
+static int32_t type_disp(int32_t r) { return r * (int32_t)sizeof(Value) + (int32_t)offsetof(Value, type); }
+static int32_t data_disp(int32_t r) { return r * (int32_t)sizeof(Value) + (int32_t)offsetof(Value, as); }
+
+/* ModRM for [rbx + disp32] with the given reg field */
+static void modrm_rbx(Asm *as, int reg, int32_t disp)
+{
+    put8(as, (u8)(0x80 | (reg << 3) | 3));
+    put32(as, disp);
+}
+
+/* mov reg, qword [rbx + disp] */
+static void emit_load(Asm *as, int reg, int32_t disp)
+{
+    put8(as, 0x48);
+    put8(as, 0x8B);
+    modrm_rbx(as, reg, disp);
+}
+
+/* mov qword [rbx + disp], reg */
+static void emit_store(Asm *as, int reg, int32_t disp)
+{
+    put8(as, 0x48);
+    put8(as, 0x89);
+    modrm_rbx(as, reg, disp);
+}
+
+/* mov dword [rbx + type(r)], type */
+static void emit_set_type(Asm *as, int32_t r, ValueType type)
+{
+    put8(as, 0xC7);
+    modrm_rbx(as, 0, type_disp(r));
+    put32(as, (int32_t)type);
+}
+
+/* cmp dword [rbx + type(r)], type */
+static void emit_cmp_type(Asm *as, int32_t r, ValueType type)
+{
+    put8(as, 0x83);
+    modrm_rbx(as, 7, type_disp(r));
+    put8(as, (u8)type);
+}
+
+/* cmp qword [rbx + data(r)], imm8 */
+static void emit_cmp_data(Asm *as, int32_t r, int8_t imm)
+{
+    put8(as, 0x48);
+    put8(as, 0x83);
+    modrm_rbx(as, 7, data_disp(r));
+    put8(as, (u8)imm);
+}
+
+/* mov reg, imm64 */
+static void emit_mov_imm64(Asm *as, int reg, uint64_t v)
+{
+    put8(as, 0x48);
+    put8(as, (u8)(0xB8 + reg));
+    put64(as, v);
+}
+
+/* regs[r] = int in rax */
+static void emit_store_int(Asm *as, int32_t r)
+{
+    emit_store(as, RAX, data_disp(r));
+    emit_set_type(as, r, V_INT);
+}
+
+static void add_fixup(Asm *as, int32_t pc, int exit)
+{
+    if (as->nfix == as->capfix)
+    {
+        size_t cap = as->capfix ? as->capfix * 2 : 64;
+        Fixup *f = (Fixup *)realloc(as->fix, cap * sizeof(Fixup));
+        if (!f)
+        {
+            as->oom = 1;
+            return;
+        }
+        as->fix = f;
+        as->capfix = cap;
+    }
+    as->fix[as->nfix].at = as->code.n;
+    as->fix[as->nfix].pc = pc;
+    as->fix[as->nfix].exit = exit;
+    as->nfix++;
+    put32(as, 0);
+}
+
+#define CC_NONE 0 /* unconditional */
+#define CC_E 0x84
+#define CC_NE 0x85
+
+/* jump (cc = CC_NONE) or branch to instruction pc: to its compiled code if it
+   is part of this function, otherwise out to the interpreter at pc */
+static void emit_goto(Asm *as, u8 cc, int32_t pc)
+{
+    if (cc == CC_NONE)
+        put8(as, 0xE9);
+    else
+    {
+        put8(as, 0x0F);
+        put8(as, cc);
+    }
+    add_fixup(as, pc, 0);
+}
+
+/* branch out to the interpreter, which re-executes instruction pc */
+static void emit_exit(Asm *as, u8 cc, int32_t pc)
+{
+    if (cc == CC_NONE)
+        put8(as, 0xE9);
+    else
+    {
+        put8(as, 0x0F);
+        put8(as, cc);
+    }
+    add_fixup(as, pc, 1);
+}
+
+/* guard that regs[r] holds an int, leaving at pc otherwise */
+static void emit_guard_int(Asm *as, int32_t r, int32_t pc)
+{
+    emit_cmp_type(as, r, V_INT);
+    emit_exit(as, CC_NE, pc);
+}
+
+/* rax = regs[a] <op> regs[b] for ints (op: 0x03 add, 0x2B sub, 0xAF imul) */
+static void emit_int_binop(Asm *as, int32_t pc, const Instr *in, u8 op)
+{
+    emit_guard_int(as, in->b, pc);
+    emit_guard_int(as, in->c, pc);
+    emit_load(as, RAX, data_disp(in->b));
+    put8(as, 0x48);
+    if (op == 0xAF)
+        put8(as, 0x0F);
+    put8(as, op);
+    modrm_rbx(as, RAX, data_disp(in->c));
+}
+
+/* vm_jit_exec(vm, pc), leaving at pc if it asks the interpreter to take over */
+static void emit_runtime_call(Asm *as, int32_t pc)
+{
+    static const u8 mov_rdi_r12[] = {0x4C, 0x89, 0xE7};
+    static const u8 call_rax_test_eax[] = {0xFF, 0xD0, 0x85, 0xC0};
+    int (*helper)(VM *, int32_t) = vm_jit_exec;
+    uint64_t addr;
+    memcpy(&addr, &helper, sizeof(addr));
+    put(as, mov_rdi_r12, sizeof(mov_rdi_r12));
+    put8(as, 0xBE); /* mov esi, pc */
+    put32(as, pc);
+    emit_mov_imm64(as, RAX, addr);
+    put(as, call_rax_test_eax, sizeof(call_rax_test_eax));
+    emit_exit(as, CC_NE, pc);
+}
+
+/* ---- region discovery ---- */
+
+static int has_ext(const Instr *in) { return in[1].op == OP_EXT; }
+
+static int is_call_op(u8 op) { return op == OP_CALL_USER || op == OP_MOV_CALL_USER || op == OP_CALL_CLOSURE; }
+
+/* successors of the instruction at pc inside a function body; returns count */
+static int successors(const Instr *code, int32_t pc, int32_t out[2])
+{
+    const Instr *in = &code[pc];
+    int32_t next = pc + (has_ext(in) ? 2 : 1);
+    switch (in->op)
+    {
+    case OP_JMP:
+        out[0] = in->a;
+        return 1;
+    case OP_JZ:
+    case OP_JZ_I:
+        out[0] = next;
+        out[1] = in->b;
+        return 2;
+    case OP_SUB_JZ:
+    case OP_SUB_JNZ:
+        out[0] = next;
+        out[1] = in[1].a;
+        return 2;
+    case OP_PUSH_HANDLER:
+        out[0] = next;
+        out[1] = in->a;
+        return 2;
+    case OP_RET:
+    case OP_THROW:
+    case OP_HALT:
+    case OP_BAD_JUMP:
+        return 0;
+    default:
+        out[0] = next;
+        return 1;
+    }
+}
+
+/* marks in[] every instruction reachable from start without leaving the
+   function; returns the number marked or -1 if the body is too large */
+static int find_region(const DecodedProgram *prog, int32_t start, u8 *in_region)
+{
+    int32_t *work = (int32_t *)malloc((JIT_MAX_REGION + 1) * sizeof(int32_t));
+    if (!work)
+        return -1;
+    int n = 0, top = 0;
+    work[top++] = start;
+    in_region[start] = 1;
+    ++n;
+    while (top > 0)
+    {
+        int32_t succ[2];
+        int ns = successors(prog->code, work[--top], succ);
+        for (int i = 0; i < ns; ++i)
+        {
+            int32_t s = succ[i];
+            if (s < 0 || (size_t)s >= prog->count || in_region[s])
+                continue;
+            if (n == JIT_MAX_REGION)
+            {
+                free(work);
+                return -1;
+            }
+            in_region[s] = 1;
+            ++n;
+            work[top++] = s;
+        }
+    }
+    free(work);
+    return n;
+}
+
+/* marks the places the interpreter may enter the function: its start, the
+   return point of every call in it, and every exception handler it pushes */
+static void find_entries(const DecodedProgram *prog, const u8 *in_region, int32_t start, u8 *entry)
+{
+    entry[start] = 1;
+    for (int32_t pc = 0; (size_t)pc < prog->count; ++pc)
+    {
+        if (!in_region[pc])
+            continue;
+        const Instr *in = &prog->code[pc];
+        if (is_call_op(in->op))
+        {
+            int32_t next = pc + (has_ext(in) ? 2 : 1);
+            if ((size_t)next < prog->count && in_region[next])
+                entry[next] = 1;
+        }
+        else if (in->op == OP_PUSH_HANDLER && in->a >= 0 && (size_t)in->a < prog->count && in_region[in->a])
+            entry[in->a] = 1;
+    }
+}
+
+/* ---- compilation ---- */
+
+/* emits the template for the instruction at pc; returns 1 if control can
+   fall through to the next instruction */
+static int emit_instr(Asm *as, const Jit *jit, int32_t pc)
+{
+    const Instr *in = &jit->prog->code[pc];
+    switch (in->op)
+    {
+    case OP_MOV:
+        emit_load(as, RAX, type_disp(in->b));
+        emit_load(as, RCX, data_disp(in->b));
+        emit_store(as, RAX, type_disp(in->a));
+        emit_store(as, RCX, data_disp(in->a));
+        return 1;
+    case OP_LOAD_CONST:
+    {
+        const Constant *c = &jit->bc->consts[in->b];
+        if (c->type == CONST_INT || c->type == CONST_DOUBLE)
+        {
+            uint64_t bits;
+            memcpy(&bits, &c->value, sizeof(bits));
+            emit_mov_imm64(as, RAX, bits);
+            emit_store(as, RAX, data_disp(in->a));
+            emit_set_type(as, in->a, c->type == CONST_INT ? V_INT : V_DOUBLE);
+        }
+        else
+            emit_runtime_call(as, pc);
+        return 1;
+    }
+    case OP_LOAD_CONST_INT:
+    case OP_LOAD_CONST_DOUBLE:
+        emit_mov_imm64(as, RAX, (uint64_t)instr_imm64(in));
+        emit_store(as, RAX, data_disp(in->a));
+        emit_set_type(as, in->a, in->op == OP_LOAD_CONST_INT ? V_INT : V_DOUBLE);
+        return 1;
+    case OP_LOAD_CONST_STR:
+        emit_mov_imm64(as, RAX, (uint32_t)in->b);
+        emit_store(as, RAX, data_disp(in->a));
+        emit_set_type(as, in->a, V_STRING);
+        return 1;
+    case OP_ADD:
+    case OP_ADD_II:
+        emit_int_binop(as, pc, in, 0x03);
+        emit_store_int(as, in->a);
+        return 1;
+    case OP_SUB:
+    case OP_SUB_II:
+        emit_int_binop(as, pc, in, 0x2B);
+        emit_store_int(as, in->a);
+        return 1;
+    case OP_MUL:
+    case OP_MUL_II:
+        emit_int_binop(as, pc, in, 0xAF);
+        emit_store_int(as, in->a);
+        return 1;
+    case OP_DIV:
+    case OP_DIV_II:
+    {
+        /* zero (reported) and -1 (INT64_MIN / -1 traps) divisors go to the interpreter */
+        static const u8 cqo[] = {0x48, 0x99};
+        emit_guard_int(as, in->b, pc);
+        emit_guard_int(as, in->c, pc);
+        emit_cmp_data(as, in->c, 0);
+        emit_exit(as, CC_E, pc);
+        emit_cmp_data(as, in->c, -1);
+        emit_exit(as, CC_E, pc);
+        emit_load(as, RAX, data_disp(in->b));
+        put(as, cqo, sizeof(cqo));
+        put8(as, 0x48); /* idiv qword [rbx + data(c)] */
+        put8(as, 0xF7);
+        modrm_rbx(as, 7, data_disp(in->c));
+        emit_store_int(as, in->a);
+        return 1;
+    }
+    case OP_ADD_IMM:
+    {
+        /* same order as the interpreter: rk is written before the guard */
+        static const u8 add_rax_rcx[] = {0x48, 0x01, 0xC8};
+        int64_t imm = instr_imm64(&in[1]);
+        emit_mov_imm64(as, RCX, (uint64_t)imm);
+        emit_store(as, RCX, data_disp(in->c));
+        emit_set_type(as, in->c, V_INT);
+        emit_guard_int(as, in->b, pc);
+        emit_load(as, RAX, data_disp(in->b));
+        put(as, add_rax_rcx, sizeof(add_rax_rcx));
+        emit_store_int(as, in->a);
+        return 1;
+    }
+    case OP_SUB_JZ:
+    case OP_SUB_JNZ:
+    {
+        static const u8 test_rax[] = {0x48, 0x85, 0xC0};
+        emit_int_binop(as, pc, in, 0x2B);
+        emit_store_int(as, in->a);
+        put(as, test_rax, sizeof(test_rax));
+        emit_goto(as, in->op == OP_SUB_JZ ? CC_E : CC_NE, in[1].a);
+        return 1;
+    }
+    case OP_JMP:
+        emit_goto(as, CC_NONE, in->a);
+        return 0;
+    case OP_JZ:
+    case OP_JZ_I:
+        /* not an int: never jumps */
+        emit_cmp_type(as, in->a, V_INT);
+        emit_goto(as, CC_NE, pc + 1);
+        emit_cmp_data(as, in->a, 0);
+        emit_goto(as, CC_E, in->b);
+        return 1;
+    case OP_PRINT:
+    case OP_ALLOC_STR:
+    case OP_CALL:
+    case OP_MK_CLOSURE:
+    case OP_PUSH_HANDLER:
+    case OP_POP_HANDLER:
+        emit_runtime_call(as, pc);
+        return 1;
+    default:
+        /* calls, RET, THROW, HALT: frames and handlers belong to the interpreter */
+        emit_exit(as, CC_NONE, pc);
+        return 0;
+    }
+}
+
+static long stub_for(Asm *as, int32_t pc, size_t epilogue)
+{
+    if (as->stub[pc] >= 0)
+        return as->stub[pc];
+    long at = (long)as->code.n;
+    put8(as, 0xB8); /* mov eax, pc */
+    put32(as, pc);
+    put8(as, 0xE9); /* jmp epilogue */
+    put32(as, (int32_t)((long)epilogue - (long)(as->code.n + 4)));
+    as->stub[pc] = at;
+    return at;
+}
+
+static JitFn jit_compile(Jit *jit, int32_t start)
+{
+    const DecodedProgram *prog = jit->prog;
+    size_t slots = prog->count + 2;
+    u8 *in_region = (u8 *)calloc(slots, 1);
+    u8 *entry = (u8 *)calloc(slots, 1);
+    Asm as;
+    memset(&as, 0, sizeof(as));
+    as.label = (long *)malloc(slots * sizeof(long));
+    as.stub = (long *)malloc(slots * sizeof(long));
+    JitFn fn = NULL;
+    if (!in_region || !entry || !as.label || !as.stub || find_region(prog, start, in_region) < 0)
+        goto done;
+    find_entries(prog, in_region, start, entry);
+    for (size_t i = 0; i < slots; ++i)
+        as.label[i] = as.stub[i] = -1;
+
+    /* prologue: r13 is saved only to keep the stack 16-byte aligned for calls */
+    static const u8 prologue[] = {0x53, 0x41, 0x54, 0x41, 0x55, /* push rbx; push r12; push r13 */
+                                  0x49, 0x89, 0xFC,             /* mov r12, rdi (vm) */
+                                  0x48, 0x89, 0xF3};            /* mov rbx, rsi (regs) */
+    put(&as, prologue, sizeof(prologue));
+    for (int32_t pc = 0; (size_t)pc < prog->count; ++pc)
+    {
+        if (!entry[pc])
+            continue;
+        put8(&as, 0x81); /* cmp edx, pc */
+        put8(&as, 0xFA);
+        put32(&as, pc);
+        emit_goto(&as, CC_E, pc);
+    }
+    static const u8 unknown_entry[] = {0x89, 0xD0}; /* mov eax, edx */
+    put(&as, unknown_entry, sizeof(unknown_entry));
+    put8(&as, 0xE9);
+    add_fixup(&as, -1, 1);
+
+    /* body, in code order so most fall-throughs need no jump */
+    for (int32_t pc = 0; (size_t)pc < prog->count; ++pc)
+    {
+        if (!in_region[pc])
+            continue;
+        as.label[pc] = (long)as.code.n;
+        int32_t next = pc + (has_ext(&prog->code[pc]) ? 2 : 1);
+        if (emit_instr(&as, jit, pc) && !((size_t)next < prog->count && in_region[next]))
+            emit_goto(&as, CC_NONE, next);
+    }
+
+    static const u8 epilogue[] = {0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}; /* pop r13; pop r12; pop rbx; ret */
+    size_t epilogue_at = as.code.n;
+    put(&as, epilogue, sizeof(epilogue));
+
+    /* resolve jumps; targets outside the function get a stub returning them */
+    size_t nfix = as.nfix;
+    for (size_t i = 0; i < nfix && !as.oom; ++i)
+    {
+        Fixup f = as.fix[i];
+        long target;
+        if (f.pc < 0)
+            target = (long)epilogue_at;
+        else if (!f.exit && as.label[f.pc] >= 0)
+            target = as.label[f.pc];
+        else
+            target = stub_for(&as, f.pc, epilogue_at);
+        if (as.oom)
+            break;
+        int32_t rel = (int32_t)(target - (long)(f.at + 4));
+        memcpy(as.code.p + f.at, &rel, 4);
+    }
+    if (as.oom)
+        goto done;
+
+    /* copy into fresh pages, then make them executable and read-only */
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (as.code.n + (size_t)page - 1) & ~((size_t)page - 1);
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        goto done;
+    memcpy(mem, as.code.p, as.code.n);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, size);
+        goto done;
+    }
+    void **blocks = (void **)realloc(jit->blocks, (jit->nblocks + 1) * sizeof(void *));
+    size_t *sizes = blocks ? (size_t *)realloc(jit->block_sizes, (jit->nblocks + 1) * sizeof(size_t)) : NULL;
+    if (blocks)
+        jit->blocks = blocks;
+    if (!sizes)
+    {
+        munmap(mem, size);
+        goto done;
+    }
+    jit->block_sizes = sizes;
+    jit->blocks[jit->nblocks] = mem;
+    jit->block_sizes[jit->nblocks] = size;
+    jit->nblocks++;
+
+    memcpy(&fn, &mem, sizeof(fn));
+    for (int32_t pc = 0; (size_t)pc < prog->count; ++pc)
+    {
+        if (entry[pc] && !jit->entry[pc])
+            jit->entry[pc] = fn;
+    }
+    jit->entry[start] = fn;
+done:
+    free(in_region);
+    free(entry);
+    free(as.label);
+    free(as.stub);
+    free(as.fix);
+    free(as.code.p);
+    return fn;
+}
+
+Jit *jit_create(DecodedProgram *prog, const Bytecode *bc, int threshold)
+{
+    if (threshold <= 0)
+        return NULL;
+    Jit *jit = (Jit *)calloc(1, sizeof(Jit));
+    if (!jit)
+        return NULL;
+    jit->prog = prog;
+    jit->bc = bc;
+    jit->threshold = (uint32_t)threshold;
+    jit->entry = (JitFn *)calloc(prog->count + 2, sizeof(JitFn));
+    jit->calls = (uint32_t *)calloc(prog->count + 2, sizeof(uint32_t));
+    if (!jit->entry || !jit->calls)
+    {
+        jit_free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_free(Jit *jit)
+{
+    if (!jit)
+        return;
+    for (int i = 0; i < jit->nblocks; ++i)
+        munmap(jit->blocks[i], jit->block_sizes[i]);
+    free(jit->blocks);
+    free(jit->block_sizes);
+    free(jit->entry);
+    free(jit->calls);
+    free(jit);
+}
+
+size_t jit_enter(Jit *jit, VM *vm, Value *regs, size_t pc, int is_call)
+{
+    JitFn fn = jit->entry[pc];
+    /* compile once, when the counter reaches the threshold; a function that
+       fails to compile keeps its counter there and is never retried */
+    if (!fn && is_call && jit->calls[pc] < jit->threshold && ++jit->calls[pc] == jit->threshold)
+        fn = jit_compile(jit, (int32_t)pc);
+    return fn ? (size_t)fn(vm, regs, (int32_t)pc) : pc;
+}
+
+int jit_compiled_count(const Jit *jit) { return jit ? jit->nblocks : 0; }
+
+#else
+
+Jit *jit_create(DecodedProgram *prog, const Bytecode *bc, int threshold)
+{
+    (void)prog;
+    (void)bc;
+    (void)threshold;
+    return NULL;
+}
+
+void jit_free(Jit *jit) { (void)jit; }
+
+size_t jit_enter(Jit *jit, VM *vm, Value *regs, size_t pc, int is_call)
+{
+    (void)jit;
+    (void)vm;
+    (void)regs;
+    (void)is_call;
+    return pc;
+}
+
+int jit_compiled_count(const Jit *jit)
+{
+    (void)jit;
+    return 0;
+}
+
+#endif
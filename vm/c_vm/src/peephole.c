@@ -0,0 +1,201 @@
+#include "../include/peephole.h"
+#include "../include/verifier.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    size_t offset;
+    u8 op;
+    int n;                          /* fixed operand count */
+    OperandKind kinds[BC_MAX_OPERANDS];
+    int32_t ops[BC_MAX_OPERANDS];   /* jump operands as absolute byte offsets */
+    size_t capture_start;           /* OP_MK_CLOSURE: first capture register in the pool */
+    int is_target;                  /* a jump, handler or function start lands here */
+    int removed;                    /* folded into the preceding superinstruction */
+} PInstr;
+
+typedef struct
+{
+    size_t pos;     /* operand position in the new code */
+    int32_t target; /* old byte offset */
+} JumpFixup;
+
+/* new byte offset for an old jump target; targets outside the code keep falling off the end */
+static int32_t map_target(const int32_t *pc_at, const size_t *new_off, size_t old_size,
+                          size_t new_size, int32_t t)
+{
+    if (t < 0 || (size_t)t >= old_size)
+        return (int32_t)new_size;
+    return (int32_t)new_off[pc_at[t]];
+}
+
+int peephole_optimize(Bytecode *bc)
+{
+    if (verify_bytecode(bc))
+        return -1;
+    size_t size = bc->code_size;
+
+    /* parse */
+    PInstr *ins = (PInstr *)calloc(size ? size : 1, sizeof(PInstr));
+    int32_t *captures = (int32_t *)malloc((size ? size : 1) * sizeof(int32_t));
+    int32_t *pc_at = (int32_t *)malloc((size + 1) * sizeof(int32_t));
+    size_t *new_off = NULL;
+    JumpFixup *fixups = NULL;
+    Bytecode out;
+    bc_init_version(&out, bc->version);
+    int fused = -1;
+    if (!ins || !captures || !pc_at)
+        goto done;
+    for (size_t i = 0; i <= size; ++i)
+        pc_at[i] = -1;
+
+    size_t n = 0, ncaptures = 0, njumps = 0, ip = 0;
+    while (ip < size)
+    {
+        PInstr *pi = &ins[n];
+        pi->offset = ip;
+        pi->op = bc->code[ip++];
+        pi->n = bc_op_operands(pi->op, pi->kinds);
+        for (int k = 0; k < pi->n; ++k)
+        {
+            pi->ops[k] = bc_read_operand(bc, &ip, pi->kinds[k]);
+            if (pi->kinds[k] == OPND_JUMP)
+                ++njumps;
+        }
+        if (pi->op == OP_MK_CLOSURE)
+        {
+            pi->capture_start = ncaptures;
+            for (int32_t k = 0; k < pi->ops[2]; ++k)
+                captures[ncaptures++] = bc_read_operand(bc, &ip, OPND_REG);
+        }
+        pc_at[pi->offset] = (int32_t)n++;
+    }
+
+    /* mark everything control can enter other than by falling through */
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (int k = 0; k < ins[i].n; ++k)
+        {
+            int32_t t = ins[i].ops[k];
+            if (ins[i].kinds[k] != OPND_JUMP || t < 0 || (size_t)t >= size)
+                continue;
+            if (pc_at[t] < 0)
+                goto done; /* jump into an instruction: leave the code alone */
+            ins[pc_at[t]].is_target = 1;
+        }
+    }
+    for (size_t c = 0; c < bc->consts_count; ++c)
+    {
+        int32_t t = bc->consts[c].value.func.start;
+        if (bc->consts[c].type != CONST_FUNCTION || t < 0 || (size_t)t >= size)
+            continue;
+        if (pc_at[t] < 0)
+            goto done;
+        ins[pc_at[t]].is_target = 1;
+    }
+
+    /* fuse */
+    fused = 0;
+    for (size_t i = 0; i + 1 < n; ++i)
+    {
+        PInstr *a = &ins[i], *b = &ins[i + 1];
+        if (b->is_target)
+            continue;
+        if (a->op == OP_LOAD_CONST && b->op == OP_ADD &&
+            a->ops[1] >= 0 && (size_t)a->ops[1] < bc->consts_count &&
+            bc->consts[a->ops[1]].type == CONST_INT &&
+            (b->ops[1] == a->ops[0] || b->ops[2] == a->ops[0]))
+        {
+            int32_t k = a->ops[0], ci = a->ops[1];
+            int32_t src = b->ops[2] == k ? b->ops[1] : b->ops[2];
+            a->op = OP_ADD_IMM;
+            a->n = bc_op_operands(OP_ADD_IMM, a->kinds);
+            a->ops[0] = b->ops[0];
+            a->ops[1] = src;
+            a->ops[2] = k;
+            a->ops[3] = ci;
+            b->removed = 1;
+        }
+        else if (a->op == OP_SUB && b->op == OP_JZ && b->ops[0] == a->ops[0])
+        {
+            PInstr *c = i + 2 < n ? &ins[i + 2] : NULL;
+            size_t after_c = i + 3 < n ? ins[i + 3].offset : size;
+            int loop_exit = c && c->op == OP_JMP && !c->is_target && (size_t)b->ops[1] == after_c;
+            a->op = loop_exit ? OP_SUB_JNZ : OP_SUB_JZ;
+            a->n = bc_op_operands(a->op, a->kinds);
+            a->ops[3] = loop_exit ? c->ops[0] : b->ops[1];
+            b->removed = 1;
+            if (loop_exit)
+                c->removed = 1;
+        }
+        else if (a->op == OP_MOV && b->op == OP_CALL_USER)
+        {
+            a->op = OP_MOV_CALL_USER;
+            a->n = bc_op_operands(OP_MOV_CALL_USER, a->kinds);
+            a->ops[2] = b->ops[0];
+            a->ops[3] = b->ops[1];
+            a->ops[4] = b->ops[2];
+            b->removed = 1;
+        }
+        else
+            continue;
+        ++fused;
+        while (i + 1 < n && ins[i + 1].removed)
+            ++i;
+    }
+
+    /* re-emit, recording where every old instruction went */
+    new_off = (size_t *)malloc((n + 1) * sizeof(size_t));
+    fixups = (JumpFixup *)malloc((njumps ? njumps : 1) * sizeof(JumpFixup));
+    if (!new_off || !fixups)
+    {
+        fused = -1;
+        goto done;
+    }
+    size_t nfix = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        PInstr *pi = &ins[i];
+        new_off[i] = out.code_size;
+        if (pi->removed)
+            continue;
+        bc_emit(&out, pi->op);
+        for (int k = 0; k < pi->n; ++k)
+        {
+            long pos = bc_emit_operand(&out, pi->kinds[k], pi->kinds[k] == OPND_JUMP ? 0 : pi->ops[k]);
+            if (pi->kinds[k] == OPND_JUMP)
+            {
+                fixups[nfix].pos = (size_t)pos;
+                fixups[nfix++].target = pi->ops[k];
+            }
+        }
+        if (pi->op == OP_MK_CLOSURE)
+            for (int32_t k = 0; k < pi->ops[2]; ++k)
+                bc_emit_reg(&out, captures[pi->capture_start + k]);
+    }
+    new_off[n] = out.code_size;
+    for (size_t f = 0; f < nfix; ++f)
+        bc_patch_operand(&out, fixups[f].pos, OPND_JUMP,
+                         map_target(pc_at, new_off, size, out.code_size, fixups[f].target));
+    for (size_t c = 0; c < bc->consts_count; ++c)
+    {
+        if (bc->consts[c].type == CONST_FUNCTION)
+            bc->consts[c].value.func.start =
+                map_target(pc_at, new_off, size, out.code_size, bc->consts[c].value.func.start);
+    }
+
+    free(bc->code);
+    bc->code = out.code;
+    bc->code_size = out.code_size;
+    out.code = NULL;
+
+done:
+    free(out.code);
+    free(ins);
+    free(captures);
+    free(pc_at);
+    free(new_off);
+    free(fixups);
+    return fused;
+}
@@ -0,0 +1,1394 @@
+#include "../include/ssa.h"
+#include "../include/verifier.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* The whole program is one control-flow graph. Its entry points (the start of
+   the code, every function start and every handler) are successors of a
+   virtual root block that defines all registers, since each of them can be
+   entered with any register contents. A handler is entered with the registers
+   as the THROW left them, which is why THROW and calls (a callee can throw)
+   read every register, as do MK_CLOSURE and PUSH_HANDLER, which throw when
+   the VM's memory limit refuses their allocation. Instruction ins[count] is an extra HALT standing for
+   the end of the code, so running or jumping off the end is an ordinary
+   successor. */
+
+#define SSA_MAX_ROUNDS 16
+/* largest magnitude a folded int operand or result may have (48-bit payload) */
+#define SSA_INT_LIMIT (((int64_t)1 << 47) - 1)
+
+typedef enum
+{
+    LAT_TOP,    /* no information yet */
+    LAT_CONST,  /* always the int k */
+    LAT_INT,    /* always some int */
+    LAT_VARYING /* anything */
+} Lattice;
+
+typedef enum
+{
+    SV_ENTRY,  /* register contents on entry (defined by the root) */
+    SV_OPAQUE, /* written by a call or a superinstruction */
+    SV_DEF,    /* written by the pure instruction `where` */
+    SV_PHI     /* merge at the start of block `where` */
+} SsaValueKind;
+
+typedef struct
+{
+    SsaValueKind kind;
+    int32_t reg;
+    int32_t where;
+    int32_t prev;     /* value the register held before (renaming stack) */
+    int32_t copy_of;  /* SV_DEF of OP_MOV: the value copied, else -1 */
+    int32_t phi_args; /* SV_PHI: first argument in phi_args, one per predecessor */
+    Lattice lat;
+    int64_t k;
+    int live;
+} SsaValue;
+
+typedef struct
+{
+    u8 op;
+    int n;
+    OperandKind kinds[BC_MAX_OPERANDS];
+    int32_t ops[BC_MAX_OPERANDS];  /* jump operands as instruction indices */
+    int32_t uses[BC_MAX_OPERANDS]; /* value each register operand reads, -1 */
+    size_t capture_start;          /* OP_MK_CLOSURE: first capture in the pool */
+    int32_t block;
+    int32_t def;      /* value written by a pure instruction, -1 */
+    int32_t hoist_to; /* loop header this LOAD_CONST moved in front of, -1 */
+    int removed;
+} SsaInstr;
+
+typedef struct
+{
+    int32_t first, end; /* instructions [first, end) */
+    int32_t succ_start, nsucc;
+    int32_t pred_start, npreds;
+    int32_t rpo; /* reverse post-order number, -1 if unreachable */
+    int32_t idom;
+    int32_t child, sibling; /* dominator tree */
+    int is_entry;
+} SsaBlock;
+
+typedef struct
+{
+    int32_t header; /* first instruction of the loop header */
+    u8 *in_loop;    /* per block */
+} HoistLoop;
+
+typedef struct
+{
+    Bytecode *bc;
+    SsaStats *stats;
+    int changes;
+
+    SsaInstr *ins; /* count + 1 */
+    size_t count;
+    int32_t *captures;
+    int32_t *capture_uses;
+    int32_t *pc_at; /* instruction starting at each byte offset, -1 */
+    int32_t nregs;
+
+    SsaBlock *blocks; /* nblocks + 1: blocks[root] is the virtual root */
+    int32_t nblocks, root;
+    int32_t *succs, *preds;
+    int32_t *order; /* reachable blocks in reverse post-order, root first */
+    int32_t norder;
+
+    int32_t *phis; /* (nblocks + 1) * nregs: phi value of each block and register, -1 */
+    int32_t *phi_args;
+    SsaValue *vals;
+    int32_t nvals;
+    int32_t *cur; /* value each register holds during renaming */
+    int32_t *log; /* values pushed during renaming, to pop on leaving a block */
+    int32_t nlog;
+    int32_t *defs; /* scratch for instr_defs, nregs + 2 */
+
+    HoistLoop *loops;
+    int nloops;
+} Ssa;
+
+static int is_base_op(u8 op) { return op < OP_ADD_IMM; }
+
+static int is_arith(u8 op) { return op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV; }
+
+static int ends_block(u8 op)
+{
+    return op == OP_JMP || op == OP_JZ || op == OP_SUB_JZ || op == OP_SUB_JNZ || op == OP_RET ||
+           op == OP_THROW || op == OP_HALT;
+}
+
+static int falls_through(u8 op)
+{
+    return op != OP_JMP && op != OP_RET && op != OP_THROW && op != OP_HALT;
+}
+
+/* calls, RET, THROW and HALT: see the comment at the top */
+static int reads_all(u8 op)
+{
+    return op == OP_CALL || op == OP_CALL_USER || op == OP_CALL_CLOSURE || op == OP_MOV_CALL_USER ||
+           op == OP_RET || op == OP_THROW || op == OP_HALT;
+}
+
+/* instructions that throw if the memory limit refuses them; they read every
+   register as THROW does, but only on that path */
+static int may_throw(u8 op)
+{
+    return op == OP_MK_CLOSURE || op == OP_PUSH_HANDLER;
+}
+
+/* operand index of the jump or handler target, or -1 */
+static int jump_operand(const SsaInstr *in)
+{
+    for (int k = 0; k < in->n; ++k)
+        if (in->kinds[k] == OPND_JUMP)
+            return k;
+    return -1;
+}
+
+/* registers in writes, in order; out needs nregs + 2 entries */
+static int instr_defs(const SsaInstr *in, int32_t nregs, int32_t *out)
+{
+    int n = 0;
+    int32_t nargs, dst;
+    switch (in->op)
+    {
+    case OP_LOAD_CONST:
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_ALLOC_STR:
+    case OP_MK_CLOSURE:
+    case OP_SUB_JZ:
+    case OP_SUB_JNZ:
+        out[n++] = in->ops[0];
+        return n;
+    case OP_ADD_IMM:
+        out[n++] = in->ops[2];
+        out[n++] = in->ops[0];
+        return n;
+    case OP_CALL:
+        out[n++] = in->ops[2];
+        return n;
+    case OP_CALL_USER:
+    case OP_CALL_CLOSURE:
+        nargs = in->ops[1];
+        dst = in->ops[2];
+        break;
+    case OP_MOV_CALL_USER:
+        out[n++] = in->ops[0];
+        nargs = in->ops[3];
+        dst = in->ops[4];
+        break;
+    default:
+        return 0;
+    }
+    /* the callee may write any register; only its arguments are restored */
+    for (int32_t r = 0; r < nregs; ++r)
+        if (r >= nargs || r == dst)
+            out[n++] = r;
+    return n;
+}
+
+static int value_is_int_typed(const Ssa *s, int32_t v)
+{
+    return v >= 0 && (s->vals[v].lat == LAT_CONST || s->vals[v].lat == LAT_INT);
+}
+
+static int value_is_const(const Ssa *s, int32_t v)
+{
+    return v >= 0 && s->vals[v].lat == LAT_CONST;
+}
+
+/* instructions that only write their destination, so can go if nothing reads
+   it; arithmetic only when it cannot fail a type check or divide by zero */
+static int removable(const Ssa *s, const SsaInstr *in)
+{
+    switch (in->op)
+    {
+    case OP_LOAD_CONST:
+    case OP_MOV:
+    case OP_ALLOC_STR:
+        return 1;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+        return value_is_int_typed(s, in->uses[1]) && value_is_int_typed(s, in->uses[2]);
+    case OP_DIV:
+        return value_is_int_typed(s, in->uses[1]) && value_is_const(s, in->uses[2]) &&
+               s->vals[in->uses[2]].k != 0 && s->vals[in->uses[2]].k != -1;
+    default:
+        return 0;
+    }
+}
+
+static int fold_int(u8 op, int64_t a, int64_t b, int64_t *out)
+{
+    if (a > SSA_INT_LIMIT || a < -SSA_INT_LIMIT || b > SSA_INT_LIMIT || b < -SSA_INT_LIMIT)
+        return 0;
+    int64_t r;
+    switch (op)
+    {
+    case OP_ADD:
+        r = a + b;
+        break;
+    case OP_SUB:
+        r = a - b;
+        break;
+    case OP_MUL:
+        if (a != 0 && (b > SSA_INT_LIMIT / (a < 0 ? -a : a) || b < -SSA_INT_LIMIT / (a < 0 ? -a : a)))
+            return 0;
+        r = a * b;
+        break;
+    default:
+        if (b == 0)
+            return 0;
+        r = a / b;
+        break;
+    }
+    if (r > SSA_INT_LIMIT || r < -SSA_INT_LIMIT)
+        return 0;
+    *out = r;
+    return 1;
+}
+
+/* index of an int constant equal to k, added if needed; -1 if the pool is full */
+static int int_const(Bytecode *bc, int64_t k)
+{
+    for (size_t c = 0; c < bc->consts_count; ++c)
+        if (bc->consts[c].type == CONST_INT && bc->consts[c].value.i == k)
+            return (int)c;
+    if (bc->version == BC_VERSION_2 && bc->consts_count > 0xFFFF)
+        return -1;
+    return bc_add_const_int(bc, k);
+}
+
+static void ssa_free(Ssa *s)
+{
+    free(s->ins);
+    free(s->captures);
+    free(s->capture_uses);
+    free(s->pc_at);
+    free(s->blocks);
+    free(s->succs);
+    free(s->preds);
+    free(s->order);
+    free(s->phis);
+    free(s->phi_args);
+    free(s->vals);
+    free(s->cur);
+    free(s->log);
+    free(s->defs);
+    for (int l = 0; l < s->nloops; ++l)
+        free(s->loops[l].in_loop);
+    free(s->loops);
+}
+
+/* decode into ins[], jump operands becoming instruction indices */
+static int parse(Ssa *s)
+{
+    const Bytecode *bc = s->bc;
+    size_t size = bc->code_size;
+    s->ins = (SsaInstr *)calloc(size + 1, sizeof(SsaInstr));
+    s->captures = (int32_t *)malloc((size ? size : 1) * sizeof(int32_t));
+    s->capture_uses = (int32_t *)malloc((size ? size : 1) * sizeof(int32_t));
+    s->pc_at = (int32_t *)malloc((size + 1) * sizeof(int32_t));
+    if (!s->ins || !s->captures || !s->capture_uses || !s->pc_at)
+        return -1;
+    for (size_t i = 0; i <= size; ++i)
+        s->pc_at[i] = -1;
+
+    size_t n = 0, ncaptures = 0, ip = 0;
+    int32_t maxreg = 0;
+    while (ip < size)
+    {
+        SsaInstr *in = &s->ins[n];
+        s->pc_at[ip] = (int32_t)n++;
+        in->op = bc->code[ip++];
+        in->n = bc_op_operands(in->op, in->kinds);
+        for (int k = 0; k < in->n; ++k)
+        {
+            int32_t v = in->ops[k] = bc_read_operand(bc, &ip, in->kinds[k]);
+            if ((in->kinds[k] == OPND_REG && v < 0) ||
+                (in->kinds[k] == OPND_CONST && (v < 0 || (size_t)v >= bc->consts_count)))
+                return -1;
+            if (in->kinds[k] == OPND_REG && v > maxreg)
+                maxreg = v;
+        }
+        if (in->op == OP_MK_CLOSURE)
+        {
+            in->capture_start = ncaptures;
+            for (int32_t k = 0; k < in->ops[2]; ++k)
+            {
+                int32_t r = bc_read_operand(bc, &ip, OPND_REG);
+                if (r < 0)
+                    return -1;
+                s->capture_uses[ncaptures] = -1;
+                s->captures[ncaptures++] = r;
+                if (r > maxreg)
+                    maxreg = r;
+            }
+        }
+    }
+    s->count = n;
+    s->ins[n].op = OP_HALT;
+    s->pc_at[size] = (int32_t)n;
+    s->nregs = maxreg + 1;
+
+    /* targets outside the code run off its end; targets inside an instruction
+       cannot be represented */
+    for (size_t i = 0; i <= n; ++i)
+    {
+        SsaInstr *in = &s->ins[i];
+        in->def = in->hoist_to = -1;
+        for (int k = 0; k < BC_MAX_OPERANDS; ++k)
+            in->uses[k] = -1;
+        int k = jump_operand(in);
+        if (k < 0)
+            continue;
+        int32_t t = in->ops[k];
+        if (t < 0 || (size_t)t >= size)
+            in->ops[k] = (int32_t)n;
+        else if (s->pc_at[t] < 0)
+            return -1;
+        else
+            in->ops[k] = s->pc_at[t];
+    }
+    for (size_t c = 0; c < bc->consts_count; ++c)
+    {
+        int32_t t = bc->consts[c].value.func.start;
+        if (bc->consts[c].type == CONST_FUNCTION && t >= 0 && (size_t)t < size && s->pc_at[t] < 0)
+            return -1;
+    }
+    s->defs = (int32_t *)malloc((s->nregs + 2) * sizeof(int32_t));
+    return s->defs ? 0 : -1;
+}
+
+/* instruction a function constant starts at, or -1 if it is outside the code */
+static int32_t function_entry(const Ssa *s, size_t c)
+{
+    const Constant *k = &s->bc->consts[c];
+    if (k->type != CONST_FUNCTION || k->value.func.start < 0 ||
+        (size_t)k->value.func.start >= s->bc->code_size)
+        return -1;
+    return s->pc_at[k->value.func.start];
+}
+
+static int build_blocks(Ssa *s)
+{
+    size_t n = s->count;
+    u8 *leader = (u8 *)calloc(n + 1, 1);
+    if (!leader)
+        return -1;
+    leader[0] = leader[n] = 1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int k = jump_operand(&s->ins[i]);
+        if (k >= 0)
+            leader[s->ins[i].ops[k]] = 1;
+        if (ends_block(s->ins[i].op))
+            leader[i + 1] = 1;
+    }
+    for (size_t c = 0; c < s->bc->consts_count; ++c)
+        if (function_entry(s, c) >= 0)
+            leader[function_entry(s, c)] = 1;
+
+    int32_t nb = 0;
+    for (size_t i = 0; i <= n; ++i)
+        nb += leader[i];
+    s->nblocks = nb;
+    s->root = nb;
+    s->blocks = (SsaBlock *)calloc(nb + 1, sizeof(SsaBlock));
+    s->succs = (int32_t *)malloc((3 * (size_t)nb + 1) * sizeof(int32_t));
+    if (!s->blocks || !s->succs)
+    {
+        free(leader);
+        return -1;
+    }
+    int32_t b = -1;
+    for (size_t i = 0; i <= n; ++i)
+    {
+        if (leader[i])
+        {
+            if (b >= 0)
+                s->blocks[b].end = (int32_t)i;
+            s->blocks[++b].first = (int32_t)i;
+        }
+        s->ins[i].block = b;
+    }
+    s->blocks[b].end = (int32_t)n + 1;
+    free(leader);
+
+    /* entry points */
+    s->blocks[s->ins[0].block].is_entry = 1;
+    for (size_t c = 0; c < s->bc->consts_count; ++c)
+        if (function_entry(s, c) >= 0)
+            s->blocks[s->ins[function_entry(s, c)].block].is_entry = 1;
+    for (size_t i = 0; i < n; ++i)
+        if (s->ins[i].op == OP_PUSH_HANDLER)
+            s->blocks[s->ins[s->ins[i].ops[0]].block].is_entry = 1;
+
+    /* successors: jump target, then fall-through; the root's are the entries */
+    int32_t nsuccs = 0;
+    for (b = 0; b < nb; ++b)
+    {
+        SsaBlock *bl = &s->blocks[b];
+        const SsaInstr *last = &s->ins[bl->end - 1];
+        bl->succ_start = nsuccs;
+        int k = jump_operand(last);
+        if (k >= 0 && last->op != OP_PUSH_HANDLER)
+            s->succs[nsuccs++] = s->ins[last->ops[k]].block;
+        if (falls_through(last->op) && b + 1 < nb)
+            s->succs[nsuccs++] = b + 1;
+        bl->nsucc = nsuccs - bl->succ_start;
+    }
+    SsaBlock *root = &s->blocks[s->root];
+    root->succ_start = nsuccs;
+    for (b = 0; b < nb; ++b)
+        if (s->blocks[b].is_entry)
+            s->succs[nsuccs++] = b;
+    root->nsucc = nsuccs - root->succ_start;
+    return 0;
+}
+
+static int compute_order(Ssa *s)
+{
+    int32_t total = s->nblocks + 1;
+    int32_t *stack = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *next = (int32_t *)calloc(total, sizeof(int32_t));
+    int32_t *post = (int32_t *)malloc(total * sizeof(int32_t));
+    s->order = (int32_t *)malloc(total * sizeof(int32_t));
+    if (!stack || !next || !post || !s->order)
+    {
+        free(stack);
+        free(next);
+        free(post);
+        return -1;
+    }
+    for (int32_t b = 0; b < total; ++b)
+        s->blocks[b].rpo = -1;
+
+    /* iterative depth-first search from the root; rpo marks "seen" meanwhile */
+    int32_t sp = 0, npost = 0;
+    stack[sp++] = s->root;
+    s->blocks[s->root].rpo = 0;
+    while (sp > 0)
+    {
+        int32_t b = stack[sp - 1];
+        SsaBlock *bl = &s->blocks[b];
+        if (next[b] < bl->nsucc)
+        {
+            int32_t t = s->succs[bl->succ_start + next[b]++];
+            if (s->blocks[t].rpo < 0)
+            {
+                s->blocks[t].rpo = 0;
+                stack[sp++] = t;
+            }
+            continue;
+        }
+        post[npost++] = b;
+        --sp;
+    }
+    s->norder = npost;
+    for (int32_t i = 0; i < npost; ++i)
+    {
+        s->order[i] = post[npost - 1 - i];
+        s->blocks[s->order[i]].rpo = i;
+    }
+    free(stack);
+    free(next);
+    free(post);
+
+    /* predecessors, counting reachable blocks only */
+    int32_t npreds = 0;
+    for (int32_t i = 0; i < s->norder; ++i)
+    {
+        const SsaBlock *bl = &s->blocks[s->order[i]];
+        for (int32_t k = 0; k < bl->nsucc; ++k)
+            s->blocks[s->succs[bl->succ_start + k]].npreds++;
+        npreds += bl->nsucc;
+    }
+    s->preds = (int32_t *)malloc((npreds ? npreds : 1) * sizeof(int32_t));
+    if (!s->preds)
+        return -1;
+    int32_t pos = 0;
+    for (int32_t b = 0; b < total; ++b)
+    {
+        s->blocks[b].pred_start = pos;
+        pos += s->blocks[b].npreds;
+        s->blocks[b].npreds = 0;
+    }
+    for (int32_t i = 0; i < s->norder; ++i)
+    {
+        int32_t b = s->order[i];
+        const SsaBlock *bl = &s->blocks[b];
+        for (int32_t k = 0; k < bl->nsucc; ++k)
+        {
+            SsaBlock *t = &s->blocks[s->succs[bl->succ_start + k]];
+            s->preds[t->pred_start + t->npreds++] = b;
+        }
+    }
+    return 0;
+}
+
+static int32_t intersect(const Ssa *s, int32_t a, int32_t b)
+{
+    while (a != b)
+    {
+        while (s->blocks[a].rpo > s->blocks[b].rpo)
+            a = s->blocks[a].idom;
+        while (s->blocks[b].rpo > s->blocks[a].rpo)
+            b = s->blocks[b].idom;
+    }
+    return a;
+}
+
+/* Cooper, Harvey and Kennedy's iterative algorithm over reverse post-order */
+static void compute_dominators(Ssa *s)
+{
+    for (int32_t b = 0; b <= s->nblocks; ++b)
+    {
+        s->blocks[b].idom = -1;
+        s->blocks[b].child = s->blocks[b].sibling = -1;
+    }
+    s->blocks[s->root].idom = s->root;
+    int changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (int32_t i = 1; i < s->norder; ++i)
+        {
+            SsaBlock *bl = &s->blocks[s->order[i]];
+            int32_t idom = -1;
+            for (int32_t k = 0; k < bl->npreds; ++k)
+            {
+                int32_t p = s->preds[bl->pred_start + k];
+                if (s->blocks[p].idom < 0)
+                    continue;
+                idom = idom < 0 ? p : intersect(s, p, idom);
+            }
+            if (idom != bl->idom)
+            {
+                bl->idom = idom;
+                changed = 1;
+            }
+        }
+    }
+    for (int32_t i = s->norder - 1; i > 0; --i)
+    {
+        SsaBlock *bl = &s->blocks[s->order[i]];
+        bl->sibling = s->blocks[bl->idom].child;
+        s->blocks[bl->idom].child = s->order[i];
+    }
+}
+
+static int dominates(const Ssa *s, int32_t a, int32_t b)
+{
+    for (;;)
+    {
+        if (a == b)
+            return 1;
+        if (b == s->root)
+            return 0;
+        b = s->blocks[b].idom;
+    }
+}
+
+static int32_t new_value(Ssa *s, SsaValueKind kind, int32_t reg, int32_t where)
+{
+    SsaValue *v = &s->vals[s->nvals];
+    memset(v, 0, sizeof(*v));
+    v->kind = kind;
+    v->reg = reg;
+    v->where = where;
+    v->copy_of = v->phi_args = -1;
+    return s->nvals++;
+}
+
+/* minimal SSA: phis on the iterated dominance frontiers of each register's writes */
+static int place_phis(Ssa *s)
+{
+    int32_t total = s->nblocks + 1, nregs = s->nregs;
+    size_t cells = (size_t)total * nregs;
+    u8 *writes = (u8 *)calloc(cells, 1);
+    int32_t *df_head = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *stamp = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *work = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *df_next = NULL, *df_block = NULL;
+    size_t ndf = 0, df_cap = (size_t)total * 2;
+    df_next = (int32_t *)malloc(df_cap * sizeof(int32_t));
+    df_block = (int32_t *)malloc(df_cap * sizeof(int32_t));
+    s->phis = (int32_t *)malloc(cells * sizeof(int32_t));
+    int err = -1;
+    if (!writes || !df_head || !stamp || !work || !df_next || !df_block || !s->phis)
+        goto done;
+
+    size_t nvals = (size_t)nregs; /* the root's entry values */
+    for (int32_t i = 0; i < s->norder; ++i)
+    {
+        int32_t b = s->order[i];
+        const SsaBlock *bl = &s->blocks[b];
+        for (int32_t j = bl->first; j < bl->end; ++j)
+        {
+            int nd = instr_defs(&s->ins[j], nregs, s->defs);
+            for (int d = 0; d < nd; ++d)
+                writes[(size_t)b * nregs + s->defs[d]] = 1;
+            nvals += nd;
+        }
+    }
+    memset(&writes[(size_t)s->root * nregs], 1, nregs);
+
+    /* dominance frontiers */
+    for (int32_t b = 0; b < total; ++b)
+        df_head[b] = stamp[b] = -1;
+    for (int32_t i = 0; i < s->norder; ++i)
+    {
+        int32_t b = s->order[i];
+        const SsaBlock *bl = &s->blocks[b];
+        if (bl->npreds < 2)
+            continue;
+        for (int32_t k = 0; k < bl->npreds; ++k)
+        {
+            for (int32_t x = s->preds[bl->pred_start + k]; x != bl->idom; x = s->blocks[x].idom)
+            {
+                if (stamp[x] == b)
+                    continue;
+                stamp[x] = b;
+                if (ndf == df_cap)
+                {
+                    df_cap *= 2;
+                    int32_t *nn = (int32_t *)realloc(df_next, df_cap * sizeof(int32_t));
+                    if (nn)
+                        df_next = nn;
+                    int32_t *nb = (int32_t *)realloc(df_block, df_cap * sizeof(int32_t));
+                    if (nb)
+                        df_block = nb;
+                    if (!nn || !nb)
+                        goto done;
+                }
+                df_block[ndf] = b;
+                df_next[ndf] = df_head[x];
+                df_head[x] = (int32_t)ndf++;
+            }
+        }
+    }
+
+    /* phi placement; -2 marks a phi whose value is created below */
+    size_t nphis = 0, nargs = 0;
+    for (size_t c = 0; c < cells; ++c)
+        s->phis[c] = -1;
+    for (int32_t r = 0; r < nregs; ++r)
+    {
+        int32_t sp = 0;
+        for (int32_t i = 0; i < s->norder; ++i)
+        {
+            int32_t b = s->order[i];
+            stamp[b] = writes[(size_t)b * nregs + r] ? r : -1;
+            if (stamp[b] == r)
+                work[sp++] = b;
+        }
+        while (sp > 0)
+        {
+            int32_t x = work[--sp];
+            for (int32_t e = df_head[x]; e >= 0; e = df_next[e])
+            {
+                int32_t y = df_block[e];
+                if (s->phis[(size_t)y * nregs + r] != -1)
+                    continue;
+                s->phis[(size_t)y * nregs + r] = -2;
+                ++nphis;
+                nargs += s->blocks[y].npreds;
+                if (stamp[y] != r)
+                {
+                    stamp[y] = r;
+                    work[sp++] = y;
+                }
+            }
+        }
+    }
+
+    nvals += nphis;
+    s->vals = (SsaValue *)malloc((nvals ? nvals : 1) * sizeof(SsaValue));
+    s->log = (int32_t *)malloc((nvals ? nvals : 1) * sizeof(int32_t));
+    s->phi_args = (int32_t *)malloc((nargs ? nargs : 1) * sizeof(int32_t));
+    s->cur = (int32_t *)malloc(nregs * sizeof(int32_t));
+    if (!s->vals || !s->log || !s->phi_args || !s->cur)
+        goto done;
+    size_t arg = 0;
+    for (int32_t i = 0; i < s->norder; ++i)
+    {
+        int32_t b = s->order[i];
+        for (int32_t r = 0; r < nregs; ++r)
+        {
+            int32_t *phi = &s->phis[(size_t)b * nregs + r];
+            if (*phi != -2)
+                continue;
+            *phi = new_value(s, SV_PHI, r, b);
+            s->vals[*phi].phi_args = (int32_t)arg;
+            for (int32_t k = 0; k < s->blocks[b].npreds; ++k)
+                s->phi_args[arg++] = -1;
+        }
+    }
+    err = 0;
+
+done:
+    free(writes);
+    free(df_head);
+    free(stamp);
+    free(work);
+    free(df_next);
+    free(df_block);
+    return err;
+}
+
+static void push_value(Ssa *s, int32_t v)
+{
+    SsaValue *val = &s->vals[v];
+    val->prev = s->cur[val->reg];
+    s->cur[val->reg] = v;
+    s->log[s->nlog++] = v;
+}
+
+/* value read through *reg. Rewritable reads are redirected to the oldest
+   value in the MOV chain that still sits in its own register. */
+static int32_t read_reg(Ssa *s, int32_t *reg, int rewrite)
+{
+    int32_t v = s->cur[*reg];
+    if (!rewrite)
+        return v;
+    int32_t best = v;
+    for (int32_t c = s->vals[v].copy_of; c >= 0; c = s->vals[c].copy_of)
+        if (s->cur[s->vals[c].reg] == c)
+            best = c;
+    if (best != v)
+    {
+        *reg = s->vals[best].reg;
+        s->stats->copies++;
+        s->changes++;
+    }
+    return best;
+}
+
+static void mark_live(Ssa *s, int32_t v)
+{
+    if (v >= 0)
+        s->vals[v].live = 1;
+}
+
+static void rename_instr(Ssa *s, int32_t i)
+{
+    SsaInstr *in = &s->ins[i];
+    int rewrite = is_base_op(in->op);
+    switch (in->op)
+    {
+    case OP_MOV:
+    case OP_ADD_IMM:
+    case OP_MOV_CALL_USER:
+        in->uses[1] = read_reg(s, &in->ops[1], rewrite);
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SUB_JZ:
+    case OP_SUB_JNZ:
+        in->uses[1] = read_reg(s, &in->ops[1], rewrite);
+        in->uses[2] = read_reg(s, &in->ops[2], rewrite);
+        break;
+    case OP_PRINT:
+    case OP_JZ:
+    case OP_RET:
+    case OP_THROW:
+    case OP_CALL_CLOSURE:
+        in->uses[0] = read_reg(s, &in->ops[0], rewrite);
+        break;
+    case OP_MK_CLOSURE:
+        for (int32_t k = 0; k < in->ops[2]; ++k)
+            s->capture_uses[in->capture_start + k] =
+                read_reg(s, &s->captures[in->capture_start + k], rewrite);
+        break;
+    default:
+        break;
+    }
+
+    if (may_throw(in->op))
+        for (int32_t r = 0; r < s->nregs; ++r)
+            mark_live(s, s->cur[r]);
+    int nd = instr_defs(in, s->nregs, s->defs);
+    int d = 0;
+    switch (in->op)
+    {
+    case OP_LOAD_CONST:
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_ALLOC_STR:
+    case OP_MK_CLOSURE:
+        in->def = new_value(s, SV_DEF, in->ops[0], i);
+        if (in->op == OP_MOV)
+            s->vals[in->def].copy_of = in->uses[1];
+        push_value(s, in->def);
+        return;
+    case OP_MOV_CALL_USER:
+        push_value(s, new_value(s, SV_OPAQUE, s->defs[d++], i));
+        break;
+    default:
+        break;
+    }
+    if (reads_all(in->op))
+        for (int32_t r = 0; r < s->nregs; ++r)
+            mark_live(s, s->cur[r]);
+    for (; d < nd; ++d)
+        push_value(s, new_value(s, SV_OPAQUE, s->defs[d], i));
+}
+
+static void rename_block(Ssa *s, int32_t b)
+{
+    const SsaBlock *bl = &s->blocks[b];
+    int32_t nregs = s->nregs;
+    for (int32_t r = 0; r < nregs; ++r)
+    {
+        if (b == s->root)
+            push_value(s, new_value(s, SV_ENTRY, r, -1));
+        else if (s->phis[(size_t)b * nregs + r] >= 0)
+            push_value(s, s->phis[(size_t)b * nregs + r]);
+    }
+    if (b != s->root)
+        for (int32_t i = bl->first; i < bl->end; ++i)
+            rename_instr(s, i);
+
+    /* fill this block's slots in the successors' phis */
+    for (int32_t k = 0; k < bl->nsucc; ++k)
+    {
+        const SsaBlock *t = &s->blocks[s->succs[bl->succ_start + k]];
+        size_t row = (size_t)(t - s->blocks) * nregs;
+        for (int32_t j = 0; j < t->npreds; ++j)
+        {
+            if (s->preds[t->pred_start + j] != b)
+                continue;
+            for (int32_t r = 0; r < nregs; ++r)
+                if (s->phis[row + r] >= 0)
+                    s->phi_args[s->vals[s->phis[row + r]].phi_args + j] = s->cur[r];
+        }
+    }
+}
+
+/* walk the dominator tree, renaming as we go */
+static int rename_all(Ssa *s)
+{
+    int32_t total = s->nblocks + 1;
+    int32_t *stack = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *saved = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *next = (int32_t *)malloc(total * sizeof(int32_t));
+    if (!stack || !saved || !next)
+    {
+        free(stack);
+        free(saved);
+        free(next);
+        return -1;
+    }
+    int32_t sp = 0;
+    saved[sp] = s->nlog;
+    stack[sp++] = s->root;
+    rename_block(s, s->root);
+    next[0] = s->blocks[s->root].child;
+    while (sp > 0)
+    {
+        int32_t c = next[sp - 1];
+        if (c >= 0)
+        {
+            next[sp - 1] = s->blocks[c].sibling;
+            saved[sp] = s->nlog;
+            stack[sp++] = c;
+            rename_block(s, c);
+            next[sp - 1] = s->blocks[c].child;
+            continue;
+        }
+        --sp;
+        while (s->nlog > saved[sp])
+        {
+            SsaValue *v = &s->vals[s->log[--s->nlog]];
+            s->cur[v->reg] = v->prev;
+        }
+    }
+    free(stack);
+    free(saved);
+    free(next);
+    return 0;
+}
+
+static void meet(SsaValue *v, const SsaValue *w)
+{
+    if (!w || w->lat == LAT_VARYING || v->lat == LAT_VARYING)
+        v->lat = LAT_VARYING;
+    else if (w->lat == LAT_TOP)
+        return;
+    else if (v->lat == LAT_TOP)
+    {
+        v->lat = w->lat;
+        v->k = w->k;
+    }
+    else if (v->lat == LAT_CONST && (w->lat != LAT_CONST || w->k != v->k))
+        v->lat = LAT_INT;
+}
+
+/* optimistic constant and int-type propagation to a fixed point */
+static void propagate(Ssa *s)
+{
+    for (int32_t v = 0; v < s->nvals; ++v)
+        s->vals[v].lat = LAT_TOP;
+    int changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (int32_t v = 0; v < s->nvals; ++v)
+        {
+            SsaValue *val = &s->vals[v], old = *val;
+            val->lat = LAT_TOP;
+            if (val->kind == SV_PHI)
+            {
+                for (int32_t k = 0; k < s->blocks[val->where].npreds; ++k)
+                {
+                    int32_t a = s->phi_args[val->phi_args + k];
+                    meet(val, a >= 0 ? &s->vals[a] : NULL);
+                }
+            }
+            else if (val->kind != SV_DEF)
+                val->lat = LAT_VARYING;
+            else
+            {
+                const SsaInstr *in = &s->ins[val->where];
+                const Constant *c = in->op == OP_LOAD_CONST ? &s->bc->consts[in->ops[1]] : NULL;
+                if (c)
+                {
+                    val->lat = c->type == CONST_INT ? LAT_CONST : LAT_VARYING;
+                    val->k = c->value.i;
+                }
+                else if (in->op == OP_MOV)
+                    meet(val, &s->vals[in->uses[1]]);
+                else if (is_arith(in->op))
+                {
+                    const SsaValue *a = &s->vals[in->uses[1]], *b = &s->vals[in->uses[2]];
+                    if (a->lat == LAT_TOP || b->lat == LAT_TOP)
+                        val->lat = LAT_TOP;
+                    else if (a->lat == LAT_CONST && b->lat == LAT_CONST &&
+                             fold_int(in->op, a->k, b->k, &val->k))
+                        val->lat = LAT_CONST;
+                    else
+                        val->lat = LAT_INT; /* anything else fails before writing */
+                }
+                else
+                    val->lat = LAT_VARYING;
+            }
+            if (val->lat != old.lat || (val->lat == LAT_CONST && val->k != old.k))
+                changed = 1;
+        }
+    }
+}
+
+static void fold_constants(Ssa *s)
+{
+    for (size_t i = 0; i < s->count; ++i)
+    {
+        SsaInstr *in = &s->ins[i];
+        if (s->blocks[in->block].rpo < 0)
+            continue;
+        if (is_arith(in->op) && value_is_const(s, in->def))
+        {
+            int ci = int_const(s->bc, s->vals[in->def].k);
+            if (ci < 0)
+                continue;
+            in->op = OP_LOAD_CONST;
+            in->n = bc_op_operands(OP_LOAD_CONST, in->kinds);
+            in->ops[1] = ci;
+            in->uses[1] = in->uses[2] = -1;
+        }
+        else if (in->op == OP_JZ && value_is_const(s, in->uses[0]))
+        {
+            if (s->vals[in->uses[0]].k == 0)
+            {
+                in->op = OP_JMP;
+                in->n = bc_op_operands(OP_JMP, in->kinds);
+                in->ops[0] = in->ops[1];
+            }
+            else
+                in->removed = 1;
+            in->uses[0] = -1;
+        }
+        else
+            continue;
+        s->stats->folded++;
+        s->changes++;
+    }
+}
+
+static void mark_uses(Ssa *s, const SsaInstr *in, int32_t *work, int32_t *sp)
+{
+    for (int k = 0; k < in->n; ++k)
+    {
+        int32_t v = in->uses[k];
+        if (v >= 0 && !s->vals[v].live)
+        {
+            s->vals[v].live = 1;
+            work[(*sp)++] = v;
+        }
+    }
+    if (in->op == OP_MK_CLOSURE)
+    {
+        for (int32_t k = 0; k < in->ops[2]; ++k)
+        {
+            int32_t v = s->capture_uses[in->capture_start + k];
+            if (v >= 0 && !s->vals[v].live)
+            {
+                s->vals[v].live = 1;
+                work[(*sp)++] = v;
+            }
+        }
+    }
+}
+
+/* mark what is read, starting from instructions that have to stay, then delete
+   pure instructions nobody reads and everything unreachable */
+static int eliminate_dead_code(Ssa *s)
+{
+    int32_t *work = (int32_t *)malloc((s->nvals ? s->nvals : 1) * sizeof(int32_t));
+    if (!work)
+        return -1;
+    int32_t sp = 0;
+    for (int32_t v = 0; v < s->nvals; ++v)
+        if (s->vals[v].live)
+            work[sp++] = v;
+    for (size_t i = 0; i < s->count; ++i)
+    {
+        const SsaInstr *in = &s->ins[i];
+        if (!in->removed && s->blocks[in->block].rpo >= 0 && !removable(s, in))
+            mark_uses(s, in, work, &sp);
+    }
+    while (sp > 0)
+    {
+        const SsaValue *v = &s->vals[work[--sp]];
+        if (v->kind == SV_PHI)
+        {
+            for (int32_t k = 0; k < s->blocks[v->where].npreds; ++k)
+            {
+                int32_t a = s->phi_args[v->phi_args + k];
+                if (a >= 0 && !s->vals[a].live)
+                {
+                    s->vals[a].live = 1;
+                    work[sp++] = a;
+                }
+            }
+        }
+        else if (v->kind == SV_DEF && removable(s, &s->ins[v->where]))
+            mark_uses(s, &s->ins[v->where], work, &sp);
+    }
+    free(work);
+
+    for (size_t i = 0; i < s->count; ++i)
+    {
+        SsaInstr *in = &s->ins[i];
+        if (in->removed)
+            continue;
+        if (s->blocks[in->block].rpo >= 0 && (!removable(s, in) || s->vals[in->def].live))
+            continue;
+        in->removed = 1;
+        s->stats->removed++;
+        s->changes++;
+    }
+    return 0;
+}
+
+static int block_falls_through(const Ssa *s, int32_t b)
+{
+    const SsaInstr *last = &s->ins[s->blocks[b].end - 1];
+    return last->removed || falls_through(last->op);
+}
+
+/* loop-invariant code motion of LOAD_CONST. A constant load can run once
+   before the loop instead of on every iteration when it is the only write to
+   its register inside the loop and the register's value on entry to the
+   header is never read (its header phi is dead): then every read inside the
+   loop, and after it, sees the constant either way. */
+static int hoist_loops(Ssa *s)
+{
+    int32_t total = s->nblocks + 1;
+    int32_t *work = (int32_t *)malloc(total * sizeof(int32_t));
+    int32_t *ndefs = (int32_t *)malloc(s->nregs * sizeof(int32_t));
+    s->loops = (HoistLoop *)malloc(total * sizeof(HoistLoop));
+    int err = -1;
+    u8 *in_loop = NULL;
+    if (!work || !ndefs || !s->loops)
+        goto done;
+    for (int32_t o = 1; o < s->norder; ++o)
+    {
+        int32_t h = s->order[o];
+        const SsaBlock *hb = &s->blocks[h];
+        if (hb->is_entry)
+            continue;
+        if (!in_loop)
+            in_loop = (u8 *)malloc(total);
+        if (!in_loop)
+            goto done;
+        memset(in_loop, 0, total);
+        in_loop[h] = 1;
+
+        /* natural loop: everything reaching a back edge without passing h */
+        int32_t sp = 0;
+        for (int32_t k = 0; k < hb->npreds; ++k)
+        {
+            int32_t p = s->preds[hb->pred_start + k];
+            if (dominates(s, h, p) && !in_loop[p])
+            {
+                in_loop[p] = 1;
+                work[sp++] = p;
+            }
+        }
+        if (sp == 0)
+            continue;
+        while (sp > 0)
+        {
+            const SsaBlock *x = &s->blocks[work[--sp]];
+            for (int32_t k = 0; k < x->npreds; ++k)
+            {
+                int32_t q = s->preds[x->pred_start + k];
+                if (!in_loop[q] && q != s->root)
+                {
+                    in_loop[q] = 1;
+                    work[sp++] = q;
+                }
+            }
+        }
+        /* the preheader goes right before h, so h must not be entered by
+           falling through from inside the loop */
+        if (h > 0 && in_loop[h - 1] && block_falls_through(s, h - 1))
+            continue;
+
+        memset(ndefs, 0, s->nregs * sizeof(int32_t));
+        for (int32_t b = 0; b < s->nblocks; ++b)
+        {
+            if (!in_loop[b])
+                continue;
+            for (int32_t i = s->blocks[b].first; i < s->blocks[b].end; ++i)
+            {
+                if (s->ins[i].removed)
+                    continue;
+                int nd = instr_defs(&s->ins[i], s->nregs, s->defs);
+                for (int d = 0; d < nd; ++d)
+                    ndefs[s->defs[d]]++;
+            }
+        }
+        int hoisted = 0;
+        for (int32_t b = 0; b < s->nblocks; ++b)
+        {
+            if (!in_loop[b])
+                continue;
+            for (int32_t i = s->blocks[b].first; i < s->blocks[b].end; ++i)
+            {
+                SsaInstr *in = &s->ins[i];
+                if (in->op != OP_LOAD_CONST || in->removed || in->hoist_to >= 0)
+                    continue;
+                ConstType type = s->bc->consts[in->ops[1]].type;
+                int32_t r = in->ops[0], phi = s->phis[(size_t)h * s->nregs + r];
+                if ((type != CONST_INT && type != CONST_DOUBLE) || ndefs[r] != 1 || phi < 0 ||
+                    s->vals[phi].live)
+                    continue;
+                in->hoist_to = hb->first;
+                ++hoisted;
+            }
+        }
+        if (hoisted)
+        {
+            s->loops[s->nloops].header = hb->first;
+            s->loops[s->nloops++].in_loop = in_loop;
+            in_loop = NULL;
+            s->stats->hoisted += hoisted;
+            s->changes += hoisted;
+        }
+    }
+    err = 0;
+
+done:
+    free(work);
+    free(ndefs);
+    free(in_loop);
+    return err;
+}
+
+static const HoistLoop *hoist_loop_at(const Ssa *s, int32_t i)
+{
+    for (int l = 0; l < s->nloops; ++l)
+        if (s->loops[l].header == i)
+            return &s->loops[l];
+    return NULL;
+}
+
+/* a JMP whose target is the next instruction left after deletion */
+static void remove_null_jumps(Ssa *s)
+{
+    for (size_t i = 0; i < s->count; ++i)
+    {
+        SsaInstr *in = &s->ins[i];
+        if (in->op != OP_JMP || in->removed || (size_t)in->ops[0] <= i)
+            continue;
+        int32_t j = (int32_t)i + 1;
+        while (j < in->ops[0] && (s->ins[j].removed || s->ins[j].hoist_to >= 0) &&
+               !hoist_loop_at(s, j))
+            ++j;
+        if (j != in->ops[0] || hoist_loop_at(s, j))
+            continue;
+        in->removed = 1;
+        s->stats->removed++;
+        s->changes++;
+    }
+}
+
+typedef struct
+{
+    size_t pos;     /* operand position in the new code */
+    int32_t target; /* instruction index */
+    int32_t from;   /* block of the jump */
+} SsaFixup;
+
+static void emit_instr(Ssa *s, Bytecode *out, const SsaInstr *in, SsaFixup *fixups, size_t *nfix)
+{
+    bc_emit(out, in->op);
+    for (int k = 0; k < in->n; ++k)
+    {
+        long pos = bc_emit_operand(out, in->kinds[k], in->kinds[k] == OPND_JUMP ? 0 : in->ops[k]);
+        if (in->kinds[k] == OPND_JUMP)
+        {
+            fixups[*nfix].pos = (size_t)pos;
+            fixups[*nfix].target = in->ops[k];
+            fixups[(*nfix)++].from = in->block;
+        }
+    }
+    if (in->op == OP_MK_CLOSURE)
+        for (int32_t k = 0; k < in->ops[2]; ++k)
+            bc_emit_reg(out, s->captures[in->capture_start + k]);
+}
+
+/* re-emit the surviving instructions, hoisted loads in front of their loop
+   header; jumps into the loop from outside go through them */
+static int emit(Ssa *s)
+{
+    size_t n = s->count;
+    size_t *new_off = (size_t *)malloc((n + 1) * sizeof(size_t));
+    size_t *pre_off = (size_t *)malloc((n + 1) * sizeof(size_t));
+    SsaFixup *fixups = (SsaFixup *)malloc((n ? n : 1) * sizeof(SsaFixup));
+    if (!new_off || !pre_off || !fixups)
+    {
+        free(new_off);
+        free(pre_off);
+        free(fixups);
+        return -1;
+    }
+    Bytecode out;
+    bc_init_version(&out, s->bc->version);
+    size_t nfix = 0, emitted = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        pre_off[i] = out.code_size;
+        if (hoist_loop_at(s, (int32_t)i))
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                if (s->ins[j].hoist_to != (int32_t)i)
+                    continue;
+                emit_instr(s, &out, &s->ins[j], fixups, &nfix);
+                ++emitted;
+            }
+        }
+        new_off[i] = out.code_size;
+        if (s->ins[i].removed || s->ins[i].hoist_to >= 0)
+            continue;
+        emit_instr(s, &out, &s->ins[i], fixups, &nfix);
+        ++emitted;
+    }
+    new_off[n] = pre_off[n] = out.code_size;
+    for (size_t f = 0; f < nfix; ++f)
+    {
+        int32_t t = fixups[f].target;
+        const HoistLoop *l = hoist_loop_at(s, t);
+        size_t off = l && !l->in_loop[fixups[f].from] ? pre_off[t] : new_off[t];
+        bc_patch_operand(&out, fixups[f].pos, OPND_JUMP, (int32_t)off);
+    }
+    for (size_t c = 0; c < s->bc->consts_count; ++c)
+    {
+        if (s->bc->consts[c].type != CONST_FUNCTION)
+            continue;
+        int32_t e = function_entry(s, c);
+        s->bc->consts[c].value.func.start = (int)(e >= 0 ? new_off[e] : out.code_size);
+    }
+
+    free(s->bc->code);
+    s->bc->code = out.code;
+    s->bc->code_size = out.code_size;
+    s->stats->instrs_after = emitted;
+    free(new_off);
+    free(pre_off);
+    free(fixups);
+    return 0;
+}
+
+/* one pass of everything; returns the number of changes, or -1 */
+static int ssa_round(Bytecode *bc, SsaStats *stats)
+{
+    Ssa s;
+    memset(&s, 0, sizeof(s));
+    s.bc = bc;
+    s.stats = stats;
+    int result = -1;
+    if (parse(&s) < 0)
+        goto done;
+    if (stats->rounds == 0)
+        stats->instrs_before = stats->instrs_after = s.count;
+    if (s.count == 0)
+    {
+        result = 0;
+        goto done;
+    }
+    if (build_blocks(&s) < 0 || compute_order(&s) < 0)
+        goto done;
+    compute_dominators(&s);
+    if (place_phis(&s) < 0 || rename_all(&s) < 0)
+        goto done;
+    propagate(&s);
+    fold_constants(&s);
+    if (eliminate_dead_code(&s) < 0 || hoist_loops(&s) < 0)
+        goto done;
+    remove_null_jumps(&s);
+    if (s.changes && emit(&s) < 0)
+        goto done;
+    result = s.changes;
+
+done:
+    ssa_free(&s);
+    return result;
+}
+
+int ssa_optimize(Bytecode *bc, SsaStats *stats)
+{
+    SsaStats local;
+    if (!stats)
+        stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (verify_bytecode(bc))
+        return -1;
+    /* a round changes bc only once its analysis has succeeded, so a later
+       failure (out of memory) still leaves valid code */
+    while (stats->rounds < SSA_MAX_ROUNDS)
+    {
+        int changes = ssa_round(bc, stats);
+        if (changes < 0)
+            return stats->rounds == 0 ? -1 : 0;
+        stats->rounds++;
+        if (changes == 0)
+            break;
+    }
+    return 0;
+}
@@ -1,83 +1,161 @@
 #include "../include/verifier.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 const char *verify_bytecode(const Bytecode *bc)
 {
+    if (bc->version != BC_VERSION_1 && bc->version != BC_VERSION_2)
+        return "unsupported bytecode version";
     size_t ip = 0;
     while (ip < bc->code_size)
     {
         u8 op = bc->code[ip++];
-        switch (op)
-        {
-        case OP_HALT:
-            break;
-        case OP_LOAD_CONST:
-            ip += 8;
-            break; /* reg + const idx */
-        case OP_MOV:
-            ip += 8;
-            break;
-        case OP_ADD:
-        case OP_SUB:
-        case OP_MUL:
-        case OP_DIV:
-            ip += 12;
-            break;
-        case OP_PRINT:
-            ip += 4;
-            break;
-        case OP_JMP:
-            ip += 4;
-            break;
-        case OP_JZ:
-            ip += 8;
-            break;
-        case OP_ALLOC_STR:
-            ip += 8;
-            break;
-        case OP_CALL:
-            ip += 12;
-            break;
-        case OP_CALL_USER:
-            ip += 12;
-            break;
-        case OP_RET:
-            ip += 4;
-            break;
-        case OP_THROW:
-            ip += 4; /* register operand */
-            break;
-        case OP_PUSH_HANDLER:
-            ip += 4;
-            break;
-        case OP_MK_CLOSURE:
+        OperandKind kinds[BC_MAX_OPERANDS];
+        int n = bc_op_operands(op, kinds);
+        if (n < 0)
+            return "unknown opcode in verifier";
+        size_t len = 0;
+        for (int i = 0; i < n; ++i)
+            len += bc_operand_size(bc, kinds[i]);
+        if (ip + len > bc->code_size)
+            return op == OP_MK_CLOSURE ? "truncated mk_closure"
+                                       : "bytecode truncated or malformed";
+        if (op == OP_MK_CLOSURE)
         {
-            /* dst (4), const idx (4), ncaptures (4), then ncaptures * 4 bytes of register indices */
-            if (ip + 12 > bc->code_size)
-                return "truncated mk_closure";
-            int32_t nc = 0;
-            memcpy(&nc, &bc->code[ip + 8], 4); /* read ncaptures */
+            /* dst, const idx, ncaptures, then ncaptures register operands */
+            size_t p = ip + len - bc_operand_size(bc, OPND_COUNT);
+            int32_t nc = bc_read_operand(bc, &p, OPND_COUNT);
             if (nc < 0)
                 return "negative ncaptures";
-            if ((size_t)(ip + 12 + (size_t)nc * 4) > bc->code_size)
+            len += (size_t)nc * bc_operand_size(bc, OPND_REG);
+            if (ip + len > bc->code_size)
                 return "truncated mk_closure captures";
-            ip += 12 + (size_t)nc * 4;
-            break;
         }
-        case OP_CALL_CLOSURE:
-            /* obj_reg (4), nargs (4), dst (4) */
-            if (ip + 12 > bc->code_size)
-                return "truncated call_closure";
-            ip += 12;
-            break;
-        case OP_POP_HANDLER:
-            break;
-        default:
-            return "unknown opcode in verifier";
-        }
-        if (ip > bc->code_size)
-            return "bytecode truncated or malformed";
+        ip += len;
     }
     return NULL;
 }
+
+/* the constant type an opcode's CONST operand must have, or -1 for any */
+static int required_const_type(u8 op)
+{
+    switch (op)
+    {
+    case OP_ALLOC_STR:
+        return CONST_STRING;
+    case OP_CALL_USER:
+    case OP_MK_CLOSURE:
+    case OP_MOV_CALL_USER:
+        return CONST_FUNCTION;
+    case OP_ADD_IMM:
+        return CONST_INT;
+    default:
+        return -1;
+    }
+}
+
+/* a jump may target any instruction start, or the end of the code (halt) */
+static int valid_target(const u8 *is_start, size_t code_size, int32_t loc)
+{
+    if (loc < 0 || (size_t)loc > code_size)
+        return 0;
+    return (size_t)loc == code_size || is_start[loc];
+}
+
+const char *verify_program(const Bytecode *bc, int num_registers)
+{
+    const char *err = verify_bytecode(bc);
+    if (err)
+        return err;
+    if (num_registers <= 0)
+        return "vm has no registers";
+
+    /* pass 1: mark instruction starts (the layout is known to be well formed) */
+    u8 *is_start = (u8 *)calloc(bc->code_size ? bc->code_size : 1, 1);
+    size_t ip = 0;
+    while (ip < bc->code_size)
+    {
+        is_start[ip] = 1;
+        u8 op = bc->code[ip++];
+        OperandKind kinds[BC_MAX_OPERANDS];
+        int n = bc_op_operands(op, kinds);
+        for (int i = 0; i < n; ++i)
+            ip += bc_operand_size(bc, kinds[i]);
+        if (op == OP_MK_CLOSURE)
+        {
+            size_t p = ip - bc_operand_size(bc, OPND_COUNT);
+            ip += (size_t)bc_read_operand(bc, &p, OPND_COUNT) * bc_operand_size(bc, OPND_REG);
+        }
+    }
+
+    /* pass 2: operand values */
+    ip = 0;
+    while (ip < bc->code_size && !err)
+    {
+        u8 op = bc->code[ip++];
+        OperandKind kinds[BC_MAX_OPERANDS];
+        int n = bc_op_operands(op, kinds);
+        int32_t nregs = 0;
+        for (int i = 0; i < n && !err; ++i)
+        {
+            int32_t v = bc_read_operand(bc, &ip, kinds[i]);
+            switch (kinds[i])
+            {
+            case OPND_REG:
+                if (v < 0 || v >= num_registers)
+                    err = "register out of range";
+                break;
+            case OPND_CONST:
+            {
+                int want = required_const_type(op);
+                if (v < 0 || (size_t)v >= bc->consts_count)
+                    err = "constant index out of range";
+                else if (want >= 0 && (int)bc->consts[v].type != want)
+                    err = want == CONST_FUNCTION ? "constant is not a function"
+                          : want == CONST_STRING ? "constant is not a string"
+                                                 : "constant is not an int";
+                break;
+            }
+            case OPND_COUNT:
+                /* call argument counts are registers saved and passed */
+                if (v < 0 || (op != OP_MK_CLOSURE && v > num_registers))
+                    err = "argument count out of range";
+                nregs = v;
+                break;
+            case OPND_NATIVE:
+                if (v < 0)
+                    err = "negative native index";
+                break;
+            case OPND_JUMP:
+                if (!valid_target(is_start, bc->code_size, v))
+                    err = "jump target is not an instruction boundary";
+                break;
+            }
+        }
+        if (op == OP_MK_CLOSURE)
+        {
+            for (int32_t i = 0; i < nregs && !err; ++i)
+            {
+                int32_t r = bc_read_operand(bc, &ip, OPND_REG);
+                if (r < 0 || r >= num_registers)
+                    err = "capture register out of range";
+            }
+        }
+    }
+
+    /* function entry points must be real instructions */
+    for (size_t i = 0; i < bc->consts_count && !err; ++i)
+    {
+        const Constant *c = &bc->consts[i];
+        if (c->type != CONST_FUNCTION)
+            continue;
+        int32_t start = c->value.func.start;
+        if (start < 0 || (size_t)start >= bc->code_size || !is_start[start])
+            err = "function start is not an instruction boundary";
+        else if (c->value.func.nargs < 0 || c->value.func.nargs > num_registers)
+            err = "function nargs out of range";
+    }
+    free(is_start);
+    return err;
+}
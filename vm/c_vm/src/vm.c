@@ -1,9 +1,17 @@
 #include "../include/vm.h"
 #include "../include/disassembler.h"
 #include "../include/verifier.h"
+#include "../include/decoder.h"
+#include "../include/peephole.h"
+#include "../include/ssa.h"
+#include "../include/jit.h"
+#include "../include/vmthread.h"
+#include "../include/arena.h"
+#include "../include/heapsnap.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 /* portable strdup implementation to avoid implicit declaration warnings on some
    platforms. Implemented here and declared in include/util.h and include/vm.h. */
@@ -19,24 +27,119 @@ char *vm_strdup(const char *s)
     return p;
 }
 
+/* slot idx of the string table is the string a V_STRING Value with str_idx idx
+   refers to. Slots never move; a freed slot (s == NULL) goes onto the
+   free-list and is handed out again by the next allocation. Strings are
+   immutable, so every live string is interned: str_buckets chains the slots
+   by hash and equal contents always share one slot. */
 typedef struct HeapString
 {
-    char *s;
-    int marked;
-    struct HeapString *next;
+    char *s; /* NULL while the slot is free */
+    int pinned;    /* a constant of a loaded program; never collected */
+    int young;     /* allocated since the last collection, see gc_minor */
+    uint32_t hash;
+    int next;      /* next slot in the same hash bucket, -1 at the end */
 } HeapString;
 
-typedef struct HeapObject
+/* The object table is a set of parallel arrays indexed by object slot, so
+   the collector's scans run over dense memory: the field counts, and
+   bitmaps (one bit per slot, like the mark bits) for alive, young and
+   remembered (an old object on the remembered set). An object of up to
+   OBJ_INLINE_FIELDS fields keeps them inline, at obj_inline + idx *
+   OBJ_INLINE_FIELDS, which takes no allocation and no pointer load to reach;
+   a bigger one has its own array in obj_fields[idx] (NULL otherwise). Most
+   objects are closures with a few captures, which fit. */
+#define OBJ_INLINE_FIELDS 4
+/* the bytes a slot takes in the table */
+#define OBJ_SLOT_SIZE (OBJ_INLINE_FIELDS * sizeof(Value) + sizeof(Value *) + sizeof(int))
+
+/* vm->gc_pending: work the next safepoint (instruction boundary) must do */
+#define GC_MINOR 1
+#define GC_MAJOR 2
+#define GC_STEP 4 /* a slice of the incremental collection under way */
+/* vm->gc_phase of an incremental major collection */
+#define GC_IDLE 0
+#define GC_MARKING 1
+#define GC_SWEEPING 2
+/* allocations between two slices of an incremental collection; one of n
+   bytes counts 1 + n / GC_SLICE_BYTES times, so big allocations bring the
+   next slice closer */
+#define GC_SLICE_ALLOCS 64
+#define GC_SLICE_BYTES 1024
+/* object slots below which opts.gc_compact_percent never compacts */
+#define GC_COMPACT_MIN 1024
+/* entries of the mark stack; objects marked while it is full are found again
+   by rescanning the heap, see trace */
+#define GC_MARK_STACK_MAX (64 * 1024)
+/* fields of one object a trace scans in one go; bigger objects are scanned
+   a chunk at a time, so one huge object cannot blow an incremental slice */
+#define GC_SCAN_CHUNK 256
+
+/* mark bits live in side bitmaps, one bit per string or object slot, so a
+   collection touches the slots of the heap tables only to scan fields */
+#define MARK_WORDS(n) (((n) + 63) / 64)
+static int bit_test(const uint64_t *bits, size_t i) { return (int)((bits[i >> 6] >> (i & 63)) & 1); }
+static int popcount64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1)
+        ++n;
+    return n;
+#endif
+}
+static void bit_set(uint64_t *bits, size_t i) { bits[i >> 6] |= (uint64_t)1 << (i & 63); }
+static void bit_clear(uint64_t *bits, size_t i) { bits[i >> 6] &= ~((uint64_t)1 << (i & 63)); }
+
+/* what a trace marks */
+#define MARK_ALL 0   /* stop-the-world major collection */
+#define MARK_YOUNG 1 /* minor collection */
+#define MARK_OLD 2   /* incremental major collection; young data is left to the
+                        minor collections, which shade what they promote */
+
+/* gray objects: marked, fields not scanned yet. An object marked while the
+   stack is full is not pushed but sets overflow, and a later pass over the
+   heap (rescan_pos the next slot) finds it again. scan_obj is the object
+   being scanned (-1 if none) and scan_field its next field. */
+typedef struct MarkStack
+{
+    int *items;
+    size_t count;
+    size_t cap;
+    int overflow;
+    int rescanning;
+    size_t rescan_pos;
+    int scan_obj;
+    int scan_field;
+} MarkStack;
+
+/* work left in an incremental slice: scanned fields and objects or swept
+   slots, and a clock() deadline (0 = none), checked every
+   GC_CLOCK_INTERVAL units of work */
+typedef struct GcBudget
 {
-    Value *fields;
-    int field_count;
-    int marked;
-    int alive; /* 1 = allocated/live, 0 = freed */
-} HeapObject;
+    size_t work;
+    clock_t deadline;
+    size_t next_check;
+} GcBudget;
+#define GC_CLOCK_INTERVAL 64
+
+/* monomorphic inline cache for one call site, indexed by the call's
+   instruction index. func_idx is the CONST_FUNCTION index the site last
+   called (-1 before the first call) and target its decoded start. */
+typedef struct CallCache
+{
+    int32_t func_idx;
+    int32_t target;
+    uint64_t hits;
+    uint64_t misses;
+} CallCache;
 
 typedef struct Frame
 {
-    int return_ip;
+    int return_ip; /* instruction index in the decoded stream */
     int return_dst;
     Value *saved_regs;
     int saved_count;
@@ -48,15 +151,76 @@ struct VM
     VMOptions opts;
     Value *regs;
     Bytecode bc;
-    size_t ip;
-    HeapString *heap_head;
-    size_t heap_count;
-    HeapObject *obj_array;
+    DecodedProgram prog; /* bc decoded at load time; this is what vm_run executes */
+    const char *decode_err;
+    CallCache *call_caches; /* one per instruction slot of prog */
+    int verified;           /* verify_err holds the verify_program result for bc */
+    const char *verify_err;
+    Jit *jit; /* NULL when the JIT is off or unavailable */
+    size_t ip; /* index of the next instruction in prog.code */
+    HeapString *str_array;
+    size_t str_count; /* slots ever used, live or free */
+    size_t str_cap;
+    size_t str_live;  /* live unpinned strings */
+    size_t str_pinned;
+    int *str_buckets; /* str_bucket_count (a power of two) chain heads, -1 if empty */
+    size_t str_bucket_count;
+    int *const_strs;  /* per constant of bc: its pinned string slot, -1 if not a string */
+    size_t const_strs_count;
+    int *str_free_list;
+    size_t str_free_count;
+    size_t str_free_cap;
+    uint64_t *str_marks; /* MARK_WORDS(str_cap) words, all clear between collections */
+    char str_scratch[VM_STRING_SCRATCH][VALUE_SMALL_STR_MAX + 1]; /* vm_string_chars of inline strings */
+    unsigned str_scratch_next;
+    Value *obj_inline; /* the object table, see OBJ_INLINE_FIELDS */
+    Value **obj_fields;
+    int *obj_field_count;
+    uint64_t *obj_alive; /* MARK_WORDS(obj_cap) words each */
+    uint64_t *obj_young;
+    uint64_t *obj_remembered;
     size_t obj_count;
     size_t obj_cap;
     int *obj_free_list;
     size_t obj_free_count;
     size_t obj_free_cap;
+    uint64_t *obj_marks; /* MARK_WORDS(obj_cap) words, all clear between collections */
+    /* young generation: string bytes and object fields allocated since the
+       last collection are bumped out of the nursery, and their slots are
+       listed in young_strs / young_objs. remembered lists the old objects a
+       young value has been stored into since then. */
+    char *nursery;
+    size_t nursery_used;
+    int *young_strs;
+    size_t young_str_count;
+    size_t young_str_cap;
+    int *young_objs;
+    size_t young_obj_count;
+    size_t young_obj_cap;
+    int *remembered;
+    size_t remembered_count;
+    size_t remembered_cap;
+    MarkStack gray;       /* major collections */
+    MarkStack young_gray; /* minor collections */
+    /* incremental major collection (opts.gc_incremental) or lazy sweep
+       (unless opts.gc_eager_sweep): the phase, the allocations since the
+       last slice and the next slots to sweep */
+    int gc_phase;
+    int gc_slice_allocs;
+    size_t sweep_str;
+    size_t sweep_obj;
+    struct MarkPool *mark_pool; /* parallel marking threads, started on first use */
+    Arena arena; /* string characters, object fields and frames outside the nursery */
+    size_t old_bytes;       /* old unpinned strings plus old objects, see str_size/obj_size */
+    size_t major_threshold; /* old_bytes that starts a major collection */
+    int gc_pending;         /* GC_MINOR | GC_MAJOR */
+    VMGCStats gc_stats;     /* the counters; vm_gc_stats fills in the sizes */
+    /* opts.gc_trace_events: a ring of the last pauses (NULL when off), the
+       number recorded so far, and the pause under way */
+    VMGCEvent *gc_trace;
+    uint64_t gc_trace_count;
+    VMGCEvent gc_event;
+    uint64_t gc_epoch;
     /* call frames */
     int *call_ret_ips;
     int call_count;
@@ -72,27 +236,320 @@ struct VM
     NativeFn *natives;
     int natives_count;
     int natives_cap;
+    /* memory accounting and limits, see mem_charge. mem_soft_next is the
+       usage that next asks for a collection (SIZE_MAX while one is due),
+       mem_hard_limit is opts.mem_hard_limit except while vm_create and
+       vm_load allocate (0 then: those are never refused), mem_exceeded is
+       set by a refused allocation until vm_run throws mem_limit_str (-1
+       until first needed, see mem_limit_string), and program_bytes is what
+       the loaded program takes. */
+    VMMemoryStats mem;
+    size_t mem_soft_next;
+    size_t mem_hard_limit;
+    int mem_exceeded;
+    int mem_limit_str;
+    size_t program_bytes;
 };
 
-VM *vm_create(const VMOptions *opts)
+/* 1 if p points into the nursery (and must not be passed to free) */
+static int in_nursery(const VM *vm, const void *p)
+{
+    const char *c = (const char *)p;
+    return vm->nursery && c >= vm->nursery && c < vm->nursery + vm->opts.nursery_size;
+}
+
+/* Memory accounting: everything the VM allocates for itself is charged to
+   vm->mem when it is allocated and credited back when it is freed. Tables
+   that grow by doubling count at their capacity, arena blocks at their size
+   class. The hard limit is checked by the mutator's allocations only
+   (vm_alloc_string, vm_alloc_object, frames and handlers), before they
+   allocate anything; what the collector allocates (promotion, its lists)
+   is charged but never refused. */
+
+static void mem_charge(VM *vm, VMMemKind kind, size_t n)
+{
+    vm->mem.by_kind[kind] += n;
+    vm->mem.used += n;
+    if (vm->mem.used > vm->mem.peak)
+        vm->mem.peak = vm->mem.used;
+    if (vm->mem.used > vm->mem_soft_next)
+    {
+        vm->mem_soft_next = SIZE_MAX;
+        vm->mem.soft_collections++;
+        vm->gc_pending |= GC_MAJOR;
+    }
+}
+
+static void mem_credit(VM *vm, VMMemKind kind, size_t n)
+{
+    vm->mem.by_kind[kind] -= n;
+    vm->mem.used -= n;
+}
+
+/* after a major collection has swept: the next usage at which
+   opts.mem_soft_limit asks for another */
+static void mem_rearm_soft(VM *vm)
+{
+    size_t soft = vm->opts.mem_soft_limit, hard = vm->opts.mem_hard_limit, used = vm->mem.used;
+    if (!soft)
+        return;
+    if (used <= soft)
+        vm->mem_soft_next = soft;
+    else
+        vm->mem_soft_next = used + (hard > used ? (hard - used) / 2 : used / 4);
+}
+
+/* an allocation failed: vm_run throws once the instruction is done, and a
+   major collection may make room for the handler */
+static void mem_exceed(VM *vm)
+{
+    vm->mem_exceeded = 1;
+    vm->mem.refused++;
+    vm->gc_pending |= GC_MAJOR;
+}
+
+/* 1 (after mem_exceed) if n more bytes would take the VM past
+   opts.mem_hard_limit */
+static int mem_refuse(VM *vm, size_t n)
+{
+    size_t limit = vm->mem_hard_limit;
+    if (!limit || (vm->mem.used <= limit && n <= limit - vm->mem.used))
+        return 0;
+    mem_exceed(vm);
+    return 1;
+}
+
+/* realloc for the VM's own tables, charged to kind. NULL, with p and the
+   charge left alone, if the system allocator fails. */
+static void *table_realloc(VM *vm, VMMemKind kind, void *p, size_t old_size, size_t new_size)
+{
+    void *q = realloc(p, new_size ? new_size : 1);
+    if (!q)
+        return NULL;
+    if (new_size > old_size)
+        mem_charge(vm, kind, new_size - old_size);
+    else
+        mem_credit(vm, kind, old_size - new_size);
+    return q;
+}
+
+static void table_free(VM *vm, VMMemKind kind, void *p, size_t size)
+{
+    if (!p)
+        return;
+    free(p);
+    mem_credit(vm, kind, size);
+}
+
+/* a block of the arena, charged to kind */
+static void *block_alloc(VM *vm, VMMemKind kind, size_t size)
+{
+    void *p = arena_alloc(&vm->arena, size);
+    if (p)
+        mem_charge(vm, kind, arena_block_size(size));
+    return p;
+}
+
+static void block_free(VM *vm, VMMemKind kind, void *p, size_t size)
+{
+    if (!p)
+        return;
+    arena_free(&vm->arena, p, size);
+    mem_credit(vm, kind, arena_block_size(size));
+}
+
+/* what a string or object counts for in the heap size that triggers major
+   collections and in VMGCStats: its characters or fields and its slot */
+static size_t str_size(const char *s)
+{
+    return sizeof(HeapString) + strlen(s) + 1;
+}
+
+static size_t obj_size(int field_count)
+{
+    return OBJ_SLOT_SIZE + (field_count > OBJ_INLINE_FIELDS ? (size_t)field_count * sizeof(Value) : 0);
+}
+
+static int object_alive(const VM *vm, int idx)
+{
+    return idx >= 0 && (size_t)idx < vm->obj_count && bit_test(vm->obj_alive, (size_t)idx);
+}
+
+static Value *object_fields(const VM *vm, size_t idx)
+{
+    return vm->obj_field_count[idx] <= OBJ_INLINE_FIELDS ? vm->obj_inline + idx * OBJ_INLINE_FIELDS
+                                                         : vm->obj_fields[idx];
+}
+
+/* monotonic wall-clock time for the pause counters and events */
+static uint64_t gc_clock_ns(void)
 {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+    return (uint64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+void vm_options_init(VMOptions *opts)
+{
+    opts->num_registers = 16;
+    opts->jit_threshold = VM_JIT_DEFAULT_THRESHOLD;
+    opts->nursery_size = VM_NURSERY_DEFAULT_SIZE;
+    opts->gc_heap_growth_percent = 100;
+    opts->gc_min_heap = VM_GC_DEFAULT_MIN_HEAP;
+    opts->gc_incremental = 0;
+    opts->gc_slice_work = VM_GC_DEFAULT_SLICE_WORK;
+    opts->gc_slice_us = 0;
+    opts->gc_mark_threads = 1;
+    opts->gc_eager_sweep = 0;
+    opts->gc_compact_percent = 0;
+    opts->allocator.alloc = NULL;
+    opts->allocator.free = NULL;
+    opts->allocator.ctx = NULL;
+    opts->gc_trace_events = 0;
+    opts->mem_soft_limit = 0;
+    opts->mem_hard_limit = 0;
+}
+
+static void pin_string(VM *vm, int idx);
+
+/* the pinned VM_MEM_LIMIT_ERROR string that a refused allocation throws, or
+   -1 if even that could not be allocated. With a hard limit vm_create makes
+   it up front, so throwing never needs room under the limit; otherwise only
+   the system allocator refuses, and it is made (past any limit) on first
+   use. */
+static int mem_limit_string(VM *vm)
+{
+    if (vm->mem_limit_str < 0)
+    {
+        size_t hard = vm->mem_hard_limit;
+        vm->mem_hard_limit = 0;
+        vm->mem_limit_str = vm_alloc_string(vm, VM_MEM_LIMIT_ERROR);
+        vm->mem_hard_limit = hard;
+        pin_string(vm, vm->mem_limit_str);
+    }
+    return vm->mem_limit_str;
+}
+
+/* opts with every 0 field replaced by its default, and the "off" values
+   turned into the 0 the rest of the VM takes as off */
+static VMOptions resolve_options(const VMOptions *opts)
+{
+    VMOptions defaults, o = *opts;
+    vm_options_init(&defaults);
+    if (o.num_registers <= 0)
+        o.num_registers = defaults.num_registers;
+    if (o.jit_threshold == 0)
+        o.jit_threshold = defaults.jit_threshold;
+    else if (o.jit_threshold < 0)
+        o.jit_threshold = 0;
+    if (o.nursery_size == 0)
+        o.nursery_size = defaults.nursery_size;
+    else if (o.nursery_size == VM_NURSERY_OFF)
+        o.nursery_size = 0;
+    if (o.gc_heap_growth_percent == 0)
+        o.gc_heap_growth_percent = defaults.gc_heap_growth_percent;
+    if (o.gc_min_heap == 0)
+        o.gc_min_heap = defaults.gc_min_heap;
+    if (o.gc_slice_work == 0)
+        o.gc_slice_work = defaults.gc_slice_work;
+    if (o.gc_mark_threads <= 0)
+        o.gc_mark_threads = defaults.gc_mark_threads;
+    return o;
+}
+
+VM *vm_create(const VMOptions *options)
+{
+    VMOptions resolved = resolve_options(options);
+    const VMOptions *opts = &resolved;
     VM *vm = (VM *)malloc(sizeof(VM));
+    if (!vm)
+        return NULL;
     vm->opts = *opts;
-    vm->regs = (Value *)calloc(opts->num_registers, sizeof(Value));
-    vm->bc.code = NULL;
-    vm->bc.code_size = 0;
-    vm->bc.consts = NULL;
-    vm->bc.consts_count = 0;
-    vm->bc.consts_cap = 0;
+    memset(&vm->mem, 0, sizeof(vm->mem));
+    vm->mem_soft_next = opts->mem_soft_limit ? opts->mem_soft_limit : SIZE_MAX;
+    vm->mem_hard_limit = 0;
+    vm->mem_exceeded = 0;
+    vm->program_bytes = 0;
+    vm->gc_pending = 0;
+    mem_charge(vm, VM_MEM_VM, sizeof(VM));
+    vm->regs = (Value *)malloc(opts->num_registers * sizeof(Value));
+    if (!vm->regs)
+    {
+        free(vm);
+        return NULL;
+    }
+    mem_charge(vm, VM_MEM_REGISTERS, opts->num_registers * sizeof(Value));
+    for (int i = 0; i < opts->num_registers; ++i)
+        vm->regs[i] = value_none();
+    bc_init(&vm->bc);
+    memset(&vm->prog, 0, sizeof(vm->prog));
+    vm->decode_err = "no bytecode loaded";
+    vm->call_caches = NULL;
+    vm->verified = 0;
+    vm->verify_err = NULL;
+    vm->jit = NULL;
     vm->ip = 0;
-    vm->heap_head = NULL;
-    vm->heap_count = 0;
-    vm->obj_array = NULL;
+    vm->str_array = NULL;
+    vm->str_count = 0;
+    vm->str_cap = 0;
+    vm->str_live = 0;
+    vm->str_pinned = 0;
+    vm->str_buckets = NULL;
+    vm->str_bucket_count = 0;
+    vm->const_strs = NULL;
+    vm->const_strs_count = 0;
+    vm->str_free_list = NULL;
+    vm->str_free_count = 0;
+    vm->str_free_cap = 0;
+    vm->obj_inline = NULL;
+    vm->obj_fields = NULL;
+    vm->obj_field_count = NULL;
+    vm->obj_alive = NULL;
+    vm->obj_young = NULL;
+    vm->obj_remembered = NULL;
     vm->obj_count = 0;
     vm->obj_cap = 0;
     vm->obj_free_list = NULL;
     vm->obj_free_count = 0;
     vm->obj_free_cap = 0;
+    arena_init(&vm->arena, &opts->allocator);
+    vm->nursery = opts->nursery_size > 0 ? (char *)arena_alloc_raw(&vm->arena, opts->nursery_size) : NULL;
+    if (vm->nursery)
+        mem_charge(vm, VM_MEM_NURSERY, opts->nursery_size);
+    vm->nursery_used = 0;
+    vm->young_strs = NULL;
+    vm->young_str_count = 0;
+    vm->young_str_cap = 0;
+    vm->young_objs = NULL;
+    vm->young_obj_count = 0;
+    vm->young_obj_cap = 0;
+    vm->remembered = NULL;
+    vm->remembered_count = 0;
+    vm->remembered_cap = 0;
+    memset(&vm->gray, 0, sizeof(vm->gray));
+    memset(&vm->young_gray, 0, sizeof(vm->young_gray));
+    vm->gray.scan_obj = -1;
+    vm->young_gray.scan_obj = -1;
+    vm->gc_phase = GC_IDLE;
+    vm->gc_slice_allocs = 0;
+    vm->sweep_str = 0;
+    vm->sweep_obj = 0;
+    vm->mark_pool = NULL;
+    vm->str_marks = NULL;
+    vm->obj_marks = NULL;
+    vm->old_bytes = 0;
+    vm->major_threshold = opts->gc_min_heap;
+    memset(&vm->gc_stats, 0, sizeof(vm->gc_stats));
+    vm->gc_trace = opts->gc_trace_events ? (VMGCEvent *)malloc(opts->gc_trace_events * sizeof(VMGCEvent)) : NULL;
+    if (vm->gc_trace)
+        mem_charge(vm, VM_MEM_GC, opts->gc_trace_events * sizeof(VMGCEvent));
+    vm->gc_trace_count = 0;
+    memset(&vm->gc_event, 0, sizeof(vm->gc_event));
+    vm->gc_epoch = gc_clock_ns();
     vm->call_ret_ips = NULL;
     vm->call_count = 0;
     vm->call_cap = 0;
@@ -104,34 +561,76 @@ VM *vm_create(const VMOptions *opts)
     vm->natives_cap = 0;
     vm->frames = NULL;
     vm->frames_count = 0;
+    vm->mem_limit_str = -1;
+    if ((opts->nursery_size && !vm->nursery) || (opts->gc_trace_events && !vm->gc_trace))
+    {
+        vm_destroy(vm);
+        return NULL;
+    }
+    if (opts->mem_hard_limit)
+        mem_limit_string(vm);
+    vm->mem_hard_limit = opts->mem_hard_limit;
     return vm;
 }
 
+static void mark_pool_free(struct MarkPool *pool);
+
+/* bytes of an object's field array, as allocated */
+static size_t fields_size(int field_count)
+{
+    return field_count ? (size_t)field_count * sizeof(Value) : 1;
+}
+
+static void free_frame(VM *vm, Frame *f)
+{
+    block_free(vm, VM_MEM_FRAMES, f, sizeof(Frame) + (size_t)f->saved_count * sizeof(Value));
+}
+
 void vm_destroy(VM *vm)
 {
     if (!vm)
         return;
+    mark_pool_free(vm->mark_pool);
     free(vm->regs);
     bc_free(&vm->bc);
-    HeapString *cur = vm->heap_head;
-    while (cur)
+    jit_free(vm->jit);
+    decoded_free(&vm->prog);
+    free(vm->call_caches);
+    /* blocks from the arena's chunks go with arena_destroy; only the big
+       ones are freed one by one */
+    for (size_t i = 0; i < vm->str_count; ++i)
     {
-        HeapString *n = cur->next;
-        free(cur->s);
-        free(cur);
-        cur = n;
+        const char *s = vm->str_array[i].s;
+        if (s && !in_nursery(vm, s) && strlen(s) + 1 > ARENA_MAX_BLOCK)
+            arena_free(&vm->arena, vm->str_array[i].s, strlen(s) + 1);
     }
-    /* free objects array and fields */
-    if (vm->obj_array)
+    free(vm->str_array);
+    free(vm->str_free_list);
+    free(vm->str_buckets);
+    free(vm->const_strs);
+    for (size_t i = 0; i < vm->obj_count; ++i)
     {
-        for (size_t i = 0; i < vm->obj_count; ++i)
-        {
-            if (vm->obj_array[i].alive && vm->obj_array[i].fields)
-                free(vm->obj_array[i].fields);
-        }
-        free(vm->obj_array);
+        Value *fields = vm->obj_fields[i];
+        if (bit_test(vm->obj_alive, i) && fields && !in_nursery(vm, fields) &&
+            fields_size(vm->obj_field_count[i]) > ARENA_MAX_BLOCK)
+            arena_free(&vm->arena, fields, fields_size(vm->obj_field_count[i]));
     }
+    free(vm->obj_inline);
+    free(vm->obj_fields);
+    free(vm->obj_field_count);
+    free(vm->obj_alive);
+    free(vm->obj_young);
+    free(vm->obj_remembered);
     free(vm->obj_free_list);
+    free(vm->gc_trace);
+    arena_free_raw(&vm->arena, vm->nursery, vm->opts.nursery_size);
+    free(vm->young_strs);
+    free(vm->young_objs);
+    free(vm->remembered);
+    free(vm->gray.items);
+    free(vm->young_gray.items);
+    free(vm->str_marks);
+    free(vm->obj_marks);
     free(vm->call_ret_ips);
     free(vm->handlers);
     free(vm->natives);
@@ -140,739 +639,2683 @@ void vm_destroy(VM *vm)
     while (f)
     {
         Frame *n = f->next;
-        if (f->saved_regs)
-            free(f->saved_regs);
-        free(f);
+        free_frame(vm, f);
         f = n;
     }
+    arena_destroy(&vm->arena);
     free(vm);
 }
 
-void vm_load(VM *vm, const Bytecode *bc)
+static int pin_constant_strings(VM *vm);
+static void unpin_constant_strings(VM *vm);
+
+/* bytes of the loaded program (VM_MEM_PROGRAM): the copy of the bytecode,
+   its decoded form, the call caches and the string constant map */
+static size_t program_bytes(const VM *vm)
 {
-    bc_init(&vm->bc);
-    /* deep copy bc */
-    vm->bc.code = malloc(bc->code_size);
-    memcpy(vm->bc.code, bc->code, bc->code_size);
-    vm->bc.code_size = bc->code_size;
-    vm->bc.consts_count = 0;
-    vm->bc.consts_cap = 0;
-    vm->bc.consts = NULL;
-    for (size_t i = 0; i < bc->consts_count; ++i)
-    {
-        Constant *c = &bc->consts[i];
-        if (c->type == CONST_INT)
-            bc_add_const_int(&vm->bc, c->value.i);
-        else if (c->type == CONST_DOUBLE)
-            bc_add_const_double(&vm->bc, c->value.d);
-        else if (c->type == CONST_STRING)
-            bc_add_const_string(&vm->bc, c->value.s);
-        else if (c->type == CONST_FUNCTION)
-            bc_add_const_function(&vm->bc, c->value.func.start, c->value.func.nargs);
+    size_t n = vm->bc.code_size + vm->bc.consts_cap * sizeof(Constant);
+    for (size_t i = 0; i < vm->bc.consts_count; ++i)
+    {
+        if (vm->bc.consts[i].type == CONST_STRING)
+            n += strlen(vm->bc.consts[i].value.s) + 1;
     }
-    vm->ip = 0;
+    if (vm->prog.code)
+        n += (vm->prog.count + 2) * (sizeof(Instr) + sizeof(uint32_t)) +
+             (vm->prog.captures_count + vm->prog.func_count) * sizeof(int32_t);
+    if (vm->call_caches)
+        n += (vm->prog.count + 2) * sizeof(CallCache);
+    if (vm->const_strs)
+        n += (vm->bc.consts_count + 1) * sizeof(int);
+    return n;
 }
 
-static void heap_mark_from_roots(VM *vm)
+/* decode vm->bc once so the interpreter never parses operands at run time,
+   turn every string constant load into an OP_LOAD_CONST_STR of its interned
+   string, and start every call site with an empty inline cache. A non-NULL
+   load_err (vm->bc could not be copied) is recorded in place of decoding. */
+static void vm_decode(VM *vm, const char *load_err)
 {
-    for (int i = 0; i < vm->opts.num_registers; ++i)
+    jit_free(vm->jit);
+    vm->jit = NULL;
+    decoded_free(&vm->prog);
+    vm->decode_err = load_err ? load_err : decode_bytecode(&vm->bc, &vm->prog);
+    free(vm->call_caches);
+    vm->call_caches = NULL;
+    if (!vm->decode_err && !pin_constant_strings(vm))
+        vm->decode_err = VM_MEM_LIMIT_ERROR;
+    if (!vm->decode_err)
+        vm->call_caches = (CallCache *)calloc(vm->prog.count + 2, sizeof(CallCache));
+    if (!vm->decode_err && !vm->call_caches)
+        vm->decode_err = VM_MEM_LIMIT_ERROR;
+    if (vm->decode_err)
     {
-        if (vm->regs[i].type == V_STRING)
-        {
-            int idx = vm->regs[i].as.str_idx; // index -> walk linked list
-            HeapString *cur = vm->heap_head;
-            int j = 0;
-            while (cur && j < idx)
-            {
-                cur = cur->next;
-                ++j;
-            }
-            if (cur)
-                cur->marked = 1;
-        }
-        else if (vm->regs[i].type == V_OBJECT)
-        {
-            int idx = vm->regs[i].as.obj_idx;
-            if (idx >= 0 && (size_t)idx < vm->obj_count)
-            {
-                if (vm->obj_array[idx].alive)
-                    vm->obj_array[idx].marked = 1;
-            }
-        }
+        unpin_constant_strings(vm);
+        free(vm->const_strs);
+        vm->const_strs = NULL;
     }
-    /* mark from frames' saved regs (we save only the callee-clobbered subset) */
-    Frame *fr = vm->frames;
-    while (fr)
+    else
     {
-        if (fr->saved_regs && fr->saved_count > 0)
+        for (size_t i = 0; i < vm->prog.count; ++i)
         {
-            for (int i = 0; i < fr->saved_count; ++i)
+            Instr *in = &vm->prog.code[i];
+            if ((in->op == OP_LOAD_CONST || in->op == OP_ALLOC_STR) && in->b >= 0 &&
+                (size_t)in->b < vm->bc.consts_count && vm->const_strs[in->b] >= 0)
             {
-                if (fr->saved_regs[i].type == V_STRING)
-                {
-                    int idx = fr->saved_regs[i].as.str_idx;
-                    HeapString *cur = vm->heap_head;
-                    int j = 0;
-                    while (cur && j < idx)
-                    {
-                        cur = cur->next;
-                        ++j;
-                    }
-                    if (cur)
-                        cur->marked = 1;
-                }
-                else if (fr->saved_regs[i].type == V_OBJECT)
-                {
-                    int idx = fr->saved_regs[i].as.obj_idx;
-                    if (idx >= 0 && (size_t)idx < vm->obj_count)
-                    {
-                        if (vm->obj_array[idx].alive)
-                            vm->obj_array[idx].marked = 1;
-                    }
-                }
+                in->op = OP_LOAD_CONST_STR;
+                in->b = vm->const_strs[in->b];
             }
         }
-        fr = fr->next;
+        for (size_t i = 0; i < vm->prog.count + 2; ++i)
+            vm->call_caches[i].func_idx = -1;
+        vm->jit = jit_create(&vm->prog, &vm->bc, vm->opts.jit_threshold);
     }
+    mem_credit(vm, VM_MEM_PROGRAM, vm->program_bytes);
+    vm->program_bytes = program_bytes(vm);
+    mem_charge(vm, VM_MEM_PROGRAM, vm->program_bytes);
+    vm->verified = 0;
+    vm->ip = 0;
+}
 
-    /* propagate marks across object graph until fixed point */
-    int changed = 1;
-    while (changed)
+/* deep copy of src into the empty dst; 0 if the system allocator failed,
+   with what was copied left for bc_free */
+static int copy_bytecode(Bytecode *dst, const Bytecode *src)
+{
+    dst->code = (u8 *)malloc(src->code_size ? src->code_size : 1);
+    dst->consts = (Constant *)malloc((src->consts_count ? src->consts_count : 1) * sizeof(Constant));
+    if (!dst->code || !dst->consts)
+        return 0;
+    memcpy(dst->code, src->code, src->code_size);
+    dst->code_size = src->code_size;
+    dst->consts_cap = src->consts_count;
+    for (size_t i = 0; i < src->consts_count; ++i)
     {
-        changed = 0;
-        for (size_t oi = 0; oi < vm->obj_count; ++oi)
-        {
-            HeapObject *o = &vm->obj_array[oi];
-            if (!o->alive)
-                continue;
-            if (o->marked)
-            {
-                for (int f = 0; f < o->field_count; ++f)
-                {
-                    Value *v = &o->fields[f];
-                    if (v->type == V_STRING)
-                    {
-                        int idx = v->as.str_idx;
-                        HeapString *cur = vm->heap_head;
-                        int j = 0;
-                        while (cur && j < idx)
-                        {
-                            cur = cur->next;
-                            ++j;
-                        }
-                        if (cur && !cur->marked)
-                        {
-                            cur->marked = 1;
-                            changed = 1;
-                        }
-                    }
-                    else if (v->type == V_OBJECT)
-                    {
-                        int idx = v->as.obj_idx;
-                        if (idx >= 0 && (size_t)idx < vm->obj_count)
-                        {
-                            HeapObject *obj2 = &vm->obj_array[idx];
-                            if (obj2->alive && !obj2->marked)
-                            {
-                                obj2->marked = 1;
-                                changed = 1;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        dst->consts[i] = src->consts[i];
+        if (src->consts[i].type == CONST_STRING)
+            dst->consts[i].value.s = vm_strdup(src->consts[i].value.s);
+        dst->consts_count = i + 1;
+        if (src->consts[i].type == CONST_STRING && !dst->consts[i].value.s)
+            return 0;
     }
+    return 1;
 }
 
-static void heap_sweep(VM *vm)
+void vm_load(VM *vm, const Bytecode *bc)
+{
+    bc_free(&vm->bc);
+    bc_init_version(&vm->bc, bc->version);
+    if (copy_bytecode(&vm->bc, bc))
+    {
+        vm_decode(vm, NULL);
+        return;
+    }
+    bc_free(&vm->bc);
+    vm_decode(vm, VM_MEM_LIMIT_ERROR);
+}
+
+/* makes room for one more entry in a growable index list (free-lists,
+   young lists, ...) of count entries, charged to kind; 0 if the system
+   allocator failed */
+static int reserve_index(VM *vm, VMMemKind kind, int **list, size_t count, size_t *cap)
+{
+    if (count + 1 > *cap)
+    {
+        size_t newcap = *cap ? *cap * 2 : 8;
+        int *grown = (int *)table_realloc(vm, kind, *list, *cap * sizeof(int), newcap * sizeof(int));
+        if (!grown)
+            return 0;
+        *list = grown;
+        *cap = newcap;
+    }
+    return 1;
+}
+
+/* bytes reserve_index would add to a list of count entries */
+static size_t index_growth(size_t count, size_t cap)
+{
+    return count + 1 > cap ? (cap ? cap : 8) * sizeof(int) : 0;
+}
+
+/* appends idx to an index list; 0 if there was no room for it */
+static int push_index(VM *vm, VMMemKind kind, int **list, size_t *count, size_t *cap, int idx)
+{
+    if (!reserve_index(vm, kind, list, *count, cap))
+        return 0;
+    (*list)[(*count)++] = idx;
+    return 1;
+}
+
+static void push_gray(VM *vm, MarkStack *st, int idx)
+{
+    if (st->count >= GC_MARK_STACK_MAX || !push_index(vm, VM_MEM_GC, &st->items, &st->count, &st->cap, idx))
+        st->overflow = 1;
+}
+
+/* 1 once b is used up; consumes `units` of work */
+static int budget_spent(GcBudget *b, size_t units)
+{
+    if (!b)
+        return 0;
+    if (b->work <= units)
+        return 1;
+    b->work -= units;
+    if (!b->deadline || b->work > b->next_check)
+        return 0;
+    b->next_check = b->work > GC_CLOCK_INTERVAL ? b->work - GC_CLOCK_INTERVAL : 0;
+    return clock() >= b->deadline;
+}
+
+/* marks v if mode traces it. A newly marked object becomes gray: it goes
+   onto the mode's mark stack. */
+static void mark_value(VM *vm, Value v, int mode)
+{
+    if (value_type(v) == V_STRING)
+    {
+        int idx = value_as_str(v);
+        if (idx < 0 || (size_t)idx >= vm->str_count || !vm->str_array[idx].s)
+            return;
+        if (mode == MARK_ALL || (mode == MARK_YOUNG) == (vm->str_array[idx].young != 0))
+            bit_set(vm->str_marks, (size_t)idx);
+    }
+    else if (value_type(v) == V_OBJECT)
+    {
+        int idx = value_as_obj(v);
+        if (!object_alive(vm, idx) || bit_test(vm->obj_marks, (size_t)idx))
+            return;
+        if (mode != MARK_ALL && (mode == MARK_YOUNG) != bit_test(vm->obj_young, (size_t)idx))
+            return;
+        bit_set(vm->obj_marks, (size_t)idx);
+        push_gray(vm, mode == MARK_YOUNG ? &vm->young_gray : &vm->gray, idx);
+    }
+}
+
+static void scan_object(VM *vm, int idx, int mode)
+{
+    const Value *fields = object_fields(vm, (size_t)idx);
+    for (int f = 0; f < vm->obj_field_count[idx]; ++f)
+        mark_value(vm, fields[f], mode);
+}
+
+/* scans gray objects until none is left (returns 1) or the budget runs out
+   (returns 0; NULL means no limit). After an overflow every marked object
+   (every marked young one for a minor collection) is scanned again, pass
+   after pass until one ends without overflowing, so deep or wide graphs cost
+   extra passes instead of unbounded stack memory. */
+static int trace(VM *vm, int mode, GcBudget *budget)
 {
-    HeapString **p = &vm->heap_head;
-    int idx = 0;
-    while (*p)
+    MarkStack *st = mode == MARK_YOUNG ? &vm->young_gray : &vm->gray;
+    for (;;)
     {
-        HeapString *cur = *p;
-        if (!cur->marked)
+        int idx;
+        if (st->scan_obj >= 0)
         {
-            *p = cur->next;
-            free(cur->s);
-            free(cur);
-            vm->heap_count--;
-            /* do not increment p or idx */
+            idx = st->scan_obj;
         }
-        else
+        else if (st->count > 0)
         {
-            cur->marked = 0;
-            p = &cur->next;
-            ++idx;
+            idx = st->items[--st->count];
+            st->scan_field = 0;
         }
-    }
-
-    /* sweep objects: free unreachable objects and push indices onto free-list */
-    for (size_t i = 0; i < vm->obj_count; ++i)
-    {
-        HeapObject *o = &vm->obj_array[i];
-        if (!o->alive)
-            continue;
-        if (!o->marked)
+        else if (st->rescanning)
         {
-            /* free object fields */
-            if (o->fields)
+            size_t end = mode == MARK_YOUNG ? vm->young_obj_count : vm->obj_count;
+            if (st->rescan_pos >= end)
             {
-                free(o->fields);
-                o->fields = NULL;
+                st->rescanning = 0;
+                continue;
             }
-            o->field_count = 0;
-            o->alive = 0;
-
-            /* push this index onto the free-list */
-            if (vm->obj_free_count + 1 > vm->obj_free_cap)
+            idx = mode == MARK_YOUNG ? vm->young_objs[st->rescan_pos] : (int)st->rescan_pos;
+            st->rescan_pos++;
+            st->scan_field = 0;
+            if (!bit_test(vm->obj_alive, (size_t)idx) || !bit_test(vm->obj_marks, (size_t)idx))
             {
-                size_t newcap = vm->obj_free_cap ? vm->obj_free_cap * 2 : 8;
-                vm->obj_free_list = realloc(vm->obj_free_list, newcap * sizeof(int));
-                vm->obj_free_cap = newcap;
+                if (budget_spent(budget, 1))
+                    return 0;
+                continue;
             }
-            vm->obj_free_list[vm->obj_free_count++] = (int)i;
+        }
+        else if (st->overflow)
+        {
+            st->overflow = 0;
+            st->rescanning = 1;
+            st->rescan_pos = 0;
+            continue;
         }
         else
         {
-            /* clear mark for next GC cycle */
-            o->marked = 0;
+            return 1;
         }
+        const Value *fields = object_fields(vm, (size_t)idx);
+        int count = vm->obj_field_count[idx];
+        int first = st->scan_field;
+        int end = count - first > GC_SCAN_CHUNK ? first + GC_SCAN_CHUNK : count;
+        for (int f = first; f < end; ++f)
+            mark_value(vm, fields[f], mode);
+        st->scan_obj = end < count ? idx : -1;
+        st->scan_field = end;
+        if (budget_spent(budget, 1 + (size_t)(end - first)))
+            return 0;
     }
 }
 
-void vm_gc(VM *vm)
+/* the registers and the saved registers of active calls */
+static void mark_roots(VM *vm, int mode)
 {
-    heap_mark_from_roots(vm);
-    heap_sweep(vm);
+    vm->gc_event.roots += (size_t)vm->opts.num_registers;
+    for (int i = 0; i < vm->opts.num_registers; ++i)
+        mark_value(vm, vm->regs[i], mode);
+    /* mark from frames' saved regs (we save only the callee-clobbered subset) */
+    for (Frame *fr = vm->frames; fr; fr = fr->next)
+    {
+        vm->gc_event.roots += (size_t)fr->saved_count;
+        for (int i = 0; i < fr->saved_count; ++i)
+            mark_value(vm, fr->saved_regs[i], mode);
+    }
 }
 
-int vm_alloc_string(VM *vm, const char *s)
+/* a string or object that turns old while an incremental collection runs
+   (allocated old, promoted, or found by interning) must survive it: while
+   marking it is marked, and a promoted object (gray set) is pushed since
+   its fields may point at unmarked data; while sweeping it is marked if the
+   sweep has not reached it yet */
+static void survive_cycle_str(VM *vm, int idx)
 {
-    HeapString *hs = (HeapString *)malloc(sizeof(HeapString));
-    hs->s = vm_strdup(s);
-    hs->marked = 0;
-    hs->next = NULL;
-    if (!vm->heap_head)
-        vm->heap_head = hs;
-    else
+    if (vm->gc_phase == GC_MARKING || (vm->gc_phase == GC_SWEEPING && (size_t)idx >= vm->sweep_str))
+        bit_set(vm->str_marks, (size_t)idx);
+}
+
+static void survive_cycle_obj(VM *vm, int idx, int gray)
+{
+    if (vm->gc_phase == GC_MARKING)
+    {
+        if (!bit_test(vm->obj_marks, (size_t)idx))
+        {
+            bit_set(vm->obj_marks, (size_t)idx);
+            if (gray)
+                push_gray(vm, &vm->gray, idx);
+        }
+    }
+    else if (vm->gc_phase == GC_SWEEPING && (size_t)idx >= vm->sweep_obj)
     {
-        HeapString *cur = vm->heap_head;
-        while (cur->next)
-            cur = cur->next;
-        cur->next = hs;
+        bit_set(vm->obj_marks, (size_t)idx);
     }
-    int idx = vm->heap_count++;
-    return idx;
 }
 
-int vm_alloc_object(VM *vm, int field_count)
+#if VM_THREADS_AVAILABLE
+/* Parallel marking for stop-the-world major collections. Each of the
+   nworkers threads (the collecting one is worker 0) traces from a private
+   stack and keeps up to GC_SHARE_MIN of its gray objects in a Chase-Lev
+   deque, which it refills as it drains: the owner pushes and pops at the
+   bottom and workers out of work steal from the top. Most objects thus never
+   touch shared memory beyond their mark bit, which is set with an atomic or
+   so that exactly one worker pushes each object. When both the stack and the
+   deque are full the object is only marked and overflow is set; another
+   round then first rescans the marked objects, GC_RESCAN_CHUNK slots per
+   claim, as the serial trace does. */
+#define GC_SHARE_MIN 64
+#define GC_RESCAN_CHUNK 4096
+#define GC_IDLE_SPINS 64
+#define GC_IDLE_SLEEP_US 50
+
+typedef struct MarkDeque
 {
-    /* reuse freed slot if available */
-    int idx = -1;
-    if (vm->obj_free_count > 0)
+    int *buf;
+    int64_t mask;
+    int64_t top;
+    int64_t bottom;
+    char pad[64]; /* keep deques of different workers off one cache line */
+} MarkDeque;
+
+typedef struct MarkWorker
+{
+    struct MarkPool *pool;
+    int id;
+    int *stack; /* private, GC_MARK_STACK_MAX entries */
+    size_t count;
+} MarkWorker;
+
+typedef struct MarkPool
+{
+    VM *vm;
+    int nworkers;
+    int nallocated; /* workers with a deque and a stack, >= nworkers */
+    VmThread *threads; /* nworkers - 1 */
+    MarkWorker *workers;
+    MarkDeque *deques;
+    VmMutex lock;
+    VmCond start; /* round was bumped or quit set */
+    VmCond done;  /* finished reached nworkers - 1 */
+    int round;
+    int finished;
+    int quit;
+    /* state of the current round */
+    int rescan;
+    int idle; /* workers that found no work anywhere */
+    int overflow;
+    size_t next_chunk;
+} MarkPool;
+
+/* 0 if the deque is full */
+static int deque_push(MarkDeque *d, int idx)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t > d->mask)
+        return 0;
+    __atomic_store_n(&d->buf[b & d->mask], idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* owner only; -1 if empty */
+static int deque_pop(MarkDeque *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b)
     {
-        idx = vm->obj_free_list[--vm->obj_free_count];
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return -1;
     }
-    else
+    int idx = __atomic_load_n(&d->buf[b & d->mask], __ATOMIC_RELAXED);
+    if (t == b)
     {
-        /* need new slot */
-        if (vm->obj_count == vm->obj_cap)
-        {
-            size_t newcap = vm->obj_cap ? vm->obj_cap * 2 : 8;
-            vm->obj_array = realloc(vm->obj_array, newcap * sizeof(HeapObject));
-            /* zero new slots */
-            for (size_t i = vm->obj_cap; i < newcap; ++i)
-            {
-                vm->obj_array[i].fields = NULL;
-                vm->obj_array[i].field_count = 0;
-                vm->obj_array[i].marked = 0;
-                vm->obj_array[i].alive = 0;
-            }
-            vm->obj_cap = newcap;
-        }
-        idx = (int)vm->obj_count++;
+        /* last item: race the thieves for it */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            idx = -1;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
     }
-    /* allocate fields for this object */
-    vm->obj_array[idx].fields = (Value *)calloc(field_count, sizeof(Value));
-    vm->obj_array[idx].field_count = field_count;
-    vm->obj_array[idx].marked = 0;
-    vm->obj_array[idx].alive = 1;
     return idx;
 }
 
-void vm_set_object_field(VM *vm, int obj_idx, int field, Value val)
+/* any thread; -1 if empty or another thread won the race */
+static int deque_steal(MarkDeque *d)
 {
-    if (obj_idx < 0 || (size_t)obj_idx >= vm->obj_count)
-        return;
-    HeapObject *cur = &vm->obj_array[obj_idx];
-    if (!cur->alive)
-        return;
-    if (field < 0 || field >= cur->field_count)
-        return;
-    cur->fields[field] = val;
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return -1;
+    int idx = __atomic_load_n(&d->buf[t & d->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;
+    return idx;
 }
 
-Value vm_get_object_field(VM *vm, int obj_idx, int field)
+static int64_t deque_size(MarkDeque *d)
 {
-    Value none;
-    none.type = V_NONE;
-    if (obj_idx < 0)
-        return none;
-    if ((size_t)obj_idx >= vm->obj_count)
-        return none;
-    HeapObject *cur = &vm->obj_array[obj_idx];
-    if (!cur->alive)
-        return none;
-    if (field < 0 || field >= cur->field_count)
-        return none;
-    return cur->fields[field];
+    return __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE) - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
 }
 
-void vm_register_native(VM *vm, int index, NativeFn fn)
+static void worker_push(MarkWorker *w, int idx)
 {
-    if (index < 0)
+    MarkDeque *d = &w->pool->deques[w->id];
+    if (deque_size(d) < GC_SHARE_MIN && deque_push(d, idx))
         return;
-    if (index + 1 > vm->natives_cap)
+    if (w->count < GC_MARK_STACK_MAX)
+        w->stack[w->count++] = idx;
+    else if (!deque_push(d, idx))
+        __atomic_store_n(&w->pool->overflow, 1, __ATOMIC_RELAXED);
+}
+
+/* the next gray object of w's own, topping the deque up from the stack;
+   -1 if w has none left */
+static int worker_pop(MarkWorker *w)
+{
+    MarkDeque *d = &w->pool->deques[w->id];
+    if (!w->count)
+        return deque_size(d) > 0 ? deque_pop(d) : -1; /* only thieves shrink it */
+    int idx = w->stack[--w->count];
+    while (w->count && deque_size(d) < GC_SHARE_MIN && deque_push(d, w->stack[w->count - 1]))
+        --w->count;
+    return idx;
+}
+
+/* 1 if this call set bit i */
+static int bit_set_atomic(uint64_t *bits, size_t i)
+{
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    if (__atomic_load_n(&bits[i >> 6], __ATOMIC_RELAXED) & bit)
+        return 0;
+    return !(__atomic_fetch_or(&bits[i >> 6], bit, __ATOMIC_RELAXED) & bit);
+}
+
+/* marks v; a newly marked object is returned in *keep if that is still
+   free and pushed otherwise */
+static void par_mark_value(MarkWorker *w, Value v, int *keep)
+{
+    VM *vm = w->pool->vm;
+    if (value_type(v) == V_STRING)
     {
-        int newcap = vm->natives_cap ? vm->natives_cap * 2 : 8;
-        while (newcap <= index)
-            newcap *= 2;
-        vm->natives = realloc(vm->natives, newcap * sizeof(NativeFn));
-        for (int i = vm->natives_count; i < newcap; ++i)
-            vm->natives[i] = NULL;
-        vm->natives_cap = newcap;
+        int idx = value_as_str(v);
+        if (idx >= 0 && (size_t)idx < vm->str_count && vm->str_array[idx].s)
+            bit_set_atomic(vm->str_marks, (size_t)idx);
+    }
+    else if (value_type(v) == V_OBJECT)
+    {
+        int idx = value_as_obj(v);
+        if (!object_alive(vm, idx) || !bit_set_atomic(vm->obj_marks, (size_t)idx))
+            return;
+        if (*keep < 0)
+            *keep = idx;
+        else
+            worker_push(w, idx);
     }
-    vm->natives[index] = fn;
-    if (index >= vm->natives_count)
-        vm->natives_count = index + 1;
 }
 
-const char *vm_run(VM *vm)
+/* scans idx, then one object that marked, and so on, so chains of objects
+   are followed without pushing anything */
+static void par_scan_object(MarkWorker *w, int idx)
 {
-    const char *verr = vm_verify(vm);
-    if (verr)
-        return verr;
+    while (idx >= 0)
+    {
+        const VM *vm = w->pool->vm;
+        const Value *fields = object_fields(vm, (size_t)idx);
+        int next = -1;
+        for (int f = 0; f < vm->obj_field_count[idx]; ++f)
+            par_mark_value(w, fields[f], &next);
+        idx = next;
+    }
+}
 
-    while (vm->ip < vm->bc.code_size)
+/* one worker's share of a round: claim rescan chunks if asked to, then
+   trace and steal until every worker is out of work */
+static void mark_round(MarkWorker *w)
+{
+    MarkPool *pool = w->pool;
+    VM *vm = pool->vm;
+    int idx;
+    if (pool->rescan)
     {
-        u8 op = vm->bc.code[vm->ip++];
-        switch (op)
+        size_t first;
+        while ((first = __atomic_fetch_add(&pool->next_chunk, 1, __ATOMIC_RELAXED) * GC_RESCAN_CHUNK) <
+               vm->obj_count)
         {
-        case OP_HALT:
-            return NULL;
-        case OP_LOAD_CONST:
-        {
-            int32_t reg;
-            memcpy(&reg, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            int32_t ci;
-            memcpy(&ci, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            Constant *c = &vm->bc.consts[ci];
-            if (c->type == CONST_INT)
+            size_t end = first + GC_RESCAN_CHUNK < vm->obj_count ? first + GC_RESCAN_CHUNK : vm->obj_count;
+            for (size_t i = first; i < end; ++i)
             {
-                vm->regs[reg].type = V_INT;
-                vm->regs[reg].as.i = c->value.i;
+                uint64_t word = __atomic_load_n(&vm->obj_marks[i >> 6], __ATOMIC_RELAXED);
+                if (!bit_test(vm->obj_alive, i) || !((word >> (i & 63)) & 1))
+                    continue;
+                par_scan_object(w, (int)i);
+                while ((idx = worker_pop(w)) >= 0)
+                    par_scan_object(w, idx);
             }
-            else if (c->type == CONST_DOUBLE)
-            {
-                vm->regs[reg].type = V_DOUBLE;
-                vm->regs[reg].as.d = c->value.d;
-            }
-            else if (c->type == CONST_STRING)
+        }
+    }
+    for (;;)
+    {
+        while ((idx = worker_pop(w)) >= 0)
+            par_scan_object(w, idx);
+        for (int k = 1; k < pool->nworkers && idx < 0; ++k)
+            idx = deque_steal(&pool->deques[(w->id + k) % pool->nworkers]);
+        if (idx >= 0)
+        {
+            par_scan_object(w, idx);
+            continue;
+        }
+        /* out of work, and done once every worker is: an idle worker pushes
+           nothing, so a deque that still has items belongs to a busy one */
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        for (int spins = 0;; ++spins)
+        {
+            if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == pool->nworkers)
+                return;
+            int busy = 0;
+            for (int k = 0; k < pool->nworkers && !busy; ++k)
+                busy = deque_size(&pool->deques[k]) > 0;
+            if (busy)
             {
-                vm->regs[reg].type = V_STRING;
-                vm->regs[reg].as.str_idx = vm_alloc_string(vm, c->value.s);
+                __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                break;
             }
+            if (spins < GC_IDLE_SPINS)
+                vm_thread_yield();
+            else
+                vm_thread_sleep_us(GC_IDLE_SLEEP_US);
+        }
+    }
+}
+
+static void *mark_worker_main(void *arg)
+{
+    MarkWorker *w = (MarkWorker *)arg;
+    MarkPool *pool = w->pool;
+    int seen = 0;
+    vm_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->round == seen && !pool->quit)
+            vm_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
             break;
+        seen = pool->round;
+        vm_mutex_unlock(&pool->lock);
+        mark_round(w);
+        vm_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->nworkers - 1)
+            vm_cond_broadcast(&pool->done);
+    }
+    vm_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* starts up to nworkers - 1 threads; NULL if none could be started */
+/* frees the pool's arrays and buffers, allocated or not */
+static void mark_pool_free_buffers(MarkPool *pool)
+{
+    for (int i = 0; i < pool->nallocated; ++i)
+    {
+        if (pool->deques)
+            free(pool->deques[i].buf);
+        if (pool->workers)
+            free(pool->workers[i].stack);
+    }
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+/* NULL if the pool cannot be allocated or no worker thread starts */
+static MarkPool *mark_pool_create(VM *vm, int nworkers)
+{
+    MarkPool *pool = (MarkPool *)calloc(1, sizeof(MarkPool));
+    if (!pool)
+        return NULL;
+    pool->vm = vm;
+    pool->nallocated = nworkers;
+    pool->threads = (VmThread *)malloc((size_t)nworkers * sizeof(VmThread));
+    pool->workers = (MarkWorker *)calloc((size_t)nworkers, sizeof(MarkWorker));
+    pool->deques = (MarkDeque *)calloc((size_t)nworkers, sizeof(MarkDeque));
+    int ok = pool->threads && pool->workers && pool->deques;
+    for (int i = 0; ok && i < nworkers; ++i)
+    {
+        pool->deques[i].buf = (int *)malloc(GC_MARK_STACK_MAX * sizeof(int));
+        pool->deques[i].mask = GC_MARK_STACK_MAX - 1;
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pool->workers[i].stack = (int *)malloc(GC_MARK_STACK_MAX * sizeof(int));
+        ok = pool->deques[i].buf && pool->workers[i].stack;
+    }
+    if (!ok)
+    {
+        mark_pool_free_buffers(pool);
+        return NULL;
+    }
+    vm_mutex_init(&pool->lock);
+    vm_cond_init(&pool->start);
+    vm_cond_init(&pool->done);
+    pool->nworkers = 1;
+    while (pool->nworkers < nworkers &&
+           vm_thread_start(&pool->threads[pool->nworkers - 1], mark_worker_main, &pool->workers[pool->nworkers]))
+        pool->nworkers++;
+    if (pool->nworkers == 1)
+    {
+        mark_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static void mark_pool_free(MarkPool *pool)
+{
+    if (!pool)
+        return;
+    vm_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    vm_cond_broadcast(&pool->start);
+    vm_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nworkers - 1; ++i)
+        vm_thread_join(pool->threads[i]);
+    vm_mutex_destroy(&pool->lock);
+    vm_cond_destroy(&pool->start);
+    vm_cond_destroy(&pool->done);
+    mark_pool_free_buffers(pool);
+}
+
+/* runs one round on every worker and waits for all of them */
+static void mark_pool_round(MarkPool *pool, int rescan)
+{
+    pool->rescan = rescan;
+    pool->idle = 0;
+    pool->next_chunk = 0;
+    pool->finished = 0;
+    vm_mutex_lock(&pool->lock);
+    pool->round++;
+    vm_cond_broadcast(&pool->start);
+    vm_mutex_unlock(&pool->lock);
+    mark_round(&pool->workers[0]);
+    vm_mutex_lock(&pool->lock);
+    while (pool->finished < pool->nworkers - 1)
+        vm_cond_wait(&pool->done, &pool->lock);
+    vm_mutex_unlock(&pool->lock);
+}
+
+/* marks everything reachable with the pool's threads; 0 if the pool is
+   unavailable and the caller must mark serially */
+static int mark_parallel(VM *vm)
+{
+    if (!vm->mark_pool)
+    {
+        /* more markers than processors only add contention */
+        int n = vm->opts.gc_mark_threads < vm_cpu_count() ? vm->opts.gc_mark_threads : vm_cpu_count();
+        if (n <= 1)
+            return 0;
+        vm->mark_pool = mark_pool_create(vm, n);
+        /* the workers' stacks and deques are part of the collector's memory
+           (the threads themselves are not counted) */
+        if (vm->mark_pool)
+            mem_charge(vm, VM_MEM_GC,
+                       sizeof(MarkPool) + (size_t)n * (sizeof(VmThread) + sizeof(MarkWorker) + sizeof(MarkDeque) +
+                                                       2 * GC_MARK_STACK_MAX * sizeof(int)));
+    }
+    MarkPool *pool = vm->mark_pool;
+    if (!pool)
+        return 0;
+    /* the roots are marked serially and dealt out round-robin */
+    mark_roots(vm, MARK_ALL);
+    pool->overflow = vm->gray.overflow;
+    for (size_t i = 0; i < vm->gray.count; ++i)
+    {
+        if (!deque_push(&pool->deques[i % (size_t)pool->nworkers], vm->gray.items[i]))
+            pool->overflow = 1;
+    }
+    vm->gray.count = 0;
+    vm->gray.overflow = 0;
+    mark_pool_round(pool, 0);
+    while (pool->overflow)
+    {
+        pool->overflow = 0;
+        mark_pool_round(pool, 1);
+    }
+    return 1;
+}
+#else
+static void mark_pool_free(struct MarkPool *pool)
+{
+    (void)pool;
+}
+
+static int mark_parallel(VM *vm)
+{
+    (void)vm;
+    return 0;
+}
+#endif
+
+/* resizes a mark bitmap from old_cap to new_cap slots; new bits are clear.
+   0, leaving it as it was, if the system allocator failed to grow it (a
+   failed shrink keeps the bigger one). The caller charges the memory with
+   the rest of its table. */
+static int resize_marks(uint64_t **bits, size_t old_cap, size_t new_cap)
+{
+    uint64_t *b = (uint64_t *)realloc(*bits, MARK_WORDS(new_cap) * sizeof(uint64_t) + !new_cap);
+    if (!b)
+        return new_cap <= old_cap;
+    *bits = b;
+    if (new_cap > old_cap)
+        memset(b + MARK_WORDS(old_cap), 0, (MARK_WORDS(new_cap) - MARK_WORDS(old_cap)) * sizeof(uint64_t));
+    return 1;
+}
+
+/* FNV-1a */
+static uint32_t string_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s)
+        h = (h ^ (u8)*s) * 16777619u;
+    return h;
+}
+
+/* remove string slot idx from its hash chain */
+static void unlink_string(VM *vm, int idx)
+{
+    int *p = &vm->str_buckets[vm->str_array[idx].hash & (vm->str_bucket_count - 1)];
+    while (*p != idx)
+        p = &vm->str_array[*p].next;
+    *p = vm->str_array[idx].next;
+}
+
+/* frees object slot idx and its field array, if it has one */
+static void free_object(VM *vm, size_t idx)
+{
+    Value *fields = vm->obj_fields[idx];
+    if (fields)
+    {
+        if (!in_nursery(vm, fields))
+            block_free(vm, VM_MEM_OBJECTS, fields, fields_size(vm->obj_field_count[idx]));
+        vm->obj_fields[idx] = NULL;
+    }
+    vm->obj_field_count[idx] = 0;
+    bit_clear(vm->obj_alive, idx);
+    push_index(vm, VM_MEM_OBJECTS, &vm->obj_free_list, &vm->obj_free_count, &vm->obj_free_cap, (int)idx);
+}
+
+/* frees the old strings and objects left unmarked, from slots sweep_str and
+   sweep_obj on, and clears the marks of the survivors. Returns 1 when both
+   tables are done, 0 if the budget (NULL = none) ran out first. Freed slots
+   go onto the free-lists; surviving strings and objects keep their index.
+   Young ones are left to finish_young. */
+static int heap_sweep(VM *vm, GcBudget *budget)
+{
+    for (; vm->sweep_str < vm->str_count; ++vm->sweep_str)
+    {
+        size_t i = vm->sweep_str;
+        HeapString *hs = &vm->str_array[i];
+        if (!hs->s || hs->young)
+            continue;
+        if (bit_test(vm->str_marks, i))
+        {
+            bit_clear(vm->str_marks, i);
+        }
+        else if (!hs->pinned)
+        {
+            unlink_string(vm, (int)i);
+            size_t size = str_size(hs->s);
+            vm->old_bytes -= size;
+            vm->gc_stats.bytes_freed += size;
+            block_free(vm, VM_MEM_STRINGS, hs->s, strlen(hs->s) + 1);
+            hs->s = NULL;
+            vm->str_live--;
+            push_index(vm, VM_MEM_STRINGS, &vm->str_free_list, &vm->str_free_count, &vm->str_free_cap, (int)i);
+        }
+        if (budget_spent(budget, 1))
+        {
+            ++vm->sweep_str;
+            return 0;
+        }
+    }
+
+    for (; vm->sweep_obj < vm->obj_count; ++vm->sweep_obj)
+    {
+        size_t i = vm->sweep_obj;
+        /* 64 slots with no old object alive are passed over at once */
+        if (!(i & 63) && !(vm->obj_alive[i >> 6] & ~vm->obj_young[i >> 6]))
+        {
+            vm->sweep_obj = (i + 64 < vm->obj_count ? i + 64 : vm->obj_count) - 1;
+            continue;
+        }
+        if (!bit_test(vm->obj_alive, i) || bit_test(vm->obj_young, i))
+            continue;
+        if (bit_test(vm->obj_marks, i))
+        {
+            bit_clear(vm->obj_marks, i);
+        }
+        else
+        {
+            size_t size = obj_size(vm->obj_field_count[i]);
+            vm->old_bytes -= size;
+            vm->gc_stats.bytes_freed += size;
+            free_object(vm, i);
+        }
+        if (budget_spent(budget, 1))
+        {
+            ++vm->sweep_obj;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* bump-allocates n bytes of young storage, or returns NULL and asks for a
+   minor collection once the nursery is full */
+static void *nursery_alloc(VM *vm, size_t n)
+{
+    n = (n + 7) & ~(size_t)7;
+    if (vm->nursery_used + n > vm->opts.nursery_size)
+    {
+        vm->gc_pending |= GC_MINOR;
+        return NULL;
+    }
+    void *p = vm->nursery + vm->nursery_used;
+    vm->nursery_used += n;
+    return p;
+}
+
+/* counts a new heap string or object of n bytes of data, size bytes of heap
+   (see str_size), towards the collection triggers. Returns 1 if it is
+   young: anything too big for half the nursery goes straight to the old
+   generation. */
+static int heap_account(VM *vm, size_t n, size_t size)
+{
+    vm->gc_stats.bytes_allocated += size;
+    int young = vm->nursery && n <= vm->opts.nursery_size / 2;
+    if (vm->gc_phase != GC_IDLE && (vm->gc_slice_allocs += 1 + (int)(n / GC_SLICE_BYTES)) >= GC_SLICE_ALLOCS)
+    {
+        vm->gc_slice_allocs = 0;
+        vm->gc_pending |= GC_STEP;
+    }
+    if (!young)
+    {
+        vm->old_bytes += size;
+        if (vm->old_bytes > vm->major_threshold)
+            vm->gc_pending |= GC_MAJOR;
+    }
+    return young;
+}
+
+/* n bytes of storage for a new heap string or field array (see
+   heap_account), charged to kind unless it is in the nursery; *young tells
+   where it went. NULL if the system allocator failed. */
+static void *heap_alloc(VM *vm, VMMemKind kind, size_t n, size_t size, int *young)
+{
+    *young = heap_account(vm, n, size);
+    if (!*young)
+        return block_alloc(vm, kind, n ? n : 1);
+    void *p = nursery_alloc(vm, n ? n : 1);
+    return p ? p : block_alloc(vm, kind, n ? n : 1);
+}
+
+/* after a collection has marked what is reachable: promote the marked young
+   strings and objects to the old generation (copying their storage out of
+   the nursery; the index stays), free the rest, and empty the nursery and the
+   remembered set. Promoted data survives an incremental collection under
+   way. A survivor whose storage cannot be copied (the allocator failed)
+   stays young where it is; the nursery and the remembered set are then kept
+   for a later collection to try again, and the failure is reported as a
+   refused allocation. Promoted objects go on the remembered set as they are
+   promoted, since they may point at a survivor that stayed behind; room for
+   them is reserved first, and without it no object is promoted. */
+static void finish_young(VM *vm)
+{
+    size_t kept_strs = 0, kept_objs = 0;
+    size_t remembered = vm->remembered_count;
+    size_t need = remembered + vm->young_obj_count;
+    while (vm->remembered_cap < need &&
+           reserve_index(vm, VM_MEM_GC, &vm->remembered, vm->remembered_cap, &vm->remembered_cap))
+        ;
+    int can_promote = vm->remembered_cap >= need;
+    for (size_t i = 0; i < vm->young_str_count; ++i)
+    {
+        int idx = vm->young_strs[i];
+        HeapString *hs = &vm->str_array[idx];
+        int marked = bit_test(vm->str_marks, (size_t)idx);
+        bit_clear(vm->str_marks, (size_t)idx);
+        if (marked || hs->pinned)
+        {
+            if (in_nursery(vm, hs->s))
+            {
+                size_t n = strlen(hs->s) + 1;
+                char *s = (char *)block_alloc(vm, VM_MEM_STRINGS, n);
+                if (!s)
+                {
+                    vm->young_strs[kept_strs++] = idx;
+                    continue;
+                }
+                memcpy(s, hs->s, n);
+                hs->s = s;
+            }
+            hs->young = 0;
+            if (!hs->pinned)
+                vm->old_bytes += str_size(hs->s);
+            survive_cycle_str(vm, idx);
+        }
+        else
+        {
+            hs->young = 0;
+            unlink_string(vm, idx);
+            vm->gc_stats.bytes_freed += str_size(hs->s);
+            if (!in_nursery(vm, hs->s))
+                block_free(vm, VM_MEM_STRINGS, hs->s, strlen(hs->s) + 1);
+            hs->s = NULL;
+            vm->str_live--;
+            push_index(vm, VM_MEM_STRINGS, &vm->str_free_list, &vm->str_free_count, &vm->str_free_cap, idx);
+        }
+    }
+    for (size_t i = 0; i < vm->young_obj_count; ++i)
+    {
+        size_t idx = (size_t)vm->young_objs[i];
+        int count = vm->obj_field_count[idx];
+        if (bit_test(vm->obj_marks, idx))
+        {
+            bit_clear(vm->obj_marks, idx);
+            Value *old = vm->obj_fields[idx];
+            Value *fields = NULL;
+            if (can_promote && old && in_nursery(vm, old))
+            {
+                fields = (Value *)block_alloc(vm, VM_MEM_OBJECTS, fields_size(count));
+                if (fields)
+                    memcpy(fields, old, (size_t)count * sizeof(Value));
+            }
+            if (!can_promote || (old && in_nursery(vm, old) && !fields))
+            {
+                vm->young_objs[kept_objs++] = (int)idx;
+                continue;
+            }
+            if (fields)
+                vm->obj_fields[idx] = fields;
+            bit_clear(vm->obj_young, idx);
+            vm->remembered[vm->remembered_count++] = (int)idx;
+            vm->old_bytes += obj_size(count);
+            survive_cycle_obj(vm, (int)idx, 1);
+        }
+        else
+        {
+            bit_clear(vm->obj_young, idx);
+            vm->gc_stats.bytes_freed += obj_size(count);
+            free_object(vm, idx);
+        }
+    }
+    vm->young_str_count = kept_strs;
+    vm->young_obj_count = kept_objs;
+    if (kept_strs || kept_objs)
+    {
+        for (size_t i = remembered; i < vm->remembered_count; ++i)
+            bit_set(vm->obj_remembered, (size_t)vm->remembered[i]);
+        mem_exceed(vm);
+        return;
+    }
+    for (size_t i = 0; i < vm->remembered_count; ++i)
+        bit_clear(vm->obj_remembered, (size_t)vm->remembered[i]);
+    vm->remembered_count = 0;
+    vm->nursery_used = 0;
+}
+
+/* with tracing on: the strings and objects marked now, all of them or only
+   the young ones */
+static void count_marked(VM *vm, int young_only)
+{
+    if (!vm->gc_trace)
+        return;
+    size_t strs = 0, objs = 0;
+    if (young_only)
+    {
+        for (size_t i = 0; i < vm->young_str_count; ++i)
+            strs += bit_test(vm->str_marks, (size_t)vm->young_strs[i]);
+        for (size_t i = 0; i < vm->young_obj_count; ++i)
+            objs += bit_test(vm->obj_marks, (size_t)vm->young_objs[i]);
+    }
+    else
+    {
+        for (size_t w = 0; w < MARK_WORDS(vm->str_count); ++w)
+            strs += (size_t)popcount64(vm->str_marks[w]);
+        for (size_t w = 0; w < MARK_WORDS(vm->obj_count); ++w)
+            objs += (size_t)popcount64(vm->obj_marks[w]);
+    }
+    vm->gc_event.strings_marked = strs;
+    vm->gc_event.objects_marked = objs;
+}
+
+/* minor collection: traces only young data, from the registers, the saved
+   registers of active calls and the fields of remembered old objects (every
+   old object a young value was stored into), so its cost follows the live
+   young data rather than the heap size */
+static void gc_minor(VM *vm)
+{
+    vm->gc_event.phases |= VM_GC_PHASE_MINOR;
+    vm->gc_event.roots += vm->remembered_count;
+    mark_roots(vm, MARK_YOUNG);
+    for (size_t i = 0; i < vm->remembered_count; ++i)
+        scan_object(vm, vm->remembered[i], MARK_YOUNG);
+    trace(vm, MARK_YOUNG, NULL);
+    count_marked(vm, 1);
+    finish_young(vm);
+}
+
+/* the next major collection starts once the old generation has grown by
+   opts.gc_heap_growth_percent from its size now */
+static void update_major_threshold(VM *vm)
+{
+    size_t t = vm->old_bytes + (size_t)((double)vm->old_bytes * vm->opts.gc_heap_growth_percent / 100);
+    vm->major_threshold = t > vm->opts.gc_min_heap ? t : vm->opts.gc_min_heap;
+}
+
+static Value forward_value(const VM *vm, const int *forward, Value v)
+{
+    if (value_type(v) != V_OBJECT)
+        return v;
+    int idx = value_as_obj(v);
+    if (idx < 0 || (size_t)idx >= vm->obj_count || forward[idx] < 0)
+        return v;
+    return value_obj(forward[idx]);
+}
+
+static void copy_bit(uint64_t *bits, size_t from, size_t to)
+{
+    if (bit_test(bits, from))
+        bit_set(bits, to);
+    else
+        bit_clear(bits, to);
+}
+
+/* bytes of an object table of cap slots: the slots and the four bitmaps */
+static size_t object_table_bytes(size_t cap)
+{
+    return cap * OBJ_SLOT_SIZE + 4 * MARK_WORDS(cap) * sizeof(uint64_t);
+}
+
+/* the object table grown or shrunk to cap slots; the bitmaps keep the bits
+   of the slots below both capacities and clear the rest. 0, with obj_cap
+   unchanged, if the system allocator failed to grow them (arrays already
+   grown just stay bigger; a failed shrink keeps the bigger array). */
+static int resize_objects(VM *vm, size_t cap)
+{
+    int grow = cap > vm->obj_cap;
+    Value *inl = (Value *)realloc(vm->obj_inline, cap * OBJ_INLINE_FIELDS * sizeof(Value));
+    if (inl)
+        vm->obj_inline = inl;
+    Value **fields = (Value **)realloc(vm->obj_fields, cap * sizeof(Value *));
+    if (fields)
+        vm->obj_fields = fields;
+    int *counts = (int *)realloc(vm->obj_field_count, cap * sizeof(int));
+    if (counts)
+        vm->obj_field_count = counts;
+    if (grow && (!inl || !fields || !counts))
+        return 0;
+    uint64_t **maps[] = {&vm->obj_alive, &vm->obj_young, &vm->obj_remembered, &vm->obj_marks};
+    for (size_t m = 0; m < sizeof(maps) / sizeof(maps[0]); ++m)
+    {
+        if (!resize_marks(maps[m], vm->obj_cap, cap))
+            return 0;
+    }
+    for (size_t i = vm->obj_cap; i < cap; ++i)
+    {
+        vm->obj_fields[i] = NULL;
+        vm->obj_field_count[i] = 0;
+    }
+    if (grow)
+        mem_charge(vm, VM_MEM_OBJECTS, object_table_bytes(cap) - object_table_bytes(vm->obj_cap));
+    else
+        mem_credit(vm, VM_MEM_OBJECTS, object_table_bytes(vm->obj_cap) - object_table_bytes(cap));
+    vm->obj_cap = cap;
+    return 1;
+}
+
+/* slides the live objects to the front of the object table, keeping their order,
+   and rewrites every object index the VM holds (registers, saved registers,
+   fields, the young list and the remembered set) through a forwarding
+   table; the table, its mark bitmap and its free-list then shrink to fit.
+   Only runs with no major collection under way, so every mark bit is clear
+   and every dead slot is on the free-list. */
+static void heap_compact(VM *vm)
+{
+    size_t forward_size = vm->obj_count * sizeof(int);
+    int *forward = (int *)table_realloc(vm, VM_MEM_GC, NULL, 0, forward_size);
+    if (!forward)
+        return;
+    vm->gc_stats.compactions++;
+    vm->gc_event.phases |= VM_GC_PHASE_COMPACT;
+    size_t live = 0;
+    for (size_t i = 0; i < vm->obj_count; ++i)
+    {
+        if (!bit_test(vm->obj_alive, i))
+        {
+            forward[i] = -1;
+            continue;
+        }
+        forward[i] = (int)live;
+        if (live != i)
+        {
+            memcpy(vm->obj_inline + live * OBJ_INLINE_FIELDS, vm->obj_inline + i * OBJ_INLINE_FIELDS,
+                   OBJ_INLINE_FIELDS * sizeof(Value));
+            vm->obj_fields[live] = vm->obj_fields[i];
+            vm->obj_field_count[live] = vm->obj_field_count[i];
+            copy_bit(vm->obj_young, i, live);
+            copy_bit(vm->obj_remembered, i, live);
+        }
+        ++live;
+    }
+    for (size_t i = 0; i < vm->obj_count; ++i)
+    {
+        if (i < live)
+        {
+            bit_set(vm->obj_alive, i);
+            continue;
+        }
+        bit_clear(vm->obj_alive, i);
+        bit_clear(vm->obj_young, i);
+        bit_clear(vm->obj_remembered, i);
+        vm->obj_fields[i] = NULL;
+        vm->obj_field_count[i] = 0;
+    }
+
+    for (int i = 0; i < vm->opts.num_registers; ++i)
+        vm->regs[i] = forward_value(vm, forward, vm->regs[i]);
+    for (Frame *fr = vm->frames; fr; fr = fr->next)
+    {
+        for (int i = 0; i < fr->saved_count; ++i)
+            fr->saved_regs[i] = forward_value(vm, forward, fr->saved_regs[i]);
+    }
+    for (size_t i = 0; i < live; ++i)
+    {
+        Value *fields = object_fields(vm, i);
+        for (int f = 0; f < vm->obj_field_count[i]; ++f)
+            fields[f] = forward_value(vm, forward, fields[f]);
+    }
+    for (size_t i = 0; i < vm->young_obj_count; ++i)
+        vm->young_objs[i] = forward[vm->young_objs[i]];
+    for (size_t i = 0; i < vm->remembered_count; ++i)
+        vm->remembered[i] = forward[vm->remembered[i]];
+    table_free(vm, VM_MEM_GC, forward, forward_size);
+
+    size_t cap = live > 8 ? live : 8;
+    if (cap < vm->obj_cap)
+        resize_objects(vm, cap);
+    vm->obj_count = live;
+    table_free(vm, VM_MEM_OBJECTS, vm->obj_free_list, vm->obj_free_cap * sizeof(int));
+    vm->obj_free_list = NULL;
+    vm->obj_free_count = 0;
+    vm->obj_free_cap = 0;
+}
+
+/* compacts once more than opts.gc_compact_percent of the object slots are
+   free after a major collection */
+static void maybe_compact(VM *vm)
+{
+    if (vm->opts.gc_compact_percent && vm->obj_count >= GC_COMPACT_MIN &&
+        vm->obj_free_count * 100 > vm->obj_count * vm->opts.gc_compact_percent)
+        heap_compact(vm);
+}
+
+/* a stop-the-world major collection. With lazy set only the marking
+   happens now: the collection is left in its sweep phase, which gc_step
+   then advances in slices between allocations as for an incremental one,
+   so allocating stays safe (survive_cycle_* keeps what turns old before
+   the sweep reaches it) */
+static void gc_major(VM *vm, int lazy)
+{
+    vm->gc_stats.major_collections++;
+    if (vm->gc_phase != GC_IDLE)
+    {
+        /* drop the incremental collection under way and start over */
+        vm->gc_phase = GC_IDLE;
+        vm->gray.count = 0;
+        vm->gray.overflow = 0;
+        vm->gray.rescanning = 0;
+        vm->gray.scan_obj = -1;
+        if (vm->str_marks)
+            memset(vm->str_marks, 0, MARK_WORDS(vm->str_count) * sizeof(uint64_t));
+        if (vm->obj_marks)
+            memset(vm->obj_marks, 0, MARK_WORDS(vm->obj_count) * sizeof(uint64_t));
+    }
+    if (vm->opts.gc_mark_threads <= 1 || !mark_parallel(vm))
+    {
+        mark_roots(vm, MARK_ALL);
+        trace(vm, MARK_ALL, NULL);
+    }
+    count_marked(vm, 0);
+    vm->gc_event.phases |= lazy ? VM_GC_PHASE_MARK : VM_GC_PHASE_MARK | VM_GC_PHASE_SWEEP;
+    vm->sweep_str = 0;
+    vm->sweep_obj = 0;
+    if (lazy)
+    {
+        /* garbage still counts until swept; the threshold tells when the
+           sweep has fallen behind */
+        vm->gc_phase = GC_SWEEPING;
+        vm->gc_slice_allocs = 0;
+        update_major_threshold(vm);
+    }
+    else
+    {
+        heap_sweep(vm, NULL);
+    }
+    finish_young(vm);
+    vm->gc_pending = 0;
+    if (!lazy)
+    {
+        update_major_threshold(vm);
+        mem_rearm_soft(vm);
+    }
+}
+
+static size_t live_objects(const VM *vm)
+{
+    return vm->obj_count - vm->obj_free_count;
+}
+
+/* starts timing a pause; with tracing on, gc_event collects what it does.
+   Nothing is allocated during a pause, so what it freed is the drop in the
+   live counts: they are kept in the freed fields until record_pause. */
+static uint64_t pause_begin(VM *vm)
+{
+    uint64_t start = gc_clock_ns();
+    if (vm->gc_trace)
+    {
+        memset(&vm->gc_event, 0, sizeof(vm->gc_event));
+        vm->gc_event.start_ns = start - vm->gc_epoch;
+        vm->gc_event.strings_freed = vm->str_live;
+        vm->gc_event.objects_freed = live_objects(vm);
+    }
+    return start;
+}
+
+static void record_pause(VM *vm, uint64_t start)
+{
+    uint64_t end = gc_clock_ns();
+    uint64_t ns = end - start;
+    vm->gc_stats.pauses++;
+    vm->gc_stats.pause_ns_total += ns;
+    if (ns > vm->gc_stats.pause_ns_max)
+        vm->gc_stats.pause_ns_max = ns;
+    if (vm->gc_trace)
+    {
+        VMGCEvent *ev = &vm->gc_event;
+        ev->end_ns = end - vm->gc_epoch;
+        ev->cycle = vm->gc_stats.major_collections;
+        ev->strings_freed -= vm->str_live;
+        ev->objects_freed -= live_objects(vm);
+        ev->string_free_list = vm->str_free_count;
+        ev->object_free_list = vm->obj_free_count;
+        vm->gc_trace[vm->gc_trace_count++ % vm->opts.gc_trace_events] = *ev;
+    }
+}
+
+size_t vm_gc_events(VM *vm, VMGCEvent *out, size_t max)
+{
+    size_t cap = vm->opts.gc_trace_events;
+    size_t held = vm->gc_trace_count < cap ? (size_t)vm->gc_trace_count : cap;
+    size_t n = held < max ? held : max;
+    for (size_t i = 0; i < n; ++i)
+        out[i] = vm->gc_trace[(vm->gc_trace_count - n + i) % cap];
+    return held;
+}
+
+void vm_gc(VM *vm)
+{
+    uint64_t start = pause_begin(vm);
+    gc_major(vm, 0);
+    record_pause(vm, start);
+}
+
+void vm_compact_heap(VM *vm)
+{
+    uint64_t start = pause_begin(vm);
+    gc_major(vm, 0);
+    heap_compact(vm);
+    record_pause(vm, start);
+}
+
+void vm_gc_stats(VM *vm, VMGCStats *out)
+{
+    *out = vm->gc_stats;
+    out->live_bytes = (size_t)(out->bytes_allocated - out->bytes_freed);
+    out->old_bytes = vm->old_bytes;
+    out->next_major_bytes = vm->major_threshold;
+    out->strings = vm->str_live + vm->str_pinned;
+    out->objects = vm->obj_count - vm->obj_free_count;
+}
+
+void vm_memory_stats(VM *vm, VMMemoryStats *out)
+{
+    *out = vm->mem;
+}
+
+static void write_varint(FILE *os, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        fputc((int)(v & 0x7f) | 0x80, os);
+        v >>= 7;
+    }
+    fputc((int)v, os);
+}
+
+/* the snapshot reference to v (see heapsnap.h), or 0 if v is not a live
+   string or object */
+static uint64_t snapshot_ref(const VM *vm, Value v)
+{
+    if (value_type(v) == V_STRING)
+    {
+        int idx = value_as_str(v);
+        if (idx >= 0 && (size_t)idx < vm->str_count && vm->str_array[idx].s)
+            return (uint64_t)idx * 2 + 2;
+    }
+    else if (value_type(v) == V_OBJECT)
+    {
+        int idx = value_as_obj(v);
+        if (object_alive(vm, idx))
+            return (uint64_t)idx * 2 + 3;
+    }
+    return 0;
+}
+
+/* CONST_FUNCTION index object idx is a closure of, or -1: field 0 holds it */
+static int closure_function(const VM *vm, size_t idx)
+{
+    if (vm->obj_field_count[idx] < 1 || !value_is_int(object_fields(vm, idx)[0]))
+        return -1;
+    int64_t ci = value_as_int(object_fields(vm, idx)[0]);
+    if (ci < 0 || (size_t)ci >= vm->bc.consts_count || vm->bc.consts[ci].type != CONST_FUNCTION)
+        return -1;
+    return (int)ci;
+}
+
+static void write_root(FILE *os, uint64_t ref, size_t *count)
+{
+    if (!ref)
+        return;
+    if (os)
+        write_varint(os, ref);
+    ++*count;
+}
+
+/* the roots: registers, saved registers and pinned strings. With os NULL
+   they are only counted. */
+static size_t write_roots(const VM *vm, FILE *os)
+{
+    size_t n = 0;
+    for (int i = 0; i < vm->opts.num_registers; ++i)
+        write_root(os, snapshot_ref(vm, vm->regs[i]), &n);
+    for (const Frame *fr = vm->frames; fr; fr = fr->next)
+    {
+        for (int i = 0; i < fr->saved_count; ++i)
+            write_root(os, snapshot_ref(vm, fr->saved_regs[i]), &n);
+    }
+    for (size_t i = 0; i < vm->str_count; ++i)
+    {
+        if (vm->str_array[i].s && vm->str_array[i].pinned)
+            write_root(os, (uint64_t)i * 2 + 2, &n);
+    }
+    return n;
+}
+
+const char *vm_heap_snapshot(VM *vm, FILE *os)
+{
+    fwrite(HEAP_SNAPSHOT_MAGIC, 1, 4, os);
+    write_varint(os, HEAP_SNAPSHOT_VERSION);
+    write_varint(os, sizeof(HeapString));
+    write_varint(os, OBJ_SLOT_SIZE);
+    write_varint(os, OBJ_INLINE_FIELDS);
+    write_varint(os, sizeof(Value));
+    write_varint(os, vm->str_count);
+    write_varint(os, vm->obj_count);
+
+    size_t nfuncs = 0;
+    for (size_t i = 0; i < vm->bc.consts_count; ++i)
+        nfuncs += vm->bc.consts[i].type == CONST_FUNCTION;
+    write_varint(os, nfuncs);
+    for (size_t i = 0; i < vm->bc.consts_count; ++i)
+    {
+        if (vm->bc.consts[i].type != CONST_FUNCTION)
+            continue;
+        write_varint(os, i);
+        write_varint(os, (uint64_t)vm->bc.consts[i].value.func.start);
+        write_varint(os, (uint64_t)vm->bc.consts[i].value.func.nargs);
+    }
+
+    write_varint(os, write_roots(vm, NULL));
+    write_roots(vm, os);
+
+    size_t nstrings = 0;
+    for (size_t i = 0; i < vm->str_count; ++i)
+        nstrings += vm->str_array[i].s != NULL;
+    write_varint(os, nstrings);
+    for (size_t i = 0; i < vm->str_count; ++i)
+    {
+        const HeapString *hs = &vm->str_array[i];
+        if (!hs->s)
+            continue;
+        size_t len = strlen(hs->s);
+        write_varint(os, i);
+        write_varint(os, (hs->pinned ? HEAP_SNAPSHOT_PINNED : 0) | (hs->young ? HEAP_SNAPSHOT_YOUNG : 0));
+        write_varint(os, len);
+        fwrite(hs->s, 1, len, os);
+    }
+
+    write_varint(os, live_objects(vm));
+    for (size_t i = 0; i < vm->obj_count; ++i)
+    {
+        if (!bit_test(vm->obj_alive, i))
+            continue;
+        const Value *fields = object_fields(vm, i);
+        int count = vm->obj_field_count[i];
+        size_t nedges = 0;
+        for (int f = 0; f < count; ++f)
+            nedges += snapshot_ref(vm, fields[f]) != 0;
+        write_varint(os, i);
+        write_varint(os, bit_test(vm->obj_young, i) ? HEAP_SNAPSHOT_YOUNG : 0);
+        write_varint(os, (uint64_t)count);
+        write_varint(os, (uint64_t)(closure_function(vm, i) + 1));
+        write_varint(os, nedges);
+        for (int f = 0; f < count; ++f)
+        {
+            uint64_t ref = snapshot_ref(vm, fields[f]);
+            if (ref)
+            {
+                write_varint(os, (uint64_t)f);
+                write_varint(os, ref);
+            }
+        }
+    }
+    fflush(os);
+    return ferror(os) ? "heap snapshot write failed" : NULL;
+}
+
+/* one slice of an incremental major collection. Marking traces the old
+   generation from the roots as they were at the start; stores into marked
+   objects are shaded by vm_set_object_field and what turns old is kept by
+   survive_cycle_*. Registers are not barriered, so once the gray objects
+   run out a minor collection (which shades everything it promotes) and a
+   rescan of the roots finish the marking in the same slice. Sweeping then
+   proceeds in slices too, as it does after a lazily swept gc_major. A
+   collection that falls behind (the old generation grows by
+   opts.gc_heap_growth_percent while it runs) is finished without a
+   budget. */
+static void gc_step(VM *vm)
+{
+    GcBudget budget;
+    budget.work = vm->opts.gc_slice_work ? vm->opts.gc_slice_work : (size_t)-1;
+    budget.deadline = 0;
+    budget.next_check = budget.work;
+    if (vm->opts.gc_slice_us)
+        budget.deadline = clock() + (clock_t)((double)vm->opts.gc_slice_us * CLOCKS_PER_SEC / 1e6);
+    GcBudget *b = vm->old_bytes > vm->major_threshold ? NULL : &budget;
+
+    if (vm->gc_phase == GC_MARKING)
+    {
+        vm->gc_event.phases |= VM_GC_PHASE_MARK;
+        if (!trace(vm, MARK_OLD, b))
+            return;
+        gc_minor(vm);
+        mark_roots(vm, MARK_OLD);
+        trace(vm, MARK_OLD, NULL);
+        count_marked(vm, 0);
+        vm->gc_phase = GC_SWEEPING;
+        vm->sweep_str = 0;
+        vm->sweep_obj = 0;
+    }
+    vm->gc_event.phases |= VM_GC_PHASE_SWEEP;
+    if (heap_sweep(vm, b))
+    {
+        vm->gc_phase = GC_IDLE;
+        update_major_threshold(vm);
+        maybe_compact(vm);
+        mem_rearm_soft(vm);
+    }
+}
+
+/* runs the collection allocation asked for; called between instructions,
+   where every live value is reachable from the roots */
+static void gc_safepoint(VM *vm)
+{
+    uint64_t start = pause_begin(vm);
+    int worked = 0;
+    if (vm->gc_pending & GC_MINOR)
+    {
+        vm->gc_stats.minor_collections++;
+        gc_minor(vm);
+        worked = 1;
+    }
+    if (vm->gc_phase != GC_IDLE)
+    {
+        /* slices come every GC_SLICE_ALLOCS allocations, but a few big ones
+           can outgrow the threshold in between: gc_step then finishes */
+        if ((vm->gc_pending & GC_STEP) || vm->old_bytes > vm->major_threshold)
+        {
+            gc_step(vm);
+            worked = 1;
+        }
+    }
+    else if ((vm->gc_pending & GC_MAJOR) || vm->old_bytes > vm->major_threshold)
+    {
+        if (vm->opts.gc_incremental)
+        {
+            /* start an incremental collection: shade the roots. The
+               threshold now tells when it has fallen behind. */
+            vm->gc_stats.major_collections++;
+            vm->gc_event.phases |= VM_GC_PHASE_MARK;
+            vm->gc_phase = GC_MARKING;
+            vm->gc_slice_allocs = 0;
+            update_major_threshold(vm);
+            mark_roots(vm, MARK_OLD);
+        }
+        else
+        {
+            gc_major(vm, !vm->opts.gc_eager_sweep);
+            if (vm->gc_phase == GC_IDLE)
+            {
+                maybe_compact(vm);
+                mem_rearm_soft(vm);
+            }
+        }
+        worked = 1;
+    }
+    vm->gc_pending = 0;
+    if (worked)
+        record_pause(vm, start);
+}
+
+/* doubles the hash buckets and rechains every live string; 0 if the
+   system allocator failed */
+static int grow_string_buckets(VM *vm)
+{
+    size_t n = vm->str_bucket_count ? vm->str_bucket_count * 2 : 64;
+    int *buckets = (int *)table_realloc(vm, VM_MEM_STRINGS, NULL, 0, n * sizeof(int));
+    if (!buckets)
+        return 0;
+    table_free(vm, VM_MEM_STRINGS, vm->str_buckets, vm->str_bucket_count * sizeof(int));
+    vm->str_buckets = buckets;
+    for (size_t i = 0; i < n; ++i)
+        vm->str_buckets[i] = -1;
+    vm->str_bucket_count = n;
+    for (size_t i = 0; i < vm->str_count; ++i)
+    {
+        HeapString *hs = &vm->str_array[i];
+        if (!hs->s)
+            continue;
+        int *head = &vm->str_buckets[hs->hash & (n - 1)];
+        hs->next = *head;
+        *head = (int)i;
+    }
+    return 1;
+}
+
+/* bytes of a string table of cap slots and its mark bitmap */
+static size_t string_table_bytes(size_t cap)
+{
+    return cap * sizeof(HeapString) + MARK_WORDS(cap) * sizeof(uint64_t);
+}
+
+/* the string table grown to cap slots; 0 if the system allocator failed */
+static int grow_strings(VM *vm, size_t cap)
+{
+    if (!resize_marks(&vm->str_marks, vm->str_cap, cap))
+        return 0;
+    HeapString *strs = (HeapString *)realloc(vm->str_array, cap * sizeof(HeapString));
+    if (!strs)
+        return 0;
+    mem_charge(vm, VM_MEM_STRINGS, string_table_bytes(cap) - string_table_bytes(vm->str_cap));
+    vm->str_array = strs;
+    vm->str_cap = cap;
+    return 1;
+}
+
+int vm_alloc_string(VM *vm, const char *s)
+{
+    /* an equal string already on the heap is shared instead of copied */
+    uint32_t hash = string_hash(s);
+    if (vm->str_bucket_count > 0)
+    {
+        for (int i = vm->str_buckets[hash & (vm->str_bucket_count - 1)]; i >= 0; i = vm->str_array[i].next)
+        {
+            if (vm->str_array[i].hash == hash && strcmp(vm->str_array[i].s, s) == 0)
+            {
+                if (!vm->str_array[i].young)
+                    survive_cycle_str(vm, i);
+                return i;
+            }
+        }
+    }
+
+    /* everything that can fail comes before the slot is taken: the limit
+       (counting the tables this allocation grows), the tables, the room on
+       the young list and the characters */
+    size_t n = strlen(s) + 1;
+    int grow_buckets = vm->str_live + vm->str_pinned >= vm->str_bucket_count;
+    int grow_table = vm->str_free_count == 0 && vm->str_count == vm->str_cap;
+    size_t newcap = vm->str_cap ? vm->str_cap * 2 : 8;
+    size_t need = arena_block_size(n);
+    if (grow_buckets)
+        need += (vm->str_bucket_count ? vm->str_bucket_count * 2 : 64) * sizeof(int);
+    if (grow_table)
+        need += string_table_bytes(newcap) - string_table_bytes(vm->str_cap);
+    if (vm->nursery)
+        need += index_growth(vm->young_str_count, vm->young_str_cap);
+    if (mem_refuse(vm, need))
+        return -1;
+    if ((grow_buckets && !grow_string_buckets(vm)) || (grow_table && !grow_strings(vm, newcap)) ||
+        (vm->nursery && !reserve_index(vm, VM_MEM_GC, &vm->young_strs, vm->young_str_count, &vm->young_str_cap)))
+    {
+        mem_exceed(vm);
+        return -1;
+    }
+    int young;
+    char *chars = (char *)heap_alloc(vm, VM_MEM_STRINGS, n, sizeof(HeapString) + n, &young);
+    if (!chars)
+    {
+        mem_exceed(vm);
+        return -1;
+    }
+
+    /* reuse freed slot if available */
+    int idx;
+    if (vm->str_free_count > 0)
+        idx = vm->str_free_list[--vm->str_free_count];
+    else
+        idx = (int)vm->str_count++;
+    HeapString *hs = &vm->str_array[idx];
+    hs->s = chars;
+    hs->young = young;
+    memcpy(hs->s, s, n);
+    hs->pinned = 0;
+    if (hs->young)
+        push_index(vm, VM_MEM_GC, &vm->young_strs, &vm->young_str_count, &vm->young_str_cap, idx);
+    else
+        survive_cycle_str(vm, idx);
+    hs->hash = hash;
+    int *head = &vm->str_buckets[hash & (vm->str_bucket_count - 1)];
+    hs->next = *head;
+    *head = idx;
+    vm->str_live++;
+    return idx;
+}
+
+/* string idx is never collected from now on and leaves the GC trigger */
+static void pin_string(VM *vm, int idx)
+{
+    if (idx < 0 || vm->str_array[idx].pinned)
+        return;
+    vm->str_array[idx].pinned = 1;
+    vm->str_live--;
+    vm->str_pinned++;
+    if (!vm->str_array[idx].young)
+        vm->old_bytes -= str_size(vm->str_array[idx].s);
+}
+
+/* hands the string constants of the previous program back to the
+   collector: from now on they live as long as something refers to them,
+   like any string (registers and saved registers are roots). Those the new
+   program shares are pinned again before anything can collect them. */
+static void unpin_constant_strings(VM *vm)
+{
+    for (size_t i = 0; i < vm->const_strs_count; ++i)
+    {
+        int idx = vm->const_strs[i];
+        if (idx < 0 || idx == vm->mem_limit_str || !vm->str_array[idx].pinned)
+            continue;
+        HeapString *hs = &vm->str_array[idx];
+        hs->pinned = 0;
+        vm->str_pinned--;
+        vm->str_live++;
+        if (!hs->young)
+        {
+            vm->old_bytes += str_size(hs->s);
+            survive_cycle_str(vm, idx);
+        }
+    }
+    vm->const_strs_count = 0;
+}
+
+/* interns and pins every string constant of the loaded program, so loading
+   one allocates nothing at run time. They stay pinned until the next
+   vm_load (see unpin_constant_strings) or vm_destroy. 0 if the system
+   allocator had no room for the map. */
+static int pin_constant_strings(VM *vm)
+{
+    unpin_constant_strings(vm);
+    free(vm->const_strs);
+    vm->const_strs = (int *)malloc((vm->bc.consts_count + 1) * sizeof(int));
+    if (!vm->const_strs)
+        return 0;
+    vm->const_strs_count = vm->bc.consts_count;
+    vm->mem_hard_limit = 0;
+    for (size_t i = 0; i < vm->bc.consts_count; ++i)
+    {
+        vm->const_strs[i] = -1;
+        if (vm->bc.consts[i].type != CONST_STRING)
+            continue;
+        int idx = vm_alloc_string(vm, vm->bc.consts[i].value.s);
+        pin_string(vm, idx);
+        vm->const_strs[i] = idx;
+    }
+    vm->mem_hard_limit = vm->opts.mem_hard_limit;
+    return 1;
+}
+
+/* contents of heap string idx, or NULL if idx is not a live string */
+static const char *heap_string(const VM *vm, int idx)
+{
+    if (idx < 0 || (size_t)idx >= vm->str_count)
+        return NULL;
+    return vm->str_array[idx].s;
+}
+
+Value vm_string_value(VM *vm, const char *s)
+{
+    size_t n = 0;
+    while (n <= VALUE_SMALL_STR_MAX && s[n])
+        ++n;
+    if (n <= VALUE_SMALL_STR_MAX)
+        return value_small_str(s, n);
+    return value_str(vm_alloc_string(vm, s));
+}
+
+const char *vm_string_chars(VM *vm, Value v)
+{
+    if (value_is_small_str(v))
+    {
+        char *buf = vm->str_scratch[vm->str_scratch_next++ % VM_STRING_SCRATCH];
+        value_small_str_chars(v, buf);
+        return buf;
+    }
+    return value_type(v) == V_STRING ? heap_string(vm, value_as_str(v)) : NULL;
+}
+
+int vm_alloc_object(VM *vm, int field_count)
+{
+    /* as for strings: the limit, the table, the young list and the field
+       storage before the slot is taken */
+    size_t n = (size_t)field_count * sizeof(Value);
+    int grow_table = vm->obj_free_count == 0 && vm->obj_count == vm->obj_cap;
+    size_t newcap = vm->obj_cap ? vm->obj_cap * 2 : 8;
+    size_t need = field_count > OBJ_INLINE_FIELDS ? arena_block_size(n) : 0;
+    if (grow_table)
+        need += object_table_bytes(newcap) - object_table_bytes(vm->obj_cap);
+    if (vm->nursery)
+        need += index_growth(vm->young_obj_count, vm->young_obj_cap);
+    if (mem_refuse(vm, need))
+        return -1;
+    if ((grow_table && !resize_objects(vm, newcap)) ||
+        (vm->nursery && !reserve_index(vm, VM_MEM_GC, &vm->young_objs, vm->young_obj_count, &vm->young_obj_cap)))
+    {
+        mem_exceed(vm);
+        return -1;
+    }
+    int young;
+    Value *fields = NULL;
+    if (field_count > OBJ_INLINE_FIELDS)
+    {
+        fields = (Value *)heap_alloc(vm, VM_MEM_OBJECTS, n, obj_size(field_count), &young);
+        if (!fields)
+        {
+            mem_exceed(vm);
+            return -1;
         }
-        case OP_MOV:
+    }
+
+    /* reuse freed slot if available */
+    int idx;
+    if (vm->obj_free_count > 0)
+        idx = vm->obj_free_list[--vm->obj_free_count];
+    else
+        idx = (int)vm->obj_count++;
+    if (field_count <= OBJ_INLINE_FIELDS)
+    {
+        /* no storage to allocate, but young inline fields still take their
+           share of the nursery, so minor collections keep their pace */
+        young = heap_account(vm, n, obj_size(field_count));
+        if (young)
+            nursery_alloc(vm, n);
+        fields = vm->obj_inline + (size_t)idx * OBJ_INLINE_FIELDS;
+        vm->obj_fields[idx] = NULL;
+    }
+    else
+        vm->obj_fields[idx] = fields;
+    for (int i = 0; i < field_count; ++i)
+        fields[i] = value_none();
+    vm->obj_field_count[idx] = field_count;
+    bit_set(vm->obj_alive, (size_t)idx);
+    bit_clear(vm->obj_remembered, (size_t)idx);
+    if (young)
+    {
+        bit_set(vm->obj_young, (size_t)idx);
+        push_index(vm, VM_MEM_GC, &vm->young_objs, &vm->young_obj_count, &vm->young_obj_cap, idx);
+    }
+    else
+        survive_cycle_obj(vm, idx, 0);
+    return idx;
+}
+
+void vm_set_object_field(VM *vm, int obj_idx, int field, Value val)
+{
+    if (!object_alive(vm, obj_idx))
+        return;
+    if (field < 0 || field >= vm->obj_field_count[obj_idx])
+        return;
+    object_fields(vm, (size_t)obj_idx)[field] = val;
+    /* write barrier: an old object now pointing at young data must be traced
+       by the next minor collection. Closure captures store through here too,
+       but into a new (young) object, so they never take this branch. */
+    int cur_young = bit_test(vm->obj_young, (size_t)obj_idx);
+    if (!cur_young && !bit_test(vm->obj_remembered, (size_t)obj_idx))
+    {
+        int young = 0;
+        if (value_type(val) == V_STRING)
         {
-            int32_t dst;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            int32_t src;
-            memcpy(&src, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            vm->regs[dst] = vm->regs[src];
-            break;
+            int si = value_as_str(val);
+            young = si >= 0 && (size_t)si < vm->str_count && vm->str_array[si].young;
         }
-        case OP_ADD:
-        case OP_SUB:
-        case OP_MUL:
-        case OP_DIV:
-        {
-            int32_t dst, a, b;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&a, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&b, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (vm->regs[a].type != V_INT || vm->regs[b].type != V_INT)
-                return "type error: expected int";
-            int64_t av = vm->regs[a].as.i, bv = vm->regs[b].as.i, rv = 0;
-            if (op == OP_ADD)
-                rv = av + bv;
-            else if (op == OP_SUB)
-                rv = av - bv;
-            else if (op == OP_MUL)
-                rv = av * bv;
-            else
-            {
-                if (bv == 0)
-                    return "division by zero";
-                rv = av / bv;
-            }
-            vm->regs[dst].type = V_INT;
-            vm->regs[dst].as.i = rv;
-            break;
+        else if (value_type(val) == V_OBJECT)
+        {
+            int oi = value_as_obj(val);
+            young = oi >= 0 && (size_t)oi < vm->obj_count && bit_test(vm->obj_young, (size_t)oi);
         }
-        case OP_PRINT:
+        if (young)
         {
-            int32_t r;
-            memcpy(&r, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (vm->regs[r].type == V_INT)
-            {
-                printf("%lld\n", (long long)vm->regs[r].as.i);
-            }
-            else if (vm->regs[r].type == V_DOUBLE)
-            {
-                printf("%f\n", vm->regs[r].as.d);
-            }
-            else if (vm->regs[r].type == V_STRING)
+            bit_set(vm->obj_remembered, (size_t)obj_idx);
+            push_index(vm, VM_MEM_GC, &vm->remembered, &vm->remembered_count, &vm->remembered_cap, obj_idx);
+        }
+    }
+    /* incremental barrier (insertion): while marking, a value stored into a
+       marked object is marked too, so no scanned object ever points at an
+       unmarked one. Young values are covered by the remembered set. */
+    if (vm->gc_phase == GC_MARKING && !cur_young && bit_test(vm->obj_marks, (size_t)obj_idx))
+        mark_value(vm, val, MARK_OLD);
+}
+
+Value vm_get_object_field(VM *vm, int obj_idx, int field)
+{
+    if (!object_alive(vm, obj_idx))
+        return value_none();
+    if (field < 0 || field >= vm->obj_field_count[obj_idx])
+        return value_none();
+    return object_fields(vm, (size_t)obj_idx)[field];
+}
+
+void vm_register_native(VM *vm, int index, NativeFn fn)
+{
+    if (index < 0)
+        return;
+    if (index + 1 > vm->natives_cap)
+    {
+        int newcap = vm->natives_cap ? vm->natives_cap * 2 : 8;
+        while (newcap <= index)
+            newcap *= 2;
+        NativeFn *natives = (NativeFn *)table_realloc(vm, VM_MEM_VM, vm->natives, vm->natives_cap * sizeof(NativeFn),
+                                                      newcap * sizeof(NativeFn));
+        if (!natives)
+            return;
+        vm->natives = natives;
+        for (int i = vm->natives_count; i < newcap; ++i)
+            vm->natives[i] = NULL;
+        vm->natives_cap = newcap;
+    }
+    vm->natives[index] = fn;
+    if (index >= vm->natives_count)
+        vm->natives_count = index + 1;
+}
+
+/* Handlers shared by the interpreter and jitted code (through vm_jit_exec). */
+
+static void exec_print(VM *vm, Value v)
+{
+    if (value_is_int(v))
+    {
+        printf("%lld\n", (long long)value_as_int(v));
+    }
+    else if (value_type(v) == V_DOUBLE)
+    {
+        printf("%f\n", value_as_double(v));
+    }
+    else if (value_type(v) == V_STRING)
+    {
+        const char *str = vm_string_chars(vm, v);
+        if (str)
+            printf("%s\n", str);
+        else
+            printf("<string oob>\n");
+    }
+    else if (value_type(v) == V_OBJECT)
+    {
+        int idx = value_as_obj(v);
+        if (object_alive(vm, idx))
+            printf("OBJECT(fields=%d)\n", vm->obj_field_count[idx]);
+        else
+            printf("OBJECT <oob>\n");
+    }
+    else
+    {
+        printf("NONE\n");
+    }
+}
+
+/* OP_CALL: native in->a with the first in->b registers as arguments; vm->ip
+   must already point past the call. An allocation the memory limit refused
+   (in here or in the native) leaves vm->mem_exceeded set. */
+static const char *exec_call_native(VM *vm, const Instr *in)
+{
+    int32_t fi = in->a, nargs = in->b, dst = in->c;
+    if (fi < 0 || fi >= vm->natives_count || !vm->natives[fi])
+        return "unknown function index";
+    /* the arguments are copied, so a native may overwrite registers */
+    Value local[8];
+    size_t size = sizeof(Value) * (size_t)(nargs > 0 ? nargs : 0);
+    Value *args = nargs > 0 ? local : NULL;
+    if (nargs > 8)
+    {
+        if (mem_refuse(vm, size))
+            return NULL;
+        args = (Value *)table_realloc(vm, VM_MEM_FRAMES, NULL, 0, size);
+        if (!args)
+        {
+            mem_exceed(vm);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < nargs; ++i)
+        args[i] = vm->regs[i];
+    Value res = vm->natives[fi](vm, nargs, args);
+    if (nargs > 8)
+        table_free(vm, VM_MEM_FRAMES, args, size);
+    vm->regs[dst] = res;
+    return NULL;
+}
+
+/* OP_PUSH_HANDLER; 0 if the memory limit refused a bigger handler stack */
+static int exec_push_handler(VM *vm, int32_t loc)
+{
+    if (vm->handlers_count + 1 > vm->handlers_cap)
+    {
+        int newcap = vm->handlers_cap ? vm->handlers_cap * 2 : 8;
+        size_t old_size = (size_t)vm->handlers_cap * 2 * sizeof(int), size = (size_t)newcap * 2 * sizeof(int);
+        if (mem_refuse(vm, size - old_size))
+            return 0;
+        int *handlers = (int *)table_realloc(vm, VM_MEM_HANDLERS, vm->handlers, old_size, size);
+        if (!handlers)
+        {
+            mem_exceed(vm);
+            return 0;
+        }
+        vm->handlers = handlers;
+        vm->handlers_cap = newcap;
+    }
+    int e = vm->handlers_count++;
+    vm->handlers[e * 2] = loc;
+    vm->handlers[e * 2 + 1] = vm->frames_count;
+    return 1;
+}
+
+/* OP_MK_CLOSURE; 0 if the memory limit refused the closure object */
+static int exec_mk_closure(VM *vm, const Instr *in)
+{
+    const int32_t *capture_list = &vm->prog.captures[in->c];
+    int32_t dst = in->a, ci = in->b, nc = capture_list[0];
+    const int32_t *capture_regs = capture_list + 1;
+    int obj_idx = vm_alloc_object(vm, nc + 1);
+    if (obj_idx < 0)
+        return 0;
+    if (bit_test(vm->obj_young, (size_t)obj_idx))
+    {
+        /* nothing to tell the collector about stores into a young object */
+        Value *fields = object_fields(vm, (size_t)obj_idx);
+        fields[0] = value_int(ci);
+        for (int i = 0; i < nc; ++i)
+            fields[1 + i] = vm->regs[capture_regs[i]];
+    }
+    else
+    {
+        vm_set_object_field(vm, obj_idx, 0, value_int(ci));
+        for (int i = 0; i < nc; ++i)
+            vm_set_object_field(vm, obj_idx, 1 + i, vm->regs[capture_regs[i]]);
+    }
+    vm->regs[dst] = value_obj(obj_idx);
+    return 1;
+}
+
+/* THROW of exc: r0 = exc, and the innermost handler is popped with every
+   frame pushed since it. Returns the handler's location, or -1 if there is
+   no handler. */
+static long exec_throw(VM *vm, Value exc)
+{
+    vm->regs[0] = exc;
+    if (vm->handlers_count == 0)
+        return -1;
+    int entry_idx = vm->handlers_count - 1;
+    int handler_loc = vm->handlers[entry_idx * 2];
+    int handler_frames = vm->handlers[entry_idx * 2 + 1];
+    /* pop handler */
+    vm->handlers_count--;
+
+    /* unwind frame stack until we reach handler_frames */
+    while (vm->frames_count > handler_frames)
+    {
+        Frame *ff = vm->frames;
+        if (!ff)
+            break;
+        vm->frames = ff->next;
+        free_frame(vm, ff);
+        vm->frames_count--;
+    }
+    return handler_loc;
+}
+
+/* push a call frame that saves only the registers the callee will clobber
+   (0..nargs-1); 0 if the memory limit refused it */
+static int push_frame(VM *vm, int nargs, int return_ip, int return_dst)
+{
+    /* one block: the frame, then its saved registers */
+    size_t size = sizeof(Frame) + sizeof(Value) * (nargs > 0 ? nargs : 0);
+    if (mem_refuse(vm, arena_block_size(size)))
+        return 0;
+    Frame *f = (Frame *)block_alloc(vm, VM_MEM_FRAMES, size);
+    if (!f)
+    {
+        mem_exceed(vm);
+        return 0;
+    }
+    if (nargs > 0)
+    {
+        f->saved_regs = (Value *)(f + 1);
+        memcpy(f->saved_regs, vm->regs, sizeof(Value) * nargs);
+        f->saved_count = nargs;
+    }
+    else
+    {
+        f->saved_regs = NULL;
+        f->saved_count = 0;
+    }
+    f->return_ip = return_ip;
+    f->return_dst = return_dst;
+    f->next = vm->frames;
+    vm->frames = f;
+    vm->frames_count++;
+    return 1;
+}
+
+/* Dispatch strategy: GCC and Clang support labels-as-values, which lets every
+   handler jump straight to the next one through a per-opcode label table
+   (direct threading). Each handler then ends in its own indirect branch, which
+   predicts far better than the single shared branch of a switch. Other
+   compilers, or builds configured with -DVM_COMPUTED_GOTO=OFF, use the
+   portable switch loop. */
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+#define VM_RETURN(val)   \
+    do                   \
+    {                    \
+        vm->ip = ip;     \
+        return (val);    \
+    } while (0)
+
+/* dst = a <op> b for int operands; each arithmetic opcode gets its own copy so
+   the handler does not branch on the opcode again */
+#define VM_INT_BINOP(expr)                                              \
+    do                                                                  \
+    {                                                                   \
+        int32_t dst = in->a, a = in->b, b = in->c;                      \
+        if (!value_is_int(regs[a]) || !value_is_int(regs[b]))           \
+            VM_RETURN("type error: expected int");                      \
+        int64_t av = value_as_int(regs[a]), bv = value_as_int(regs[b]); \
+        regs[dst] = value_int(expr);                                    \
+    } while (0)
+
+/* control has just moved to ip through a call, return or throw: let the JIT
+   count the call and run compiled code from there (see jit.h). Compiled code
+   that had an allocation refused leaves at that instruction, which then
+   throws instead of running again. */
+#define VM_JIT_HOOK(is_call)                                      \
+    do                                                            \
+    {                                                             \
+        if (vm->jit)                                              \
+        {                                                         \
+            ip = jit_enter(vm->jit, vm, regs, ip, (is_call));     \
+            if (vm->mem_exceeded)                                 \
+                goto mem_limit;                                   \
+        }                                                         \
+    } while (0)
+
+/* call the CONST_FUNCTION at constant ci (the verifier checked its type);
+   ip must already point past the call */
+#define VM_CALL_USER(ci_, nargs_, dst_)                         \
+    do                                                          \
+    {                                                           \
+        int32_t ci = (ci_);                                     \
+        CallCache *ic = &caches[in - code];                     \
+        if (ic->func_idx != ci)                                 \
+        {                                                       \
+            ic->func_idx = ci;                                  \
+            ic->target = func_pc[ci];                           \
+            ic->misses++;                                       \
+        }                                                       \
+        else                                                    \
+            ic->hits++;                                         \
+        if (!push_frame(vm, (nargs_), (int)ip, (dst_)))         \
+            goto mem_limit;                                     \
+        ip = (size_t)ic->target;                                \
+        VM_JIT_HOOK(1);                                         \
+    } while (0)
+
+/* quickened int arithmetic: one combined type guard, no opcode branch. If the
+   guard fails the instruction reverts to its generic opcode and is re-executed,
+   which reports the type error or re-quickens. A bare block rather than
+   do/while, so VM_NEXT can break out of the switch in the portable loop. */
+#define VM_II_BINOP(expr, generic_op)                                     \
+    {                                                                     \
+        int32_t dst = in->a, a = in->b, b = in->c;                        \
+        if (!(value_is_int(regs[a]) & value_is_int(regs[b])))             \
+        {                                                                 \
+            in->op = (generic_op);                                        \
+            --ip;                                                         \
+            VM_NEXT();                                                    \
+        }                                                                 \
+        int64_t av = value_as_int(regs[a]), bv = value_as_int(regs[b]);   \
+        regs[dst] = value_int(expr);                                      \
+    }
+
+#if VM_THREADED_DISPATCH
+#define VM_CASE(name) lbl_##name:
+#define VM_DISPATCH()                 \
+    do                                \
+    {                                 \
+        in = &code[ip++];             \
+        goto *dispatch_table[in->op]; \
+    } while (0)
+#define VM_NEXT()                     \
+    do                                \
+    {                                 \
+        if (vm->gc_pending)           \
+        {                             \
+            gc_safepoint(vm);         \
+            if (vm->mem_exceeded)     \
+                goto mem_limit;       \
+        }                             \
+        VM_DISPATCH();                \
+    } while (0)
+#else
+#define VM_CASE(name) case name:
+#define VM_NEXT() break
+#endif
+
+const char *vm_run(VM *vm)
+{
+    const char *verr = vm_verify(vm);
+    if (verr)
+        return verr;
+    if (vm->decode_err)
+        return vm->decode_err;
+    vm->mem_exceeded = 0;
+
+    /* keep the hot interpreter state in locals; vm->ip is written back on exit.
+       The decoded stream ends in an OP_HALT sentinel, so no bounds check is needed.
+       verify_program has checked every register, constant and jump operand, so
+       handlers only check what depends on run-time values (types, objects,
+       natives). */
+    Instr *code = vm->prog.code; /* writable: handlers quicken themselves in place */
+    const int32_t *func_pc = vm->prog.func_pc;
+    CallCache *caches = vm->call_caches;
+    Value *regs = vm->regs;
+    size_t ip = vm->ip;
+    Instr *in;
+
+#if VM_THREADED_DISPATCH
+    static void *const dispatch_table[256] = {
+        [0 ... 255] = &&lbl_unknown,
+        [OP_HALT] = &&lbl_OP_HALT,
+        [OP_LOAD_CONST] = &&lbl_OP_LOAD_CONST,
+        [OP_MOV] = &&lbl_OP_MOV,
+        [OP_ADD] = &&lbl_OP_ADD,
+        [OP_SUB] = &&lbl_OP_SUB,
+        [OP_MUL] = &&lbl_OP_MUL,
+        [OP_DIV] = &&lbl_OP_DIV,
+        [OP_PRINT] = &&lbl_OP_PRINT,
+        [OP_JMP] = &&lbl_OP_JMP,
+        [OP_JZ] = &&lbl_OP_JZ,
+        [OP_ALLOC_STR] = &&lbl_OP_ALLOC_STR,
+        [OP_CALL] = &&lbl_OP_CALL,
+        [OP_CALL_USER] = &&lbl_OP_CALL_USER,
+        [OP_RET] = &&lbl_OP_RET,
+        [OP_THROW] = &&lbl_OP_THROW,
+        [OP_PUSH_HANDLER] = &&lbl_OP_PUSH_HANDLER,
+        [OP_POP_HANDLER] = &&lbl_OP_POP_HANDLER,
+        [OP_MK_CLOSURE] = &&lbl_OP_MK_CLOSURE,
+        [OP_CALL_CLOSURE] = &&lbl_OP_CALL_CLOSURE,
+        [OP_ADD_IMM] = &&lbl_OP_ADD_IMM,
+        [OP_SUB_JZ] = &&lbl_OP_SUB_JZ,
+        [OP_SUB_JNZ] = &&lbl_OP_SUB_JNZ,
+        [OP_MOV_CALL_USER] = &&lbl_OP_MOV_CALL_USER,
+        [OP_BAD_JUMP] = &&lbl_OP_BAD_JUMP,
+        [OP_ADD_II] = &&lbl_OP_ADD_II,
+        [OP_SUB_II] = &&lbl_OP_SUB_II,
+        [OP_MUL_II] = &&lbl_OP_MUL_II,
+        [OP_DIV_II] = &&lbl_OP_DIV_II,
+        [OP_JZ_I] = &&lbl_OP_JZ_I,
+        [OP_LOAD_CONST_INT] = &&lbl_OP_LOAD_CONST_INT,
+        [OP_LOAD_CONST_DOUBLE] = &&lbl_OP_LOAD_CONST_DOUBLE,
+        [OP_LOAD_CONST_STR] = &&lbl_OP_LOAD_CONST_STR,
+    };
+    VM_DISPATCH();
+#else
+    for (;;)
+    {
+        in = &code[ip++];
+        switch (in->op)
+        {
+#endif
+        VM_CASE(OP_HALT)
+            VM_RETURN(NULL);
+        VM_CASE(OP_LOAD_CONST)
+        {
+            int32_t reg = in->a, ci = in->b;
+            Constant *c = &vm->bc.consts[ci];
+            /* constants never change, so numeric loads quicken unconditionally */
+            if (c->type == CONST_INT)
             {
-                HeapString *cur = vm->heap_head;
-                int idx = 0;
-                while (cur && idx < vm->regs[r].as.str_idx)
-                {
-                    cur = cur->next;
-                    ++idx;
-                }
-                if (cur)
-                    printf("%s\n", cur->s);
-                else
-                    printf("<string oob>\n");
+                regs[reg] = value_int(c->value.i);
+                in->op = OP_LOAD_CONST_INT;
+                instr_set_imm64(in, c->value.i);
             }
-            else if (vm->regs[r].type == V_OBJECT)
+            else if (c->type == CONST_DOUBLE)
             {
-                int idx = vm->regs[r].as.obj_idx;
-                if (idx >= 0 && (size_t)idx < vm->obj_count && vm->obj_array[idx].alive)
-                    printf("OBJECT(fields=%d)\n", vm->obj_array[idx].field_count);
-                else
-                    printf("OBJECT <oob>\n");
+                regs[reg] = value_double(c->value.d);
+                int64_t bits;
+                memcpy(&bits, &c->value.d, sizeof(bits));
+                in->op = OP_LOAD_CONST_DOUBLE;
+                instr_set_imm64(in, bits);
             }
-            else
+            else if (c->type == CONST_STRING)
             {
-                printf("NONE\n");
+                regs[reg] = value_str(vm->const_strs[ci]);
             }
-            break;
+            VM_NEXT();
         }
-        case OP_JMP:
+        VM_CASE(OP_MOV)
         {
-            int32_t loc;
-            memcpy(&loc, &vm->bc.code[vm->ip], 4);
-            vm->ip = (size_t)loc;
-            break;
+            regs[in->a] = regs[in->b];
+            VM_NEXT();
         }
-        case OP_JZ:
+        VM_CASE(OP_ADD)
         {
-            int32_t r;
-            memcpy(&r, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            int32_t loc;
-            memcpy(&loc, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (vm->regs[r].type == V_INT && vm->regs[r].as.i == 0)
-                vm->ip = (size_t)loc;
-            break;
+            VM_INT_BINOP(av + bv);
+            in->op = OP_ADD_II;
+            VM_NEXT();
         }
-        case OP_ALLOC_STR:
+        VM_CASE(OP_SUB)
         {
-            int32_t dst, ci;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&ci, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            vm->regs[dst].type = V_STRING;
-            vm->regs[dst].as.str_idx = vm_alloc_string(vm, vm->bc.consts[ci].value.s);
-            break;
+            VM_INT_BINOP(av - bv);
+            in->op = OP_SUB_II;
+            VM_NEXT();
         }
-        case OP_CALL:
+        VM_CASE(OP_MUL)
         {
-            int32_t fi, nargs, dst;
-            memcpy(&fi, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&nargs, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (fi >= 0 && fi < vm->natives_count && vm->natives[fi])
-            {
-                Value *args = NULL;
-                if (nargs > 0)
-                {
-                    args = (Value *)malloc(sizeof(Value) * nargs);
-                    for (int i = 0; i < nargs; ++i)
-                        args[i] = vm->regs[i];
-                }
-                Value res = vm->natives[fi](vm, nargs, args);
-                if (args)
-                    free(args);
-                vm->regs[dst] = res;
-            }
-            else
-            {
-                return "unknown function index";
-            }
-            break;
+            VM_INT_BINOP(av * bv);
+            in->op = OP_MUL_II;
+            VM_NEXT();
         }
-        case OP_CALL_USER:
-        {
-            int32_t ci, nargs, dst;
-            memcpy(&ci, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&nargs, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (ci < 0 || (size_t)ci >= vm->bc.consts_count)
-                return "bad function const index";
-            Constant *fc = &vm->bc.consts[ci];
-            if (fc->type != CONST_FUNCTION)
-                return "const is not a function";
-            int target = fc->value.func.start;
-            /* push frame: save only registers that will be clobbered by callee (0..nargs-1) */
-            Frame *f = (Frame *)malloc(sizeof(Frame));
-            if (nargs > 0)
-            {
-                f->saved_regs = (Value *)malloc(sizeof(Value) * nargs);
-                for (int si = 0; si < nargs; ++si)
-                    f->saved_regs[si] = vm->regs[si];
-                f->saved_count = nargs;
-            }
-            else
+        VM_CASE(OP_DIV)
+        {
+            int32_t dst = in->a, a = in->b, b = in->c;
+            if (!value_is_int(regs[a]) || !value_is_int(regs[b]))
+                VM_RETURN("type error: expected int");
+            if (value_as_int(regs[b]) == 0)
+                VM_RETURN("division by zero");
+            regs[dst] = value_int(value_as_int(regs[a]) / value_as_int(regs[b]));
+            in->op = OP_DIV_II;
+            VM_NEXT();
+        }
+        VM_CASE(OP_PRINT)
+        {
+            exec_print(vm, regs[in->a]);
+            VM_NEXT();
+        }
+        VM_CASE(OP_JMP)
+        {
+            ip = (size_t)in->a;
+            VM_NEXT();
+        }
+        VM_CASE(OP_JZ)
+        {
+            int32_t r = in->a;
+            if (value_is_int(regs[r]))
             {
-                f->saved_regs = NULL;
-                f->saved_count = 0;
+                in->op = OP_JZ_I;
+                if (value_as_int(regs[r]) == 0)
+                    ip = (size_t)in->b;
             }
-            f->return_ip = vm->ip;
-            f->return_dst = dst;
-            f->next = vm->frames;
-            vm->frames = f;
-            vm->frames_count++;
-            /* jump to function start */
-            vm->ip = (size_t)target;
-            break;
+            VM_NEXT();
+        }
+        VM_CASE(OP_ALLOC_STR)
+        {
+            regs[in->a] = value_str(vm->const_strs[in->b]);
+            VM_NEXT();
         }
-        case OP_RET:
+        VM_CASE(OP_CALL)
         {
-            int32_t r;
-            memcpy(&r, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
+            vm->ip = ip;
+            const char *err = exec_call_native(vm, in);
+            if (err)
+                VM_RETURN(err);
+            if (vm->mem_exceeded)
+                goto mem_limit;
+            VM_NEXT();
+        }
+        VM_CASE(OP_CALL_USER)
+        {
+            VM_CALL_USER(in->a, in->b, in->c);
+            VM_NEXT();
+        }
+        VM_CASE(OP_RET)
+        {
+            int32_t r = in->a;
             /* if no frame, terminate program returning value in r (ignored) */
             if (!vm->frames)
-                return NULL;
+                VM_RETURN(NULL);
             Frame *f = vm->frames;
             vm->frames = f->next;
-            Value retval = vm->regs[r];
+            Value retval = regs[r];
             /* restore only the saved registers */
             if (f->saved_count > 0 && f->saved_regs)
             {
                 for (int si = 0; si < f->saved_count; ++si)
-                    vm->regs[si] = f->saved_regs[si];
+                    regs[si] = f->saved_regs[si];
             }
             /* store return value into return_dst */
-            vm->regs[f->return_dst] = retval;
+            regs[f->return_dst] = retval;
             int ret_ip = f->return_ip;
-            if (f->saved_regs)
-                free(f->saved_regs);
-            free(f);
+            free_frame(vm, f);
             vm->frames_count--;
-            vm->ip = (size_t)ret_ip;
-            break;
+            ip = (size_t)ret_ip;
+            VM_JIT_HOOK(0);
+            VM_NEXT();
         }
-        case OP_THROW:
-        {
-            int32_t rsrc;
-            memcpy(&rsrc, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (rsrc < 0 || rsrc >= vm->opts.num_registers)
-                return "bad throw register";
-            vm->regs[0] = vm->regs[rsrc];
-
-            if (vm->handlers_count == 0)
-                return "unhandled exception";
-            int entry_idx = vm->handlers_count - 1;
-            int handler_loc = vm->handlers[entry_idx * 2];
-            int handler_frames = vm->handlers[entry_idx * 2 + 1];
-            /* pop handler */
-            vm->handlers_count--;
-
-            /* unwind frame stack until we reach handler_frames */
-            while (vm->frames_count > handler_frames)
-            {
-                Frame *ff = vm->frames;
-                if (!ff)
-                    break;
-                vm->frames = ff->next;
-                if (ff->saved_regs)
-                    free(ff->saved_regs);
-                free(ff);
-                vm->frames_count--;
-            }
-
+        VM_CASE(OP_THROW)
+        {
+            long handler_loc = exec_throw(vm, regs[in->a]);
+            if (handler_loc < 0)
+                VM_RETURN("unhandled exception");
             /* jump to handler location; exception value is available in r0 */
-            vm->ip = (size_t)handler_loc;
-            break;
+            ip = (size_t)handler_loc;
+            VM_JIT_HOOK(0);
+            VM_NEXT();
         }
-        case OP_PUSH_HANDLER:
+    /* an allocation was refused (vm->mem_exceeded), by the instruction that
+       asked for it or by a collection at a safepoint that could not promote
+       its survivors: throw VM_MEM_LIMIT_ERROR in its place */
+    mem_limit:
         {
-            int32_t loc;
-            memcpy(&loc, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (vm->handlers_count + 1 > vm->handlers_cap)
-            {
-                int newcap = vm->handlers_cap ? vm->handlers_cap * 2 : 8;
-                vm->handlers = realloc(vm->handlers, newcap * 2 * sizeof(int));
-                vm->handlers_cap = newcap;
-            }
-            int e = vm->handlers_count++;
-            vm->handlers[e * 2] = loc;
-            vm->handlers[e * 2 + 1] = vm->frames_count;
-            break;
+            int exc = mem_limit_string(vm);
+            vm->mem_exceeded = 0;
+            long handler_loc = exc < 0 ? -1 : exec_throw(vm, value_str(exc));
+            if (handler_loc < 0)
+                VM_RETURN(VM_MEM_LIMIT_ERROR);
+            ip = (size_t)handler_loc;
+            VM_JIT_HOOK(0);
+            VM_NEXT();
+        }
+        VM_CASE(OP_PUSH_HANDLER)
+        {
+            if (!exec_push_handler(vm, in->a))
+                goto mem_limit;
+            VM_NEXT();
         }
-        case OP_POP_HANDLER:
+        VM_CASE(OP_POP_HANDLER)
         {
             if (vm->handlers_count > 0)
                 vm->handlers_count--;
-            break;
+            VM_NEXT();
+        }
+        VM_CASE(OP_MK_CLOSURE)
+        {
+            if (!exec_mk_closure(vm, in))
+                goto mem_limit;
+            VM_NEXT();
         }
-        case OP_MK_CLOSURE:
-        {
-            int32_t dst, ci, nc;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&ci, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&nc, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (ci < 0 || (size_t)ci >= vm->bc.consts_count)
-                return "bad function const index";
-            int obj_idx = vm_alloc_object(vm, nc + 1);
-            Value v;
-            v.type = V_INT;
-            v.as.i = ci;
-            vm_set_object_field(vm, obj_idx, 0, v);
-            for (int i = 0; i < nc; ++i)
+        VM_CASE(OP_CALL_CLOSURE)
+        {
+            int32_t objr = in->a, nargs = in->b, dst = in->c;
+            if (value_type(regs[objr]) != V_OBJECT)
+                VM_RETURN("call_closure expected object");
+            int obj_idx = value_as_obj(regs[objr]);
+            if (obj_idx < 0 || (size_t)obj_idx >= vm->obj_count)
+                VM_RETURN("closure object oob");
+            if (!bit_test(vm->obj_alive, (size_t)obj_idx))
+                VM_RETURN("dead closure object");
+            int field_count = vm->obj_field_count[obj_idx];
+            if (field_count < 1)
+                VM_RETURN("closure missing function index");
+            const Value *fields = object_fields(vm, (size_t)obj_idx);
+            /* the object itself can change between calls, so only the
+               function constant lookup is cached, keyed by field 0 */
+            Value fval = fields[0];
+            CallCache *ic = &caches[in - code];
+            if (value_is_int(fval) && value_as_int(fval) == ic->func_idx)
+                ic->hits++;
+            else
             {
-                int32_t r;
-                memcpy(&r, &vm->bc.code[vm->ip], 4);
-                vm->ip += 4;
-                if (r < 0 || r >= vm->opts.num_registers)
-                    return "bad capture register";
-                vm_set_object_field(vm, obj_idx, 1 + i, vm->regs[r]);
+                if (!value_is_int(fval))
+                    VM_RETURN("closure missing function index");
+                int64_t ci = value_as_int(fval);
+                if (ci < 0 || (size_t)ci >= vm->bc.consts_count)
+                    VM_RETURN("bad function const index in closure");
+                if (vm->bc.consts[ci].type != CONST_FUNCTION)
+                    VM_RETURN("closure const not a function");
+                ic->func_idx = (int32_t)ci;
+                ic->target = func_pc[ci];
+                ic->misses++;
             }
-            vm->regs[dst].type = V_OBJECT;
-            vm->regs[dst].as.obj_idx = obj_idx;
-            break;
+            int target = ic->target;
+            int cap = field_count - 1;
+            if (nargs + cap > vm->opts.num_registers)
+                VM_RETURN("closure captures exceed register file");
+            if (!push_frame(vm, nargs, (int)ip, dst))
+                goto mem_limit;
+            for (int i = 0; i < cap; ++i)
+                regs[nargs + i] = fields[1 + i];
+            ip = (size_t)target;
+            VM_JIT_HOOK(1);
+            VM_NEXT();
         }
-        case OP_CALL_CLOSURE:
-        {
-            int32_t objr, nargs, dst;
-            memcpy(&objr, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&nargs, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            memcpy(&dst, &vm->bc.code[vm->ip], 4);
-            vm->ip += 4;
-            if (objr < 0 || objr >= vm->opts.num_registers)
-                return "bad closure obj register";
-            if (vm->regs[objr].type != V_OBJECT)
-                return "call_closure expected object";
-            int obj_idx = vm->regs[objr].as.obj_idx;
-            if (obj_idx < 0 || (size_t)obj_idx >= vm->obj_count)
-                return "closure object oob";
-            HeapObject *co = &vm->obj_array[obj_idx];
-            if (!co->alive)
-                return "dead closure object";
-            Value fval = co->fields[0];
-            if (fval.type != V_INT)
-                return "closure missing function index";
-            int ci = (int)fval.as.i;
-            if (ci < 0 || (size_t)ci >= vm->bc.consts_count)
-                return "bad function const index in closure";
-            Constant *fc = &vm->bc.consts[ci];
-            if (fc->type != CONST_FUNCTION)
-                return "closure const not a function";
-            int target = fc->value.func.start;
-            Frame *f = (Frame *)malloc(sizeof(Frame));
-            if (nargs > 0)
+        VM_CASE(OP_ADD_IMM)
+        {
+            const Instr *ext = &code[ip++];
+            int64_t imm = instr_imm64(ext);
+            regs[in->c] = value_int(imm);
+            if (!value_is_int(regs[in->b]))
+                VM_RETURN("type error: expected int");
+            regs[in->a] = value_int(value_as_int(regs[in->b]) + imm);
+            VM_NEXT();
+        }
+        VM_CASE(OP_SUB_JZ)
+        {
+            VM_INT_BINOP(av - bv);
+            const Instr *ext = &code[ip++];
+            if (value_as_int(regs[in->a]) == 0)
+                ip = (size_t)ext->a;
+            VM_NEXT();
+        }
+        VM_CASE(OP_SUB_JNZ)
+        {
+            VM_INT_BINOP(av - bv);
+            const Instr *ext = &code[ip++];
+            if (value_as_int(regs[in->a]) != 0)
+                ip = (size_t)ext->a;
+            VM_NEXT();
+        }
+        VM_CASE(OP_MOV_CALL_USER)
+        {
+            const Instr *ext = &code[ip++];
+            regs[in->a] = regs[in->b];
+            VM_CALL_USER(in->c, ext->a, ext->b);
+            VM_NEXT();
+        }
+        VM_CASE(OP_ADD_II)
+        VM_II_BINOP(av + bv, OP_ADD)
+        VM_NEXT();
+        VM_CASE(OP_SUB_II)
+        VM_II_BINOP(av - bv, OP_SUB)
+        VM_NEXT();
+        VM_CASE(OP_MUL_II)
+        VM_II_BINOP(av * bv, OP_MUL)
+        VM_NEXT();
+        VM_CASE(OP_DIV_II)
+        {
+            /* division by zero goes through the generic handler to report it */
+            if (value_is_int(regs[in->c]) && value_as_int(regs[in->c]) == 0)
             {
-                f->saved_regs = (Value *)malloc(sizeof(Value) * nargs);
-                for (int si = 0; si < nargs; ++si)
-                    f->saved_regs[si] = vm->regs[si];
-                f->saved_count = nargs;
+                in->op = OP_DIV;
+                --ip;
+                VM_NEXT();
             }
-            else
+        }
+        VM_II_BINOP(av / bv, OP_DIV)
+        VM_NEXT();
+        VM_CASE(OP_JZ_I)
+        {
+            int32_t r = in->a;
+            if (!value_is_int(regs[r]))
             {
-                f->saved_regs = NULL;
-                f->saved_count = 0;
+                in->op = OP_JZ;
+                --ip;
+                VM_NEXT();
             }
-            f->return_ip = vm->ip;
-            f->return_dst = dst;
-            f->next = vm->frames;
-            vm->frames = f;
-            vm->frames_count++;
-            int cap = co->field_count - 1;
-            for (int i = 0; i < cap; ++i)
-                vm->regs[nargs + i] = co->fields[1 + i];
-            vm->ip = (size_t)target;
-            break;
+            if (value_as_int(regs[r]) == 0)
+                ip = (size_t)in->b;
+            VM_NEXT();
         }
+        VM_CASE(OP_LOAD_CONST_INT)
+        {
+            regs[in->a] = value_int(instr_imm64(in));
+            VM_NEXT();
+        }
+        VM_CASE(OP_LOAD_CONST_DOUBLE)
+        {
+            int64_t bits = instr_imm64(in);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            regs[in->a] = value_double(d);
+            VM_NEXT();
+        }
+        VM_CASE(OP_LOAD_CONST_STR)
+        {
+            regs[in->a] = value_str(in->b);
+            VM_NEXT();
+        }
+        VM_CASE(OP_BAD_JUMP)
+            VM_RETURN("jump target is not an instruction boundary");
+#if VM_THREADED_DISPATCH
+    lbl_unknown:
+        VM_RETURN("unknown opcode during run");
+#else
         default:
-            return "unknown opcode during run";
+            VM_RETURN("unknown opcode during run");
+        }
+        if (vm->gc_pending)
+        {
+            gc_safepoint(vm);
+            if (vm->mem_exceeded)
+                goto mem_limit;
         }
-        if (vm->heap_count > 1024)
-            vm_gc(vm);
     }
-    return NULL;
+#endif
+}
+
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_INT_BINOP
+#undef VM_CALL_USER
+#undef VM_JIT_HOOK
+#undef VM_II_BINOP
+#undef VM_RETURN
+
+int vm_jit_exec(VM *vm, int32_t pc)
+{
+    const Instr *in = &vm->prog.code[pc];
+    Value *regs = vm->regs;
+    vm->ip = (size_t)pc + 1;
+    switch (in->op)
+    {
+    case OP_PRINT:
+        exec_print(vm, regs[in->a]);
+        break;
+    case OP_LOAD_CONST:
+    case OP_ALLOC_STR:
+    {
+        /* jitted code loads numeric constants itself, and vm_load already
+           turned string loads into OP_LOAD_CONST_STR */
+        if (vm->const_strs[in->b] < 0)
+            return 1;
+        regs[in->a] = value_str(vm->const_strs[in->b]);
+        break;
+    }
+    case OP_CALL:
+        /* a refused allocation makes the interpreter throw (VM_JIT_HOOK) */
+        if (exec_call_native(vm, in) || vm->mem_exceeded)
+            return 1;
+        break;
+    case OP_MK_CLOSURE:
+        if (!exec_mk_closure(vm, in))
+            return 1;
+        break;
+    case OP_PUSH_HANDLER:
+        if (!exec_push_handler(vm, in->a))
+            return 1;
+        break;
+    case OP_POP_HANDLER:
+        if (vm->handlers_count > 0)
+            vm->handlers_count--;
+        break;
+    default:
+        return 1;
+    }
+    if (vm->gc_pending)
+        gc_safepoint(vm);
+    return 0;
+}
+
+int vm_jit_compiled(VM *vm) { return jit_compiled_count(vm->jit); }
+
+const char *vm_optimize(VM *vm)
+{
+    const char *err = vm_verify(vm);
+    if (err)
+        return err;
+    if (ssa_optimize(&vm->bc, NULL) < 0)
+        return "SSA optimizer could not analyse the bytecode";
+    if (peephole_optimize(&vm->bc) < 0)
+        return "peephole pass could not analyse the bytecode";
+    vm_decode(vm, NULL);
+    return vm->decode_err;
 }
 
 void vm_disassemble(VM *vm, FILE *os) { disassemble_bytecode(&vm->bc, os); }
-const char *vm_verify(VM *vm) { return verify_bytecode(&vm->bc); }
+
+size_t vm_error_offset(VM *vm)
+{
+    if (vm->ip == 0 || vm->ip > vm->prog.count + 1)
+        return 0;
+    return vm->prog.offsets[vm->ip - 1];
+}
+
+size_t vm_call_site_stats(VM *vm, VMCallSiteStats *out, size_t max)
+{
+    size_t n = 0;
+    if (!vm->call_caches)
+        return 0;
+    for (size_t i = 0; i < vm->prog.count; ++i)
+    {
+        u8 op = vm->prog.code[i].op;
+        if (op != OP_CALL_USER && op != OP_MOV_CALL_USER && op != OP_CALL_CLOSURE)
+            continue;
+        if (n < max)
+        {
+            const CallCache *ic = &vm->call_caches[i];
+            out[n].offset = vm->prog.offsets[i];
+            out[n].func_index = ic->func_idx;
+            out[n].hits = ic->hits;
+            out[n].misses = ic->misses;
+        }
+        ++n;
+    }
+    return n;
+}
+const char *vm_verify(VM *vm)
+{
+    if (!vm->verified)
+    {
+        vm->verify_err = verify_program(&vm->bc, vm->opts.num_registers);
+        vm->verified = 1;
+    }
+    return vm->verify_err;
+}
 
 void vm_print_registers(VM *vm, FILE *os)
 {
     for (int i = 0; i < vm->opts.num_registers; ++i)
     {
         fprintf(os, "r%d: ", i);
-        if (vm->regs[i].type == V_INT)
-            fprintf(os, "INT %lld\n", (long long)vm->regs[i].as.i);
-        else if (vm->regs[i].type == V_DOUBLE)
-            fprintf(os, "DOUBLE %f\n", vm->regs[i].as.d);
-        else if (vm->regs[i].type == V_STRING)
-        {
-            HeapString *cur = vm->heap_head;
-            int idx = 0;
-            while (cur && idx < vm->regs[i].as.str_idx)
-            {
-                cur = cur->next;
-                ++idx;
-            }
-            if (cur)
-                fprintf(os, "STRING \"%s\"\n", cur->s);
+        if (value_is_int(vm->regs[i]))
+            fprintf(os, "INT %lld\n", (long long)value_as_int(vm->regs[i]));
+        else if (value_type(vm->regs[i]) == V_DOUBLE)
+            fprintf(os, "DOUBLE %f\n", value_as_double(vm->regs[i]));
+        else if (value_type(vm->regs[i]) == V_STRING)
+        {
+            const char *str = vm_string_chars(vm, vm->regs[i]);
+            if (str)
+                fprintf(os, "STRING \"%s\"\n", str);
             else
                 fprintf(os, "STRING <oob>\n");
         }
-        else if (vm->regs[i].type == V_OBJECT)
+        else if (value_type(vm->regs[i]) == V_OBJECT)
         {
-            int idx = vm->regs[i].as.obj_idx;
-            if (idx >= 0 && (size_t)idx < vm->obj_count && vm->obj_array[idx].alive)
-                fprintf(os, "OBJECT(fields=%d)\n", vm->obj_array[idx].field_count);
+            int idx = value_as_obj(vm->regs[i]);
+            if (object_alive(vm, idx))
+                fprintf(os, "OBJECT(fields=%d)\n", vm->obj_field_count[idx]);
             else
                 fprintf(os, "OBJECT <oob>\n");
         }
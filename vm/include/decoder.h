@@ -0,0 +1,29 @@
+// decoder.h - load-time decoding of Bytecode into fixed-width instructions
+#pragma once
+#include "bytecode.h"
+#include <optional>
+#include <string>
+#include <vector>
+namespace vm
+{
+    // loader-internal opcode; only ever appears in a decoded stream
+    constexpr u8 OP_BAD_JUMP = OP_POP_HANDLER + 1;
+
+    // One fixed-width decoded instruction. Operands keep their encoding order
+    // (e.g. ADD: a = dst, b = lhs, c = rhs); jump operands hold instruction indices.
+    struct Instr
+    {
+        u8 op = OP_HALT;
+        int32_t a = 0, b = 0, c = 0;
+    };
+
+    struct DecodedProgram
+    {
+        // the program followed by two sentinels: OP_HALT at end() (falling off
+        // the code) and OP_BAD_JUMP (a jump into the middle of an instruction)
+        std::vector<Instr> code;
+        std::vector<uint32_t> offsets; // per instruction: byte offset in Bytecode::code
+    };
+
+    std::optional<std::string> decode_bytecode(const Bytecode &bc, DecodedProgram &out);
+}
@@ -2,25 +2,95 @@
 #pragma once
 
 #include "bytecode.h"
+#include "decoder.h"
 #include <vector>
+#include <cstring>
 #include <string>
 #include <optional>
+#include <unordered_map>
 
 namespace vm
 {
 
-    struct Value
+    // Value is only accessed through its member functions, so the layout is a
+    // compile-time choice: by default a 16-byte tagged union; with
+    // VM_NAN_BOXING an 8-byte NaN box, where doubles are stored as themselves
+    // (NaNs canonicalised) and every other type sits in the payload of a
+    // negative quiet NaN (type in bits 48-50, 48-bit payload). Ints are 48-bit
+    // in that mode.
+    class Value
     {
+    public:
         enum Type
         {
             INT,
             DOUBLE,
             STRING,
             NONE
-        } type = NONE;
-        int64_t i = 0;
-        double d = 0.0;
-        int64_t str_idx = -1; // index into GC heap for strings
+        };
+
+        Value() = default; // NONE
+        static Value from_int(int64_t i) { return Value(INT, (uint64_t)i); }
+        static Value from_string(int64_t idx) { return Value(STRING, (uint64_t)idx); }
+#ifdef VM_NAN_BOXING
+        static Value from_double(double d)
+        {
+            Value v;
+            if (d != d)
+                v.bits_ = CANONICAL_NAN;
+            else
+                std::memcpy(&v.bits_, &d, sizeof(d));
+            return v;
+        }
+
+        Type type() const { return (bits_ >> 48) <= 0xFFF8 ? DOUBLE : (Type)(((bits_ >> 48) & 7) - 1); }
+        bool is_int() const { return (bits_ >> 48) == (box(INT, 0) >> 48); }
+        int64_t as_int() const { return (int64_t)(bits_ << 16) >> 16; }
+        double as_double() const
+        {
+            double d;
+            std::memcpy(&d, &bits_, sizeof(d));
+            return d;
+        }
+        int64_t str_idx() const { return as_int(); }
+
+    private:
+        static constexpr uint64_t BOX_PREFIX = 0xFFF8000000000000ull;
+        static constexpr uint64_t PAYLOAD_MASK = 0x0000FFFFFFFFFFFFull;
+        static constexpr uint64_t CANONICAL_NAN = 0x7FF8000000000000ull;
+        // tag = type + 1, so no boxed value is a real NaN
+        static constexpr uint64_t box(Type t, uint64_t payload)
+        {
+            return BOX_PREFIX | ((uint64_t)(t + 1) << 48) | (payload & PAYLOAD_MASK);
+        }
+        Value(Type t, uint64_t payload) : bits_(box(t, payload)) {}
+
+        uint64_t bits_ = box(NONE, 0);
+#else
+        static Value from_double(double d)
+        {
+            Value v;
+            v.type_ = DOUBLE;
+            v.d_ = d;
+            return v;
+        }
+
+        Type type() const { return type_; }
+        bool is_int() const { return type_ == INT; }
+        int64_t as_int() const { return i_; }
+        double as_double() const { return d_; }
+        int64_t str_idx() const { return i_; } // index into GC heap for strings
+
+    private:
+        Value(Type t, uint64_t payload) : type_(t), i_((int64_t)payload) {}
+
+        Type type_ = NONE;
+        union
+        {
+            int64_t i_ = 0;
+            double d_;
+        };
+#endif
     };
 
     struct VMOptions
@@ -43,13 +113,16 @@ namespace vm
         void disassemble(std::ostream &os) const;
         bool verify(std::string &err) const;
 
-        // helper to allocate string on heap (returns index)
+        // helper to allocate string on heap (returns index); returns the
+        // existing slot if an equal string is live
         int64_t alloc_string(const std::string &s);
 
     private:
         // internal
         VMOptions opts_;
         Bytecode bc_;
+        DecodedProgram prog_; // bc_ decoded by load(); this is what run() executes
+        std::optional<std::string> decode_err_;
         std::vector<Value> regs_;
         std::vector<int32_t> call_stack_;
         std::vector<int64_t> handler_stack_; // ip of handlers
@@ -57,8 +130,15 @@ namespace vm
         // heap: store strings only for this minimal implementation
         std::vector<std::string> heap_strings_;
         std::vector<char> marked_; // mark bits for GC
+        std::vector<char> free_;   // 1 if the slot was reclaimed and is on free_strings_
+        std::vector<int64_t> free_strings_;
+        size_t live_strings_ = 0; // unpinned; the GC runs once this passes 1024
+        // strings are immutable, so equal contents share one slot
+        std::unordered_map<std::string, int64_t> interned_;
+        std::vector<char> pinned_;        // string constants of the loaded program; not collected
+        std::vector<int64_t> const_strs_; // per constant: its pinned slot, -1 if not a string
 
-        size_t ip_ = 0;
+        size_t ip_ = 0; // index of the next instruction in prog_.code
         // GC
         void gc();
         void mark_from_roots();
@@ -0,0 +1,90 @@
+#include "../include/decoder.h"
+#include <cstring>
+
+namespace vm
+{
+
+    // number of i32 operands following the opcode byte, or -1 if unknown
+    static int operand_count(u8 op)
+    {
+        switch (op)
+        {
+        case OP_HALT:
+        case OP_POP_HANDLER:
+            return 0;
+        case OP_PRINT:
+        case OP_JMP:
+        case OP_RET:
+        case OP_THROW:
+        case OP_PUSH_HANDLER:
+            return 1;
+        case OP_LOAD_CONST:
+        case OP_MOV:
+        case OP_JZ:
+        case OP_ALLOC_STR:
+            return 2;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_CALL:
+            return 3;
+        default:
+            return -1;
+        }
+    }
+
+    std::optional<std::string> decode_bytecode(const Bytecode &bc, DecodedProgram &out)
+    {
+        const auto &code = bc.code;
+        out.code.clear();
+        out.offsets.clear();
+
+        // pass 1: instruction boundaries
+        std::vector<int32_t> pc_at(code.size() + 1, -1);
+        size_t ip = 0, count = 0;
+        while (ip < code.size())
+        {
+            int n = operand_count(code[ip]);
+            if (n < 0)
+                return std::string("unknown opcode ") + std::to_string(code[ip]);
+            if (ip + 1 + (size_t)n * 4 > code.size())
+                return std::string("truncated instruction at ") + std::to_string(ip);
+            pc_at[ip] = (int32_t)count++;
+            ip += 1 + (size_t)n * 4;
+        }
+
+        // targets past the end fall off the program; targets inside an
+        // instruction land on the OP_BAD_JUMP sentinel
+        auto resolve = [&](int32_t loc) -> int32_t
+        {
+            if (loc < 0 || (size_t)loc >= code.size())
+                return (int32_t)count;
+            return pc_at[loc] < 0 ? (int32_t)count + 1 : pc_at[loc];
+        };
+
+        // pass 2: unpack operands
+        out.code.resize(count + 2);
+        out.offsets.resize(count + 2, (uint32_t)code.size());
+        ip = 0;
+        for (size_t pc = 0; pc < count; ++pc)
+        {
+            Instr &in = out.code[pc];
+            in.op = code[ip];
+            out.offsets[pc] = (uint32_t)ip;
+            int n = operand_count(in.op);
+            int32_t *ops[3] = {&in.a, &in.b, &in.c};
+            for (int i = 0; i < n; ++i)
+                std::memcpy(ops[i], &code[ip + 1 + (size_t)i * 4], 4);
+            if (in.op == OP_JMP || in.op == OP_PUSH_HANDLER)
+                in.a = resolve(in.a);
+            else if (in.op == OP_JZ)
+                in.b = resolve(in.b);
+            ip += 1 + (size_t)n * 4;
+        }
+        out.code[count].op = OP_HALT;
+        out.code[count + 1].op = OP_BAD_JUMP;
+        return std::nullopt;
+    }
+
+}
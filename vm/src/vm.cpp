@@ -11,13 +11,56 @@ namespace vm
     void VM::load(const Bytecode &bc)
     {
         bc_ = bc;
+        // decode once so run() never parses operands
+        decode_err_ = decode_bytecode(bc_, prog_);
         ip_ = 0;
+        // the previous program's constants are collectable again (registers
+        // are roots); those this program shares are pinned again below
+        for (int64_t idx : const_strs_)
+        {
+            if (idx >= 0 && pinned_[idx])
+            {
+                pinned_[idx] = 0;
+                ++live_strings_;
+            }
+        }
+        // intern string constants once; loading one never allocates
+        const_strs_.assign(bc_.consts.size(), -1);
+        for (size_t i = 0; i < bc_.consts.size(); ++i)
+        {
+            if (bc_.consts[i].type != Constant::STRING)
+                continue;
+            int64_t idx = alloc_string(std::get<std::string>(bc_.consts[i].value));
+            if (!pinned_[idx])
+            {
+                pinned_[idx] = 1;
+                --live_strings_;
+            }
+            const_strs_[i] = idx;
+        }
     }
 
     int64_t VM::alloc_string(const std::string &s)
     {
+        auto it = interned_.find(s);
+        if (it != interned_.end())
+            return it->second;
+        ++live_strings_;
+        // reuse a slot freed by sweep() so indices stay small and stable
+        if (!free_strings_.empty())
+        {
+            int64_t idx = free_strings_.back();
+            free_strings_.pop_back();
+            heap_strings_[idx] = s;
+            free_[idx] = 0;
+            interned_.emplace(s, idx);
+            return idx;
+        }
         heap_strings_.push_back(s);
         marked_.push_back(0);
+        free_.push_back(0);
+        pinned_.push_back(0);
+        interned_.emplace(s, (int64_t)heap_strings_.size() - 1);
         return (int64_t)heap_strings_.size() - 1;
     }
 
@@ -26,8 +69,8 @@ namespace vm
         // mark regs
         for (const auto &r : regs_)
         {
-            if (r.type == Value::STRING && r.str_idx >= 0 && (size_t)r.str_idx < heap_strings_.size())
-                marked_[r.str_idx] = 1;
+            if (r.type() == Value::STRING && r.str_idx() >= 0 && (size_t)r.str_idx() < heap_strings_.size())
+                marked_[r.str_idx()] = 1;
         }
         // TODO: mark stack frames if they reference heap
     }
@@ -36,10 +79,16 @@ namespace vm
     {
         for (size_t i = 0; i < heap_strings_.size(); ++i)
         {
-            if (!marked_[i])
+            if (free_[i])
+                continue;
+            if (!marked_[i] && !pinned_[i])
             {
-                // reclaim
-                heap_strings_[i].clear();
+                // reclaim: release the storage and hand the slot to alloc_string
+                interned_.erase(heap_strings_[i]);
+                std::string().swap(heap_strings_[i]);
+                free_[i] = 1;
+                free_strings_.push_back((int64_t)i);
+                --live_strings_;
             }
             else
             {
@@ -54,184 +103,199 @@ namespace vm
         sweep();
     }
 
+    // Dispatch strategy: with GCC/Clang each handler jumps straight to the next
+    // through a label table (direct threading); otherwise, or when built with
+    // VM_NO_COMPUTED_GOTO, a portable switch loop is used.
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_THREADED_DISPATCH 1
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+#if VM_THREADED_DISPATCH
+#define VM_CASE(name) lbl_##name:
+#define VM_NEXT()                                \
+    do                                           \
+    {                                            \
+        if (live_strings_ > 1024)                \
+            gc();                                \
+        in = &code[ip++];                        \
+        goto *dispatch_table[in->op];            \
+    } while (0)
+#else
+#define VM_CASE(name) case name:
+#define VM_NEXT() break
+#endif
+
     std::optional<std::string> VM::run()
     {
-        auto &code = bc_.code;
-        auto read_i32 = [&](int32_t &out) -> bool
+        if (decode_err_)
+            return decode_err_;
+        // hot interpreter state lives in locals; ip_ is written back on exit.
+        // The decoded stream ends in an OP_HALT sentinel, so no bounds check is needed.
+        const Instr *code = prog_.code.data();
+        Value *regs = regs_.data();
+        size_t ip = ip_;
+        const Instr *in = nullptr;
+        struct IpWriteBack
         {
-            if (ip_ + 4 > code.size())
-                return false;
-            std::memcpy(&out, &code[ip_], 4);
-            ip_ += 4;
-            return true;
-        };
+            size_t &src;
+            size_t &dst;
+            ~IpWriteBack() { dst = src; }
+        } write_back{ip, ip_};
 
         try
         {
-            while (ip_ < code.size())
+#if VM_THREADED_DISPATCH
+            // indexed by opcode; must follow the enum order in bytecode.h.
+            // The decoder only emits known opcodes, so no range check is needed.
+            static void *const dispatch_table[] = {
+                &&lbl_OP_HALT, &&lbl_OP_LOAD_CONST, &&lbl_OP_MOV, &&lbl_OP_ADD,
+                &&lbl_OP_SUB, &&lbl_OP_MUL, &&lbl_OP_DIV, &&lbl_OP_PRINT,
+                &&lbl_OP_JMP, &&lbl_OP_JZ, &&lbl_OP_CALL, &&lbl_OP_RET,
+                &&lbl_OP_ALLOC_STR, &&lbl_OP_THROW, &&lbl_OP_PUSH_HANDLER,
+                &&lbl_OP_POP_HANDLER, &&lbl_OP_BAD_JUMP};
+            in = &code[ip++];
+            goto *dispatch_table[in->op];
+#else
+            for (;;)
             {
-                u8 op = code[ip_++];
-                switch (op)
-                {
-                case OP_HALT:
-                    return std::nullopt;
-                case OP_LOAD_CONST:
-                {
-                    int32_t reg, ci;
-                    read_i32(reg);
-                    read_i32(ci);
-                    if (ci < 0 || (size_t)ci >= bc_.consts.size())
-                        return std::string("const index OOB");
-                    auto &c = bc_.consts[ci];
-                    if (c.type == Constant::INT)
-                    {
-                        regs_[reg].type = Value::INT;
-                        regs_[reg].i = std::get<int64_t>(c.value);
-                    }
-                    else if (c.type == Constant::DOUBLE)
-                    {
-                        regs_[reg].type = Value::DOUBLE;
-                        regs_[reg].d = std::get<double>(c.value);
-                    }
-                    else if (c.type == Constant::STRING)
-                    {
-                        regs_[reg].type = Value::STRING;
-                        regs_[reg].str_idx = alloc_string(std::get<std::string>(c.value));
-                    }
-                    break;
-                }
-                case OP_MOV:
-                {
-                    int32_t dst, src;
-                    read_i32(dst);
-                    read_i32(src);
-                    regs_[dst] = regs_[src];
-                    break;
-                }
-                case OP_ADD:
-                case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                {
-                    int32_t dst, a, b;
-                    read_i32(dst);
-                    read_i32(a);
-                    read_i32(b);
-                    // only int for simplicity
-                    if (regs_[a].type != Value::INT || regs_[b].type != Value::INT)
-                        return std::string("type error: expected INT");
-                    int64_t av = regs_[a].i, bv = regs_[b].i, rv = 0;
-                    if (op == OP_ADD)
-                        rv = av + bv;
-                    else if (op == OP_SUB)
-                        rv = av - bv;
-                    else if (op == OP_MUL)
-                        rv = av * bv;
-                    else
-                        rv = (bv == 0 ? 0 : av / bv);
-                    regs_[dst].type = Value::INT;
-                    regs_[dst].i = rv;
-                    break;
-                }
-                case OP_PRINT:
-                {
-                    int32_t r;
-                    read_i32(r);
-                    if (regs_[r].type == Value::INT)
-                        std::cout << regs_[r].i << "\n";
-                    else if (regs_[r].type == Value::DOUBLE)
-                        std::cout << regs_[r].d << "\n";
-                    else if (regs_[r].type == Value::STRING)
-                        std::cout << heap_strings_[regs_[r].str_idx] << "\n";
-                    else
-                        std::cout << "<none>\n";
-                    break;
-                }
-                case OP_JMP:
+                in = &code[ip++];
+                switch (in->op)
                 {
-                    int32_t rel;
-                    read_i32(rel);
-                    ip_ = (size_t)rel;
-                    break;
-                }
-                case OP_JZ:
-                {
-                    int32_t r, rel;
-                    read_i32(r);
-                    read_i32(rel);
-                    bool iszero = (regs_[r].type == Value::INT && regs_[r].i == 0);
-                    if (iszero)
-                        ip_ = (size_t)rel;
-                    break;
-                }
-                case OP_ALLOC_STR:
-                {
-                    int32_t dst, ci;
-                    read_i32(dst);
-                    read_i32(ci);
-                    if (ci < 0 || (size_t)ci >= bc_.consts.size())
-                        return std::string("const index OOB");
-                    auto &c = bc_.consts[ci];
-                    if (c.type != Constant::STRING)
-                        return std::string("const not string");
-                    regs_[dst].type = Value::STRING;
-                    regs_[dst].str_idx = alloc_string(std::get<std::string>(c.value));
-                    break;
-                }
-                case OP_CALL:
-                {
-                    int32_t fi, nargs, dst;
-                    read_i32(fi);
-                    read_i32(nargs);
-                    read_i32(dst);
-                    // for simplicity we only allow builtin print function at index 0
-                    if (fi == 0)
-                    {
-                        // print first arg
-                        int32_t argreg = 0; // assume arg in r0
-                        if (regs_[argreg].type == Value::INT)
-                            std::cout << regs_[argreg].i << "\n";
-                        else if (regs_[argreg].type == Value::STRING)
-                            std::cout << heap_strings_[regs_[argreg].str_idx] << "\n";
-                        regs_[dst].type = Value::NONE;
-                    }
-                    else
-                        return std::string("unknown function index");
-                    break;
-                }
-                case OP_RET:
-                {
-                    int32_t r;
-                    read_i32(r);
-                    // for single-main program halt
-                    return std::nullopt;
-                }
-                case OP_THROW:
+#endif
+            VM_CASE(OP_HALT)
+                return std::nullopt;
+            VM_CASE(OP_LOAD_CONST)
+            {
+                int32_t reg = in->a, ci = in->b;
+                if (ci < 0 || (size_t)ci >= bc_.consts.size())
+                    return std::string("const index OOB");
+                auto &c = bc_.consts[ci];
+                if (c.type == Constant::INT)
                 {
-                    int32_t r;
-                    read_i32(r);
-                    return std::string("unhandled exception");
+                    regs[reg] = Value::from_int(std::get<int64_t>(c.value));
                 }
-                case OP_PUSH_HANDLER:
+                else if (c.type == Constant::DOUBLE)
                 {
-                    int32_t rel;
-                    read_i32(rel);
-                    handler_stack_.push_back(rel);
-                    break;
+                    regs[reg] = Value::from_double(std::get<double>(c.value));
                 }
-                case OP_POP_HANDLER:
+                else if (c.type == Constant::STRING)
                 {
-                    if (!handler_stack_.empty())
-                        handler_stack_.pop_back();
-                    break;
+                    regs[reg] = Value::from_string(const_strs_[ci]);
                 }
+                VM_NEXT();
+            }
+            VM_CASE(OP_MOV)
+            {
+                regs[in->a] = regs[in->b];
+                VM_NEXT();
+            }
+            VM_CASE(OP_ADD)
+            VM_CASE(OP_SUB)
+            VM_CASE(OP_MUL)
+            VM_CASE(OP_DIV)
+            {
+                int32_t dst = in->a, a = in->b, b = in->c;
+                // only int for simplicity
+                if (!regs[a].is_int() || !regs[b].is_int())
+                    return std::string("type error: expected INT");
+                int64_t av = regs[a].as_int(), bv = regs[b].as_int(), rv = 0;
+                if (in->op == OP_ADD)
+                    rv = av + bv;
+                else if (in->op == OP_SUB)
+                    rv = av - bv;
+                else if (in->op == OP_MUL)
+                    rv = av * bv;
+                else
+                    rv = (bv == 0 ? 0 : av / bv);
+                regs[dst] = Value::from_int(rv);
+                VM_NEXT();
+            }
+            VM_CASE(OP_PRINT)
+            {
+                int32_t r = in->a;
+                if (regs[r].type() == Value::INT)
+                    std::cout << regs[r].as_int() << "\n";
+                else if (regs[r].type() == Value::DOUBLE)
+                    std::cout << regs[r].as_double() << "\n";
+                else if (regs[r].type() == Value::STRING)
+                    std::cout << heap_strings_[regs[r].str_idx()] << "\n";
+                else
+                    std::cout << "<none>\n";
+                VM_NEXT();
+            }
+            VM_CASE(OP_JMP)
+            {
+                ip = (size_t)in->a;
+                VM_NEXT();
+            }
+            VM_CASE(OP_JZ)
+            {
+                int32_t r = in->a;
+                bool iszero = (regs[r].is_int() && regs[r].as_int() == 0);
+                if (iszero)
+                    ip = (size_t)in->b;
+                VM_NEXT();
+            }
+            VM_CASE(OP_ALLOC_STR)
+            {
+                int32_t dst = in->a, ci = in->b;
+                if (ci < 0 || (size_t)ci >= bc_.consts.size())
+                    return std::string("const index OOB");
+                auto &c = bc_.consts[ci];
+                if (c.type != Constant::STRING)
+                    return std::string("const not string");
+                regs[dst] = Value::from_string(const_strs_[ci]);
+                VM_NEXT();
+            }
+            VM_CASE(OP_CALL)
+            {
+                int32_t fi = in->a, dst = in->c;
+                // for simplicity we only allow builtin print function at index 0
+                if (fi != 0)
+                    return std::string("unknown function index");
+                // print first arg
+                int32_t argreg = 0; // assume arg in r0
+                if (regs[argreg].type() == Value::INT)
+                    std::cout << regs[argreg].as_int() << "\n";
+                else if (regs[argreg].type() == Value::STRING)
+                    std::cout << heap_strings_[regs[argreg].str_idx()] << "\n";
+                regs[dst] = Value();
+                VM_NEXT();
+            }
+            VM_CASE(OP_RET)
+            {
+                // for single-main program halt
+                return std::nullopt;
+            }
+            VM_CASE(OP_THROW)
+            {
+                return std::string("unhandled exception");
+            }
+            VM_CASE(OP_PUSH_HANDLER)
+            {
+                // handler location as an instruction index
+                handler_stack_.push_back(in->a);
+                VM_NEXT();
+            }
+            VM_CASE(OP_POP_HANDLER)
+            {
+                if (!handler_stack_.empty())
+                    handler_stack_.pop_back();
+                VM_NEXT();
+            }
+            VM_CASE(OP_BAD_JUMP)
+                return std::string("jump target is not an instruction boundary");
+#if !VM_THREADED_DISPATCH
                 default:
-                    return std::string("unknown opcode at runtime: ") + std::to_string(op);
+                    return std::string("unknown opcode at runtime: ") + std::to_string(in->op);
                 }
                 // opportunistic GC
-                if (heap_strings_.size() > 1024)
+                if (live_strings_ > 1024)
                     gc();
             }
+#endif
         }
         catch (const std::exception &e)
         {
@@ -240,6 +304,9 @@ namespace vm
         return std::nullopt;
     }
 
+#undef VM_CASE
+#undef VM_NEXT
+
     void VM::disassemble(std::ostream &os) const { disassemble(bc_, os); }
 
     bool VM::verify(std::string &err) const